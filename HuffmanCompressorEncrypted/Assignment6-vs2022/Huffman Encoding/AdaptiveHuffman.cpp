@@ -0,0 +1,257 @@
+/**********************************************************
+ * File: AdaptiveHuffman.cpp
+ *
+ * Implementation of the class and functions from
+ * AdaptiveHuffman.h.
+ */
+
+#include "AdaptiveHuffman.h"
+#include "error.h"
+#include <algorithm>
+#include <vector>
+
+/* The number of bits a new character is written in after NYT. */
+static const int RAW_CHAR_BITS = 9;
+
+/* The lowest weight limit allowed.  Halving can leave the total
+ * weight as high as half the limit plus one per character, so a
+ * limit much lower than this would rebuild the tree every update.
+ */
+static const int MIN_ADAPTIVE_LIMIT = 4 * NUM_SYMBOLS;
+
+AdaptiveHuffmanCoder::AdaptiveHuffmanCoder(int limit) : used(1), nyt(0), limit(limit) {
+	if (limit < MIN_ADAPTIVE_LIMIT) error("The adaptive weight limit is too low.");
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		leaf[ch] = -1;
+	}
+	nodes[0].character = NOT_A_CHAR;
+	nodes[0].zero = nodes[0].one = nullptr;
+	nodes[0].weight = 0;
+	parent[0] = -1;
+}
+
+int AdaptiveHuffmanCoder::position(const Node* node) const {
+	return int(node - nodes);
+}
+
+/*
+* The number of edges between the root and the node at the given
+* position, which is the length of its code.
+*/
+int AdaptiveHuffmanCoder::depth(int pos) const {
+	int edges = 0;
+	for (; pos != 0; pos = parent[pos]) edges++;
+	return edges;
+}
+
+/*
+* Points whatever refers to the node now at pos back at it: the
+* parent entries of its children, or the leaf entry of its character.
+*/
+void AdaptiveHuffmanCoder::fixLinks(int pos) {
+	Node& node = nodes[pos];
+	if (node.zero != nullptr) {
+		parent[position(node.zero)] = pos;
+		parent[position(node.one)] = pos;
+	} else if (node.character == NOT_A_CHAR) {
+		nyt = pos;
+	} else {
+		leaf[node.character] = pos;
+	}
+}
+
+/*
+* Exchanges the subtrees at two positions.  Each position keeps its
+* parent, so the subtrees trade places in the tree.
+*/
+void AdaptiveHuffmanCoder::swapNodes(int a, int b) {
+	swap(nodes[a], nodes[b]);
+	fixLinks(a);
+	fixLinks(b);
+}
+
+/* Member function AdaptiveHuffmanCoder::update
+ * -------------------------------------------
+ * Adds one to the weight of the given character, splitting NYT
+ * first if the character is new.  Walking up from its leaf, each
+ * node is first swapped with the lowest numbered node of the same
+ * weight, so that after its weight goes up no node numbered after
+ * it is heavier.
+ */
+void AdaptiveHuffmanCoder::update(ext_char ch) {
+	int pos = leaf[ch];
+	if (pos < 0) {
+		// NYT becomes the parent of the new leaf and a new NYT
+		int leafPos = used, nytPos = used + 1;
+		used += 2;
+		Node& split = nodes[nyt];
+		nodes[leafPos].character = ch;
+		nodes[nytPos].character = NOT_A_CHAR;
+		nodes[leafPos].zero = nodes[leafPos].one = nodes[nytPos].zero = nodes[nytPos].one = nullptr;
+		nodes[leafPos].weight = nodes[nytPos].weight = 0;
+		split.zero = &nodes[nytPos];
+		split.one = &nodes[leafPos];
+		parent[leafPos] = parent[nytPos] = nyt;
+		leaf[ch] = leafPos;
+		nyt = nytPos;
+		pos = leafPos;
+	}
+
+	while (true) {
+		int leader = pos;
+		while (leader > 0 && nodes[leader - 1].weight == nodes[pos].weight) leader--;
+		if (leader != pos && leader != parent[pos]) {
+			swapNodes(pos, leader);
+			pos = leader;
+		}
+		nodes[pos].weight++;
+		if (pos == 0) break;
+		pos = parent[pos];
+	}
+
+	if (nodes[0].weight >= limit) rescale();
+}
+
+/*
+* A subtree waiting to be placed while the tree is rebuilt: a leaf,
+* or the positions of the two subtrees merged into it.
+*/
+struct PendingNode {
+	int weight;
+	ext_char character;
+	int zero, one;
+};
+
+/* Member function AdaptiveHuffmanCoder::rescale
+ * -------------------------------------------
+ * Halves every weight, rounding up so no character drops out, and
+ * rebuilds the tree from the halved weights.  The rebuild merges
+ * the two lightest subtrees at a time, as buildEncodingTreeFromCounts
+ * does.  Subtrees are taken in order of weight, so placing each one
+ * at the highest free position as it is taken numbers the new tree
+ * in sibling order, with every pair merged placed side by side.
+ */
+void AdaptiveHuffmanCoder::rescale() {
+	std::vector<PendingNode> leaves;
+	for (int pos = 0; pos < used; pos++) {
+		const Node& node = nodes[pos];
+		if (node.zero != nullptr) continue;
+		PendingNode pending = { (node.weight + 1) / 2, node.character, -1, -1 };
+		leaves.push_back(pending);
+	}
+	// NYT weighs nothing, so it is taken first and placed last
+	sort(leaves.begin(), leaves.end(), [](const PendingNode& a, const PendingNode& b) {
+		return a.weight != b.weight ? a.weight < b.weight : a.character < b.character;
+	});
+
+	std::vector<PendingNode> merged;
+	size_t nextLeaf = 0, nextMerged = 0;
+	int next = used - 1;
+	while (next >= 0) {
+		int placed[2], weight = 0, taken = 0;
+		for (; taken < 2 && next >= 0; taken++) {
+			bool useLeaf = nextMerged == merged.size() ||
+			               (nextLeaf < leaves.size() && leaves[nextLeaf].weight <= merged[nextMerged].weight);
+			const PendingNode& pending = useLeaf ? leaves[nextLeaf++] : merged[nextMerged++];
+			Node& node = nodes[next];
+			node.character = pending.character;
+			node.weight = pending.weight;
+			node.zero = pending.zero < 0 ? nullptr : &nodes[pending.zero];
+			node.one = pending.one < 0 ? nullptr : &nodes[pending.one];
+			fixLinks(next);
+			weight += pending.weight;
+			placed[taken] = next--;
+		}
+		if (taken == 2) {
+			PendingNode subtree = { weight, NOT_A_CHAR, placed[0], placed[1] };
+			merged.push_back(subtree);
+		}
+	}
+	parent[0] = -1;
+}
+
+/* Member function AdaptiveHuffmanCoder::encode
+ * -------------------------------------------
+ * The path is found by walking up from the leaf, so its bits are
+ * gathered deepest first and written out root first.
+ */
+void AdaptiveHuffmanCoder::encode(ext_char ch, obstream& outfile) {
+	if (ch < 0 || ch > PSEUDO_EOF) error("Only bytes and PSEUDO_EOF can be encoded.");
+	int pos = leaf[ch] >= 0 ? leaf[ch] : nyt;
+
+	bool path[ADAPTIVE_TREE_NODES];
+	int length = 0;
+	for (; pos != 0; pos = parent[pos]) {
+		path[length++] = nodes[parent[pos]].one == &nodes[pos];
+	}
+	while (length > 0) {
+		uint64_t bits = 0;
+		int count = min(length, 64);
+		for (int i = 0; i < count; i++) {
+			bits |= uint64_t(path[--length]) << i;
+		}
+		outfile.writeBits(bits, count);
+	}
+
+	if (leaf[ch] < 0) outfile.writeBits(uint64_t(ch), RAW_CHAR_BITS);
+	update(ch);
+}
+
+ext_char AdaptiveHuffmanCoder::decode(ibstream& infile) {
+	int pos = 0;
+	while (nodes[pos].zero != nullptr) {
+		int bit = infile.readBit();
+		if (bit == EOF) error("The adaptive stream ended in the middle of a code.");
+		pos = position(bit ? nodes[pos].one : nodes[pos].zero);
+	}
+
+	ext_char ch = nodes[pos].character;
+	if (pos == nyt) {
+		ch = 0;
+		for (int i = 0; i < RAW_CHAR_BITS; i++) {
+			int bit = infile.readBit();
+			if (bit == EOF) error("The adaptive stream ended in the middle of a character.");
+			ch |= bit << i;
+		}
+		if (ch > PSEUDO_EOF || leaf[ch] >= 0) error("The adaptive stream is corrupt.");
+	}
+	update(ch);
+	return ch;
+}
+
+int AdaptiveHuffmanCoder::codeLength(ext_char ch) const {
+	if (leaf[ch] >= 0) return depth(leaf[ch]);
+	return depth(nyt) + RAW_CHAR_BITS;
+}
+
+/* Function: encodeFileAdaptive
+ * Usage: encodeFileAdaptive(infile, outfile);
+ * --------------------------------------------------------
+ * Encodes the rest of the given stream with an adaptive code,
+ * reading it once, then writes PSEUDO_EOF and flushes the bits.
+ * Every character's code is written before the next character
+ * is read.  Unlike encodeFile, no tree or header is needed.
+ */
+void encodeFileAdaptive(istream& infile, obstream& outfile) {
+	AdaptiveHuffmanCoder coder;
+	int ch;
+	while ((ch = infile.get()) != EOF) {
+		coder.encode(ch, outfile);
+	}
+	coder.encode(PSEUDO_EOF, outfile);
+	outfile.flushBits();
+}
+
+/* Function: decodeFileAdaptive
+ * Usage: decodeFileAdaptive(infile, outfile);
+ * --------------------------------------------------------
+ * Decodes a stream written by encodeFileAdaptive, writing each
+ * character as soon as its code has been read.
+ */
+void decodeFileAdaptive(ibstream& infile, ostream& file) {
+	AdaptiveHuffmanCoder coder;
+	ext_char ch;
+	while ((ch = coder.decode(infile)) != PSEUDO_EOF) {
+		file.put(char(ch));
+	}
+}
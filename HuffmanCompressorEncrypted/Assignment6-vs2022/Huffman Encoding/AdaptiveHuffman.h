@@ -0,0 +1,129 @@
+/**********************************************************
+ * File: AdaptiveHuffman.h
+ *
+ * Adaptive Huffman coding, for streams that must be encoded
+ * as they arrive.  encodeFile needs a tree built from counts
+ * of the whole input, so nothing can be written until all of
+ * it has been read.  An AdaptiveHuffmanCoder instead starts
+ * from a tree holding only an escape leaf, NYT ("not yet
+ * transmitted"), and updates the tree after every character
+ * with the FGK algorithm, so the code always matches the
+ * counts of the characters seen so far.  The encoder and the
+ * decoder make the same updates in the same order, so there
+ * is no frequency pass and no header.
+ *
+ * A character seen before is written with its current code.
+ * A new one is written as the code for NYT followed by the
+ * character itself in 9 bits, and gets a leaf of its own.
+ *
+ * The tree is kept in one array in sibling order: nodes are
+ * numbered from the root down, no node is heavier than one
+ * numbered before it, and siblings are numbered next to each
+ * other.  Updates then only swap nodes in place, and no node
+ * is ever allocated on the heap.
+ */
+
+#ifndef AdaptiveHuffman_Included
+#define AdaptiveHuffman_Included
+
+#include "HuffmanTypes.h"
+#include "bstream.h"
+#include <istream>
+#include <ostream>
+using namespace std;
+
+/* Constant: ADAPTIVE_TREE_NODES
+ * The most nodes an adaptive tree can have: a leaf for every
+ * extended character and one for NYT, plus one fewer internal
+ * nodes.
+ */
+const int ADAPTIVE_TREE_NODES = 2 * (NUM_SYMBOLS + 1) - 1;
+
+/* Constant: DEFAULT_ADAPTIVE_LIMIT
+ * The total weight at which an adaptive tree halves all of its
+ * weights unless the caller asks for something else.  This
+ * keeps the weights well inside an int however long the stream.
+ */
+const int DEFAULT_ADAPTIVE_LIMIT = 1 << 24;
+
+/*
+ * Class: AdaptiveHuffmanCoder
+ * ---------------
+ * One side of an adaptive Huffman stream.  The encoder and the
+ * decoder of a stream each keep their own coder, made with the same
+ * limit, and pass it every character in order.
+ */
+class AdaptiveHuffmanCoder {
+public:
+	/* Constructor: AdaptiveHuffmanCoder(int limit);
+	 * Usage: AdaptiveHuffmanCoder coder;
+	 * --------------------------
+	 * Creates a coder that has seen no characters.  Whenever the
+	 * total weight reaches limit, every weight is halved and the tree
+	 * rebuilt, so lower limits adapt faster to changes in the data at
+	 * some cost in compression.  Raises an error if the limit is below
+	 * 4 * NUM_SYMBOLS.
+	 */
+	AdaptiveHuffmanCoder(int limit = DEFAULT_ADAPTIVE_LIMIT);
+
+	/* Member function: encode(ext_char ch, obstream& outfile);
+	 * Usage: coder.encode(ch, outfile);
+	 * --------------------------
+	 * Writes the code for the given character, which may be PSEUDO_EOF,
+	 * then updates the tree.
+	 */
+	void encode(ext_char ch, obstream& outfile);
+
+	/* Member function: decode(ibstream& infile);
+	 * Usage: ext_char ch = coder.decode(infile);
+	 * --------------------------
+	 * Reads the code for one character, updates the tree and returns
+	 * the character.  Raises an error if the stream ends first or does
+	 * not hold a valid code.
+	 */
+	ext_char decode(ibstream& infile);
+
+	/* Member function: codeLength(ext_char ch);
+	 * Usage: int length = coder.codeLength(ch);
+	 * --------------------------
+	 * The number of bits the next encode of the given character would
+	 * write, counting the 9 bits that follow NYT for a new character.
+	 */
+	int codeLength(ext_char ch) const;
+
+private:
+	Node nodes[ADAPTIVE_TREE_NODES];
+	int parent[ADAPTIVE_TREE_NODES];
+	int leaf[NUM_SYMBOLS]; // position of each character's leaf, or -1
+	int used, nyt, limit;
+
+	int position(const Node* node) const;
+	int depth(int pos) const;
+	void fixLinks(int pos);
+	void swapNodes(int a, int b);
+	void update(ext_char ch);
+	void rescale();
+
+	AdaptiveHuffmanCoder(const AdaptiveHuffmanCoder&);
+	AdaptiveHuffmanCoder& operator=(const AdaptiveHuffmanCoder&);
+};
+
+/* Function: encodeFileAdaptive
+ * Usage: encodeFileAdaptive(infile, outfile);
+ * --------------------------------------------------------
+ * Encodes the rest of the given stream with an adaptive code,
+ * reading it once, then writes PSEUDO_EOF and flushes the bits.
+ * Every character's code is written before the next character
+ * is read.  Unlike encodeFile, no tree or header is needed.
+ */
+void encodeFileAdaptive(istream& infile, obstream& outfile);
+
+/* Function: decodeFileAdaptive
+ * Usage: decodeFileAdaptive(infile, outfile);
+ * --------------------------------------------------------
+ * Decodes a stream written by encodeFileAdaptive, writing each
+ * character as soon as its code has been read.
+ */
+void decodeFileAdaptive(ibstream& infile, ostream& file);
+
+#endif
@@ -0,0 +1,1418 @@
+/**********************************************************
+ * File: BlockCompression.cpp
+ *
+ * Implementation of the functions from BlockCompression.h.
+ */
+
+#include "BlockCompression.h"
+#include "HuffmanEncoding.h"
+#include "HuffmanTables.h"
+#include "CanonicalHuffman.h"
+#include "Histogram.h"
+#include "KeyStream.h"
+#include "Checksum.h"
+#include "error.h"
+#include "strlib.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+/* The last four bytes of a file with a block index, without
+ * checksums in it and with them.
+ */
+static const uint64_t INDEX_MAGIC = 'H' | ('U' << 8) | ('F' << 16) | (uint64_t('I') << 24);
+static const uint64_t CHECKED_INDEX_MAGIC = 'H' | ('U' << 8) | ('F' << 16) | (uint64_t('C') << 24);
+
+/* Bytes taken by the magic number, by the salt and nonce of a
+ * salted file after it, by the password check after those, by the
+ * sizes that start each frame, by one index entry with and without
+ * checksums, and by the index trailer.
+ */
+static const size_t MAGIC_BYTES = 4;
+static const size_t SALT_AND_NONCE_BYTES = SALT_BYTES + 8;
+static const size_t CHECK_BYTES = 4;
+static const size_t FRAME_SIZES_BYTES = 8;
+static const size_t INDEX_ENTRY_BYTES = 12;
+static const size_t CHECKED_INDEX_ENTRY_BYTES = 20;
+static const size_t INDEX_TRAILER_BYTES = 8;
+
+/* Added to a block number to get the nonce that seals its frame,
+ * so that it never matches the nonce of any header.  A stored
+ * frame is sealed from the first word of its keystream, and there
+ * is nothing else in it, so the only keystream anyone can work out
+ * is that of data they already know, which the file's own key
+ * never uses again.
+ */
+static const uint64_t SEAL_NONCE = uint64_t(1) << 63;
+
+/* Added to a block number to get the nonce that encrypts the
+ * checksum of its data, which would otherwise let anyone check a
+ * guess at the data without the password.
+ */
+static const uint64_t CHECKSUM_NONCE = uint64_t(1) << 62;
+
+/* Set in a frame's size field when its block is stored as it is,
+ * encrypted with the keystream that would seal it, rather than
+ * encoded.  No encoded frame is anywhere near this long.
+ */
+static const size_t STORED_FRAME = size_t(1) << 31;
+
+/* The number of blocks each queue of compressPipelined holds. */
+static const size_t PIPELINE_DEPTH = 2;
+
+/* Type: BlockChecksums
+ * The CRC32C of a block's data, encrypted as sealChecksum leaves
+ * it, and that of its whole frame, sizes and all, as written,
+ * followed by the data's, so that every byte of an entry in the
+ * index is covered by a checksum that needs no password.
+ */
+struct BlockChecksums {
+	uint32_t data;
+	uint32_t frame;
+};
+
+/* Type: BlockIndexEntry
+ * Where one block's frame starts, in bytes from the magic number,
+ * which bytes of the decompressed data it holds, and, if the index
+ * has them, its checksums.
+ */
+struct BlockIndexEntry {
+	uint64_t frameOffset;
+	uint64_t dataOffset;
+	size_t dataBytes;
+	BlockChecksums checksums;
+};
+
+/*
+* Encrypts or decrypts the checksum of a block's data, which are
+* the same thing.
+*/
+static uint32_t sealChecksum(uint32_t checksum, const PasswordKey& password, uint64_t block) {
+	return checksum ^ uint32_t(KeyStream(password.keystreamKey(), block + CHECKSUM_NONCE).nextWord());
+}
+
+/*
+* Carries a frame's CRC32C on over the encrypted checksum of its
+* data, as the index holds it.
+*/
+static uint32_t withDataChecksum(uint32_t crc, uint32_t dataChecksum) {
+	unsigned char bytes[4];
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = (unsigned char)(dataChecksum >> (8 * i));
+	}
+	return crc32c(bytes, 4, crc);
+}
+
+/*
+* The CRC32C of the sizes that start a frame, which its frame
+* checksum carries on from.
+*/
+static uint32_t frameSizesChecksum(size_t blockBytes, size_t frameField) {
+	unsigned char sizes[FRAME_SIZES_BYTES];
+	for (int i = 0; i < 4; i++) {
+		sizes[i] = (unsigned char)(blockBytes >> (8 * i));
+		sizes[4 + i] = (unsigned char)(frameField >> (8 * i));
+	}
+	return crc32c(sizes, FRAME_SIZES_BYTES);
+}
+
+/*
+* The frame checksum for a frame with the given sizes and body and
+* the given encrypted data checksum.
+*/
+static uint32_t frameChecksum(size_t blockBytes, size_t frameField, const void* body, size_t bodyBytes,
+                              uint32_t dataChecksum) {
+	return withDataChecksum(crc32c(body, bodyBytes, frameSizesChecksum(blockBytes, frameField)), dataChecksum);
+}
+
+/* The longest header writeCanonicalFileHeader writes: it picks the
+ * shortest form, so never more than every length at 8 bits wide.
+ */
+static const uint64_t MAX_HEADER_BITS = 4 + NUM_SYMBOLS * 8;
+
+/*
+* Header and code bytes can't outgrow the input by more than
+* this: the longest header, a code of MAX_CANONICAL_LENGTH
+* bits for every byte and the PSEUDO_EOF, and for interleaved
+* frames the stream offsets and each stream's padding byte.
+*/
+static size_t maxFrameBytes(size_t blockBytes) {
+	uint64_t bits = MAX_HEADER_BITS + 32 * (INTERLEAVED_STREAMS - 1) + uint64_t(MAX_CANONICAL_LENGTH) * (blockBytes + 1);
+	return size_t((bits + 7) / 8 + INTERLEAVED_STREAMS);
+}
+
+/*
+* The version a block file's frame headers are written and read
+* with: the file's own, less the flag that says how its frames
+* are encrypted.
+*/
+static int frameHeaderVersion(int version) {
+	return version & ~FORMAT_FLAG_SEALED;
+}
+
+/*
+* Whether the given version is that of a block file whose codes
+* go in interleaved streams.
+*/
+static bool isInterleavedVersion(int version) {
+	return (version & ~(FORMAT_FLAG_SEALED | FORMAT_FLAG_COMPACT)) == FORMAT_VERSION_INTERLEAVED_BLOCKS;
+}
+
+/*
+* The number of bytes compressBlock would encode a block into
+* with the given code, header and all, worked out from the code
+* lengths without encoding anything. The version is that of the
+* file, which says how short the header can be. An interleaved
+* frame needs the bits of each stream separately, since each one
+* is padded to a byte.
+*/
+static uint64_t encodedFrameBytes(const unsigned char* data, size_t length, const uint64_t counts[NUM_SYMBOLS],
+                                  const int lengths[NUM_SYMBOLS], const EncodeTable& table, int version) {
+	uint64_t headerBits = canonicalHeaderBits(lengths, frameHeaderVersion(version));
+	if (!isInterleavedVersion(version)) return (headerBits + encodedBits(counts, table) + 7) / 8;
+
+	uint64_t streamBits[INTERLEAVED_STREAMS] = { 0 };
+	for (size_t i = 0; i < length; i++) {
+		streamBits[i % INTERLEAVED_STREAMS] += table.codes[data[i]].length;
+	}
+	uint64_t bytes = (headerBits + 32 * (INTERLEAVED_STREAMS - 1) + 7) / 8;
+	for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+		bytes += (streamBits[s] + 7) / 8;
+	}
+	return bytes;
+}
+
+/*
+* Compresses one block: a tree built from the block's own
+* counts, turned into a canonical code, then the header and
+* the codes written to a buffer so that the frame can say how
+* long it is. Blocks are numbered from 1 for encryption, so
+* none shares its header bits with a whole-file header. The
+* version is that of the file: an interleaved file's codes go
+* in interleaved streams, and a sealed frame is then encrypted
+* whole, header and all. If the frame would be no smaller than
+* the block, which the counts say before anything is encoded,
+* the block is stored instead, always encrypted, and stored is
+* set. Either way the frame's checksums are filled in.
+*/
+static string compressBlock(const unsigned char* data, size_t length, const PasswordKey& password, uint64_t block,
+                            int version, bool& stored, BlockChecksums& checksums) {
+	uint64_t counts[NUM_SYMBOLS] = { 0 };
+	countBytes(data, length, counts);
+	int lengths[NUM_SYMBOLS];
+	getCodeLengthsForCounts(counts, lengths);
+	EncodeTable table;
+	buildCanonicalEncodeTable(lengths, table);
+
+	checksums.data = sealChecksum(crc32c(data, length), password, block);
+	stored = encodedFrameBytes(data, length, counts, lengths, table, version) >= length;
+	if (stored) {
+		string body((const char*)data, length);
+		KeyStream(password.keystreamKey(), block + SEAL_NONCE).apply((unsigned char*)&body[0], body.size());
+		checksums.frame = frameChecksum(length, body.size() | STORED_FRAME, body.data(), body.size(), checksums.data);
+		return body;
+	}
+
+	ostringbstream frame;
+	writeCanonicalFileHeader(frame, lengths, password, block, frameHeaderVersion(version));
+	if (isInterleavedVersion(version)) {
+		encodeBufferInterleaved(data, length, table, frame);
+	} else {
+		encodeBufferWithTable(data, length, table, frame);
+	}
+	string body = frame.str();
+	if ((version & FORMAT_FLAG_SEALED) && !body.empty()) {
+		KeyStream(password.keystreamKey(), block + SEAL_NONCE).apply((unsigned char*)&body[0], body.size());
+	}
+	checksums.frame = frameChecksum(length, body.size(), body.data(), body.size(), checksums.data);
+	return body;
+}
+
+/*
+* Decodes the body of one frame, as written by compressBlock,
+* into exactly length bytes of buffer. The version is that of
+* the file, which says how the frame is encrypted. A stored
+* frame is the block itself, length bytes of it.
+*/
+static void decompressBlock(const string& frame, const PasswordKey& password, uint64_t block, int version,
+                            bool stored, unsigned char* buffer, size_t length) {
+	string body = frame;
+	if ((stored || (version & FORMAT_FLAG_SEALED)) && !body.empty()) {
+		KeyStream(password.keystreamKey(), block + SEAL_NONCE).apply((unsigned char*)&body[0], body.size());
+	}
+	if (stored) {
+		memcpy(buffer, body.data(), length);
+		return;
+	}
+	istringbstream source(body);
+	int lengths[NUM_SYMBOLS];
+	int headerBits = readCanonicalFileHeader(source, lengths, password, block, frameHeaderVersion(version));
+	DecodeTable table;
+	buildCanonicalDecodeTable(lengths, table);
+	if (isInterleavedVersion(version)) {
+		// the streams are read straight from the frame, just past the header
+		const unsigned char* rest = (const unsigned char*)body.data() + headerBits / 8;
+		decodeBufferInterleaved(rest, body.size() - headerBits / 8, headerBits % 8, table, buffer, length);
+	} else {
+		decodeBufferWithTable(source, table, buffer, length);
+	}
+}
+
+/*
+* Writes the frames of a block compressed file, keeping track
+* of where each one starts so that the index can be written
+* once the last block is done. New files get checksums in their
+* index; a file carried on from gets them only if it had them.
+* The blocks are encrypted with the writer's key, the one bound
+* to the file's salt and nonce.
+*/
+class BlockWriter {
+public:
+	BlockWriter(obstream& outfile, int version, const PasswordKey& password)
+		: outfile(outfile), fileKey(writeFormatMagic(outfile, version, password)), written(0), dataWritten(0),
+		  checksummed(true) {
+		outfile.flushBits();
+		written = FORMAT_PREFIX_BYTES;
+	}
+
+	// carries on after the blocks of an existing file, writing over its end frame
+	BlockWriter(obstream& outfile, const PasswordKey& fileKey, const std::vector<BlockIndexEntry>& existing,
+	            uint64_t endOffset, bool checksummed)
+		: outfile(outfile), fileKey(fileKey), written(endOffset), dataWritten(0), checksummed(checksummed),
+		  index(existing) {
+		if (!index.empty()) dataWritten = index.back().dataOffset + index.back().dataBytes;
+	}
+
+	const PasswordKey& key() const {
+		return fileKey;
+	}
+
+	uint64_t blocks() const {
+		return index.size();
+	}
+
+	void writeBlock(size_t blockBytes, const string& frame, bool stored, const BlockChecksums& checksums) {
+		BlockIndexEntry entry = { written, dataWritten, blockBytes, checksums };
+		index.push_back(entry);
+		writeSizes(blockBytes, frame.size() | (stored ? STORED_FRAME : 0));
+		outfile.write(frame.data(), frame.size());
+		written += FRAME_SIZES_BYTES + frame.size();
+		dataWritten += blockBytes;
+	}
+
+	// the end frame records how many index bytes follow it
+	void finish() {
+		size_t entryBytes = checksummed ? CHECKED_INDEX_ENTRY_BYTES : INDEX_ENTRY_BYTES;
+		writeSizes(0, index.size() * entryBytes + INDEX_TRAILER_BYTES);
+		for (size_t i = 0; i < index.size(); i++) {
+			outfile.writeBits(index[i].frameOffset, 64);
+			outfile.writeBits(index[i].dataBytes, 32);
+			if (checksummed) {
+				outfile.writeBits(index[i].checksums.data, 32);
+				outfile.writeBits(index[i].checksums.frame, 32);
+			}
+		}
+		outfile.writeBits(index.size(), 32);
+		outfile.writeBits(checksummed ? CHECKED_INDEX_MAGIC : INDEX_MAGIC, 32);
+		outfile.flushBits();
+	}
+
+private:
+	obstream& outfile;
+	PasswordKey fileKey;
+	uint64_t written, dataWritten;
+	bool checksummed;
+	std::vector<BlockIndexEntry> index;
+
+	void writeSizes(size_t blockBytes, size_t frameBytes) {
+		outfile.writeBits(blockBytes, 32);
+		outfile.writeBits(frameBytes, 32);
+		outfile.flushBits();
+	}
+};
+
+/*
+* The number of threads to use when the caller asked for the
+* given number, where 0 means one per core.
+*/
+static int threadCount(int threads) {
+	if (threads > 0) return threads;
+	int cores = int(std::thread::hardware_concurrency());
+	return cores > 0 ? cores : 1;
+}
+
+/*
+* Runs task(0) through task(count - 1) on up to threads threads,
+* each thread taking the next index nobody has claimed yet. The
+* calling thread works too. If any task raises an error, no new
+* tasks are started and the first error is raised again here
+* once every thread has finished.
+*/
+static void runParallel(size_t count, int threads, const std::function<void(size_t)>& task) {
+	std::atomic<size_t> next(0);
+	std::exception_ptr failure;
+	std::mutex failureLock;
+	auto worker = [&]() {
+		while (true) {
+			size_t index = next++;
+			if (index >= count) return;
+			try {
+				task(index);
+			} catch (...) {
+				std::lock_guard<std::mutex> guard(failureLock);
+				if (!failure) failure = std::current_exception();
+				next = count;
+			}
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (int i = 1; i < threads && size_t(i) < count; i++) {
+		pool.push_back(std::thread(worker));
+	}
+	worker();
+	for (size_t i = 0; i < pool.size(); i++) {
+		pool[i].join();
+	}
+	if (failure) std::rethrow_exception(failure);
+}
+
+/*
+* The version of the block files written with the given options.
+* New files may have compact frame headers.
+*/
+static int blockVersion(bool encryptPayload, bool interleaved) {
+	int version = interleaved ? FORMAT_VERSION_INTERLEAVED_BLOCKS : FORMAT_VERSION_KEYSTREAM_BLOCKS;
+	return version | FORMAT_FLAG_COMPACT | (encryptPayload ? FORMAT_FLAG_SEALED : 0);
+}
+
+/*
+* Reads the rest of the input a block at a time, writing each one
+* as the writer's next block, and then the end frame and index.
+*/
+static void writeBlocks(istream& infile, BlockWriter& writer, size_t blockSize, int version) {
+	std::vector<char> buffer(blockSize);
+	for (uint64_t block = writer.blocks() + 1; ; block++) {
+		infile.read(buffer.data(), buffer.size());
+		size_t got = size_t(infile.gcount());
+		if (got == 0) break;
+
+		bool stored;
+		BlockChecksums checksums;
+		string frame = compressBlock((const unsigned char*)buffer.data(), got, writer.key(), block, version, stored,
+		                             checksums);
+		writer.writeBlock(got, frame, stored, checksums);
+		if (got < blockSize) break; // short read, so the input is exhausted
+	}
+	writer.finish();
+}
+
+/* Function: compressStream
+ * Usage: compressStream(infile, outfile, password);
+ * --------------------------------------------------------
+ * Compresses the rest of the given stream into the block
+ * format, reading it exactly once and never seeking, so any
+ * istream will do.  At most blockSize bytes of input are held
+ * in memory at a time.  If encryptPayload is set, the file is
+ * sealed: the encoded data is encrypted along with the headers.
+ * If interleaved is set, every block is encoded as interleaved
+ * streams, which decode faster.
+ */
+void compressStream(istream& infile, obstream& outfile, const PasswordKey& password, size_t blockSize,
+                    bool encryptPayload, bool interleaved) {
+	if (blockSize == 0 || blockSize > MAX_BLOCK_SIZE) error("Block size is out of range.");
+	int version = blockVersion(encryptPayload, interleaved);
+	BlockWriter writer(outfile, version, password);
+	writeBlocks(infile, writer, blockSize, version);
+}
+
+/* Function: estimateStreamCompressedSize
+ * Usage: uint64_t bytes = estimateStreamCompressedSize(infile);
+ * --------------------------------------------------------
+ * Returns exactly how many bytes compressStream would write for
+ * the rest of the given stream, reading it once a block at a time
+ * but encoding nothing.  Sealing a file doesn't change its size.
+ */
+uint64_t estimateStreamCompressedSize(istream& infile, size_t blockSize, bool interleaved) {
+	if (blockSize == 0 || blockSize > MAX_BLOCK_SIZE) error("Block size is out of range.");
+	uint64_t total = FORMAT_PREFIX_BYTES + FRAME_SIZES_BYTES + INDEX_TRAILER_BYTES;
+	int version = blockVersion(false, interleaved);
+
+	std::vector<char> buffer(blockSize);
+	while (true) {
+		infile.read(buffer.data(), buffer.size());
+		size_t got = size_t(infile.gcount());
+		if (got == 0) break;
+
+		const unsigned char* data = (const unsigned char*)buffer.data();
+		uint64_t counts[NUM_SYMBOLS] = { 0 };
+		countBytes(data, got, counts);
+		int lengths[NUM_SYMBOLS];
+		getCodeLengthsForCounts(counts, lengths);
+		EncodeTable table;
+		buildCanonicalEncodeTable(lengths, table);
+
+		// a block that wouldn't shrink is stored as it is
+		uint64_t frameBytes = std::min<uint64_t>(encodedFrameBytes(data, got, counts, lengths, table, version), got);
+		total += FRAME_SIZES_BYTES + frameBytes + CHECKED_INDEX_ENTRY_BYTES;
+		if (got < blockSize) break;
+	}
+	return total;
+}
+
+/* Function: compressParallel
+ * Usage: compressParallel(infile, outfile, password, threads);
+ * --------------------------------------------------------
+ * Compresses the rest of the given stream into exactly the
+ * bytes compressStream would write, but counts and encodes
+ * up to threads blocks at a time.  A threads value of 0 means
+ * one thread per core.  At most two blocks per thread are
+ * held in memory at once.
+ */
+void compressParallel(istream& infile, obstream& outfile, const PasswordKey& password, int threads, size_t blockSize,
+                      bool encryptPayload, bool interleaved) {
+	if (blockSize == 0 || blockSize > MAX_BLOCK_SIZE) error("Block size is out of range.");
+	threads = threadCount(threads);
+	int version = blockVersion(encryptPayload, interleaved);
+	BlockWriter writer(outfile, version, password);
+
+	// two blocks per thread, so one slow block doesn't leave the others idle
+	size_t batchBlocks = size_t(threads) * 2;
+	std::vector<std::vector<char>> inputs(batchBlocks);
+	std::vector<size_t> sizes(batchBlocks);
+	std::vector<string> frames(batchBlocks);
+	std::vector<char> stored(batchBlocks); // not vector<bool>, whose elements threads can't set apart
+	std::vector<BlockChecksums> checksums(batchBlocks);
+
+	uint64_t block = 1;
+	bool exhausted = false;
+	while (!exhausted) {
+		size_t filled = 0;
+		while (filled < batchBlocks) {
+			inputs[filled].resize(blockSize);
+			infile.read(inputs[filled].data(), blockSize);
+			size_t got = size_t(infile.gcount());
+			if (got == 0) {
+				exhausted = true;
+				break;
+			}
+			sizes[filled++] = got;
+			if (got < blockSize) {
+				exhausted = true;
+				break;
+			}
+		}
+
+		runParallel(filled, threads, [&](size_t i) {
+			bool isStored;
+			frames[i] = compressBlock((const unsigned char*)inputs[i].data(), sizes[i], writer.key(), block + i, version,
+			                          isStored, checksums[i]);
+			stored[i] = isStored;
+		});
+
+		// frames go out in input order, whichever thread finished first
+		for (size_t i = 0; i < filled; i++) {
+			writer.writeBlock(sizes[i], frames[i], stored[i] != 0, checksums[i]);
+			string().swap(frames[i]);
+		}
+		block += filled;
+	}
+	writer.finish();
+}
+
+/* Type: PipelineBlock
+ * One block on its way through compressPipelined: the buffer it
+ * was read into, how much of that it holds, and once a worker has
+ * been at it, its frame.  A block holding no bytes marks the end
+ * of the input.
+ */
+struct PipelineBlock {
+	std::vector<char> input;
+	size_t size;
+	string frame;
+	bool stored;
+	BlockChecksums checksums;
+
+	PipelineBlock() : size(0), stored(false), checksums() {}
+};
+
+/*
+* A bounded queue of blocks between exactly one thread that puts
+* them in and exactly one that takes them out, with no lock: each
+* side only ever writes its own counter. Blocks are swapped in and
+* out of the slots rather than copied, so the buffers a consumer is
+* done with go back to the producer to be filled again. A side that
+* finds the queue full or empty yields until it isn't, or gives up,
+* returning false, once abandon is set.
+*/
+class BlockRing {
+public:
+	BlockRing(size_t capacity, const std::atomic<bool>& abandon)
+		: slots(capacity), head(0), tail(0), abandon(abandon) {}
+
+	bool push(PipelineBlock& block) {
+		size_t back = tail.load(std::memory_order_relaxed);
+		while (back - head.load(std::memory_order_acquire) == slots.size()) {
+			if (abandon.load(std::memory_order_relaxed)) return false;
+			std::this_thread::yield();
+		}
+		std::swap(slots[back % slots.size()], block);
+		tail.store(back + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(PipelineBlock& block) {
+		size_t front = head.load(std::memory_order_relaxed);
+		while (tail.load(std::memory_order_acquire) == front) {
+			if (abandon.load(std::memory_order_relaxed)) return false;
+			std::this_thread::yield();
+		}
+		std::swap(slots[front % slots.size()], block);
+		head.store(front + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<PipelineBlock> slots;
+	std::atomic<size_t> head, tail; // blocks taken out and put in, ever
+	const std::atomic<bool>& abandon;
+
+	BlockRing(const BlockRing&);
+	BlockRing& operator=(const BlockRing&);
+};
+
+/* Function: compressPipelined
+ * Usage: compressPipelined(infile, outfile, password, threads);
+ * --------------------------------------------------------
+ * Compresses the rest of the given stream into exactly the
+ * bytes compressStream would write, with reading, encoding and
+ * writing all going on at once, so that slow storage on either
+ * side is hidden behind the encoding.
+ */
+void compressPipelined(istream& infile, obstream& outfile, const PasswordKey& password, int threads, size_t blockSize,
+                       bool encryptPayload, bool interleaved) {
+	if (blockSize == 0 || blockSize > MAX_BLOCK_SIZE) error("Block size is out of range.");
+	size_t workers = size_t(threadCount(threads));
+	int version = blockVersion(encryptPayload, interleaved);
+	BlockWriter writer(outfile, version, password);
+
+	// block n goes through worker n % workers both ways, so taking frames
+	// from the workers in turn puts them back in input order
+	std::atomic<bool> abandon(false);
+	std::vector<std::unique_ptr<BlockRing>> toWorkers, fromWorkers;
+	for (size_t w = 0; w < workers; w++) {
+		toWorkers.push_back(std::unique_ptr<BlockRing>(new BlockRing(PIPELINE_DEPTH, abandon)));
+		fromWorkers.push_back(std::unique_ptr<BlockRing>(new BlockRing(PIPELINE_DEPTH, abandon)));
+	}
+
+	std::exception_ptr failure;
+	std::mutex failureLock;
+	auto fail = [&]() {
+		std::lock_guard<std::mutex> guard(failureLock);
+		if (!failure) failure = std::current_exception();
+		abandon = true;
+	};
+
+	std::vector<std::thread> pool;
+	pool.push_back(std::thread([&]() {
+		try {
+			PipelineBlock block;
+			for (size_t n = 0; ; n++) {
+				block.input.resize(blockSize);
+				infile.read(block.input.data(), blockSize);
+				size_t got = size_t(infile.gcount());
+				if (got == 0) break;
+				block.size = got;
+				if (!toWorkers[n % workers]->push(block)) return;
+				if (got < blockSize) break; // short read, so the input is exhausted
+			}
+
+			// every worker gets an empty block to say there are no more
+			for (size_t w = 0; w < workers; w++) {
+				block.size = 0;
+				if (!toWorkers[w]->push(block)) return;
+			}
+		} catch (...) {
+			fail();
+		}
+	}));
+	for (size_t w = 0; w < workers; w++) {
+		pool.push_back(std::thread([&, w]() {
+			try {
+				PipelineBlock block;
+				for (uint64_t n = w; ; n += workers) {
+					if (!toWorkers[w]->pop(block)) return;
+					bool last = block.size == 0;
+					if (!last) {
+						block.frame = compressBlock((const unsigned char*)block.input.data(), block.size, writer.key(), n + 1,
+						                            version, block.stored, block.checksums);
+					}
+					// the push hands back an old block, so what was pushed is decided first
+					if (!fromWorkers[w]->push(block) || last) return;
+				}
+			} catch (...) {
+				fail();
+			}
+		}));
+	}
+
+	// this thread writes, in order, until the first empty block
+	try {
+		PipelineBlock block;
+		for (size_t n = 0; fromWorkers[n % workers]->pop(block) && block.size > 0; n++) {
+			writer.writeBlock(block.size, block.frame, block.stored, block.checksums);
+		}
+	} catch (...) {
+		fail();
+	}
+	for (size_t i = 0; i < pool.size(); i++) {
+		pool[i].join();
+	}
+	if (failure) std::rethrow_exception(failure);
+	writer.finish();
+}
+
+/*
+* Reads a 32-bit frame field, treating the end of the input as
+* a truncated file rather than as zero bits.
+*/
+static size_t readFrameField(ibstream& infile) {
+	if (!infile.hasBits(32)) error("Compressed file is truncated.");
+	return size_t(infile.readBits(32));
+}
+
+/*
+* Checks the two sizes at the start of a frame before anything
+* is allocated for them, returning the size of the frame's body
+* and setting stored if its block is stored. A stored body is
+* exactly the size of the block.
+*/
+static size_t checkFrameSizes(size_t blockBytes, size_t frameField, bool& stored) {
+	stored = (frameField & STORED_FRAME) != 0;
+	size_t frameBytes = frameField & ~STORED_FRAME;
+	if (blockBytes > MAX_BLOCK_SIZE || frameBytes > maxFrameBytes(blockBytes) || (stored && frameBytes != blockBytes)) {
+		error("Corrupt block in compressed file.");
+	}
+	return frameBytes;
+}
+
+/*
+* Returns the given version, as readFormatMagic gives it, or raises
+* an error if it isn't that of a block compressed file.
+*/
+static int blockVersionOf(int version) {
+	int base = version & ~(FORMAT_FLAG_SEALED | FORMAT_FLAG_COMPACT);
+	bool known = base == FORMAT_VERSION_KEYSTREAM_BLOCKS || base == FORMAT_VERSION_INTERLEAVED_BLOCKS ||
+	             version == FORMAT_VERSION_BLOCKS;
+	if (!known) error("Not a block compressed file.");
+	return version;
+}
+
+/*
+* Raises the error for a block whose checksum doesn't match,
+* numbering blocks from 1.
+*/
+static void blockDamaged(uint64_t block) {
+	error("Block " + integerToString(int(block)) + " of the compressed file is damaged.");
+}
+
+/*
+* Reads a little-endian field of the given number of bytes, the
+* order in which writeBits lays out whole bytes.
+*/
+static uint64_t littleEndian(const unsigned char* bytes, int count) {
+	uint64_t result = 0;
+	for (int i = count - 1; i >= 0; i--) {
+		result = (result << 8) | bytes[i];
+	}
+	return result;
+}
+
+/*
+* Returns the bytes of each entry in the index of a file read as a
+* stream, given the size its end frame records and the number of
+* blocks read. The index must be exactly the size of one with or
+* without checksums for those blocks, or a damaged size could turn
+* the checks off.
+*/
+static size_t streamedEntryBytes(size_t indexBytes, uint64_t blocks) {
+	if (indexBytes == blocks * CHECKED_INDEX_ENTRY_BYTES + INDEX_TRAILER_BYTES) return CHECKED_INDEX_ENTRY_BYTES;
+	if (indexBytes == blocks * INDEX_ENTRY_BYTES + INDEX_TRAILER_BYTES) return INDEX_ENTRY_BYTES;
+	error("Corrupt block index.");
+	return 0;
+}
+
+/*
+* Checks the trailer of that index, which must count the blocks read
+* and have the magic number of the entries its size gives it; an
+* empty index may have either. Returns whether it has checksums.
+*/
+static bool checkStreamedTrailer(const unsigned char trailer[INDEX_TRAILER_BYTES], uint64_t blocks, size_t entryBytes) {
+	uint64_t magic = littleEndian(trailer + 4, 4);
+	bool matches = magic == (entryBytes == CHECKED_INDEX_ENTRY_BYTES ? CHECKED_INDEX_MAGIC : INDEX_MAGIC) ||
+	               (blocks == 0 && magic == INDEX_MAGIC);
+	if (!matches || littleEndian(trailer, 4) != blocks) error("Corrupt block index.");
+	return magic == CHECKED_INDEX_MAGIC;
+}
+
+/* Function: decompressStream
+ * Usage: decompressStream(infile, outfile, password);
+ * --------------------------------------------------------
+ * Decompresses a file written by compressStream, one block at
+ * a time, starting from its magic number.  Like compressStream
+ * it reads the input once and never seeks.  Raises an error if
+ * the file is truncated or a block does not decode to exactly
+ * the size its frame records.  The checksums are at the end of
+ * the file, so each block's are worked out as it goes by and
+ * checked once the index is reached.
+ */
+void decompressStream(ibstream& infile, ostream& outfile, const PasswordKey& password) {
+	if (!infile.hasBits(32)) error("Compressed file is truncated.");
+	PasswordKey fileKey = password;
+	int version = blockVersionOf(readFormatMagic(infile, password, fileKey));
+
+	std::vector<BlockChecksums> seen;
+	for (uint64_t block = 1; ; block++) {
+		size_t blockBytes = readFrameField(infile);
+		size_t frameField = readFrameField(infile);
+		if (blockBytes == 0) {
+			size_t entryBytes = streamedEntryBytes(frameField, seen.size());
+			std::vector<unsigned char> index(frameField);
+			readStoredBytes(infile, index.data(), frameField);
+			if (checkStreamedTrailer(&index[frameField - INDEX_TRAILER_BYTES], seen.size(), entryBytes)) {
+				for (size_t i = 0; i < seen.size(); i++) {
+					const unsigned char* entry = &index[i * CHECKED_INDEX_ENTRY_BYTES];
+					if (littleEndian(entry + 12, 4) != seen[i].data || littleEndian(entry + 16, 4) != seen[i].frame) {
+						blockDamaged(i + 1);
+					}
+				}
+			}
+			break;
+		}
+		bool stored;
+		size_t frameBytes = checkFrameSizes(blockBytes, frameField, stored);
+
+		string frame(frameBytes, '\0');
+		readStoredBytes(infile, (unsigned char*)&frame[0], frameBytes);
+
+		std::vector<unsigned char> decoded(blockBytes);
+		decompressBlock(frame, fileKey, block, version, stored, decoded.data(), blockBytes);
+		outfile.write((const char*)decoded.data(), blockBytes);
+		BlockChecksums checksums;
+		checksums.data = sealChecksum(crc32c(decoded.data(), blockBytes), fileKey, block);
+		checksums.frame = frameChecksum(blockBytes, frameField, frame.data(), frame.size(), checksums.data);
+		seen.push_back(checksums);
+	}
+}
+
+/*
+* The body of one frame as BlockDecodeStream reads it: fetched from
+* the file a window at a time, checksummed as it was written, then
+* decrypted if it was encrypted, and handed out as a stream buffer
+* so that an ibstream can read the header and codes from it. Since
+* every window but the last is whole keystream words, decrypting a
+* window at a time matches decrypting the frame at once.
+*/
+class FrameSource: public streambuf {
+public:
+	FrameSource(size_t windowBytes) : window(windowBytes), input(nullptr), remaining(0), cipher(0, 0),
+	                                  encrypted(false), crc(0) {}
+
+	/*
+	* Starts on a frame of the given number of bytes, the next ones
+	* in input, carrying its checksum on from crc.
+	*/
+	void start(ibstream& input, size_t bytes, bool encrypted, const KeyStream& cipher, uint32_t crc) {
+		this->input = &input;
+		remaining = bytes;
+		this->encrypted = encrypted;
+		this->cipher = cipher;
+		this->crc = crc;
+		setg(nullptr, nullptr, nullptr);
+	}
+
+	/*
+	* Reads whatever is left of the frame, so that its checksum is
+	* complete and the input is at the next frame, and returns the
+	* checksum.
+	*/
+	uint32_t finish() {
+		while (remaining > 0) {
+			underflow();
+		}
+		setg(nullptr, nullptr, nullptr);
+		return crc;
+	}
+
+	unsigned char* data() {
+		return window.data();
+	}
+
+	size_t capacity() const {
+		return window.size();
+	}
+
+protected:
+	virtual int_type underflow() {
+		if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+		if (remaining == 0) return traits_type::eof();
+		size_t count = std::min(remaining, window.size());
+		readStoredBytes(*input, window.data(), count);
+		crc = crc32c(window.data(), count, crc);
+		if (encrypted) cipher.apply(window.data(), count);
+		remaining -= count;
+		char* start = (char*)window.data();
+		setg(start, start, start + count);
+		return traits_type::to_int_type(*gptr());
+	}
+
+	/*
+	* Only the seek to the start that rewind makes, just after a frame
+	* is started, is allowed.
+	*/
+	virtual pos_type seekoff(off_type offset, ios_base::seekdir dir, ios_base::openmode) {
+		if (offset != 0 || dir != ios_base::beg || gptr() != egptr()) return pos_type(off_type(-1));
+		return pos_type(0);
+	}
+
+	virtual pos_type seekpos(pos_type position, ios_base::openmode which) {
+		return seekoff(off_type(position), ios_base::beg, which);
+	}
+
+private:
+	std::vector<unsigned char> window;
+	ibstream* input;
+	size_t remaining;
+	KeyStream cipher;
+	bool encrypted;
+	uint32_t crc;
+};
+
+/*
+* The ibstream a frame's header and codes are read from.
+*/
+class FrameStream: public ibstream {
+public:
+	FrameStream(FrameSource& source) {
+		init(&source);
+	}
+};
+
+/* Type: BlockDecodeStream::State
+ * Everything BlockDecodeStream carries from one read to the next:
+ * the frame being read and its code, how much of its block is
+ * still to come, and the CRC32C of the checksums of every block
+ * so far, in the order the index lists them, to be checked against
+ * the index's without keeping a checksum per block.
+ */
+struct BlockDecodeStream::State {
+	enum FrameKind {
+		FRAME_NONE,
+		FRAME_CODED,
+		FRAME_STORED,
+		FRAME_HELD
+	};
+
+	ibstream& infile;
+	PasswordKey password;
+	int version;
+	FrameSource source;
+	FrameStream frame;
+	DecodeTable table;
+	FrameKind kind;
+	uint64_t block;
+	size_t left;
+	const unsigned char* held;
+	uint32_t dataCrc, checks;
+	bool finished;
+
+	State(ibstream& infile, const PasswordKey& password, size_t windowBytes)
+		: infile(infile), password(password), version(0), source(windowBytes), frame(source), kind(FRAME_NONE),
+		  block(0), left(0), held(nullptr), dataCrc(0), checks(0), finished(false) {}
+
+	void startFrame();
+	void finishFrame();
+	void readIndex(size_t indexBytes);
+};
+
+/* Constructor: BlockDecodeStream
+ * Usage: BlockDecodeStream blocks(infile, password, windowBytes);
+ * --------------------------------------------------------
+ * Reads the magic number and password check, but no frame yet.
+ */
+BlockDecodeStream::BlockDecodeStream(ibstream& infile, const PasswordKey& password, size_t windowBytes) {
+	if (windowBytes < 8) error("The decode window must be at least 8 bytes.");
+	if (!infile.hasBits(32)) error("Compressed file is truncated.");
+	PasswordKey fileKey = password;
+	int version = blockVersionOf(readFormatMagic(infile, password, fileKey));
+	state = new State(infile, fileKey, windowBytes / 8 * 8);
+	state->version = version;
+}
+
+BlockDecodeStream::~BlockDecodeStream() {
+	delete state;
+}
+
+/* Member function: read
+ * Usage: size_t got = blocks.read(buffer, count);
+ * --------------------------------------------------------
+ * Starts a frame whenever the last one's block is used up, and
+ * takes the bytes from wherever that frame's kind keeps them.
+ */
+size_t BlockDecodeStream::read(unsigned char* buffer, size_t count) {
+	State& s = *state;
+	size_t done = 0;
+	while (done < count && !s.finished) {
+		if (s.kind == State::FRAME_NONE) {
+			s.startFrame();
+			continue;
+		}
+		size_t want = std::min(count - done, s.left), got = want;
+		if (s.kind == State::FRAME_STORED) {
+			s.source.sgetn((char*)buffer + done, streamsize(want));
+		} else if (s.kind == State::FRAME_HELD) {
+			memcpy(buffer + done, s.held, want);
+			s.held += want;
+		} else {
+			bool ended;
+			got = decodeSpanWithTable(s.frame, s.table, buffer + done, want, ended);
+			if (ended) error("Encoded data ends before its recorded length.");
+		}
+		s.dataCrc = crc32c(buffer + done, got, s.dataCrc);
+		done += got;
+		s.left -= got;
+		if (s.left == 0) s.finishFrame();
+	}
+	return done;
+}
+
+/*
+* Reads the sizes of the next frame and gets ready to hand out its
+* block, or reads the index if this is the end frame. A coded frame
+* has its header read now and its codes as they are asked for; an
+* interleaved one is decoded whole, into the window just past it.
+*/
+void BlockDecodeStream::State::startFrame() {
+	size_t blockBytes = readFrameField(infile);
+	size_t frameField = readFrameField(infile);
+	if (blockBytes == 0) {
+		readIndex(frameField);
+		finished = true;
+		return;
+	}
+	bool stored;
+	size_t frameBytes = checkFrameSizes(blockBytes, frameField, stored);
+	block++;
+	bool sealed = stored || (version & FORMAT_FLAG_SEALED);
+	source.start(infile, frameBytes, sealed, KeyStream(password.keystreamKey(), block + SEAL_NONCE),
+	             frameSizesChecksum(blockBytes, frameField));
+	left = blockBytes;
+	dataCrc = 0;
+
+	int headerVersion = frameHeaderVersion(version);
+	int lengths[NUM_SYMBOLS];
+	if (stored) {
+		kind = FRAME_STORED;
+	} else if (isInterleavedVersion(version)) {
+		if (frameBytes + blockBytes > source.capacity()) {
+			error("Block " + std::to_string(block) + " needs a decode window of at least " +
+			      std::to_string(uint64_t(frameBytes) + blockBytes) + " bytes.");
+		}
+		// the window was empty, so the whole frame lands at its start
+		source.sgetc();
+		imembstream header(source.data(), frameBytes);
+		int headerBits = readCanonicalFileHeader(header, lengths, password, block, headerVersion);
+		buildCanonicalDecodeTable(lengths, table);
+		unsigned char* decoded = source.data() + frameBytes;
+		decodeBufferInterleaved(source.data() + headerBits / 8, frameBytes - headerBits / 8, headerBits % 8, table,
+		                        decoded, blockBytes);
+		held = decoded;
+		kind = FRAME_HELD;
+	} else {
+		frame.rewind();
+		readCanonicalFileHeader(frame, lengths, password, block, headerVersion);
+		buildCanonicalDecodeTable(lengths, table);
+		kind = FRAME_CODED;
+	}
+}
+
+/*
+* Once a frame's block has all been handed out, checks that a coded
+* frame's PSEUDO_EOF comes next, then adds the frame's checksums to
+* those of the blocks before it.
+*/
+void BlockDecodeStream::State::finishFrame() {
+	if (kind == FRAME_CODED) {
+		unsigned char extra;
+		bool ended;
+		if (decodeSpanWithTable(frame, table, &extra, 1, ended) > 0) {
+			error("Encoded data runs past its recorded length.");
+		}
+	}
+	BlockChecksums checksums;
+	checksums.data = sealChecksum(dataCrc, password, block);
+	checksums.frame = withDataChecksum(source.finish(), checksums.data);
+	unsigned char bytes[8];
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = (unsigned char)(checksums.data >> (8 * i));
+		bytes[4 + i] = (unsigned char)(checksums.frame >> (8 * i));
+	}
+	checks = crc32c(bytes, 8, checks);
+	kind = FRAME_NONE;
+}
+
+/*
+* Reads the index after the end frame, and if it has checksums,
+* checks them against those of the blocks read. The entries are
+* read one at a time and only the CRC32C of their checksums is
+* kept, so a damaged block is caught but not named.
+*/
+void BlockDecodeStream::State::readIndex(size_t indexBytes) {
+	size_t entryBytes = streamedEntryBytes(indexBytes, block);
+	uint32_t listed = 0;
+	unsigned char entry[CHECKED_INDEX_ENTRY_BYTES];
+	for (uint64_t i = 0; i < block; i++) {
+		readStoredBytes(infile, entry, entryBytes);
+		if (entryBytes == CHECKED_INDEX_ENTRY_BYTES) listed = crc32c(entry + 12, 8, listed);
+	}
+	unsigned char trailer[INDEX_TRAILER_BYTES];
+	readStoredBytes(infile, trailer, INDEX_TRAILER_BYTES);
+	if (checkStreamedTrailer(trailer, block, entryBytes) && listed != checks) {
+		error("A block of the compressed file is damaged.");
+	}
+}
+
+/*
+* Reads count bytes starting offset bytes past base.
+*/
+static void readBytesAt(ibstream& infile, streampos base, uint64_t offset, unsigned char* buffer, size_t count) {
+	infile.clear();
+	infile.seekg(base + streamoff(offset));
+	infile.read((char*)buffer, count);
+	if (size_t(infile.gcount()) != count) error("Compressed file is truncated.");
+}
+
+/*
+* Reads the block index from the end of a block compressed file
+* whose magic number is at base, checking the password, unless it
+* is null, and that the index agrees with itself and with the end
+* frame. Sets fileKey to the password's key for the file, endOffset
+* to where the end frame starts, just past the last block, version
+* to the version of the file, and checksummed to whether the index
+* has checksums.
+*/
+static void readBlockIndex(ibstream& infile, streampos base, const PasswordKey* password, PasswordKey& fileKey,
+                           std::vector<BlockIndexEntry>& index, uint64_t& endOffset, int& version, bool& checksummed) {
+	index.clear();
+	unsigned char field[INDEX_TRAILER_BYTES];
+	readBytesAt(infile, base, 0, field, MAGIC_BYTES);
+	uint64_t magic = littleEndian(field, 4);
+	version = (magic & 0xFFFFFF) == FORMAT_MAGIC ? int(magic >> 24) : 0;
+	blockVersionOf(version & ~(FORMAT_FLAG_CHECKED | FORMAT_FLAG_SALTED));
+
+	// the first frame follows the magic number, any salt and nonce, and any password check
+	uint64_t framesStart = MAGIC_BYTES;
+	if (password) fileKey = *password;
+	if (version & FORMAT_FLAG_SALTED) {
+		unsigned char salt[SALT_AND_NONCE_BYTES];
+		readBytesAt(infile, base, framesStart, salt, SALT_AND_NONCE_BYTES);
+		if (password) fileKey = password->forFile(salt, littleEndian(salt + SALT_BYTES, 8));
+		framesStart += SALT_AND_NONCE_BYTES;
+		version &= ~FORMAT_FLAG_SALTED;
+	}
+	if (version & FORMAT_FLAG_CHECKED) {
+		readBytesAt(infile, base, framesStart, field, CHECK_BYTES);
+		if (password && uint32_t(littleEndian(field, 4)) != fileKey.check()) error("Wrong password.");
+		framesStart += CHECK_BYTES;
+		version &= ~FORMAT_FLAG_CHECKED;
+	}
+
+	infile.clear();
+	infile.seekg(0, ios::end);
+	uint64_t fileBytes = uint64_t(infile.tellg() - base);
+	if (fileBytes < framesStart + FRAME_SIZES_BYTES + INDEX_TRAILER_BYTES) error("Compressed file has no block index.");
+	readBytesAt(infile, base, fileBytes - INDEX_TRAILER_BYTES, field, INDEX_TRAILER_BYTES);
+	uint64_t count = littleEndian(field, 4);
+	uint64_t indexMagic = littleEndian(field + 4, 4);
+	if (indexMagic != INDEX_MAGIC && indexMagic != CHECKED_INDEX_MAGIC) error("Compressed file has no block index.");
+	checksummed = indexMagic == CHECKED_INDEX_MAGIC;
+	size_t entryBytes = checksummed ? CHECKED_INDEX_ENTRY_BYTES : INDEX_ENTRY_BYTES;
+
+	uint64_t indexBytes = count * entryBytes + INDEX_TRAILER_BYTES;
+	if (indexBytes + framesStart + FRAME_SIZES_BYTES > fileBytes) error("Corrupt block index.");
+	endOffset = fileBytes - indexBytes - FRAME_SIZES_BYTES;
+	readBytesAt(infile, base, endOffset, field, FRAME_SIZES_BYTES);
+	if (littleEndian(field, 4) != 0 || littleEndian(field + 4, 4) != indexBytes) error("Corrupt block index.");
+
+	// each frame must start after the one before it and before the end frame
+	std::vector<unsigned char> entries(size_t(count) * entryBytes);
+	if (count > 0) readBytesAt(infile, base, endOffset + FRAME_SIZES_BYTES, entries.data(), entries.size());
+	uint64_t dataOffset = 0;
+	for (size_t i = 0; i < count; i++) {
+		const unsigned char* fields = &entries[i * entryBytes];
+		BlockIndexEntry entry;
+		entry.frameOffset = littleEndian(fields, 8);
+		entry.dataBytes = size_t(littleEndian(fields + 8, 4));
+		entry.dataOffset = dataOffset;
+		entry.checksums.data = checksummed ? uint32_t(littleEndian(fields + 12, 4)) : 0;
+		entry.checksums.frame = checksummed ? uint32_t(littleEndian(fields + 16, 4)) : 0;
+		uint64_t earliest = i == 0 ? framesStart : index[i - 1].frameOffset + FRAME_SIZES_BYTES;
+		if (entry.frameOffset < earliest || entry.frameOffset >= endOffset) error("Corrupt block index.");
+		if (i == 0 && entry.frameOffset != framesStart) error("Corrupt block index.");
+		if (entry.dataBytes == 0 || entry.dataBytes > MAX_BLOCK_SIZE) error("Corrupt block index.");
+		index.push_back(entry);
+		dataOffset += entry.dataBytes;
+	}
+	if (count == 0 && endOffset != framesStart) error("Corrupt block index.");
+}
+
+/*
+* Decodes blocks first through first + count - 1 of the index on
+* up to threads threads, each straight into its place in buffer,
+* which must hold all of their bytes. The frames are read in one
+* go, since they sit next to each other in the file. If the index
+* is checksummed, each frame is checked before it is decoded and
+* its data after.
+*/
+static void decompressBlocks(ibstream& infile, streampos base, const std::vector<BlockIndexEntry>& index,
+                             uint64_t endOffset, int version, bool checksummed, size_t first, size_t count,
+                             const PasswordKey& password, int threads, unsigned char* buffer) {
+	uint64_t start = index[first].frameOffset;
+	uint64_t end = first + count < index.size() ? index[first + count].frameOffset : endOffset;
+	std::vector<unsigned char> frames(size_t(end - start));
+	readBytesAt(infile, base, start, frames.data(), frames.size());
+
+	runParallel(count, threads, [&](size_t i) {
+		const BlockIndexEntry& entry = index[first + i];
+		uint64_t next = first + i + 1 < index.size() ? index[first + i + 1].frameOffset : endOffset;
+		const unsigned char* frame = &frames[size_t(entry.frameOffset - start)];
+		size_t blockBytes = size_t(littleEndian(frame, 4));
+		bool stored;
+		size_t frameBytes = checkFrameSizes(blockBytes, size_t(littleEndian(frame + 4, 4)), stored);
+		if (blockBytes != entry.dataBytes || entry.frameOffset + FRAME_SIZES_BYTES + frameBytes != next) {
+			error("Block does not match the block index.");
+		}
+
+		uint64_t block = first + i + 1;
+		if (checksummed && withDataChecksum(crc32c(frame, FRAME_SIZES_BYTES + frameBytes), entry.checksums.data) !=
+		                   entry.checksums.frame) {
+			blockDamaged(block);
+		}
+
+		string body((const char*)frame + FRAME_SIZES_BYTES, frameBytes);
+		uint64_t offset = entry.dataOffset - index[first].dataOffset;
+		decompressBlock(body, password, block, version, stored, buffer + offset, blockBytes);
+		if (checksummed && sealChecksum(crc32c(buffer + offset, blockBytes), password, block) != entry.checksums.data) {
+			blockDamaged(block);
+		}
+	});
+}
+
+/* Function: decompressParallel
+ * Usage: decompressParallel(infile, outfile, password, threads);
+ * --------------------------------------------------------
+ * Decompresses a block compressed file, starting from its magic
+ * number, by decoding up to threads blocks at a time.  The block
+ * index at the end of the file says where every block starts
+ * and where its bytes belong, so each thread decodes straight
+ * into its place in the output.  At most two blocks per thread
+ * are held in memory at once.  The input stream must be able to
+ * seek.
+ */
+void decompressParallel(ibstream& infile, ostream& outfile, const PasswordKey& password, int threads) {
+	threads = threadCount(threads);
+	infile.syncBits();
+	streampos base = infile.tellg();
+	if (base == streampos(-1)) error("Parallel decompression needs a stream that can seek.");
+
+	std::vector<BlockIndexEntry> index;
+	uint64_t endOffset;
+	int version;
+	bool checksummed;
+	PasswordKey fileKey = password;
+	readBlockIndex(infile, base, &password, fileKey, index, endOffset, version, checksummed);
+
+	size_t batchBlocks = size_t(threads) * 2;
+	std::vector<unsigned char> buffer;
+	for (size_t first = 0; first < index.size(); first += batchBlocks) {
+		size_t count = std::min(batchBlocks, index.size() - first);
+		const BlockIndexEntry& last = index[first + count - 1];
+		size_t batchBytes = size_t(last.dataOffset + last.dataBytes - index[first].dataOffset);
+		buffer.resize(batchBytes);
+		decompressBlocks(infile, base, index, endOffset, version, checksummed, first, count, fileKey, threads,
+		                 buffer.data());
+		outfile.write((const char*)buffer.data(), batchBytes);
+	}
+
+	// leave the input just past the index, as decompressStream would
+	infile.clear();
+	infile.seekg(0, ios::end);
+}
+
+/* Function: decompressRange
+ * Usage: decompressRange(infile, offset, length, outfile, password);
+ * --------------------------------------------------------
+ * Writes length bytes of the decompressed data, starting offset
+ * bytes in, to outfile, decoding only the blocks that hold them.
+ * The block index is used to find those blocks, so the stream
+ * must be able to seek.  A range that runs past the end of the
+ * data is cut short there.  Returns the number of bytes written.
+ */
+uint64_t decompressRange(ibstream& infile, uint64_t offset, uint64_t length, ostream& outfile,
+                         const PasswordKey& password) {
+	infile.syncBits();
+	streampos base = infile.tellg();
+	if (base == streampos(-1)) error("Range decompression needs a stream that can seek.");
+
+	std::vector<BlockIndexEntry> index;
+	uint64_t endOffset;
+	int version;
+	bool checksummed;
+	PasswordKey fileKey = password;
+	readBlockIndex(infile, base, &password, fileKey, index, endOffset, version, checksummed);
+
+	// the first block that ends after offset
+	size_t first = std::upper_bound(index.begin(), index.end(), offset,
+		[](uint64_t target, const BlockIndexEntry& entry) {
+			return target < entry.dataOffset + entry.dataBytes;
+		}) - index.begin();
+
+	uint64_t written = 0;
+	std::vector<unsigned char> buffer;
+	for (size_t i = first; i < index.size() && written < length; i++) {
+		const BlockIndexEntry& entry = index[i];
+		buffer.resize(entry.dataBytes);
+		decompressBlocks(infile, base, index, endOffset, version, checksummed, i, 1, fileKey, 1, buffer.data());
+
+		uint64_t skip = offset + written - entry.dataOffset;
+		uint64_t take = std::min(uint64_t(entry.dataBytes) - skip, length - written);
+		outfile.write((const char*)buffer.data() + skip, streamsize(take));
+		written += take;
+	}
+
+	infile.clear();
+	infile.seekg(0, ios::end);
+	return written;
+}
+
+/* The extension of a file while an append is written into it. */
+static const char* const PARTIAL_EXTENSION = ".part";
+
+/* How much of the existing blocks is copied at a time. */
+static const size_t APPEND_COPY_SIZE = 1 << 20;
+
+/* Function: appendStream
+ * Usage: appendStream(filename, infile, password);
+ * --------------------------------------------------------
+ * Adds the rest of the given stream to the end of a block file
+ * as new blocks.  The existing blocks are copied into a temporary
+ * file, the new blocks and a new end frame and index are written
+ * after them, and only then is it renamed over the file, so an
+ * append cut short leaves the file as it was.  Only the magic
+ * number and the index of the file are read.  The new blocks are
+ * written with the file's own version, so a file from before
+ * compact headers never gets one.  A file with no password check
+ * is refused, since nothing would stop new blocks being added to
+ * it under the wrong password.
+ */
+void appendStream(const string& filename, istream& infile, const PasswordKey& password, size_t blockSize) {
+	if (blockSize == 0 || blockSize > MAX_BLOCK_SIZE) error("Block size is out of range.");
+	std::vector<BlockIndexEntry> index;
+	uint64_t endOffset;
+	int version;
+	bool checksummed;
+	PasswordKey fileKey = password;
+	string partial = filename + PARTIAL_EXTENSION;
+	{
+		ifbstream existing(filename);
+		if (!existing.is_open()) error("Cannot open " + filename + " for appending.");
+		unsigned char magic[MAGIC_BYTES];
+		readBytesAt(existing, 0, 0, magic, MAGIC_BYTES);
+		readBlockIndex(existing, 0, &password, fileKey, index, endOffset, version, checksummed);
+		if (version == FORMAT_VERSION_BLOCKS) error("Cannot append to a file in the old block format.");
+		if (!(magic[MAGIC_BYTES - 1] & FORMAT_FLAG_CHECKED)) error("Cannot append to a file with no password check.");
+
+		ofbstream outfile(partial);
+		if (!outfile.is_open()) error("Cannot create " + partial + ".");
+		try {
+			existing.clear();
+			existing.seekg(0);
+			std::vector<char> chunk(APPEND_COPY_SIZE);
+			for (uint64_t copied = 0; copied < endOffset; ) {
+				size_t count = size_t(std::min<uint64_t>(chunk.size(), endOffset - copied));
+				existing.read(chunk.data(), count);
+				if (size_t(existing.gcount()) != count) error("Compressed file is truncated.");
+				outfile.write(chunk.data(), count);
+				copied += count;
+			}
+			BlockWriter writer(outfile, fileKey, index, endOffset, checksummed);
+			writeBlocks(infile, writer, blockSize, version);
+			outfile.close();
+			if (outfile.fail()) error("Cannot write to " + partial + ".");
+		} catch (...) {
+			outfile.close();
+			remove(partial.c_str());
+			throw;
+		}
+	}
+#ifdef _WIN32
+	// rename won't replace a file on Windows
+	remove(filename.c_str());
+#endif
+	if (rename(partial.c_str(), filename.c_str()) != 0) {
+		remove(partial.c_str());
+		error("Cannot rename " + partial + " to " + filename + ".");
+	}
+}
+
+/* Function: verifyStream
+ * Usage: uint64_t blocks = verifyStream(infile);
+ * --------------------------------------------------------
+ * Checks the frame checksum of every block against the index,
+ * reading the frames in order a batch at a time.  Nothing is
+ * decrypted or decoded, so no password is needed.
+ */
+uint64_t verifyStream(ibstream& infile) {
+	infile.syncBits();
+	streampos base = infile.tellg();
+	if (base == streampos(-1)) error("Verifying a compressed file needs a stream that can seek.");
+
+	std::vector<BlockIndexEntry> index;
+	uint64_t endOffset;
+	int version;
+	bool checksummed;
+	PasswordKey fileKey("");
+	readBlockIndex(infile, base, NULL, fileKey, index, endOffset, version, checksummed);
+	if (!checksummed) error("Compressed file has no checksums to verify.");
+
+	// read about a block's worth of frames at a time, however small the blocks
+	std::vector<unsigned char> frames;
+	for (size_t first = 0; first < index.size(); ) {
+		size_t last = first + 1;
+		while (last < index.size() && index[last].frameOffset - index[first].frameOffset < DEFAULT_BLOCK_SIZE) last++;
+		uint64_t start = index[first].frameOffset;
+		uint64_t end = last < index.size() ? index[last].frameOffset : endOffset;
+		frames.resize(size_t(end - start));
+		readBytesAt(infile, base, start, frames.data(), frames.size());
+
+		for (size_t i = first; i < last; i++) {
+			uint64_t next = i + 1 < index.size() ? index[i + 1].frameOffset : endOffset;
+			const unsigned char* frame = &frames[size_t(index[i].frameOffset - start)];
+			size_t frameBytes = size_t(next - index[i].frameOffset);
+			uint32_t crc = withDataChecksum(crc32c(frame, frameBytes), index[i].checksums.data);
+			if (littleEndian(frame, 4) != index[i].dataBytes || crc != index[i].checksums.frame) blockDamaged(i + 1);
+		}
+		first = last;
+	}
+
+	infile.clear();
+	infile.seekg(0, ios::end);
+	return index.size();
+}
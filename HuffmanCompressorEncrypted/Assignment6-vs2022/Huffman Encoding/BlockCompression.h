@@ -0,0 +1,269 @@
+/**********************************************************
+ * File: BlockCompression.h
+ *
+ * A block format for input that can only be read once, such
+ * as a pipe or a socket.  compress reads its input twice,
+ * once to count characters and once to encode them, which
+ * needs a stream that can rewind.  compressStream instead
+ * reads the input one bounded block at a time and encodes
+ * each block with a tree built from that block alone, so
+ * every block is a self-describing frame:
+ *
+ *   32 bits  number of input bytes in the block
+ *   32 bits  number of bytes in the rest of the frame
+ *   ...      an encrypted canonical header, then the block
+ *            encoded with its code and ended by PSEUDO_EOF
+ *
+ * The frames follow the FORMAT_VERSION_KEYSTREAM_BLOCKS magic
+ * number, the file's salt and nonce (see FORMAT_FLAG_SALTED) and
+ * the password check (see FORMAT_FLAG_CHECKED), so a wrong
+ * password is turned away before the first frame is read, and
+ * decompress recognizes them; files written before
+ * the KeyStream cipher have FORMAT_VERSION_BLOCKS instead.  New
+ * files have FORMAT_FLAG_COMPACT in their version, so their frame
+ * headers may be compact.  A sealed file has FORMAT_FLAG_SEALED
+ * in its version, and the whole of every frame after its sizes
+ * is encrypted.  In an
+ * interleaved file, FORMAT_VERSION_INTERLEAVED_BLOCKS, the codes
+ * after each header are split into interleaved streams, as
+ * encodeBufferInterleaved writes them, so that the decoder can
+ * follow several at once.  A block that its code would not
+ * shrink, such as one of already compressed data, is stored
+ * instead: the top bit of its frame size is set, and the rest
+ * of the frame is the block itself, encrypted as a sealed frame
+ * is whether or not the file is sealed.  An end frame holding no
+ * bytes follows the last block, recording the size of the
+ * block index after it:
+ *
+ *   per block  64 bits  offset of its frame from the magic
+ *              32 bits  number of input bytes in the block
+ *              32 bits  CRC32C of the block's input bytes,
+ *                       encrypted with the password
+ *              32 bits  CRC32C of the whole frame, sizes and all,
+ *                       followed by the field before
+ *   32 bits    number of blocks
+ *   32 bits    "HUFC"
+ *
+ * Files written before the checksums have "HUFI" instead and
+ * only the first two fields per block; they are still read, and
+ * blocks appended to them go without checksums too.  Every reader
+ * checks the checksums where there are any, so damage to a block
+ * is reported as that rather than as whatever it decodes to, and
+ * since the frame checksum needs no password, verifyStream can
+ * check every frame of a file without decoding any.
+ *
+ * Since blocks don't depend on each other, compressParallel
+ * can encode several at once, and with the index in hand
+ * decompressParallel can find and decode several at once, and
+ * decompressRange can decode just the blocks a slice needs.
+ * For the same reason appendStream can add blocks to the end of
+ * a file that is still growing, such as a log, without decoding
+ * or encoding again the blocks it already has.
+ */
+
+#ifndef BlockCompression_Included
+#define BlockCompression_Included
+
+#include "HuffmanTypes.h"
+#include "bstream.h"
+#include "KeyStream.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+using namespace std;
+
+/* Constant: DEFAULT_BLOCK_SIZE
+ * The number of input bytes in each block unless the caller
+ * asks for something else.
+ */
+const size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+
+/* Constant: MAX_BLOCK_SIZE
+ * The largest block compressStream will write or the reader
+ * will accept, which bounds the memory either side needs.
+ */
+const size_t MAX_BLOCK_SIZE = 1 << 26;
+
+/* Function: compressStream
+ * Usage: compressStream(infile, outfile, password);
+ * --------------------------------------------------------
+ * Compresses the rest of the given stream into the block
+ * format, reading it exactly once and never seeking, so any
+ * istream will do.  At most blockSize bytes of input are held
+ * in memory at a time.  If encryptPayload is set, the file is
+ * sealed: the encoded data is encrypted along with the headers.
+ * If interleaved is set, every block is encoded as interleaved
+ * streams, which decode faster.
+ */
+void compressStream(istream& infile, obstream& outfile, const PasswordKey& password,
+                    size_t blockSize = DEFAULT_BLOCK_SIZE, bool encryptPayload = false, bool interleaved = false);
+
+/* Function: estimateStreamCompressedSize
+ * Usage: uint64_t bytes = estimateStreamCompressedSize(infile);
+ * --------------------------------------------------------
+ * Returns exactly how many bytes compressStream would write for
+ * the rest of the given stream with the given options, counting
+ * and building a code for every block but encoding nothing and
+ * writing nothing.  Like compressStream it reads the input once
+ * and never seeks.  Sealing a file doesn't change its size, so
+ * there is no encryptPayload here.
+ */
+uint64_t estimateStreamCompressedSize(istream& infile, size_t blockSize = DEFAULT_BLOCK_SIZE, bool interleaved = false);
+
+/* Function: compressParallel
+ * Usage: compressParallel(infile, outfile, password, threads);
+ * --------------------------------------------------------
+ * Compresses the rest of the given stream into exactly the
+ * bytes compressStream would write, but counts and encodes
+ * up to threads blocks at a time.  A threads value of 0 means
+ * one thread per core.  At most two blocks per thread are
+ * held in memory at once.
+ */
+void compressParallel(istream& infile, obstream& outfile, const PasswordKey& password, int threads,
+                      size_t blockSize = DEFAULT_BLOCK_SIZE, bool encryptPayload = false, bool interleaved = false);
+
+/* Function: compressPipelined
+ * Usage: compressPipelined(infile, outfile, password, threads);
+ * --------------------------------------------------------
+ * Compresses the rest of the given stream into exactly the
+ * bytes compressStream would write, as a pipeline: one thread
+ * reads blocks, threads workers encode them, and the calling
+ * thread writes the frames in order, so that waiting on the
+ * input or the output overlaps with encoding rather than adding
+ * to it.  The stages pass blocks through bounded queues with no
+ * locks, two blocks deep, so at most about five blocks per worker
+ * are held in memory at once.  A threads value of 0 means one
+ * worker per core.  Where compressParallel reads a batch, encodes
+ * it and writes it in turn, here no stage waits for another
+ * unless a queue is full or empty.
+ */
+void compressPipelined(istream& infile, obstream& outfile, const PasswordKey& password, int threads,
+                       size_t blockSize = DEFAULT_BLOCK_SIZE, bool encryptPayload = false, bool interleaved = false);
+
+/* Function: appendStream
+ * Usage: appendStream(filename, infile, password);
+ * --------------------------------------------------------
+ * Compresses the rest of the given stream into new blocks at the
+ * end of the named block compressed file, as if the file had been
+ * written by compressStream from its old data followed by the new.
+ * Its existing blocks are copied as they are, and only its magic
+ * number and block index are read, so nothing already in the file
+ * is encoded again.  The new blocks are sealed or interleaved as
+ * the file's are.  The whole file is written under a temporary
+ * name and renamed over the old one at the end, so if the append
+ * is cut short the file is left as it was.  Raises an error if the
+ * file is not a block compressed file, has no password check or
+ * the password is wrong.
+ */
+void appendStream(const string& filename, istream& infile, const PasswordKey& password,
+                  size_t blockSize = DEFAULT_BLOCK_SIZE);
+
+/* Function: decompressStream
+ * Usage: decompressStream(infile, outfile, password);
+ * --------------------------------------------------------
+ * Decompresses a file written by compressStream, one block at
+ * a time, starting from its magic number.  Like compressStream
+ * it reads the input once and never seeks.  Raises an error if
+ * the file is truncated, a block does not decode to exactly the
+ * size its frame records, or a block doesn't match its checksums.
+ * Those are at the end of the file, so a damaged block is only
+ * reported once it and everything before it has been written.
+ * The index there must be one for exactly the blocks read, with
+ * or without checksums, or it is reported as corrupt.
+ */
+void decompressStream(ibstream& infile, ostream& outfile, const PasswordKey& password);
+
+/*
+ * Class: BlockDecodeStream
+ * ---------------
+ * decompressStream turned inside out: rather than writing every
+ * block to a stream, it decodes into the caller's buffer as much
+ * as is asked for each time, carrying on from there the next
+ * time.  Frames are read through a window of a fixed size, and
+ * decoded as their bytes arrive rather than read whole, so the
+ * memory it needs doesn't grow with the blocks or the file.
+ * HuffmanDecodeStream (see DecodeStream.h) uses it for block
+ * compressed files.
+ */
+class BlockDecodeStream {
+public:
+	/* Constructor: BlockDecodeStream(ibstream& infile, PasswordKey password, size_t windowBytes);
+	 * Usage: BlockDecodeStream blocks(infile, password, windowBytes);
+	 * --------------------------
+	 * Starts decoding the block compressed file infile is at the
+	 * magic number of, reading its frames windowBytes at a time,
+	 * rounded down to a whole number of keystream words.  Raises
+	 * an error if the file isn't block compressed, the password is
+	 * wrong, or the window is less than 8 bytes.  The stream must
+	 * outlive the BlockDecodeStream, and like decompressStream it
+	 * is read only once and never seeks.  Interleaved blocks are
+	 * the exception to reading frames piecemeal, since their
+	 * streams all start together: each needs a window holding its
+	 * frame and its data at once.
+	 */
+	BlockDecodeStream(ibstream& infile, const PasswordKey& password, size_t windowBytes);
+	~BlockDecodeStream();
+
+	/* Member function: read(unsigned char* buffer, size_t count);
+	 * Usage: size_t got = blocks.read(buffer, count);
+	 * --------------------------
+	 * Decodes the next count bytes of the data into buffer, or as
+	 * many as are left, returning how many.  Once the data is used
+	 * up it returns 0.  Raises the errors decompressStream would:
+	 * damage to a block is found when the index after the last one
+	 * is read, so it is reported by the call that reaches the end.
+	 */
+	size_t read(unsigned char* buffer, size_t count);
+
+private:
+	struct State;
+	State* state;
+
+	BlockDecodeStream(const BlockDecodeStream&);
+	BlockDecodeStream& operator=(const BlockDecodeStream&);
+};
+
+/* Function: verifyStream
+ * Usage: uint64_t blocks = verifyStream(infile);
+ * --------------------------------------------------------
+ * Checks a block compressed file, starting from its magic number,
+ * against the checksums in its index, without the password and
+ * without decoding anything: every frame is read once, in order,
+ * and its CRC32C compared with the index's, which goes about as
+ * fast as the file can be read.  This catches damage to the frames
+ * and the index; damage to the magic number, salt, nonce or
+ * password check ahead of them, and a block that was encoded wrongly in the first
+ * place, are only caught by decompressing the file.  Returns the
+ * number of blocks checked.  Raises an error naming the first
+ * damaged block, or if the file isn't a block compressed file or
+ * has no checksums.  The stream must be able to seek.
+ */
+uint64_t verifyStream(ibstream& infile);
+
+/* Function: decompressParallel
+ * Usage: decompressParallel(infile, outfile, password, threads);
+ * --------------------------------------------------------
+ * Decompresses a block compressed file, starting from its magic
+ * number, by decoding up to threads blocks at a time.  The block
+ * index at the end of the file says where every block starts
+ * and where its bytes belong, so each thread decodes straight
+ * into its place in the output.  Each block is checked against
+ * its checksums before it is written.  At most two blocks per
+ * thread are held in memory at once.  The input stream must be
+ * able to seek.
+ */
+void decompressParallel(ibstream& infile, ostream& outfile, const PasswordKey& password, int threads);
+
+/* Function: decompressRange
+ * Usage: decompressRange(infile, offset, length, outfile, password);
+ * --------------------------------------------------------
+ * Writes length bytes of the decompressed data, starting offset
+ * bytes in, to outfile, decoding only the blocks that hold them.
+ * The block index is used to find those blocks, so the stream
+ * must be able to seek.  A range that runs past the end of the
+ * data is cut short there.  Returns the number of bytes written.
+ */
+uint64_t decompressRange(ibstream& infile, uint64_t offset, uint64_t length, ostream& outfile,
+                         const PasswordKey& password);
+
+#endif
@@ -0,0 +1,134 @@
+/**********************************************************
+ * File: BufferCompression.cpp
+ *
+ * Implementation of the functions from BufferCompression.h.
+ */
+
+#include "BufferCompression.h"
+#include "HuffmanEncoding.h"
+#include "CanonicalHuffman.h"
+#include "BlockCompression.h"
+#include "ContextModel.h"
+#include "Histogram.h"
+#include "error.h"
+#include <string.h>
+
+/* Bytes taken by the magic number, salt, nonce, password check
+ * and length that start a stored file.
+ */
+static const size_t STORED_HEADER_BYTES = FORMAT_PREFIX_BYTES + 8;
+
+HuffmanCompressor::HuffmanCompressor(const PasswordKey& password) : password(password) {}
+
+void HuffmanCompressor::reset(const PasswordKey& password) {
+	this->password = password;
+}
+
+/* Member function HuffmanCompressor::compress
+ * -------------------------------------------
+ * Works out the size from the counts first, so that nothing is
+ * written to a buffer too small for it, then writes the headers
+ * through the compressor's own stream and encodes in place.
+ */
+size_t HuffmanCompressor::compress(const uint8_t* data, size_t length, uint8_t* output, size_t capacity) {
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		counts[ch] = 0;
+	}
+	countBytes(data, length, counts);
+	getCodeLengthsForCounts(counts, lengths);
+	buildCanonicalEncodeTable(lengths, table);
+
+	// the size is known before anything is written, so a small buffer is turned away untouched
+	uint64_t bits = uint64_t(canonicalHeaderBits(lengths)) + encodedBits(counts, table);
+	bool stored = !isWorthEncoding(uint64_t(length) + 8, bits);
+	uint64_t total = stored ? STORED_HEADER_BYTES + length : FORMAT_PREFIX_BYTES + (bits + 7) / 8;
+	if (total > capacity) error("Output buffer is too small.");
+
+	header.span(output, capacity);
+	if (stored) {
+		KeyStream stream = writeStoredHeader(header, length, password);
+		if (length > 0) memcpy(output + STORED_HEADER_BYTES, data, length);
+		stream.apply(output + STORED_HEADER_BYTES, length);
+		return STORED_HEADER_BYTES + length;
+	}
+	PasswordKey fileKey = writeFormatMagic(header, FORMAT_VERSION_KEYSTREAM | FORMAT_FLAG_COMPACT, password);
+	int headerBits = 8 * FORMAT_PREFIX_BYTES + writeCanonicalFileHeader(header, lengths, fileKey);
+	header.flushBits();
+
+	// the codes start partway through the header's last byte
+	return headerBits / 8 + encodeBufferToMemory(data, length, table, output + headerBits / 8, headerBits % 8);
+}
+
+HuffmanDecompressor::HuffmanDecompressor(const PasswordKey& password) : password(password) {}
+
+void HuffmanDecompressor::reset(const PasswordKey& password) {
+	this->password = password;
+}
+
+/* Member function HuffmanDecompressor::decompress
+ * -------------------------------------------
+ * Reads the header through the decompressor's own stream over the
+ * input, then decodes or copies straight into the output.  Only the
+ * formats that decode a block at a time go through an output stream.
+ */
+size_t HuffmanDecompressor::decompress(const uint8_t* data, size_t length, uint8_t* output, size_t capacity) {
+	source.span(data, length);
+	int version = readCompressedHeader(source, password, table);
+	if (version == FORMAT_VERSION_STORED) {
+		// the bytes are already in memory, so they are copied rather than streamed
+		uint64_t storedBytes;
+		KeyStream stream = readStoredHeader(source, password, storedBytes);
+		if (storedBytes > length - STORED_HEADER_BYTES) error("Compressed file is truncated.");
+		if (storedBytes > capacity) error("Output buffer is too small.");
+		if (storedBytes > 0) memcpy(output, data + STORED_HEADER_BYTES, size_t(storedBytes));
+		stream.apply(output, size_t(storedBytes));
+		return size_t(storedBytes);
+	}
+	if (isBlockFormat(version) || version == FORMAT_VERSION_CONTEXT) {
+		sink.span(output, capacity);
+		if (isBlockFormat(version)) {
+			decompressStream(source, sink, password);
+		} else {
+			decompressContexts(source, sink, password);
+		}
+		if (sink.fail()) error("Output buffer is too small.");
+		return sink.written();
+	}
+
+	// single-stream codes decode straight into the buffer
+	size_t written = 0;
+	bool finished = false;
+	while (!finished && written < capacity) {
+		written += decodeSpanWithTable(source, table, output + written, capacity - written, finished);
+	}
+	if (!finished) {
+		// a full buffer is only enough if PSEUDO_EOF comes next
+		unsigned char extra;
+		if (decodeSpanWithTable(source, table, &extra, 1, finished) > 0) error("Output buffer is too small.");
+	}
+	return written;
+}
+
+/* Function: compressBuffer
+ * Usage: size_t bytes = compressBuffer(data, length, output, capacity, password);
+ * --------------------------------------------------------
+ * Compresses the given bytes into the output buffer with a
+ * compressor of its own.
+ */
+size_t compressBuffer(const uint8_t* data, size_t length, uint8_t* output, size_t capacity,
+                      const PasswordKey& password) {
+	HuffmanCompressor compressor(password);
+	return compressor.compress(data, length, output, capacity);
+}
+
+/* Function: decompressBuffer
+ * Usage: size_t bytes = decompressBuffer(data, length, output, capacity, password);
+ * --------------------------------------------------------
+ * Decompresses a file held in memory into the output buffer with
+ * a decompressor of its own.
+ */
+size_t decompressBuffer(const uint8_t* data, size_t length, uint8_t* output, size_t capacity,
+                        const PasswordKey& password) {
+	HuffmanDecompressor decompressor(password);
+	return decompressor.decompress(data, length, output, capacity);
+}
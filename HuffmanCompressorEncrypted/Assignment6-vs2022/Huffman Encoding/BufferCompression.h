@@ -0,0 +1,159 @@
+/**********************************************************
+ * File: BufferCompression.h
+ *
+ * Compression straight from one block of memory into another,
+ * for callers that hold their data in memory already and would
+ * otherwise have to copy it into an istringbstream and back out
+ * of an ostringbstream.  compressBuffer writes exactly the bytes
+ * compress would, into a buffer the caller provides; since the
+ * stored format bounds how much any input can grow, the caller
+ * can size that buffer with compressBufferBound and never need
+ * to grow it.  decompressBuffer reads any of the formats that
+ * decompress does.
+ *
+ * Each call of those sets up its tables and streams afresh.  A
+ * caller making many calls can keep a HuffmanCompressor or a
+ * HuffmanDecompressor instead, which holds all of that, and the
+ * derived key, from one call to the next.
+ */
+
+#ifndef BufferCompression_Included
+#define BufferCompression_Included
+
+#include "KeyStream.h"
+#include "HuffmanEncoding.h"
+#include "HuffmanTables.h"
+#include "bstream.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Class: HuffmanCompressor
+ * ---------------
+ * Everything compressBuffer needs, kept from one call to the next:
+ * the key, the counts, the code lengths and table, and the stream
+ * the headers are written with.  Once made, a compressor puts no
+ * load on the heap at all, unless a code has to be limited in
+ * length, so many threads can each keep one and compress without
+ * meeting in the allocator.  A compressor may only be used by one
+ * thread at a time.
+ */
+class HuffmanCompressor {
+public:
+	/* Constructor: HuffmanCompressor(const PasswordKey& password);
+	 * Usage: HuffmanCompressor compressor(password);
+	 * --------------------------
+	 * Makes a compressor that encrypts with the given password.
+	 */
+	HuffmanCompressor(const PasswordKey& password);
+
+	/* Member function: reset(const PasswordKey& password);
+	 * Usage: compressor.reset(password);
+	 * --------------------------
+	 * Switches to another password, keeping everything else.
+	 */
+	void reset(const PasswordKey& password);
+
+	/* Member function: compress(data, length, output, capacity);
+	 * Usage: size_t bytes = compressor.compress(data, length, output, capacity);
+	 * --------------------------
+	 * Does what compressBuffer does, with this compressor's password.
+	 */
+	size_t compress(const uint8_t* data, size_t length, uint8_t* output, size_t capacity);
+
+private:
+	PasswordKey password;
+	uint64_t counts[NUM_SYMBOLS];
+	int lengths[NUM_SYMBOLS];
+	EncodeTable table;
+	omembstream header;
+
+	HuffmanCompressor(const HuffmanCompressor&);
+	HuffmanCompressor& operator=(const HuffmanCompressor&);
+};
+
+/*
+ * Class: HuffmanDecompressor
+ * ---------------
+ * Everything decompressBuffer needs, kept from one call to the next:
+ * the key, the decode table, and the streams over the input and the
+ * output.  Once its decode table has grown as large as the files it
+ * reads need, a decompressor of single-stream and stored files
+ * puts no load on the heap at all.  Block and context modeled files
+ * still allocate as they go.  A decompressor may only be used by one
+ * thread at a time.
+ */
+class HuffmanDecompressor {
+public:
+	/* Constructor: HuffmanDecompressor(const PasswordKey& password);
+	 * Usage: HuffmanDecompressor decompressor(password);
+	 * --------------------------
+	 * Makes a decompressor that decrypts with the given password.
+	 */
+	HuffmanDecompressor(const PasswordKey& password);
+
+	/* Member function: reset(const PasswordKey& password);
+	 * Usage: decompressor.reset(password);
+	 * --------------------------
+	 * Switches to another password, keeping everything else.
+	 */
+	void reset(const PasswordKey& password);
+
+	/* Member function: decompress(data, length, output, capacity);
+	 * Usage: size_t bytes = decompressor.decompress(data, length, output, capacity);
+	 * --------------------------
+	 * Does what decompressBuffer does, with this decompressor's
+	 * password.
+	 */
+	size_t decompress(const uint8_t* data, size_t length, uint8_t* output, size_t capacity);
+
+private:
+	PasswordKey password;
+	DecodeTable table;
+	imembstream source;
+	omembstream sink;
+
+	HuffmanDecompressor(const HuffmanDecompressor&);
+	HuffmanDecompressor& operator=(const HuffmanDecompressor&);
+};
+
+/* Function: compressBufferBound
+ * Usage: vector<uint8_t> output(compressBufferBound(length));
+ * --------------------------------------------------------
+ * Returns the most bytes compressBuffer can write for an input
+ * of the given length.  Input the codes would not shrink is
+ * stored, after the magic number, salt, nonce, password check
+ * and length, and anything encoded comes out smaller than that.
+ */
+inline size_t compressBufferBound(size_t length) {
+	return length + FORMAT_PREFIX_BYTES + 8;
+}
+
+/* Function: compressBuffer
+ * Usage: size_t bytes = compressBuffer(data, length, output, capacity, password);
+ * --------------------------------------------------------
+ * Compresses the given bytes into the output buffer, writing
+ * exactly what compress would write for them, and returns how
+ * many bytes that took.  The input is counted and encoded in
+ * place, with no stream in between.  Raises an error, having
+ * written nothing, if capacity is too small; compressBufferBound
+ * always gives enough.
+ */
+size_t compressBuffer(const uint8_t* data, size_t length, uint8_t* output, size_t capacity,
+                      const PasswordKey& password);
+
+/* Function: decompressBuffer
+ * Usage: size_t bytes = decompressBuffer(data, length, output, capacity, password);
+ * --------------------------------------------------------
+ * Decompresses a file in any of the formats decompress reads,
+ * held in memory, into the output buffer and returns how many
+ * bytes it got back.  The input is read in place.  Most formats
+ * don't record how long their data is, so the caller must know
+ * how much room it needs; raises an error if the data does not
+ * fit in capacity bytes, in which case the output holds as much
+ * of it as fitted.
+ */
+size_t decompressBuffer(const uint8_t* data, size_t length, uint8_t* output, size_t capacity,
+                        const PasswordKey& password);
+
+#endif
@@ -0,0 +1,302 @@
+/**********************************************************
+ * File: CanonicalHuffman.cpp
+ *
+ * Implementation of the functions from CanonicalHuffman.h.
+ */
+
+#include "CanonicalHuffman.h"
+#include "error.h"
+#include <algorithm>
+#include <vector>
+using namespace std;
+
+/* Function: getCodeLengths
+ * Usage: getCodeLengths(encodingTree, lengths);
+ * --------------------------------------------------------
+ * Fills lengths[ch] with the depth of ch in the given encoding
+ * tree, or 0 for characters that do not appear in it.  A tree
+ * holding only PSEUDO_EOF gives it a length of 0.
+ */
+void getCodeLengths(Node* encodingTree, int lengths[NUM_SYMBOLS]) {
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		lengths[ch] = 0;
+	}
+
+	// an explicit stack of nodes and their depths, so deep trees can't overflow the call stack
+	vector<pair<Node*, int> > pending;
+	if (encodingTree) pending.push_back(make_pair(encodingTree, 0));
+	while (!pending.empty()) {
+		Node* node = pending.back().first;
+		int depth = pending.back().second;
+		pending.pop_back();
+		if (!node->zero && !node->one) {
+			lengths[node->character] = depth;
+			continue;
+		}
+		if (node->one) pending.push_back(make_pair(node->one, depth + 1));
+		if (node->zero) pending.push_back(make_pair(node->zero, depth + 1));
+	}
+}
+
+/*
+* Orders the leaves for getHuffmanCodeLengths: by weight, then by
+* character, as buildEncodingTreeFromCounts orders its leaves.
+*/
+struct LighterLeaf {
+	const uint64_t* weights;
+	bool operator()(ext_char one, ext_char two) const {
+		if (weights[one] != weights[two]) return weights[one] < weights[two];
+		return one < two;
+	}
+};
+
+/* Function: getHuffmanCodeLengths
+ * Usage: getHuffmanCodeLengths(weights, lengths);
+ * --------------------------------------------------------
+ * Fills lengths with the code lengths of the encoding tree
+ * buildEncodingTreeFromCounts would build for the same weights,
+ * without building any tree: the merge keeps only an array of
+ * parents and reads the depths back off it, with no recursion
+ * and nothing allocated.  Characters of zero weight get length
+ * 0, and a lone character gets length 0 as in getCodeLengths.
+ * There is no limit on the code lengths, and the weights must
+ * total less than 2^63.
+ */
+void getHuffmanCodeLengths(const uint64_t weights[NUM_SYMBOLS], int lengths[NUM_SYMBOLS]) {
+	ext_char leaves[NUM_SYMBOLS];
+	int numLeaves = 0;
+	for (ext_char ch = 0; ch < NUM_SYMBOLS; ch++) {
+		lengths[ch] = 0;
+		if (weights[ch] > 0) leaves[numLeaves++] = ch;
+	}
+	if (numLeaves < 2) return;
+	LighterLeaf lighter = { weights };
+	sort(leaves, leaves + numLeaves, lighter);
+
+	// nodes 0 to numLeaves - 1 are the sorted leaves, and the merged
+	// trees follow them in the order they are made, lightest first
+	uint64_t weight[2 * NUM_SYMBOLS];
+	int parent[2 * NUM_SYMBOLS];
+	for (int i = 0; i < numLeaves; i++) {
+		weight[i] = weights[leaves[i]];
+	}
+	int nextLeaf = 0, nextTree = numLeaves, numNodes = numLeaves;
+	while ((numLeaves - nextLeaf) + (numNodes - nextTree) > 1) {
+		int children[2];
+		for (int& child : children) {
+			// the leaf wins a tie, as in takeLighter
+			if (nextTree == numNodes || (nextLeaf < numLeaves && weight[nextLeaf] <= weight[nextTree])) {
+				child = nextLeaf++;
+			} else {
+				child = nextTree++;
+			}
+		}
+		weight[numNodes] = weight[children[0]] + weight[children[1]];
+		parent[children[0]] = parent[children[1]] = numNodes++;
+	}
+
+	// the root is the last node made; every other node's parent comes after it
+	int depth[2 * NUM_SYMBOLS];
+	depth[numNodes - 1] = 0;
+	for (int i = numNodes - 2; i >= 0; i--) {
+		depth[i] = depth[parent[i]] + 1;
+	}
+	for (int i = 0; i < numLeaves; i++) {
+		lengths[leaves[i]] = depth[i];
+	}
+}
+
+/*
+* One entry in a package-merge list: a single character, or a
+* package of two entries from the list for the level below.
+*/
+struct MergeItem {
+	uint64_t weight;
+	ext_char character; // NOT_A_CHAR for a package
+};
+
+/*
+* Orders the characters for package-merge: by weight, then
+* by character.
+*/
+static bool lighterItem(const MergeItem& one, const MergeItem& two) {
+	if (one.weight != two.weight) return one.weight < two.weight;
+	return one.character < two.character;
+}
+
+/* Function: getLimitedCodeLengths
+ * Usage: getLimitedCodeLengths(weights, maxLength, lengths);
+ * --------------------------------------------------------
+ * Fills lengths with the code lengths of an optimal prefix code
+ * for the characters of nonzero weight in which no code is
+ * longer than maxLength bits, found with the package-merge
+ * algorithm.  Characters of zero weight get length 0, and a
+ * lone character gets length 0 as in getCodeLengths.  Ties are
+ * broken in favor of lower character values, so the result
+ * depends only on the weights.  Raises an error if maxLength is
+ * more than MAX_CANONICAL_LENGTH or too short for every
+ * character to have a code, or if the weights total 2^56 or more.
+ */
+void getLimitedCodeLengths(const uint64_t weights[NUM_SYMBOLS], int maxLength, int lengths[NUM_SYMBOLS]) {
+	if (maxLength > MAX_CANONICAL_LENGTH) error("Code length limit is too long.");
+	vector<MergeItem> leaves;
+	uint64_t total = 0;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		lengths[ch] = 0;
+		if (weights[ch] == 0) continue;
+		total += weights[ch];
+		if (total >= uint64_t(1) << 56) error("Character counts are too large to limit code lengths.");
+		MergeItem leaf = { weights[ch], ch };
+		leaves.push_back(leaf);
+	}
+	size_t n = leaves.size();
+	if (n <= 1) return;
+	if (maxLength < 1 || (maxLength < 63 && n > uint64_t(1) << maxLength)) {
+		error("Code length limit is too short for the number of characters.");
+	}
+	sort(leaves.begin(), leaves.end(), lighterItem);
+
+	// levels[0] is for the deepest level; each level above merges the
+	// characters with the pairs of entries from the level below it
+	vector<vector<MergeItem> > levels(maxLength);
+	levels[0] = leaves;
+	for (int level = 1; level < maxLength; level++) {
+		const vector<MergeItem>& below = levels[level - 1];
+		vector<MergeItem>& merged = levels[level];
+		size_t nextLeaf = 0, nextPair = 0;
+		while (nextLeaf < n || nextPair + 1 < below.size()) {
+			bool takeLeaf = nextPair + 1 >= below.size() ||
+			                (nextLeaf < n && leaves[nextLeaf].weight <= below[nextPair].weight + below[nextPair + 1].weight);
+			if (takeLeaf) {
+				merged.push_back(leaves[nextLeaf++]);
+			} else {
+				MergeItem package = { below[nextPair].weight + below[nextPair + 1].weight, NOT_A_CHAR };
+				merged.push_back(package);
+				nextPair += 2;
+			}
+		}
+	}
+
+	// the cheapest 2n - 2 entries of the top level make the code; every
+	// package among them brings in the first two unused entries below it
+	size_t chosen = 2 * n - 2;
+	for (int level = maxLength - 1; level >= 0; level--) {
+		size_t packages = 0;
+		for (size_t i = 0; i < chosen; i++) {
+			const MergeItem& item = levels[level][i];
+			if (item.character == NOT_A_CHAR) {
+				packages++;
+			} else {
+				lengths[item.character]++;
+			}
+		}
+		chosen = 2 * packages;
+	}
+}
+
+/* Function: isValidCodeLengths
+ * Usage: if (isValidCodeLengths(lengths)) { ... }
+ * --------------------------------------------------------
+ * Returns whether the given lengths describe a complete prefix
+ * code containing PSEUDO_EOF: either PSEUDO_EOF alone with length
+ * 0, or lengths of at most MAX_CANONICAL_LENGTH bits whose Kraft
+ * sum is exactly one.
+ */
+bool isValidCodeLengths(const int lengths[NUM_SYMBOLS]) {
+	int used = 0;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (lengths[ch] < 0 || lengths[ch] > MAX_CANONICAL_LENGTH) return false;
+		if (lengths[ch] > 0) used++;
+	}
+	if (used == 0) return true; // PSEUDO_EOF alone, with the empty code
+	if (lengths[PSEUDO_EOF] == 0) return false;
+
+	// the Kraft sum, scaled so a code of length MAX_CANONICAL_LENGTH adds 1
+	const uint64_t whole = uint64_t(1) << MAX_CANONICAL_LENGTH;
+	uint64_t sum = 0;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (lengths[ch] == 0) continue;
+		sum += uint64_t(1) << (MAX_CANONICAL_LENGTH - lengths[ch]);
+		if (sum > whole) return false;
+	}
+	return sum == whole;
+}
+
+/* Function: getCanonicalCodes
+ * Usage: getCanonicalCodes(lengths, codes);
+ * --------------------------------------------------------
+ * Assigns the canonical code for each character with a nonzero
+ * length.  Each code is stored in stream order, with the first
+ * bit of the code in bit 0, ready to be passed to writeBits.
+ * The lengths must be valid.
+ */
+void getCanonicalCodes(const int lengths[NUM_SYMBOLS], uint64_t codes[NUM_SYMBOLS]) {
+	int count[MAX_CANONICAL_LENGTH + 1] = { 0 };
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (lengths[ch] > 0) count[lengths[ch]]++;
+	}
+
+	// the first code of each length follows the last code of the length before
+	uint64_t next[MAX_CANONICAL_LENGTH + 1] = { 0 };
+	uint64_t code = 0;
+	for (int length = 1; length <= MAX_CANONICAL_LENGTH; length++) {
+		code = (code + count[length - 1]) << 1;
+		next[length] = code;
+	}
+	next[0] = 0;
+
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		codes[ch] = 0;
+		int length = lengths[ch];
+		if (length == 0) continue;
+
+		// the code is numbered most significant bit first; flip it to stream order
+		uint64_t value = next[length]++;
+		for (int i = 0; i < length; i++) {
+			codes[ch] |= ((value >> (length - 1 - i)) & 1) << i;
+		}
+	}
+}
+
+/* Function: buildCanonicalTree
+ * Usage: Node* tree = buildCanonicalTree(lengths);
+ * --------------------------------------------------------
+ * Builds an encoding tree whose codes are the canonical codes
+ * for the given lengths, so that the tree-based functions such
+ * as encodeFile and decodeFile produce and read canonical
+ * streams.  Weights in this tree are all zero, since only the
+ * lengths are known.  Free it with freeTree.
+ */
+Node* buildCanonicalTree(const int lengths[NUM_SYMBOLS]) {
+	if (!isValidCodeLengths(lengths)) error("Invalid code lengths for a canonical code.");
+
+	Node* root = new Node();
+	root->zero = root->one = nullptr;
+	root->weight = 0;
+	if (lengths[PSEUDO_EOF] == 0) {
+		root->character = PSEUDO_EOF;
+		return root;
+	}
+	root->character = NOT_A_CHAR;
+
+	uint64_t codes[NUM_SYMBOLS];
+	getCanonicalCodes(lengths, codes);
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (lengths[ch] == 0) continue;
+
+		// walk down the code, creating internal nodes that aren't there yet
+		Node* curr = root;
+		for (int i = 0; i < lengths[ch]; i++) {
+			Node*& child = ((codes[ch] >> i) & 1) ? curr->one : curr->zero;
+			if (!child) {
+				child = new Node();
+				child->character = NOT_A_CHAR;
+				child->zero = child->one = nullptr;
+				child->weight = 0;
+			}
+			curr = child;
+		}
+		curr->character = ch;
+	}
+	return root;
+}
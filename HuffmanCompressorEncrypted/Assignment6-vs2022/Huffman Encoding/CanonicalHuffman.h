@@ -0,0 +1,96 @@
+/**********************************************************
+ * File: CanonicalHuffman.h
+ *
+ * Canonical Huffman codes.  A canonical code is fixed entirely
+ * by the length of each character's code, so a compressed file
+ * only needs to store those lengths, and the decoder can build
+ * its tables without rebuilding the encoding tree.
+ *
+ * Codes are assigned in order of increasing length, and among
+ * codes of the same length in order of increasing character
+ * value, each code being the next binary number after the
+ * previous one.
+ */
+
+#ifndef CanonicalHuffman_Included
+#define CanonicalHuffman_Included
+
+#include "HuffmanTypes.h"
+#include <stdint.h>
+
+/* Constant: MAX_CANONICAL_LENGTH
+ * The longest code length a canonical code may use.  This is
+ * the most bits a code can occupy in a 64-bit word.
+ */
+const int MAX_CANONICAL_LENGTH = 63;
+
+/* Function: getCodeLengths
+ * Usage: getCodeLengths(encodingTree, lengths);
+ * --------------------------------------------------------
+ * Fills lengths[ch] with the depth of ch in the given encoding
+ * tree, or 0 for characters that do not appear in it.  A tree
+ * holding only PSEUDO_EOF gives it a length of 0.
+ */
+void getCodeLengths(Node* encodingTree, int lengths[NUM_SYMBOLS]);
+
+/* Function: getHuffmanCodeLengths
+ * Usage: getHuffmanCodeLengths(weights, lengths);
+ * --------------------------------------------------------
+ * Fills lengths with the code lengths of the encoding tree
+ * buildEncodingTreeFromCounts would build for the same weights,
+ * without building any tree: the merge keeps only an array of
+ * parents and reads the depths back off it, with no recursion
+ * and nothing allocated.  Characters of zero weight get length
+ * 0, and a lone character gets length 0 as in getCodeLengths.
+ * There is no limit on the code lengths, and the weights must
+ * total less than 2^63.
+ */
+void getHuffmanCodeLengths(const uint64_t weights[NUM_SYMBOLS], int lengths[NUM_SYMBOLS]);
+
+/* Function: getLimitedCodeLengths
+ * Usage: getLimitedCodeLengths(weights, maxLength, lengths);
+ * --------------------------------------------------------
+ * Fills lengths with the code lengths of an optimal prefix code
+ * for the characters of nonzero weight in which no code is
+ * longer than maxLength bits, found with the package-merge
+ * algorithm.  Characters of zero weight get length 0, and a
+ * lone character gets length 0 as in getCodeLengths.  Ties are
+ * broken in favor of lower character values, so the result
+ * depends only on the weights.  Raises an error if maxLength is
+ * more than MAX_CANONICAL_LENGTH or too short for every
+ * character to have a code, or if the weights total 2^56 or more.
+ */
+void getLimitedCodeLengths(const uint64_t weights[NUM_SYMBOLS], int maxLength, int lengths[NUM_SYMBOLS]);
+
+/* Function: isValidCodeLengths
+ * Usage: if (isValidCodeLengths(lengths)) { ... }
+ * --------------------------------------------------------
+ * Returns whether the given lengths describe a complete prefix
+ * code containing PSEUDO_EOF: either PSEUDO_EOF alone with length
+ * 0, or lengths of at most MAX_CANONICAL_LENGTH bits whose Kraft
+ * sum is exactly one.
+ */
+bool isValidCodeLengths(const int lengths[NUM_SYMBOLS]);
+
+/* Function: getCanonicalCodes
+ * Usage: getCanonicalCodes(lengths, codes);
+ * --------------------------------------------------------
+ * Assigns the canonical code for each character with a nonzero
+ * length.  Each code is stored in stream order, with the first
+ * bit of the code in bit 0, ready to be passed to writeBits.
+ * The lengths must be valid.
+ */
+void getCanonicalCodes(const int lengths[NUM_SYMBOLS], uint64_t codes[NUM_SYMBOLS]);
+
+/* Function: buildCanonicalTree
+ * Usage: Node* tree = buildCanonicalTree(lengths);
+ * --------------------------------------------------------
+ * Builds an encoding tree whose codes are the canonical codes
+ * for the given lengths, so that the tree-based functions such
+ * as encodeFile and decodeFile produce and read canonical
+ * streams.  Weights in this tree are all zero, since only the
+ * lengths are known.  Free it with freeTree.
+ */
+Node* buildCanonicalTree(const int lengths[NUM_SYMBOLS]);
+
+#endif
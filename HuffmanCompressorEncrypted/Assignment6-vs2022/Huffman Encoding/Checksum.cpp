@@ -0,0 +1,132 @@
+/**********************************************************
+ * File: Checksum.cpp
+ *
+ * Implementation of the functions from Checksum.h.
+ */
+
+#include "Checksum.h"
+#include <string.h>
+
+#if defined(__SSE4_2__) || defined(__AVX2__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#define CRC32C_HARDWARE
+#elif defined(__ARM_FEATURE_CRC32) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_acle.h>
+#define CRC32C_ARM
+#define CRC32C_HARDWARE
+#endif
+
+#ifndef CRC32C_HARDWARE
+
+/* The CRC32C polynomial, with its bits in reverse order. */
+static const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+
+/* Type: Crc32cTables
+ * The tables for eight bytes at a time: entry b of table k is the
+ * CRC of byte b followed by k zero bytes.
+ */
+struct Crc32cTables {
+	uint32_t table[8][256];
+};
+
+/*
+* Our helper function for the tables, worked out at compile time.
+*/
+static constexpr Crc32cTables buildCrc32cTables() {
+	Crc32cTables tables = {};
+	for (uint32_t b = 0; b < 256; b++) {
+		uint32_t crc = b;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+		}
+		tables.table[0][b] = crc;
+	}
+	for (int k = 1; k < 8; k++) {
+		for (uint32_t b = 0; b < 256; b++) {
+			uint32_t previous = tables.table[k - 1][b];
+			tables.table[k][b] = (previous >> 8) ^ tables.table[0][previous & 0xFF];
+		}
+	}
+	return tables;
+}
+
+static constexpr Crc32cTables CRC32C_TABLES = buildCrc32cTables();
+
+/*
+* Reads four bytes as a little-endian word, whatever the order
+* of the machine.
+*/
+static inline uint32_t littleEndianWord(const unsigned char* bytes) {
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+/*
+* CRC32C with the tables, eight bytes per step, on the CRC register
+* as it stands between bytes, so without the final inversion.
+*/
+static uint32_t crc32cTables(const unsigned char* data, size_t length, uint32_t crc) {
+	const uint32_t (*t)[256] = CRC32C_TABLES.table;
+	while (length >= 8) {
+		uint32_t low = crc ^ littleEndianWord(data);
+		uint32_t high = littleEndianWord(data + 4);
+		crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+		      t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+		data += 8;
+		length -= 8;
+	}
+	for (size_t i = 0; i < length; i++) {
+		crc = (crc >> 8) ^ t[0][(crc ^ data[i]) & 0xFF];
+	}
+	return crc;
+}
+
+#endif
+
+/* Function: crc32c
+ * Usage: uint32_t crc = crc32c(data, length);
+ * --------------------------------------------------------
+ * The register starts at all ones and is inverted at the end, so
+ * the CRC of some bytes is inverted again to carry on from it.
+ */
+uint32_t crc32c(const void* data, size_t length, uint32_t crc) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	crc = ~crc;
+#if defined(CRC32C_SSE42)
+	uint64_t wide = crc;
+	for (; length >= 8; bytes += 8, length -= 8) {
+		uint64_t word;
+		memcpy(&word, bytes, 8);
+		wide = _mm_crc32_u64(wide, word);
+	}
+	crc = uint32_t(wide);
+	for (; length > 0; bytes++, length--) {
+		crc = _mm_crc32_u8(crc, *bytes);
+	}
+#elif defined(CRC32C_ARM)
+	for (; length >= 8; bytes += 8, length -= 8) {
+		uint64_t word;
+		memcpy(&word, bytes, 8);
+		crc = __crc32cd(crc, word);
+	}
+	for (; length > 0; bytes++, length--) {
+		crc = __crc32cb(crc, *bytes);
+	}
+#else
+	crc = crc32cTables(bytes, length, crc);
+#endif
+	return ~crc;
+}
+
+/* Function: crc32cIsHardware
+ * Usage: if (crc32cIsHardware()) ...
+ * --------------------------------------------------------
+ * Decided when the file is compiled.
+ */
+bool crc32cIsHardware() {
+#ifdef CRC32C_HARDWARE
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,41 @@
+/**********************************************************
+ * File: Checksum.h
+ *
+ * CRC32C, the Castagnoli CRC, for catching damage to block
+ * compressed files.  It is the CRC that iSCSI, ext4 and SSE4.2's
+ * crc32 instruction use, so the check value of the nine bytes
+ * "123456789" is 0xE3069283 here as everywhere else.  Where the
+ * compiler targets a processor with CRC32C instructions, SSE4.2
+ * on x86 (as HUFFMAN_NATIVE builds on most machines do) or the
+ * CRC extension on ARM, they compute it eight bytes at a time;
+ * elsewhere a table lookup per byte, eight bytes per step, does.
+ * A CRC catches any burst of damage up to 32 bits long, and all
+ * but one in 2^32 of the rest, but like the KeyStream cipher it
+ * is no defense against someone damaging a file on purpose.
+ */
+
+#ifndef Checksum_Included
+#define Checksum_Included
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Function: crc32c
+ * Usage: uint32_t crc = crc32c(data, length);
+ *        crc = crc32c(more, moreLength, crc);
+ * --------------------------------------------------------
+ * Returns the CRC32C of length bytes of data.  Passing the CRC
+ * of some bytes as crc gives the CRC of those bytes followed by
+ * these, so a CRC can be worked out a piece at a time.
+ */
+uint32_t crc32c(const void* data, size_t length, uint32_t crc = 0);
+
+/* Function: crc32cIsHardware
+ * Usage: if (crc32cIsHardware()) ...
+ * --------------------------------------------------------
+ * Returns whether this build computes crc32c with the processor's
+ * CRC32C instructions rather than with tables.
+ */
+bool crc32cIsHardware();
+
+#endif
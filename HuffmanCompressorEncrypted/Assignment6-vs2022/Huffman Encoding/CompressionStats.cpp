@@ -0,0 +1,19 @@
+/**********************************************************
+ * File: CompressionStats.cpp
+ *
+ * Implementation of the types from CompressionStats.h.
+ */
+
+#include "CompressionStats.h"
+
+CompressionStats::CompressionStats() : countSeconds(0), treeSeconds(0), headerSeconds(0), codingSeconds(0),
+	bytesIn(0), bytesOut(0), codeBits(0), symbols(0), refills(0), sampledBytes(0), sampleLossBits(0), treeDepth(0) {}
+
+PhaseTimer::PhaseTimer(CompressionStats* stats, double CompressionStats::* field) : stats(stats), field(field) {
+	if (stats != nullptr) start = std::chrono::steady_clock::now();
+}
+
+PhaseTimer::~PhaseTimer() {
+	if (stats == nullptr) return;
+	stats->*field += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
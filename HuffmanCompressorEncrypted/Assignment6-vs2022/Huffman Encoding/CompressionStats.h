@@ -0,0 +1,97 @@
+/**********************************************************
+ * File: CompressionStats.h
+ *
+ * Counters for where the time goes in compress, decompress,
+ * encodeFile and decodeFile, for use outside the benchmark.
+ * Each of them takes an optional CompressionStats and, given
+ * one, adds to it the time spent in every phase along with
+ * counts of what was done.  Given none, they run exactly the
+ * loops they always did: nothing is timed or counted, and the
+ * per-character loops have no counting in them at all.  With
+ * stats, decoding counts inside those same loops.
+ *
+ * This is the production counterpart of the Node counts in
+ * MemoryDiagnostics.h.  Unlike those, the counts belong to
+ * the caller, so separate calls on separate threads can keep
+ * separate stats.
+ */
+
+#ifndef CompressionStats_Included
+#define CompressionStats_Included
+
+#include <chrono>
+#include <stdint.h>
+
+/* Type: CompressionStats
+ * What one or more calls did.  Every field is added to, never
+ * set, so one object can cover a whole run of calls; make a new
+ * one, which starts at zero, to measure afresh.
+ *
+ * Times are wall-clock seconds in each phase: counting the
+ * input, building the code, reading or writing the header, and
+ * encoding or decoding the data.  Symbols are the characters
+ * encoded or decoded, not counting PSEUDO_EOF, and code bits
+ * are the bits of their codes, counting it but not the header.
+ * Refills are the times a coding loop went back to the input
+ * stream for another block.  Block, context modeled and stored
+ * files record only the times and the byte counts.
+ *
+ * compressSampled also records the bytes it read to sample the
+ * input, on top of the bytes in, and how many more bits its code
+ * took, header included, than the code built from exact counts
+ * would have.
+ */
+struct CompressionStats {
+	double countSeconds;
+	double treeSeconds;
+	double headerSeconds;
+	double codingSeconds;
+
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	uint64_t codeBits;
+	uint64_t symbols;
+	uint64_t refills;
+	uint64_t sampledBytes;
+	int64_t sampleLossBits;
+
+	/* The length of the longest code seen, which is the depth of the
+	 * deepest encoding tree.  This is a maximum, not a sum.
+	 */
+	int treeDepth;
+
+	CompressionStats();
+};
+
+/*
+ * Class: PhaseTimer
+ * ---------------
+ * Adds the time from its construction to its destruction to one
+ * of the time fields of a CompressionStats, or does nothing at all
+ * if there are no stats.
+ */
+class PhaseTimer {
+public:
+	/* Constructor: PhaseTimer(CompressionStats* stats, double CompressionStats::* field);
+	 * Usage: PhaseTimer timer(stats, &CompressionStats::codingSeconds);
+	 * --------------------------
+	 * Starts timing a phase, if stats is not null.
+	 */
+	PhaseTimer(CompressionStats* stats, double CompressionStats::* field);
+
+	/* Destructor: ~PhaseTimer();
+	 * --------------------------
+	 * Adds the time since the timer was made to its field.
+	 */
+	~PhaseTimer();
+
+private:
+	CompressionStats* stats;
+	double CompressionStats::* field;
+	std::chrono::steady_clock::time_point start;
+
+	PhaseTimer(const PhaseTimer&);
+	PhaseTimer& operator=(const PhaseTimer&);
+};
+
+#endif
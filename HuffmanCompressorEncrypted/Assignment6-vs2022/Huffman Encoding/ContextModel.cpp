@@ -0,0 +1,398 @@
+/**********************************************************
+ * File: ContextModel.cpp
+ *
+ * Implementation of the functions from ContextModel.h.
+ */
+
+#include "ContextModel.h"
+#include "HuffmanEncoding.h"
+#include "HuffmanTables.h"
+#include "error.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+/* The keystream block the context map is encrypted with.  The
+ * headers of the codes use the blocks just after it.  Like the
+ * dictionary's, it is well clear of the blocks other files use.
+ */
+static const uint64_t CONTEXT_NONCE = uint64_t(1) << 61;
+
+/* Size of the blocks the input is read in. */
+static const size_t CONTEXT_BLOCK_SIZE = 1 << 16;
+
+/* Number of bits that hold the number of codes, less one. */
+static const int CODE_COUNT_BITS = 4;
+
+/* The version new files are written with, whose headers may be
+ * compact.
+ */
+static const int CONTEXT_VERSION = FORMAT_VERSION_CONTEXT | FORMAT_FLAG_COMPACT;
+
+/* Function: countContexts
+ * Usage: countContexts(data, length, context, counts);
+ * --------------------------------------------------------
+ * Adds each byte of the given block to the counts of the
+ * context before it.  context is the byte before the block,
+ * which is 0 at the start of the data, and is left set to the
+ * last byte of the block so that the next block carries on.
+ */
+void countContexts(const unsigned char* data, size_t length, int& context, ContextCounts& counts) {
+	int previous = context;
+	for (size_t i = 0; i < length; i++) {
+		counts.counts[previous][data[i]]++;
+		previous = data[i];
+	}
+	context = previous;
+}
+
+/*
+* A group of contexts while groupContexts merges them: the counts
+* of all of its contexts added up, the characters with a count, and
+* what coding them costs.
+*/
+struct ContextGroup {
+	uint64_t counts[NUM_SYMBOLS];
+	std::vector<int> used;
+	double cost;
+	bool merged; // true once folded into another group
+};
+
+/* Counts below this have count * log2(count) looked up rather than
+ * worked out, since groupContexts needs it for a great many small
+ * counts.
+ */
+static const int COUNT_LOG_TABLE_SIZE = 1 << 12;
+
+/*
+* Fills in the table countLog looks small counts up in.
+*/
+static std::vector<double> makeCountLogTable() {
+	std::vector<double> table(COUNT_LOG_TABLE_SIZE, 0);
+	for (int i = 1; i < COUNT_LOG_TABLE_SIZE; i++) table[i] = i * log2(double(i));
+	return table;
+}
+
+/*
+* count * log2(count), the number of bits count characters would
+* take if each took log2(count) bits.
+*/
+static double countLog(uint64_t count) {
+	static const std::vector<double> table = makeCountLogTable();
+	if (count < uint64_t(COUNT_LOG_TABLE_SIZE)) return table[size_t(count)];
+	return double(count) * log2(double(count));
+}
+
+/*
+* The estimated cost in bits of coding the counts of one group, or
+* of two added together, with one code: the entropy of the data plus
+* about what writeCanonicalFileHeader takes to list the characters
+* used.  Only the characters with a count are visited, which is
+* most of the time groupContexts takes.
+*/
+static double groupCost(const ContextGroup& one, const ContextGroup* two) {
+	static const uint64_t none[NUM_SYMBOLS] = { 0 };
+	const uint64_t* other = two ? two->counts : none;
+	uint64_t total = 0;
+	double sum = 0;
+	int used = int(one.used.size());
+	for (int ch : one.used) {
+		uint64_t count = one.counts[ch] + other[ch];
+		total += count;
+		sum += countLog(count);
+	}
+	if (two) {
+		for (int ch : two->used) {
+			if (one.counts[ch] != 0) continue;
+			total += other[ch];
+			sum += countLog(other[ch]);
+			used++;
+		}
+	}
+	if (used == 0) return 0;
+	double header = min(used * 13.0, NUM_SYMBOLS * 4.0) + 16;
+	return countLog(total) - sum + header;
+}
+
+/*
+* The bits saved by coding two groups with one code rather than two,
+* which is negative when sharing costs more than it saves.
+*/
+static double mergeSaving(const ContextGroup& one, const ContextGroup& two) {
+	return one.cost + two.cost - groupCost(one, &two);
+}
+
+/* Function: groupContexts
+ * Usage: int codes = groupContexts(counts, maxCodes, groups);
+ * --------------------------------------------------------
+ * Keeps the saving of merging every pair of groups in a table, so
+ * that after each merge only the pairs with the new group need
+ * working out again.
+ */
+int groupContexts(const ContextCounts& counts, int maxCodes, int groups[NUM_CONTEXTS]) {
+	if (maxCodes < 1 || maxCodes > MAX_CONTEXT_CODES) error("Contexts can share between 1 and 16 codes.");
+
+	// every context in use starts in a group of its own
+	std::vector<ContextGroup> found;
+	for (int context = 0; context < NUM_CONTEXTS; context++) {
+		groups[context] = -1;
+		ContextGroup group;
+		const uint64_t* row = counts.counts[context];
+		copy(row, row + NUM_SYMBOLS, group.counts);
+		for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+			if (row[ch] != 0) group.used.push_back(ch);
+		}
+		if (group.used.empty()) continue;
+		group.cost = groupCost(group, nullptr);
+		group.merged = false;
+		groups[context] = int(found.size());
+		found.push_back(group);
+	}
+	int size = int(found.size());
+	std::vector<double> saving(size_t(size) * size);
+	for (int i = 0; i < size; i++) {
+		for (int j = i + 1; j < size; j++) {
+			saving[i * size + j] = mergeSaving(found[i], found[j]);
+		}
+	}
+
+	int remaining = size;
+	while (remaining > 1) {
+		int bestI = -1, bestJ = -1;
+		for (int i = 0; i < size; i++) {
+			if (found[i].merged) continue;
+			for (int j = i + 1; j < size; j++) {
+				if (found[j].merged) continue;
+				if (bestI < 0 || saving[i * size + j] > saving[bestI * size + bestJ]) {
+					bestI = i;
+					bestJ = j;
+				}
+			}
+		}
+		if (remaining <= maxCodes && saving[bestI * size + bestJ] <= 0) break;
+
+		// fold the second group into the first
+		ContextGroup& into = found[bestI];
+		ContextGroup& from = found[bestJ];
+		for (int ch : from.used) {
+			if (into.counts[ch] == 0) into.used.push_back(ch);
+			into.counts[ch] += from.counts[ch];
+		}
+		into.cost = groupCost(into, nullptr);
+		from.merged = true;
+		for (int context = 0; context < NUM_CONTEXTS; context++) {
+			if (groups[context] == bestJ) groups[context] = bestI;
+		}
+		remaining--;
+		for (int k = 0; k < size; k++) {
+			if (k == bestI || found[k].merged) continue;
+			int i = min(k, bestI), j = max(k, bestI);
+			saving[i * size + j] = mergeSaving(found[i], found[j]);
+		}
+	}
+
+	// number the groups left from 0, putting unused contexts in group 0
+	std::vector<int> number(size, 0);
+	int codes = 0;
+	for (int i = 0; i < size; i++) {
+		if (!found[i].merged) number[i] = codes++;
+	}
+	for (int context = 0; context < NUM_CONTEXTS; context++) {
+		groups[context] = groups[context] < 0 ? 0 : number[groups[context]];
+	}
+	return max(codes, 1);
+}
+
+/*
+* The number of bits needed to write any group number below codes.
+*/
+static int groupBits(int codes) {
+	int bits = 0;
+	while ((1 << bits) < codes) bits++;
+	return bits;
+}
+
+/*
+* Works out the code lengths of every group, filling in lengths with
+* those of group 0 first, then group 1 and so on, and returns how
+* many bits the file would take with them, header and all.
+*/
+static uint64_t planCodes(const ContextCounts& counts, const int groups[NUM_CONTEXTS], int codes,
+                          const PasswordKey& password, std::vector<int>& lengths) {
+	std::vector<uint64_t> groupCounts(size_t(codes) * NUM_SYMBOLS, 0);
+	for (int context = 0; context < NUM_CONTEXTS; context++) {
+		uint64_t* total = &groupCounts[size_t(groups[context]) * NUM_SYMBOLS];
+		for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+			total[ch] += counts.counts[context][ch];
+		}
+	}
+
+	lengths.assign(size_t(codes) * NUM_SYMBOLS, 0);
+	uint64_t bits = CODE_COUNT_BITS + uint64_t(groupBits(codes)) * NUM_CONTEXTS;
+	for (int code = 0; code < codes; code++) {
+		const uint64_t* total = &groupCounts[size_t(code) * NUM_SYMBOLS];
+		int* codeLengths = &lengths[size_t(code) * NUM_SYMBOLS];
+		getCodeLengthsForCounts(total, codeLengths);
+		ostringbstream header;
+		bits += writeCanonicalFileHeader(header, codeLengths, password, 0, CONTEXT_VERSION);
+		for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+			bits += total[ch] * uint64_t(codeLengths[ch]);
+		}
+	}
+	return bits;
+}
+
+/* Function: compressWithContexts
+ * Usage: compressWithContexts(infile, outfile, password);
+ * --------------------------------------------------------
+ * Compresses like compress, reading the input twice, but with
+ * an order-1 context model.  If grouping the contexts saves no
+ * bits once the headers are counted, every context shares one
+ * code.  decompress reads the result.
+ */
+void compressWithContexts(ibstream& infile, obstream& outfile, const PasswordKey& password) {
+	std::unique_ptr<ContextCounts> counts(new ContextCounts());
+	std::vector<char> block(CONTEXT_BLOCK_SIZE);
+	int context = 0;
+	while (true) {
+		infile.read(block.data(), block.size());
+		size_t got = size_t(infile.gcount());
+		if (got == 0) break;
+		countContexts((const unsigned char*)block.data(), got, context, *counts);
+	}
+
+	// the grouping works from estimates, so make sure it really beats one code
+	int groups[NUM_CONTEXTS];
+	int codes = groupContexts(*counts, MAX_CONTEXT_CODES, groups);
+	std::vector<int> lengths;
+	uint64_t bits = planCodes(*counts, groups, codes, password, lengths);
+	if (codes > 1) {
+		int oneGroup[NUM_CONTEXTS] = { 0 };
+		std::vector<int> oneLengths;
+		if (planCodes(*counts, oneGroup, 1, password, oneLengths) <= bits) {
+			copy(oneGroup, oneGroup + NUM_CONTEXTS, groups);
+			codes = 1;
+			lengths = oneLengths;
+		}
+	}
+
+	PasswordKey fileKey = writeFormatMagic(outfile, CONTEXT_VERSION, password);
+	KeyStream map(fileKey.keystreamKey(), CONTEXT_NONCE);
+	outfile.writeBits(map.nextBits(uint64_t(codes - 1), CODE_COUNT_BITS), CODE_COUNT_BITS);
+	int width = groupBits(codes);
+	if (width > 0) {
+		for (context = 0; context < NUM_CONTEXTS; context++) {
+			outfile.writeBits(map.nextBits(uint64_t(groups[context]), width), width);
+		}
+	}
+
+	std::vector<EncodeTable> tables(codes);
+	for (int code = 0; code < codes; code++) {
+		const int* codeLengths = &lengths[size_t(code) * NUM_SYMBOLS];
+		writeCanonicalFileHeader(outfile, codeLengths, fileKey, CONTEXT_NONCE + 1 + code, CONTEXT_VERSION);
+		buildCanonicalEncodeTable(codeLengths, tables[code]);
+	}
+
+	// look codes up by context directly rather than through the groups
+	const EncodeEntry* byContext[NUM_CONTEXTS];
+	for (context = 0; context < NUM_CONTEXTS; context++) {
+		byContext[context] = tables[groups[context]].codes;
+	}
+
+	infile.rewind();
+	context = 0;
+	while (true) {
+		infile.read(block.data(), block.size());
+		size_t got = size_t(infile.gcount());
+		if (got == 0) break;
+		const unsigned char* data = (const unsigned char*)block.data();
+		for (size_t i = 0; i < got; i++) {
+			const EncodeEntry& entry = byContext[context][data[i]];
+			outfile.writeBits(entry.bits, entry.length);
+			context = data[i];
+		}
+	}
+	const EncodeEntry& end = byContext[context][PSEUDO_EOF];
+	outfile.writeBits(end.bits, end.length);
+	outfile.flushBits();
+}
+
+/* Function: decompressContexts
+ * Usage: decompressContexts(infile, outfile, password);
+ * --------------------------------------------------------
+ * Decompresses a file written by compressWithContexts, starting
+ * from its magic number.  decompress calls this for such files.
+ */
+void decompressContexts(ibstream& infile, ostream& outfile, const PasswordKey& password) {
+	ContextDecoder decoder;
+	readContextHeader(infile, password, decoder);
+
+	std::vector<unsigned char> span(CONTEXT_BLOCK_SIZE);
+	bool finished = false;
+	while (!finished) {
+		size_t got = decodeContextSpan(infile, decoder, span.data(), span.size(), finished);
+		outfile.write((const char*)span.data(), got);
+	}
+}
+
+/* Function: readContextHeader
+ * Usage: readContextHeader(infile, password, decoder);
+ * --------------------------------------------------------
+ * Reads the context map and then the header of every code, which
+ * are compact only if the file's version says they may be.
+ */
+void readContextHeader(ibstream& infile, const PasswordKey& password, ContextDecoder& decoder) {
+	PasswordKey fileKey = password;
+	int version = readFormatMagic(infile, password, fileKey);
+	if ((version & ~FORMAT_FLAG_COMPACT) != FORMAT_VERSION_CONTEXT) {
+		error("This is not a context modeled file.");
+	}
+	KeyStream map(fileKey.keystreamKey(), CONTEXT_NONCE);
+	int codes = int(map.nextBits(infile.readBits(CODE_COUNT_BITS), CODE_COUNT_BITS)) + 1;
+	int width = groupBits(codes);
+	int groups[NUM_CONTEXTS] = { 0 };
+	if (width > 0) {
+		for (int context = 0; context < NUM_CONTEXTS; context++) {
+			groups[context] = int(map.nextBits(infile.readBits(width), width));
+			if (groups[context] >= codes) error("The context map is corrupt; check the password.");
+		}
+	}
+
+	decoder.tables.assign(codes, DecodeTable());
+	for (int code = 0; code < codes; code++) {
+		int lengths[NUM_SYMBOLS];
+		readCanonicalFileHeader(infile, lengths, fileKey, CONTEXT_NONCE + 1 + code, version);
+		buildCanonicalDecodeTable(lengths, decoder.tables[code]);
+	}
+	for (int context = 0; context < NUM_CONTEXTS; context++) {
+		decoder.entries[context] = decoder.tables[groups[context]].entries.data();
+		decoder.rootBits[context] = decoder.tables[groups[context]].rootBits;
+	}
+	decoder.context = 0;
+}
+
+/* Function: decodeContextSpan
+ * Usage: size_t got = decodeContextSpan(infile, decoder, buffer, capacity, finished);
+ * --------------------------------------------------------
+ * Like decodeSpanWithTable, it checks for input that ends too
+ * soon once per span.
+ */
+size_t decodeContextSpan(ibstream& infile, ContextDecoder& decoder, unsigned char* buffer, size_t capacity,
+                         bool& finished) {
+	finished = false;
+	int context = decoder.context;
+	size_t i = 0;
+	for (; i < capacity; i++) {
+		ext_char ch = decodeSymbol(infile, decoder.entries[context], decoder.rootBits[context]);
+		if (ch == PSEUDO_EOF) {
+			finished = true;
+			break;
+		}
+		buffer[i] = (unsigned char)ch;
+		context = ch;
+	}
+	decoder.context = context;
+	if (infile.readPastEnd()) error("Encoded data ends before its PSEUDO_EOF.");
+	return i;
+}
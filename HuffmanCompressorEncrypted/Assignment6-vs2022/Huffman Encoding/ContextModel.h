@@ -0,0 +1,141 @@
+/**********************************************************
+ * File: ContextModel.h
+ *
+ * Order-1 context modeling.  compress gives every character
+ * one code whatever came before it, but in text the previous
+ * character says a lot about the next: 'q' is nearly always
+ * followed by 'u', and a space by a letter.  This mode picks
+ * the code for each character by the byte before it, its
+ * context, so each context gets a code fitted to what follows
+ * it.  A code per context would need 256 headers, so contexts
+ * that are followed by much the same characters are grouped
+ * together to share one code, trading a few bits of payload
+ * for a header that is not worth more than it saves.
+ *
+ * The file starts with the FORMAT_VERSION_CONTEXT magic
+ * number, with FORMAT_FLAG_COMPACT, the salt and nonce (see
+ * FORMAT_FLAG_SALTED) and the password check (see
+ * FORMAT_FLAG_CHECKED), then, encrypted with a KeyStream,
+ *
+ *   4 bits     number of codes, less one
+ *   per byte   the code its context uses, in just enough bits
+ *              (none at all if there is only one code)
+ *   per code   a canonical header, as writeCanonicalFileHeader
+ *              writes it
+ *
+ * and then the data, each character encoded with the code of
+ * the byte before it.  The first character's context is 0,
+ * and PSEUDO_EOF ends the data in the context of the last.
+ * Every code has one, although only the last context uses it.
+ */
+
+#ifndef ContextModel_Included
+#define ContextModel_Included
+
+#include "HuffmanTypes.h"
+#include "HuffmanTables.h"
+#include "bstream.h"
+#include "KeyStream.h"
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+/* Constant: NUM_CONTEXTS
+ * The number of order-1 contexts, one per byte value.
+ */
+const int NUM_CONTEXTS = 256;
+
+/* Constant: MAX_CONTEXT_CODES
+ * The most codes a file's contexts can be grouped into.
+ */
+const int MAX_CONTEXT_CODES = 16;
+
+/* Type: ContextCounts
+ * How many times every character follows every context:
+ * counts[context][ch].  At half a megabyte, this belongs on
+ * the heap rather than the stack.
+ */
+struct ContextCounts {
+	uint64_t counts[NUM_CONTEXTS][NUM_SYMBOLS];
+};
+
+/* Function: countContexts
+ * Usage: countContexts(data, length, context, counts);
+ * --------------------------------------------------------
+ * Adds each byte of the given block to the counts of the
+ * context before it.  context is the byte before the block,
+ * which is 0 at the start of the data, and is left set to the
+ * last byte of the block so that the next block carries on.
+ */
+void countContexts(const unsigned char* data, size_t length, int& context, ContextCounts& counts);
+
+/* Function: groupContexts
+ * Usage: int codes = groupContexts(counts, maxCodes, groups);
+ * --------------------------------------------------------
+ * Groups the contexts so that each group can share one code,
+ * filling in the group of every context and returning how many
+ * groups there are, at most maxCodes.  Groups are merged two at
+ * a time, always the pair whose merging costs the fewest bits,
+ * for as long as that saves bits overall or there are more than
+ * maxCodes groups.  The cost counts each group's data at its
+ * entropy and estimates the size of its header.  Contexts that
+ * are never used go in group 0.
+ */
+int groupContexts(const ContextCounts& counts, int maxCodes, int groups[NUM_CONTEXTS]);
+
+/* Function: compressWithContexts
+ * Usage: compressWithContexts(infile, outfile, password);
+ * --------------------------------------------------------
+ * Compresses like compress, reading the input twice, but with
+ * an order-1 context model.  If grouping the contexts saves no
+ * bits once the headers are counted, every context shares one
+ * code.  decompress reads the result.
+ */
+void compressWithContexts(ibstream& infile, obstream& outfile, const PasswordKey& password);
+
+/* Function: decompressContexts
+ * Usage: decompressContexts(infile, outfile, password);
+ * --------------------------------------------------------
+ * Decompresses a file written by compressWithContexts, starting
+ * from its magic number.  decompress calls this for such files.
+ */
+void decompressContexts(ibstream& infile, ostream& outfile, const PasswordKey& password);
+
+/* Type: ContextDecoder
+ * The codes of a context modeled file, the table every context
+ * decodes with, which points into them, and the context of the
+ * next character, so that its data can be decoded a span at a
+ * time.  The pointers keep it from being copied once filled in.
+ */
+struct ContextDecoder {
+	std::vector<DecodeTable> tables;
+	const DecodeEntry* entries[NUM_CONTEXTS];
+	int rootBits[NUM_CONTEXTS];
+	int context;
+};
+
+/* Function: readContextHeader
+ * Usage: readContextHeader(infile, password, decoder);
+ * --------------------------------------------------------
+ * Reads a file written by compressWithContexts from its magic
+ * number up to its data, filling in decoder to decode it from
+ * the first character.  Raises an error if the file isn't
+ * context modeled or the password is wrong.
+ */
+void readContextHeader(ibstream& infile, const PasswordKey& password, ContextDecoder& decoder);
+
+/* Function: decodeContextSpan
+ * Usage: size_t got = decodeContextSpan(infile, decoder, buffer, capacity, finished);
+ * --------------------------------------------------------
+ * Decodes characters of a context modeled file into the given
+ * buffer, as decodeSpanWithTable does for a single code, until
+ * it reads the PSEUDO_EOF, when it sets finished to true, or it
+ * has written capacity characters.  Returns how many it wrote,
+ * and leaves decoder set to carry on from there.
+ */
+size_t decodeContextSpan(ibstream& infile, ContextDecoder& decoder, unsigned char* buffer, size_t capacity,
+                         bool& finished);
+
+#endif
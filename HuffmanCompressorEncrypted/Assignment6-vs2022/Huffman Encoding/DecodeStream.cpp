@@ -0,0 +1,122 @@
+/**********************************************************
+ * File: DecodeStream.cpp
+ *
+ * Implementation of the HuffmanDecodeStream class from
+ * DecodeStream.h.
+ */
+
+#include "DecodeStream.h"
+#include "HuffmanEncoding.h"
+#include "HuffmanTables.h"
+#include "BlockCompression.h"
+#include "ContextModel.h"
+#include "error.h"
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+/* Type: HuffmanDecodeStream::State
+ * What the decoder of each format carries from one read to the
+ * next.  Only the one for the file's format is used: the tables
+ * of a single-stream file, one of them multi-symbol if its code
+ * is short enough, the contexts of a context modeled one, the
+ * keystream and the bytes left of a stored one, held in the window
+ * a piece at a time, or the decoder of a block compressed one.
+ */
+struct HuffmanDecodeStream::State {
+	ibstream& infile;
+	int version;
+	DecodeTable table;
+	MultiDecodeTable multi;
+	ContextDecoder contexts;
+	KeyStream cipher;
+	uint64_t storedLeft;
+	std::vector<unsigned char> window;
+	size_t windowPos, windowEnd;
+	BlockDecodeStream* blocks;
+	bool finished;
+
+	State(ibstream& infile)
+		: infile(infile), version(0), cipher(0, 0), storedLeft(0), windowPos(0), windowEnd(0), blocks(nullptr),
+		  finished(false) {}
+
+	~State() {
+		delete blocks;
+	}
+};
+
+/* Constructor: HuffmanDecodeStream
+ * Usage: HuffmanDecodeStream decoder(infile, password);
+ * --------------------------------------------------------
+ * Reads the start of the file as decompress does, with
+ * readCompressedHeader, then whatever its format has before the
+ * data.  A stored file's window is whole keystream words, so that
+ * it can be decrypted a window at a time.
+ */
+HuffmanDecodeStream::HuffmanDecodeStream(ibstream& infile, const PasswordKey& password, size_t windowBytes) {
+	if (windowBytes < 8) error("The decode window must be at least 8 bytes.");
+	state = new State(infile);
+	try {
+		state->version = readCompressedHeader(infile, password, state->table);
+		if (isBlockFormat(state->version)) {
+			state->blocks = new BlockDecodeStream(infile, password, windowBytes);
+		} else if (state->version == FORMAT_VERSION_CONTEXT) {
+			readContextHeader(infile, password, state->contexts);
+		} else if (state->version == FORMAT_VERSION_STORED) {
+			state->cipher = readStoredHeader(infile, password, state->storedLeft);
+			state->window.resize(size_t(std::min<uint64_t>(windowBytes / 8 * 8, state->storedLeft)));
+		} else if (prefersMultiSymbolDecode(state->table)) {
+			buildMultiDecodeTable(state->table, state->multi);
+		}
+	} catch (...) {
+		delete state;
+		throw;
+	}
+}
+
+HuffmanDecodeStream::~HuffmanDecodeStream() {
+	delete state;
+}
+
+/* Member function: read
+ * Usage: size_t got = decoder.read(buffer, count);
+ * --------------------------------------------------------
+ * Hands each format's decoder the room left in the buffer until
+ * it is full or the data ends.
+ */
+size_t HuffmanDecodeStream::read(char* buffer, size_t count) {
+	State& s = *state;
+	unsigned char* out = (unsigned char*)buffer;
+	size_t done = 0;
+	while (done < count && !s.finished) {
+		if (s.blocks != nullptr) {
+			size_t got = s.blocks->read(out + done, count - done);
+			if (got == 0) s.finished = true;
+			done += got;
+		} else if (s.version == FORMAT_VERSION_CONTEXT) {
+			done += decodeContextSpan(s.infile, s.contexts, out + done, count - done, s.finished);
+		} else if (s.version == FORMAT_VERSION_STORED) {
+			if (s.windowPos == s.windowEnd) {
+				if (s.storedLeft == 0) {
+					s.finished = true;
+					break;
+				}
+				size_t bytes = size_t(std::min<uint64_t>(s.window.size(), s.storedLeft));
+				readStoredBytes(s.infile, s.window.data(), bytes);
+				s.cipher.apply(s.window.data(), bytes);
+				s.storedLeft -= bytes;
+				s.windowPos = 0;
+				s.windowEnd = bytes;
+			}
+			size_t got = std::min(count - done, s.windowEnd - s.windowPos);
+			memcpy(out + done, s.window.data() + s.windowPos, got);
+			s.windowPos += got;
+			done += got;
+		} else if (!s.multi.entries.empty()) {
+			done += decodeSpanMultiSymbol(s.infile, s.table, s.multi, out + done, count - done, s.finished);
+		} else {
+			done += decodeSpanWithTable(s.infile, s.table, out + done, count - done, s.finished);
+		}
+	}
+	return done;
+}
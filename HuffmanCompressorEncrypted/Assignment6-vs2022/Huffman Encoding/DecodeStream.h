@@ -0,0 +1,85 @@
+/**********************************************************
+ * File: DecodeStream.h
+ *
+ * A pull decoder for compressed files.  decompress writes the
+ * whole of a file to a stream in one call, so a server handing
+ * the data out a piece at a time has to collect all of it first.
+ * A HuffmanDecodeStream instead decodes only as much as each read
+ * asks for, in a fixed amount of memory: a window of the size its
+ * caller chooses, the bit buffers of a couple of ibstreams, and
+ * the decode tables, which are a few kilobytes per code.  None of
+ * it grows with the size of the file, nor, except in interleaved
+ * block files, with the size of its blocks: an interleaved block
+ * is decoded whole, so the window must hold its frame and its data
+ * together, and a file of larger blocks than the default needs a
+ * window chosen to match.
+ */
+
+#ifndef DecodeStream_Included
+#define DecodeStream_Included
+
+#include "bstream.h"
+#include "KeyStream.h"
+#include "BlockCompression.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constant: DEFAULT_DECODE_WINDOW
+ * The number of bytes of compressed input a HuffmanDecodeStream
+ * holds at a time unless its caller asks for something else.  It
+ * holds an interleaved block of the default size along with its
+ * frame, which is always smaller than the block, since a block
+ * that doesn't shrink is stored instead.
+ */
+const size_t DEFAULT_DECODE_WINDOW = 2 * DEFAULT_BLOCK_SIZE;
+
+/*
+ * Class: HuffmanDecodeStream
+ * ---------------
+ * Decodes a file in any of the formats decompress reads, on
+ * demand.  Everything before the data itself, the magic number,
+ * the password check and the first header, is read when it is
+ * constructed, so a wrong password is turned away before any of
+ * the data is asked for.  After that, each call to read decodes
+ * just the bytes it hands out.
+ */
+class HuffmanDecodeStream {
+public:
+	/* Constructor: HuffmanDecodeStream(ibstream& infile, PasswordKey password, size_t windowBytes);
+	 * Usage: HuffmanDecodeStream decoder(infile, password);
+	 * --------------------------
+	 * Starts decoding the compressed file infile is at the start of,
+	 * reading stored data and the frames of block compressed files
+	 * through a window of windowBytes bytes, at least 8.  The other
+	 * formats decode straight from infile's bit buffer and need no
+	 * window.  The stream must outlive the HuffmanDecodeStream; it
+	 * is read only once and never seeks.  Raises the errors
+	 * decompress would for the start of the file, and an error if
+	 * the window is less than 8 bytes.  An interleaved block file
+	 * needs a window holding one block's frame and data together
+	 * (see BlockDecodeStream).
+	 */
+	HuffmanDecodeStream(ibstream& infile, const PasswordKey& password, size_t windowBytes = DEFAULT_DECODE_WINDOW);
+	~HuffmanDecodeStream();
+
+	/* Member function: read(char* buffer, size_t count);
+	 * Usage: size_t got = decoder.read(buffer, count);
+	 * --------------------------
+	 * Decodes the next count bytes of the data into buffer, or as
+	 * many as are left, returning how many: always count, until the
+	 * data runs out, and 0 once it has.  Raises an error if the file
+	 * turns out to be truncated or damaged; what was handed out
+	 * before that may already be wrong, since a block's checksum is
+	 * only checked at the end of the file.
+	 */
+	size_t read(char* buffer, size_t count);
+
+private:
+	struct State;
+	State* state;
+
+	HuffmanDecodeStream(const HuffmanDecodeStream&);
+	HuffmanDecodeStream& operator=(const HuffmanDecodeStream&);
+};
+
+#endif
@@ -0,0 +1,120 @@
+/**********************************************************
+ * File: Dictionary.cpp
+ *
+ * Implementation of the class and functions from
+ * Dictionary.h.
+ */
+
+#include "Dictionary.h"
+#include "HuffmanEncoding.h"
+#include "CanonicalHuffman.h"
+#include "error.h"
+
+/* The keystream block a dictionary's header is encrypted with.  It
+ * is well clear of the block numbers compressed files use for
+ * theirs, so a dictionary and a file sharing a password never
+ * share keystream.
+ */
+static const uint64_t DICTIONARY_NONCE = uint64_t(1) << 62;
+
+/*
+* FNV-1a over the code lengths, in the 32-bit form.
+*/
+static uint32_t dictionaryId(const int lengths[NUM_SYMBOLS]) {
+	uint32_t hash = 2166136261u;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		hash ^= uint32_t(lengths[ch]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+* Reads the magic number a record starts with and raises an error
+* unless it has the expected version.
+*/
+static void readMagic(ibstream& infile, int version, const string& what) {
+	uint64_t magic = infile.readBits(32);
+	if ((magic & 0xFFFFFF) != FORMAT_MAGIC || int(magic >> 24) != version) {
+		error("This is not a " + what + ".");
+	}
+}
+
+HuffmanDictionary::HuffmanDictionary(const uint64_t counts[NUM_SYMBOLS]) {
+	// one extra of every byte gives the bytes the samples lack a code
+	uint64_t smoothed[NUM_SYMBOLS] = { 0 };
+	for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+		smoothed[ch] = counts[ch] + 1;
+	}
+	getCodeLengthsForCounts(smoothed, lengths);
+	buildTables();
+}
+
+HuffmanDictionary::HuffmanDictionary(ibstream& infile, const PasswordKey& password) {
+	// dictionaries from before compact headers or salts are read as they were written
+	PasswordKey fileKey = password;
+	int version = readFormatMagic(infile, password, fileKey);
+	if ((version & ~FORMAT_FLAG_COMPACT) != FORMAT_VERSION_DICTIONARY) error("This is not a dictionary.");
+	uint32_t storedId = uint32_t(infile.readBits(32));
+	readCanonicalFileHeader(infile, lengths, fileKey, DICTIONARY_NONCE, version);
+	buildTables();
+	if (identifier != storedId) error("The dictionary could not be read; check the password.");
+}
+
+void HuffmanDictionary::buildTables() {
+	identifier = dictionaryId(lengths);
+	buildCanonicalEncodeTable(lengths, encoder);
+	buildCanonicalDecodeTable(lengths, decoder);
+}
+
+void HuffmanDictionary::write(obstream& outfile, const PasswordKey& password) const {
+	int version = FORMAT_VERSION_DICTIONARY | FORMAT_FLAG_COMPACT;
+	PasswordKey fileKey = writeFormatMagic(outfile, version, password);
+	outfile.writeBits(identifier, 32);
+	writeCanonicalFileHeader(outfile, lengths, fileKey, DICTIONARY_NONCE, version);
+	outfile.flushBits();
+}
+
+uint32_t HuffmanDictionary::id() const {
+	return identifier;
+}
+
+int HuffmanDictionary::codeLength(ext_char ch) const {
+	return lengths[ch];
+}
+
+const EncodeTable& HuffmanDictionary::encodeTable() const {
+	return encoder;
+}
+
+const DecodeTable& HuffmanDictionary::decodeTable() const {
+	return decoder;
+}
+
+/* Function: compressRecord
+ * Usage: compressRecord(infile, outfile, dictionary);
+ * --------------------------------------------------------
+ * Compresses the rest of the given stream with the dictionary's
+ * code, reading it once.  The record carries no header of its
+ * own, only the dictionary's id.
+ */
+void compressRecord(istream& infile, obstream& outfile, const HuffmanDictionary& dictionary) {
+	outfile.writeBits(FORMAT_MAGIC | (uint64_t(FORMAT_VERSION_RECORD) << 24), 32);
+	outfile.writeBits(dictionary.id(), 32);
+	encodeFileWithTable(infile, dictionary.encodeTable(), outfile);
+}
+
+/* Function: decompressRecord
+ * Usage: decompressRecord(infile, outfile, dictionary);
+ * --------------------------------------------------------
+ * Decompresses a record written by compressRecord with the same
+ * dictionary.  Raises an error if the stream does not hold a
+ * record or the record was encoded with a different dictionary.
+ */
+void decompressRecord(ibstream& infile, ostream& outfile, const HuffmanDictionary& dictionary) {
+	readMagic(infile, FORMAT_VERSION_RECORD, "dictionary compressed record");
+	if (uint32_t(infile.readBits(32)) != dictionary.id()) {
+		error("This record was compressed with a different dictionary.");
+	}
+	decodeFileWithTable(infile, dictionary.decodeTable(), outfile);
+}
@@ -0,0 +1,126 @@
+/**********************************************************
+ * File: Dictionary.h
+ *
+ * Compression of many small records against one shared code.
+ * For a record of a few kilobytes, the header compress writes
+ * and the tree it builds cost as much as the record itself.
+ * A HuffmanDictionary is instead trained once on sample data
+ * and saved to its own file; every record is then encoded
+ * with the dictionary's code and carries only
+ *
+ *   32 bits  FORMAT_MAGIC, version FORMAT_VERSION_RECORD
+ *   32 bits  the id of the dictionary it was encoded with
+ *   ...      the record encoded with the dictionary's code
+ *            and ended by PSEUDO_EOF
+ *
+ * so neither side reads a header or builds a tree per record.
+ * A dictionary file holds
+ *
+ *   32 bits  FORMAT_MAGIC, version FORMAT_VERSION_DICTIONARY
+ *            with FORMAT_FLAG_COMPACT, FORMAT_FLAG_SALTED and
+ *            FORMAT_FLAG_CHECKED
+ *   192 bits the salt and nonce, and 32 bits the password check
+ *   32 bits  the id of the dictionary
+ *   ...      an encrypted canonical header holding the code
+ *
+ * Records are not encrypted themselves; without the password
+ * there is no code to decode them with.
+ */
+
+#ifndef Dictionary_Included
+#define Dictionary_Included
+
+#include "HuffmanTypes.h"
+#include "HuffmanTables.h"
+#include "bstream.h"
+#include "KeyStream.h"
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+using namespace std;
+
+/*
+ * Class: HuffmanDictionary
+ * ---------------
+ * A code shared by many records, with its encode and decode tables
+ * built once when the dictionary is made.  A HuffmanDictionary never
+ * changes, so threads can share one.
+ */
+class HuffmanDictionary {
+public:
+	/* Constructor: HuffmanDictionary(counts);
+	 * Usage: HuffmanDictionary dictionary(counts);
+	 * --------------------------
+	 * Trains a dictionary on the byte counts of the sample data, as
+	 * countStream adds them up.  Every byte value is given a code, even
+	 * those the samples never use, so any record can be encoded.
+	 */
+	HuffmanDictionary(const uint64_t counts[NUM_SYMBOLS]);
+
+	/* Constructor: HuffmanDictionary(infile, password);
+	 * Usage: HuffmanDictionary dictionary(infile, password);
+	 * --------------------------
+	 * Reads a dictionary written by write.  Raises an error if the
+	 * stream does not hold a dictionary or the password is wrong.
+	 */
+	HuffmanDictionary(ibstream& infile, const PasswordKey& password);
+
+	/* Member function: write(outfile, password);
+	 * Usage: dictionary.write(outfile, password);
+	 * --------------------------
+	 * Writes the dictionary to the given stream, with its code
+	 * encrypted under the password.
+	 */
+	void write(obstream& outfile, const PasswordKey& password) const;
+
+	/* Member function: id();
+	 * Usage: uint32_t id = dictionary.id();
+	 * --------------------------
+	 * A number worked out from the code, which records carry so that
+	 * decoding one with the wrong dictionary can be caught.
+	 */
+	uint32_t id() const;
+
+	/* Member function: codeLength(ext_char ch);
+	 * Usage: int length = dictionary.codeLength(ch);
+	 * --------------------------
+	 * The number of bits in the code for the given character.
+	 */
+	int codeLength(ext_char ch) const;
+
+	/* Member functions: encodeTable(), decodeTable()
+	 * Usage: encodeFileWithTable(infile, dictionary.encodeTable(), outfile);
+	 * --------------------------
+	 * The tables for the dictionary's code.
+	 */
+	const EncodeTable& encodeTable() const;
+	const DecodeTable& decodeTable() const;
+
+private:
+	int lengths[NUM_SYMBOLS];
+	uint32_t identifier;
+	EncodeTable encoder;
+	DecodeTable decoder;
+
+	void buildTables();
+};
+
+/* Function: compressRecord
+ * Usage: compressRecord(infile, outfile, dictionary);
+ * --------------------------------------------------------
+ * Compresses the rest of the given stream with the dictionary's
+ * code, reading it once.  The record carries no header of its
+ * own, only the dictionary's id.
+ */
+void compressRecord(istream& infile, obstream& outfile, const HuffmanDictionary& dictionary);
+
+/* Function: decompressRecord
+ * Usage: decompressRecord(infile, outfile, dictionary);
+ * --------------------------------------------------------
+ * Decompresses a record written by compressRecord with the same
+ * dictionary.  Raises an error if the stream does not hold a
+ * record or the record was encoded with a different dictionary.
+ */
+void decompressRecord(ibstream& infile, ostream& outfile, const HuffmanDictionary& dictionary);
+
+#endif
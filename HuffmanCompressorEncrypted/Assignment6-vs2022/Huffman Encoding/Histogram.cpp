@@ -0,0 +1,106 @@
+/**********************************************************
+ * File: Histogram.cpp
+ *
+ * Implementation of the functions from Histogram.h.
+ */
+
+#include "Histogram.h"
+#include "error.h"
+#include <climits>
+#include <cstring>
+#include <vector>
+
+/* Number of separate histograms the counting kernel rotates
+ * between.  A run of identical bytes then updates four different
+ * counters in turn, instead of making every increment wait for
+ * the one before it to reach memory.
+ */
+static const int NUM_HISTOGRAMS = 4;
+
+/* Inputs shorter than this are counted directly; setting up and
+ * merging the separate histograms would cost more than it saves.
+ */
+static const size_t SHORT_INPUT = 1024;
+
+/* Size of the blocks read by countStream. */
+static const size_t BLOCK_SIZE = 1 << 16;
+
+/* Function: countBytes
+ * Usage: countBytes(data, length, counts);
+ * --------------------------------------------------------
+ * Adds the number of times each byte value appears in the
+ * given block of memory to counts[0] through counts[255].
+ * The other entries of counts are left untouched.
+ */
+void countBytes(const unsigned char* data, size_t length, uint64_t counts[NUM_SYMBOLS]) {
+	if (length < SHORT_INPUT) {
+		for (size_t i = 0; i < length; i++) {
+			counts[data[i]]++;
+		}
+		return;
+	}
+
+	uint64_t partial[NUM_HISTOGRAMS][256];
+	memset(partial, 0, sizeof(partial));
+
+	// eight bytes per iteration, two to each histogram
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		partial[0][word & 0xFF]++;
+		partial[1][(word >> 8) & 0xFF]++;
+		partial[2][(word >> 16) & 0xFF]++;
+		partial[3][(word >> 24) & 0xFF]++;
+		partial[0][(word >> 32) & 0xFF]++;
+		partial[1][(word >> 40) & 0xFF]++;
+		partial[2][(word >> 48) & 0xFF]++;
+		partial[3][word >> 56]++;
+	}
+	for (; i < length; i++) {
+		partial[0][data[i]]++;
+	}
+
+	for (int b = 0; b < 256; b++) {
+		counts[b] += partial[0][b] + partial[1][b] + partial[2][b] + partial[3][b];
+	}
+}
+
+/* Function: countStream
+ * Usage: countStream(file, counts);
+ * --------------------------------------------------------
+ * Reads the rest of the given stream in large blocks, adding
+ * the count of every byte value to counts, and returns the
+ * number of bytes read.  The stream is left at end of file.
+ */
+uint64_t countStream(istream& file, uint64_t counts[NUM_SYMBOLS]) {
+	std::vector<char> block(BLOCK_SIZE);
+	uint64_t total = 0;
+	while (true) {
+		file.read(block.data(), block.size());
+		size_t got = size_t(file.gcount());
+		if (got == 0) break;
+		countBytes(reinterpret_cast<const unsigned char*>(block.data()), got, counts);
+		total += got;
+	}
+	return total;
+}
+
+/* Function: histogramToMap
+ * Usage: Map<ext_char, int> freq = histogramToMap(counts);
+ * --------------------------------------------------------
+ * Converts byte counts into the frequency table returned by
+ * getFrequencyTable: one entry per byte value that occurs,
+ * plus PSEUDO_EOF with a frequency of 1.  Raises an error if
+ * any count does not fit in an int.
+ */
+Map<ext_char, int> histogramToMap(const uint64_t counts[NUM_SYMBOLS]) {
+	Map<ext_char, int> freqMap;
+	for (int b = 0; b < 256; b++) {
+		if (counts[b] == 0) continue;
+		if (counts[b] > uint64_t(INT_MAX)) error("Character count is too large for the frequency table.");
+		freqMap[b] = int(counts[b]);
+	}
+	freqMap[PSEUDO_EOF] = 1;
+	return freqMap;
+}
@@ -0,0 +1,47 @@
+/**********************************************************
+ * File: Histogram.h
+ *
+ * Fast character counting.  Rather than one istream::get and
+ * one Map update per byte, these functions read large blocks
+ * and count into flat arrays of 64-bit counters, converting
+ * to the Map used by the rest of the program only at the end.
+ */
+
+#ifndef Histogram_Included
+#define Histogram_Included
+
+#include "HuffmanTypes.h"
+#include "map.h"
+#include <istream>
+#include <stdint.h>
+using namespace std;
+
+/* Function: countBytes
+ * Usage: countBytes(data, length, counts);
+ * --------------------------------------------------------
+ * Adds the number of times each byte value appears in the
+ * given block of memory to counts[0] through counts[255].
+ * The other entries of counts are left untouched.
+ */
+void countBytes(const unsigned char* data, size_t length, uint64_t counts[NUM_SYMBOLS]);
+
+/* Function: countStream
+ * Usage: countStream(file, counts);
+ * --------------------------------------------------------
+ * Reads the rest of the given stream in large blocks, adding
+ * the count of every byte value to counts, and returns the
+ * number of bytes read.  The stream is left at end of file.
+ */
+uint64_t countStream(istream& file, uint64_t counts[NUM_SYMBOLS]);
+
+/* Function: histogramToMap
+ * Usage: Map<ext_char, int> freq = histogramToMap(counts);
+ * --------------------------------------------------------
+ * Converts byte counts into the frequency table returned by
+ * getFrequencyTable: one entry per byte value that occurs,
+ * plus PSEUDO_EOF with a frequency of 1.  Raises an error if
+ * any count does not fit in an int.
+ */
+Map<ext_char, int> histogramToMap(const uint64_t counts[NUM_SYMBOLS]);
+
+#endif
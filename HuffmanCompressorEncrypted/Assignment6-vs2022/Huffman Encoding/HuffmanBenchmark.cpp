@@ -0,0 +1,342 @@
+/**********************************************************
+ * File: HuffmanBenchmark.cpp
+ *
+ * A benchmark driver for the compressor, built as its own
+ * executable so that it runs with nobody at the keyboard.
+ * The files in test/encodeDecode and a few large generated
+ * inputs are put through each phase of compression in turn:
+ *
+ *   frequency          counting the bytes
+ *   tree               turning the counts into code lengths
+ *   header             writing and reading back the header
+ *   encode             encoding the data into memory
+ *   decode             decoding it from a single stream
+ *   decodeInterleaved  decoding it from interleaved streams
+ *   checksum           the CRC32C every block file keeps of every
+ *                      block
+ *
+ * Each phase is run until it has taken a while, and the
+ * fastest run is reported as JSON on the console, in MB/s
+ * and nanoseconds per input byte, along with the compression
+ * ratio and the peak resident set size so far.  Give a file
+ * name on the command line to write the JSON there instead.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include "error.h"
+#include "bstream.h"
+#include "HuffmanEncoding.h"
+#include "HuffmanTables.h"
+#include "Histogram.h"
+#include "KeyStream.h"
+#include "Checksum.h"
+using namespace std;
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/* Every phase runs at least this many times, and keeps running
+ * until it has taken at least this long in all.
+ */
+static const int MIN_PHASE_RUNS = 3;
+static const double MIN_PHASE_SECONDS = 0.25;
+
+/* The size of each generated input. */
+static const size_t GENERATED_BYTES = 16 << 20;
+
+/* Type: BenchmarkInput
+ * One input to benchmark and the name to report it under.
+ */
+struct BenchmarkInput {
+	string name;
+	string data;
+};
+
+/* Type: PhaseResult
+ * The fastest run of one phase on one input.
+ */
+struct PhaseResult {
+	string name;
+	double seconds;
+};
+
+/*
+* The most memory the process has held at once, in bytes, or 0 if
+* the system won't say.
+*/
+static uint64_t peakResidentBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return uint64_t(counters.PeakWorkingSetSize);
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return uint64_t(usage.ru_maxrss);
+#else
+	return uint64_t(usage.ru_maxrss) * 1024; // Linux counts in kilobytes
+#endif
+#endif
+}
+
+/*
+* Runs a phase until it has run MIN_PHASE_RUNS times and for
+* MIN_PHASE_SECONDS in all, and returns its fastest run in seconds.
+*/
+static double timePhase(const function<void()>& phase) {
+	double fastest = 0, total = 0;
+	for (int runs = 0; runs < MIN_PHASE_RUNS || total < MIN_PHASE_SECONDS; runs++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		phase();
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if (runs == 0 || seconds < fastest) fastest = seconds;
+		total += seconds;
+	}
+	return fastest;
+}
+
+/*
+* The same pseudo-random sequence the test harness uses, so that
+* the generated inputs are the same on every run.
+*/
+static unsigned char nextRandomByte(uint64_t& state) {
+	state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (unsigned char)(state >> 56);
+}
+
+/*
+* Builds the list of inputs: every test file that can be read,
+* then large generated inputs of text, of random bytes, and of
+* bytes so skewed that a few characters are nearly all of them.
+*/
+static vector<BenchmarkInput> benchmarkInputs() {
+	static const char* const files[] = {
+		"singleChar", "nonRepeated", "alphaOnce", "allRepeated", "fibonacci",
+		"poem", "allCharsOnce", "tomSawyer", "dikdik.jpg", "random"
+	};
+	vector<BenchmarkInput> inputs;
+	string text;
+	for (const char* file : files) {
+		ifstream source(("test/encodeDecode/" + string(file)).c_str(), ios::binary);
+		if (!source.is_open()) {
+			cerr << "Skipping test/encodeDecode/" << file << ", which cannot be read." << endl;
+			continue;
+		}
+		ostringstream contents;
+		contents << source.rdbuf();
+		BenchmarkInput input = { file, contents.str() };
+		inputs.push_back(input);
+		if (input.name == "tomSawyer") text = input.data;
+	}
+
+	if (!text.empty()) {
+		BenchmarkInput large = { "generatedText", "" };
+		while (large.data.size() < GENERATED_BYTES) large.data += text;
+		large.data.resize(GENERATED_BYTES);
+		inputs.push_back(large);
+	}
+
+	uint64_t state = 0x48554646;
+	BenchmarkInput noise = { "generatedRandom", string(GENERATED_BYTES, '\0') };
+	for (size_t i = 0; i < GENERATED_BYTES; i++) {
+		noise.data[i] = char(nextRandomByte(state));
+	}
+	inputs.push_back(noise);
+
+	// each byte is the number of leading one bits of a random byte, mostly 0 or 1
+	BenchmarkInput skewed = { "generatedSkewed", string(GENERATED_BYTES, '\0') };
+	for (size_t i = 0; i < GENERATED_BYTES; i++) {
+		unsigned char byte = nextRandomByte(state);
+		int ones = 0;
+		while (ones < 8 && (byte & (0x80 >> ones))) ones++;
+		skewed.data[i] = char('a' + ones);
+	}
+	inputs.push_back(skewed);
+	return inputs;
+}
+
+/*
+* Puts one input through every phase, checking that it decodes
+* back, and fills in the timings and the size of the file compress
+* would write for it.
+*/
+static void benchmarkInput(const BenchmarkInput& input, const PasswordKey& password, vector<PhaseResult>& phases,
+                           uint64_t& compressedBytes) {
+	const unsigned char* data = (const unsigned char*)input.data.data();
+	size_t length = input.data.size();
+	phases.clear();
+
+	uint64_t counts[NUM_SYMBOLS];
+	PhaseResult frequency = { "frequency", timePhase([&]() {
+		for (int ch = 0; ch < NUM_SYMBOLS; ch++) counts[ch] = 0;
+		countBytes(data, length, counts);
+	}) };
+	phases.push_back(frequency);
+
+	int lengths[NUM_SYMBOLS];
+	PhaseResult tree = { "tree", timePhase([&]() {
+		getCodeLengthsForCounts(counts, lengths);
+	}) };
+	phases.push_back(tree);
+
+	int headerBits = 0;
+	PhaseResult header = { "header", timePhase([&]() {
+		ostringbstream written;
+		headerBits = writeCanonicalFileHeader(written, lengths, password);
+		istringbstream reading(written.str());
+		int readLengths[NUM_SYMBOLS];
+		readCanonicalFileHeader(reading, readLengths, password);
+	}) };
+	phases.push_back(header);
+
+	EncodeTable encoder;
+	buildCanonicalEncodeTable(lengths, encoder);
+	uint64_t codeBits = encodedBits(counts, encoder);
+	vector<unsigned char> encoded(size_t((codeBits + 7) / 8));
+	PhaseResult encode = { "encode", timePhase([&]() {
+		encodeBufferToMemory(data, length, encoder, encoded.data());
+	}) };
+	phases.push_back(encode);
+	// compress stores what its code would not shrink, behind an 8 byte length
+	bool worthEncoding = isWorthEncoding(length + 8, uint64_t(headerBits) + codeBits);
+	compressedBytes = FORMAT_PREFIX_BYTES + (worthEncoding ? (uint64_t(headerBits) + codeBits + 7) / 8 : 8 + length);
+
+	DecodeTable decoder;
+	buildCanonicalDecodeTable(lengths, decoder);
+	string encodedStream((const char*)encoded.data(), encoded.size());
+	vector<unsigned char> decoded(length);
+	PhaseResult decode = { "decode", timePhase([&]() {
+		istringbstream source(encodedStream);
+		decodeBufferWithTable(source, decoder, decoded.data(), length);
+	}) };
+	phases.push_back(decode);
+	if (length > 0 && memcmp(decoded.data(), data, length) != 0) error("Decoding " + input.name + " did not get it back.");
+
+	ostringbstream interleavedStream;
+	encodeBufferInterleaved(data, length, encoder, interleavedStream);
+	string interleaved = interleavedStream.str();
+	PhaseResult decodeInterleaved = { "decodeInterleaved", timePhase([&]() {
+		decodeBufferInterleaved((const unsigned char*)interleaved.data(), interleaved.size(), 0, decoder,
+		                        decoded.data(), length);
+	}) };
+	phases.push_back(decodeInterleaved);
+	if (length > 0 && memcmp(decoded.data(), data, length) != 0) error("Decoding " + input.name + " did not get it back.");
+
+	volatile uint32_t crc = 0; // kept, so the loop isn't optimized away
+	PhaseResult checksum = { "checksum", timePhase([&]() {
+		crc = crc32c(data, length);
+	}) };
+	phases.push_back(checksum);
+}
+
+/*
+* A number as JSON has it, which has no way to write infinities or
+* NaNs, so those come out as 0.
+*/
+static string jsonNumber(double value) {
+	if (!std::isfinite(value)) return "0";
+	ostringstream result;
+	result << setprecision(6) << value;
+	return result.str();
+}
+
+/*
+* A string as JSON has it, quoted, with quotes, backslashes and
+* control characters escaped.
+*/
+static string jsonString(const string& text) {
+	ostringstream result;
+	result << '"';
+	for (char ch : text) {
+		if (ch == '"' || ch == '\\') {
+			result << '\\' << ch;
+		} else if ((unsigned char)ch < 0x20) {
+			result << "\\u" << hex << setw(4) << setfill('0') << int((unsigned char)ch) << dec;
+		} else {
+			result << ch;
+		}
+	}
+	result << '"';
+	return result.str();
+}
+
+/*
+* Writes the results for one input as a JSON object.
+*/
+static void writeInputJson(ostream& out, const BenchmarkInput& input, const vector<PhaseResult>& phases,
+                           uint64_t compressedBytes) {
+	double bytes = double(input.data.size());
+	out << "    {" << endl;
+	out << "      \"name\": " << jsonString(input.name) << "," << endl;
+	out << "      \"bytes\": " << input.data.size() << "," << endl;
+	out << "      \"compressedBytes\": " << compressedBytes << "," << endl;
+	out << "      \"ratio\": " << jsonNumber(bytes > 0 ? double(compressedBytes) / bytes : 0) << "," << endl;
+	out << "      \"phases\": {" << endl;
+	for (size_t i = 0; i < phases.size(); i++) {
+		double seconds = phases[i].seconds;
+		out << "        " << jsonString(phases[i].name) << ": { "
+		    << "\"seconds\": " << jsonNumber(seconds) << ", "
+		    << "\"mbPerSecond\": " << jsonNumber(seconds > 0 ? bytes / seconds / 1e6 : 0) << ", "
+		    << "\"nsPerSymbol\": " << jsonNumber(bytes > 0 ? seconds * 1e9 / bytes : 0) << " }"
+		    << (i + 1 < phases.size() ? "," : "") << endl;
+	}
+	out << "      }," << endl;
+	out << "      \"peakRssBytes\": " << peakResidentBytes() << endl;
+	out << "    }";
+}
+
+/* Main program: argc and argv come from the library's main. */
+int main() {
+	string outputName = argc > 1 ? argv[1] : "";
+	ofstream outputFile;
+	if (!outputName.empty()) {
+		outputFile.open(outputName.c_str());
+		if (!outputFile.is_open()) {
+			cerr << "Cannot open " << outputName << " for writing." << endl;
+			return 1;
+		}
+	}
+	ostream& out = outputName.empty() ? cout : outputFile;
+
+	try {
+		vector<BenchmarkInput> inputs = benchmarkInputs();
+		// the key of one file, so the headers are encrypted as a new file's are
+		unsigned char salt[SALT_BYTES];
+		uint64_t nonce;
+		PasswordKey password = PasswordKey("benchmark password").forNewFile(salt, nonce);
+		out << "{" << endl;
+		out << "  \"benchmark\": \"huffman\"," << endl;
+		out << "  \"inputs\": [" << endl;
+		for (size_t i = 0; i < inputs.size(); i++) {
+			cerr << "Benchmarking " << inputs[i].name << "..." << endl;
+			vector<PhaseResult> phases;
+			uint64_t compressedBytes;
+			benchmarkInput(inputs[i], password, phases, compressedBytes);
+			writeInputJson(out, inputs[i], phases, compressedBytes);
+			out << (i + 1 < inputs.size() ? "," : "") << endl;
+		}
+		out << "  ]," << endl;
+		out << "  \"peakRssBytes\": " << peakResidentBytes() << endl;
+		out << "}" << endl;
+	} catch (ErrorException& e) {
+		cerr << "Benchmark failed: " << e.getMessage() << endl;
+		return 1;
+	}
+	return 0;
+}
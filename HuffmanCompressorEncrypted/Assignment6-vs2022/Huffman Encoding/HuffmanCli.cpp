@@ -0,0 +1,723 @@
+/**********************************************************
+ * File: HuffmanCli.cpp
+ *
+ * A command-line driver for the compressor, built as its own
+ * executable so that scripts and nightly jobs can use it with
+ * nobody at the keyboard.  It runs as
+ *
+ *   huff c|d|t|v [-j threads] [-k keyfile] [-b] [-c] [-f] files...
+ *
+ * where the mode is
+ *
+ *   c   compress each file into file.huf
+ *   d   decompress each file.huf back into file
+ *   t   compress and decompress each file in memory, checking
+ *       that it comes back unchanged, and write nothing
+ *   v   check each block compressed file against its checksums
+ *       without decoding it, which needs no password
+ *
+ * and the options are
+ *
+ *   -j  how many files to work on at once; 0, the default, means
+ *       one per core
+ *   -k  the file holding the password, less one trailing line
+ *       break; without it, the file named by HUFFMAN_KEY_FILE or
+ *       the value of HUFFMAN_PASSWORD is used
+ *   -b  compress into checksummed blocks, as compressStream does,
+ *       rather than as one stream
+ *   -c  write to standard output, in the order the files were
+ *       given, instead of to files
+ *   -f  overwrite output files that already exist
+ *
+ * A file named - is standard input, and its output always goes
+ * to standard output.  The files are shared out among the workers,
+ * and as each one finishes, in turn, its size before and after and
+ * its speed in MB/s of uncompressed data are reported on standard
+ * error, followed by totals for the files that succeeded; a file
+ * verified is reported by its compressed size.  Input
+ * files are never removed.  Output files are written as
+ * name.part and renamed once they are complete, so a file that
+ * fails leaves no output behind.  It exits with 0 if every file
+ * succeeded, 1 if any failed and 2 if it was used wrongly.
+ *
+ * Standard input is read once, as it comes, so it is always
+ * compressed in blocks rather than as one stream, which would need
+ * to read it twice; only verifying holds it in memory, since the
+ * checksums are found from the index at its end.  Output to standard
+ * output is written as it is made, each file in turn as it is
+ * reached, while the workers get on with the files written to files.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "error.h"
+#include "strlib.h"
+#include "bstream.h"
+#include "HuffmanEncoding.h"
+#include "BlockCompression.h"
+#include "KeyStream.h"
+using namespace std;
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+/* The extension compressed files are given. */
+static const char* const COMPRESSED_EXTENSION = ".huf";
+
+/* The extension of an output file while it is being written. */
+static const char* const PARTIAL_EXTENSION = ".part";
+
+/* Type: CliMode
+ * What to do with every file.
+ */
+enum CliMode {
+	MODE_COMPRESS,
+	MODE_DECOMPRESS,
+	MODE_TEST,
+	MODE_VERIFY
+};
+
+/* Type: CliOptions
+ * Everything the command line asked for.
+ */
+struct CliOptions {
+	CliMode mode;
+	int threads;
+	string keyFile;
+	bool blocks;
+	bool toStdout;
+	bool force;
+	vector<string> files;
+};
+
+/* Type: FileResult
+ * How one file went.  The uncompressed and compressed sizes are
+ * the same way round in every mode.  Blocks are counted only when
+ * verifying.
+ */
+struct FileResult {
+	bool done;
+	bool succeeded;
+	string message;
+	uint64_t uncompressedBytes;
+	uint64_t compressedBytes;
+	uint64_t blocks;
+	double seconds;
+};
+
+/*
+ * Class: CountingBuffer
+ * ---------------
+ * A stream buffer that passes everything written to it on to
+ * another, in large writes, counting the bytes as they go.  The
+ * last byte is held back until more follow, and the writer may seek
+ * anywhere among the bytes not yet passed on, so that the bit writer
+ * can back up over a partial byte even though the other buffer,
+ * such as standard output's, cannot seek.
+ */
+class CountingBuffer: public streambuf {
+public:
+	CountingBuffer(streambuf* target) : target(target), written(0), buffer(1 << 16) {
+		setp(buffer.data(), buffer.data() + buffer.size());
+		end = pbase();
+	}
+
+	~CountingBuffer() {
+		sync();
+	}
+
+	/* The bytes written so far, counting those not yet passed on. */
+	uint64_t bytes() const {
+		return written + uint64_t(std::max(end, pptr()) - pbase());
+	}
+
+protected:
+	int overflow(int ch) {
+		// the buffer is full, so pass on all but its last byte
+		streamsize pending = pptr() - pbase() - 1;
+		if (target->sputn(pbase(), pending) != pending) return EOF;
+		written += uint64_t(pending);
+		buffer[0] = *(pptr() - 1);
+		setp(buffer.data(), buffer.data() + buffer.size());
+		pbump(1);
+		end = pptr();
+		if (ch != EOF) {
+			*pptr() = char(ch);
+			pbump(1);
+		}
+		return ch == EOF ? 0 : ch;
+	}
+
+	int sync() {
+		end = std::max(end, pptr());
+		streamsize pending = end - pbase();
+		if (pending > 0 && target->sputn(pbase(), pending) != pending) return -1;
+		written += uint64_t(pending);
+		setp(buffer.data(), buffer.data() + buffer.size());
+		end = pbase();
+		return target->pubsync();
+	}
+
+	pos_type seekoff(off_type offset, ios_base::seekdir dir, ios_base::openmode which) {
+		if (!(which & ios_base::out)) return pos_type(off_type(-1));
+		end = std::max(end, pptr());
+		off_type base = dir == ios_base::beg ? -off_type(written) : dir == ios_base::cur ? pptr() - pbase() : end - pbase();
+		off_type target = base + offset;
+		if (target < 0 || target > end - pbase()) return pos_type(off_type(-1));
+		setp(pbase(), epptr());
+		pbump(int(target));
+		return pos_type(off_type(written) + target);
+	}
+
+	pos_type seekpos(pos_type position, ios_base::openmode which) {
+		return seekoff(off_type(position), ios_base::beg, which);
+	}
+
+private:
+	streambuf* target;
+	uint64_t written;
+	vector<char> buffer;
+	char* end; // the furthest the writer has got, which it may have backed up from
+
+	CountingBuffer(const CountingBuffer&);
+	CountingBuffer& operator=(const CountingBuffer&);
+};
+
+/*
+ * Class: CountingInputBuffer
+ * ---------------
+ * A stream buffer that reads another in large reads, counting the
+ * bytes as they go.  The last few kilobytes handed out are kept, and
+ * the reader may seek back among them, so that the bit reader can
+ * give back what it read ahead even though the other buffer, such as
+ * standard input's, cannot seek.  Nothing further back can be read
+ * again, so a reader that needs to rewind fails as it would on a pipe.
+ */
+class CountingInputBuffer: public streambuf {
+public:
+	CountingInputBuffer(streambuf* source) : source(source), before(0), buffer(KEPT_BYTES + (1 << 16)) {
+		setg(buffer.data(), buffer.data(), buffer.data());
+	}
+
+	/* The bytes read from the other buffer so far. */
+	uint64_t bytes() const {
+		return before + uint64_t(egptr() - eback());
+	}
+
+protected:
+	int underflow() {
+		if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+		streamsize kept = std::min<streamsize>(KEPT_BYTES, egptr() - eback());
+		memmove(buffer.data(), egptr() - kept, size_t(kept));
+		before += uint64_t(egptr() - eback() - kept);
+		streamsize count = source->sgetn(buffer.data() + kept, streamsize(buffer.size()) - kept);
+		setg(buffer.data(), buffer.data() + kept, buffer.data() + kept + std::max<streamsize>(count, 0));
+		return count > 0 ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+	}
+
+	pos_type seekoff(off_type offset, ios_base::seekdir dir, ios_base::openmode which) {
+		if (dir == ios_base::end) return pos_type(off_type(-1));
+		off_type base = dir == ios_base::beg ? -off_type(before) : gptr() - eback();
+		off_type target = base + offset;
+		if (target < 0 || target > egptr() - eback()) return pos_type(off_type(-1));
+		setg(eback(), eback() + target, egptr());
+		return pos_type(off_type(before) + target);
+	}
+
+	pos_type seekpos(pos_type position, ios_base::openmode which) {
+		return seekoff(off_type(position), ios_base::beg, which);
+	}
+
+private:
+	/* More than the bit reader ever reads ahead. */
+	static const streamsize KEPT_BYTES = 1 << 13;
+
+	streambuf* source;
+	uint64_t before; // the bytes read before the start of the buffer
+	vector<char> buffer;
+
+	CountingInputBuffer(const CountingInputBuffer&);
+	CountingInputBuffer& operator=(const CountingInputBuffer&);
+};
+
+/*
+ * Class: StandardInput
+ * ---------------
+ * Standard input as an ibstream, read once from start to end.
+ */
+class StandardInput: public ibstream {
+public:
+	StandardInput() : counter(cin.rdbuf()) {
+		init(&counter);
+	}
+
+	/* The bytes read from standard input so far. */
+	uint64_t bytes() const {
+		return counter.bytes();
+	}
+
+private:
+	CountingInputBuffer counter;
+};
+
+/*
+ * Class: StandardOutput
+ * ---------------
+ * Standard output as an obstream, written as it goes.
+ */
+class StandardOutput: public obstream {
+public:
+	StandardOutput(ostream& stream) : counter(stream.rdbuf()) {
+		init(&counter);
+	}
+
+	/* The bytes written so far. */
+	uint64_t bytes() const {
+		return counter.bytes();
+	}
+
+	/* Passes everything on, raising an error if it can't be written. */
+	void finish() {
+		flush();
+		if (!*this) error("Cannot write to standard output.");
+	}
+
+private:
+	CountingBuffer counter;
+};
+
+/*
+* Prints how to use the program and returns the exit status for
+* having been used wrongly.
+*/
+static int usage() {
+	cerr << "Usage: huff c|d|t|v [-j threads] [-k keyfile] [-b] [-c] [-f] files..." << endl;
+	cerr << "  c   compress each file into file" << COMPRESSED_EXTENSION << endl;
+	cerr << "  d   decompress each file" << COMPRESSED_EXTENSION << " back into file" << endl;
+	cerr << "  t   check that each file compresses and decompresses unchanged" << endl;
+	cerr << "  v   check each block compressed file against its checksums" << endl;
+	cerr << "  -j  files to work on at once (default: one per core)" << endl;
+	cerr << "  -k  file holding the password (default: $HUFFMAN_KEY_FILE or $HUFFMAN_PASSWORD)" << endl;
+	cerr << "  -b  compress into checksummed blocks" << endl;
+	cerr << "  -c  write to standard output" << endl;
+	cerr << "  -f  overwrite existing output files" << endl;
+	cerr << "A file named - is standard input, which is always compressed in blocks." << endl;
+	return 2;
+}
+
+/*
+* Reads the command line into the options, returning whether it
+* made sense.
+*/
+static bool parseOptions(int argc, char** argv, CliOptions& options) {
+	if (argc < 2) return false;
+	string mode = argv[1];
+	if (mode == "c") {
+		options.mode = MODE_COMPRESS;
+	} else if (mode == "d") {
+		options.mode = MODE_DECOMPRESS;
+	} else if (mode == "t") {
+		options.mode = MODE_TEST;
+	} else if (mode == "v") {
+		options.mode = MODE_VERIFY;
+	} else {
+		return false;
+	}
+	options.threads = 0;
+	options.blocks = false;
+	options.toStdout = false;
+	options.force = false;
+
+	bool moreOptions = true;
+	for (int i = 2; i < argc; i++) {
+		string arg = argv[i];
+		if (moreOptions && arg == "--") {
+			moreOptions = false;
+		} else if (moreOptions && (arg == "-j" || arg == "-k")) {
+			if (i + 1 == argc) return false;
+			string value = argv[++i];
+			if (arg == "-k") {
+				options.keyFile = value;
+				continue;
+			}
+			char* end;
+			long threads = strtol(value.c_str(), &end, 10);
+			if (value.empty() || *end != '\0' || threads < 0) return false;
+			options.threads = int(threads);
+		} else if (moreOptions && arg == "-b") {
+			options.blocks = true;
+		} else if (moreOptions && arg == "-c") {
+			options.toStdout = true;
+		} else if (moreOptions && arg == "-f") {
+			options.force = true;
+		} else if (moreOptions && arg.size() > 1 && arg[0] == '-') {
+			return false;
+		} else {
+			options.files.push_back(arg);
+		}
+	}
+	return !options.files.empty();
+}
+
+/*
+* Reads the password from the key file, or from the environment if
+* there is none, as the interactive program does.
+*/
+static PasswordKey readPasswordKey(const CliOptions& options) {
+	string keyFile = options.keyFile;
+	if (keyFile.empty()) {
+		const char* named = getenv("HUFFMAN_KEY_FILE");
+		if (named != NULL) {
+			keyFile = named;
+		} else {
+			const char* password = getenv("HUFFMAN_PASSWORD");
+			if (password == NULL) error("No password: give a key file with -k, or set HUFFMAN_KEY_FILE or HUFFMAN_PASSWORD.");
+			return PasswordKey(string(password));
+		}
+	}
+	ifstream file(keyFile.c_str(), ios::binary);
+	if (!file.is_open()) error("Cannot open key file " + keyFile + ".");
+	ostringstream contents;
+	contents << file.rdbuf();
+	string material = contents.str();
+	if (!material.empty() && material[material.size() - 1] == '\n') material.erase(material.size() - 1);
+	if (!material.empty() && material[material.size() - 1] == '\r') material.erase(material.size() - 1);
+	return PasswordKey(material);
+}
+
+/*
+* Whether a file's output goes to standard output.
+*/
+static bool writesToStandardOutput(const CliOptions& options, const string& name) {
+	return (options.toStdout || name == "-") && (options.mode == MODE_COMPRESS || options.mode == MODE_DECOMPRESS);
+}
+
+/*
+* The name a file's output goes to.
+*/
+static string outputName(const CliOptions& options, const string& name) {
+	if (options.mode == MODE_COMPRESS) return name + COMPRESSED_EXTENSION;
+	return name.substr(0, name.size() - string(COMPRESSED_EXTENSION).size());
+}
+
+/*
+* Whether a file of the given name exists.
+*/
+static bool fileExists(const string& name) {
+	ifstream existing(name.c_str());
+	return existing.is_open();
+}
+
+/*
+ * Class: OutputFile
+ * ---------------
+ * The output file for one input.  It is written under a temporary
+ * name in the same directory and only renamed to its own once keep
+ * is called, so a file that fails leaves nothing behind, neither a
+ * truncated archive nor an empty file that would stop the next try
+ * without -f.  What was there before is untouched until then.
+ */
+class OutputFile {
+public:
+	/*
+	* Opens the temporary file, raising an error if the output exists
+	* and may not be overwritten.
+	*/
+	OutputFile(const CliOptions& options, const string& name)
+		: target(outputName(options, name)), partial(target + PARTIAL_EXTENSION), force(options.force), kept(false) {
+		if (!force && fileExists(target)) error(target + " already exists; use -f to overwrite it.");
+		outfile.open(partial.c_str());
+		if (!outfile.is_open()) error("Cannot create " + partial + ".");
+	}
+
+	/* Removes the temporary file unless it was kept. */
+	~OutputFile() {
+		if (kept) return;
+		outfile.close();
+		remove(partial.c_str());
+	}
+
+	ofbstream& stream() {
+		return outfile;
+	}
+
+	/*
+	* Closes the file and gives it its own name, raising an error if
+	* that fails.
+	*/
+	void keep() {
+		outfile.close();
+		if (!force && fileExists(target)) error(target + " already exists; use -f to overwrite it.");
+#ifdef _WIN32
+		// rename won't replace a file on Windows
+		if (force) remove(target.c_str());
+#endif
+		if (rename(partial.c_str(), target.c_str()) != 0) error("Cannot rename " + partial + " to " + target + ".");
+		kept = true;
+	}
+
+private:
+	string target, partial;
+	bool force, kept;
+	ofbstream outfile;
+
+	OutputFile(const OutputFile&);
+	OutputFile& operator=(const OutputFile&);
+};
+
+/*
+* Compresses a whole file, as one stream or in blocks as the options
+* say.  Standard input is always compressed in blocks, since a stream
+* needs two passes over its input.
+*/
+static void compressFile(const CliOptions& options, const string& name, ibstream& infile, obstream& outfile,
+                         const PasswordKey& password) {
+	if (options.blocks || name == "-") {
+		compressStream(infile, outfile, password);
+	} else {
+		compress(infile, outfile, password);
+	}
+}
+
+/*
+* Compresses, decompresses or verifies one file, to the given stream if there
+* is one and otherwise to the output file.
+*/
+static void processFile(const CliOptions& options, const PasswordKey& password, const string& name,
+                        FileResult& result, ostream* direct) {
+	ifbstream file;
+	StandardInput standardInput;
+	istringbstream memory;
+	ibstream* infile = &file;
+	if (name == "-" && options.mode == MODE_VERIFY) {
+		// the checksums are found from the index at the end, so this one input is held in memory
+		ostringstream contents;
+		contents << cin.rdbuf();
+		memory.str(contents.str());
+		infile = &memory;
+	} else if (name == "-") {
+		infile = &standardInput;
+	} else {
+		file.open(name.c_str());
+		if (!file.is_open()) error("Cannot open " + name + ".");
+	}
+	uint64_t inputBytes = infile == &standardInput ? 0 : uint64_t(infile->size());
+
+	if (options.mode == MODE_COMPRESS) {
+		if (direct != nullptr) {
+			StandardOutput output(*direct);
+			compressFile(options, name, *infile, output, password);
+			output.finish();
+			result.compressedBytes = output.bytes();
+		} else {
+			OutputFile output(options, name);
+			compressFile(options, name, *infile, output.stream(), password);
+			result.compressedBytes = uint64_t(output.stream().size());
+			output.keep();
+		}
+		result.uncompressedBytes = infile == &standardInput ? standardInput.bytes() : inputBytes;
+	} else if (options.mode == MODE_DECOMPRESS) {
+		if (direct != nullptr) {
+			StandardOutput output(*direct);
+			decompress(*infile, output, password);
+			output.finish();
+			result.uncompressedBytes = output.bytes();
+		} else {
+			OutputFile output(options, name);
+			decompress(*infile, output.stream(), password);
+			result.uncompressedBytes = uint64_t(output.stream().size());
+			output.keep();
+		}
+		result.compressedBytes = infile == &standardInput ? standardInput.bytes() : inputBytes;
+	} else if (options.mode == MODE_VERIFY) {
+		result.compressedBytes = inputBytes;
+		result.blocks = verifyStream(*infile);
+	} else {
+		ostringstream original;
+		original << infile->rdbuf();
+		string data = original.str();
+		istringbstream source(data);
+		ostringbstream compressed;
+		compressFile(options, name, source, compressed, password);
+		istringbstream packed(compressed.str());
+		ostringstream decompressed;
+		decompress(packed, decompressed, password);
+		if (decompressed.str() != data) error("Decompressing it did not give it back.");
+		result.uncompressedBytes = data.size();
+		result.compressedBytes = compressed.str().size();
+	}
+}
+
+/*
+* Runs one file, timing it and catching its errors into the result.
+* Errors from the library as well as the codec's own are caught, so
+* that running out of memory or a failing write still removes the
+* partial output.
+*/
+static void runFile(const CliOptions& options, const PasswordKey& password, const string& name,
+                    FileResult& result, ostream* direct) {
+	result.succeeded = false;
+	result.uncompressedBytes = result.compressedBytes = result.blocks = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	try {
+		processFile(options, password, name, result, direct);
+		result.succeeded = true;
+	} catch (ErrorException& e) {
+		result.message = e.getMessage();
+	} catch (exception& e) {
+		result.message = e.what();
+	}
+	result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/*
+* Megabytes per second, or 0 if no time was measured.
+*/
+static double megabytesPerSecond(uint64_t bytes, double seconds) {
+	return seconds > 0 ? double(bytes) / seconds / 1e6 : 0;
+}
+
+/*
+* Reports how one file went.
+*/
+static void reportFile(const CliOptions& options, const string& name, const FileResult& result) {
+	cerr << (name == "-" ? "(standard input)" : name) << ": ";
+	if (!result.succeeded) {
+		cerr << "FAILED: " << result.message << endl;
+		return;
+	}
+	if (options.mode == MODE_VERIFY) {
+		cerr << result.compressedBytes << " bytes in " << result.blocks << " block" << (result.blocks == 1 ? "" : "s")
+		     << ", " << fixed << setprecision(2) << megabytesPerSecond(result.compressedBytes, result.seconds)
+		     << " MB/s, checksums OK" << endl;
+		return;
+	}
+	double ratio = result.uncompressedBytes > 0 ? double(result.compressedBytes) / double(result.uncompressedBytes) : 0;
+	cerr << result.uncompressedBytes << (options.mode == MODE_DECOMPRESS ? " <- " : " -> ")
+	     << result.compressedBytes << " bytes (" << fixed << setprecision(1) << ratio * 100 << "%), "
+	     << setprecision(2) << megabytesPerSecond(result.uncompressedBytes, result.seconds) << " MB/s"
+	     << (options.mode == MODE_TEST ? ", round trip OK" : "") << endl;
+}
+
+/*
+* Works through every file with the given password, reporting each
+* in turn and then the totals, and returns the exit status.
+*/
+static int runBatch(const CliOptions& options, const PasswordKey& password) {
+	size_t count = options.files.size();
+	size_t toFiles = 0;
+	for (const string& name : options.files) {
+		if (!writesToStandardOutput(options, name)) toFiles++;
+	}
+	int threads = options.threads > 0 ? options.threads : int(thread::hardware_concurrency());
+	if (size_t(threads) > toFiles) threads = int(toFiles);
+	if (threads < 1) threads = 1;
+	vector<FileResult> results(count);
+	for (FileResult& result : results) result.done = false;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// each worker takes the next file nobody has started; this thread reports them in order, and
+	// itself runs those written to standard output as it comes to them, so they go out in order
+	mutex lock;
+	condition_variable finished;
+	size_t next = 0;
+	vector<thread> workers;
+	for (int i = 0; i < threads && toFiles > 0; i++) {
+		workers.push_back(thread([&]() {
+			while (true) {
+				size_t index;
+				{
+					lock_guard<mutex> guard(lock);
+					while (next < count && writesToStandardOutput(options, options.files[next])) next++;
+					if (next == count) return;
+					index = next++;
+				}
+				FileResult result;
+				runFile(options, password, options.files[index], result, nullptr);
+				lock_guard<mutex> guard(lock);
+				results[index] = result;
+				results[index].done = true;
+				finished.notify_all();
+			}
+		}));
+	}
+
+	uint64_t totalUncompressed = 0, totalCompressed = 0;
+	int failed = 0;
+	for (size_t i = 0; i < count; i++) {
+		FileResult result;
+		if (writesToStandardOutput(options, options.files[i])) {
+			runFile(options, password, options.files[i], result, &cout);
+		} else {
+			unique_lock<mutex> guard(lock);
+			while (!results[i].done) finished.wait(guard);
+			result = results[i];
+		}
+		reportFile(options, options.files[i], result);
+		if (!result.succeeded) {
+			failed++;
+			continue;
+		}
+		totalUncompressed += result.uncompressedBytes;
+		totalCompressed += result.compressedBytes;
+	}
+	for (thread& worker : workers) worker.join();
+	cout.flush();
+
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	uint64_t measured = options.mode == MODE_VERIFY ? totalCompressed : totalUncompressed;
+	cerr << count << " file" << (count == 1 ? "" : "s") << ", " << failed << " failed, ";
+	if (options.mode == MODE_VERIFY) {
+		cerr << totalCompressed;
+	} else {
+		cerr << totalUncompressed << (options.mode == MODE_DECOMPRESS ? " <- " : " -> ") << totalCompressed;
+	}
+	cerr << " bytes in " << fixed << setprecision(3) << seconds << " s with " << threads << " thread"
+	     << (threads == 1 ? "" : "s") << ", " << setprecision(2) << megabytesPerSecond(measured, seconds) << " MB/s"
+	     << endl;
+	return failed > 0 ? 1 : 0;
+}
+
+/* Main program: argc and argv come from the library's main. */
+int main() {
+	CliOptions options;
+	if (!parseOptions(argc, argv, options)) return usage();
+	for (const string& name : options.files) {
+		if (options.mode == MODE_DECOMPRESS && !options.toStdout && name != "-" &&
+		    (name == COMPRESSED_EXTENSION || !endsWith(name, COMPRESSED_EXTENSION))) {
+			cerr << name << " does not end in " << COMPRESSED_EXTENSION << "; use -c to decompress it to standard output."
+			     << endl;
+			return 2;
+		}
+	}
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	try {
+		// verifying reads only checksums that need no password
+		PasswordKey password = options.mode == MODE_VERIFY ? PasswordKey("") : readPasswordKey(options);
+		return runBatch(options, password);
+	} catch (ErrorException& e) {
+		cerr << e.getMessage() << endl;
+		return 2;
+	} catch (exception& e) {
+		cerr << e.what() << endl;
+		return 2;
+	}
+}
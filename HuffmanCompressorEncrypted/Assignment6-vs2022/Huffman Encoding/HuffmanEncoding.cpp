@@ -5,25 +5,44 @@
  */
 
 #include "HuffmanEncoding.h"
+#include "HuffmanTables.h"
+#include "CanonicalHuffman.h"
+#include "Histogram.h"
+#include "BlockCompression.h"
+#include "ContextModel.h"
+#include "KeyStream.h"
 #include "pqueue.h"
 #include "simpio.h"
 #include <random>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <vector>
 
  /*
  * we will use XOR encryption. We first convert string
  * password into number and use hash function so it
- * gives us same value with same password all the time.
- * we encrypt bit by bit with nextBit function
+ * gives us same value with same password all the time
+ * (PasswordKey does that part, once per password).
+ * we encrypt bit by bit with nextBits function.
+ * Newer files use a KeyStream instead; this one is
+ * kept for the files written before it.
  */
 class PasswordStream {
 public:
-	PasswordStream(const string& password) {
-		seed = hash<string>{}(password);
+	PasswordStream(const PasswordKey& password, uint64_t block = 0) {
+		seed = password.legacySeed();
+		seed ^= size_t(block * 0x9E3779B97F4A7C15ULL); // block 0 keeps the plain password seed
 		engine.seed(seed);
 	}
 
-	bool nextBit(bool originalBit) {
-		return originalBit ^ (engine() & 1); // XOR with pseudo-random bit
+	// XOR each of the count bits, bit 0 first, with a pseudo-random bit
+	uint64_t nextBits(uint64_t originalBits, int count) {
+		uint64_t mask = 0;
+		for (int i = 0; i < count; i++) {
+			mask |= uint64_t(engine() & 1) << i;
+		}
+		return originalBits ^ mask;
 	}
 
 private:
@@ -31,6 +50,19 @@ private:
 	default_random_engine engine;
 };
 
+/*
+* Header fields are written most significant bit first, while
+* writeBits sends bit 0 first, so fields are reversed before
+* being handed to it.
+*/
+static uint64_t reverseBits(uint64_t value, int count) {
+	uint64_t result = 0;
+	for (int i = 0; i < count; i++) {
+		result = (result << 1) | ((value >> i) & 1);
+	}
+	return result;
+}
+
 /* Function: getFrequencyTable
  * Usage: Map<ext_char, int> freq = getFrequencyTable(file);
  * --------------------------------------------------------
@@ -45,25 +77,27 @@ private:
  * the PSEUDO_EOF character.
  */
 Map<ext_char, int> getFrequencyTable(istream& file) {
-	Map<ext_char, int> freqMap;
-	ext_char ch = EOF; // initialize it
-	while (true) {
-		ch = file.get();
-		if (ch == EOF)break;
-		freqMap[ch]++;
-	}
-	freqMap[PSEUDO_EOF] = 1;
-	return freqMap;
+	uint64_t counts[NUM_SYMBOLS] = { 0 };
+	countStream(file, counts);
+	return histogramToMap(counts);
+}
+
+/*
+* Takes a new node from the arena, or from the heap when
+* there is no arena.
+*/
+static Node* newNode(NodeArena* arena) {
+	return arena ? arena->allocate() : new Node();
 }
 
 /*
 * Our helper function for buildEncodingTree. We fill
 * priority queue with Nodes.
 */
-void fillQueue(PriorityQueue<Node*>& queue, Map<ext_char, int>& frequencies) {
+void fillQueue(PriorityQueue<Node*>& queue, Map<ext_char, int>& frequencies, NodeArena* arena) {
 	for (ext_char ch : frequencies) {
 		int freq = frequencies[ch];
-		Node* node = new Node();
+		Node* node = newNode(arena);
 		node->character = ch;
 		node->zero = node->one = nullptr;
 		node->weight = freq;
@@ -71,6 +105,26 @@ void fillQueue(PriorityQueue<Node*>& queue, Map<ext_char, int>& frequencies) {
 	}
 }
 
+/*
+* Builds the tree for both versions of buildEncodingTree,
+* so the heap and arena trees always come out the same.
+*/
+static Node* buildTree(Map<ext_char, int>& frequencies, NodeArena* arena) {
+	PriorityQueue<Node*> queue;
+	fillQueue(queue, frequencies, arena);
+	while (queue.size() > 1) {
+		Node* node1 = queue.dequeue();
+		Node* node2 = queue.dequeue();
+		Node* parentNode = newNode(arena);
+		parentNode->character = NOT_A_CHAR;
+		parentNode->zero = node1;
+		parentNode->one = node2;
+		parentNode->weight = node1->weight + node2->weight;
+		queue.enqueue(parentNode, parentNode->weight);
+	}
+	return queue.dequeue();
+}
+
 /* Function: buildEncodingTree
  * Usage: Node* tree = buildEncodingTree(frequency);
  * --------------------------------------------------------
@@ -83,30 +137,83 @@ void fillQueue(PriorityQueue<Node*>& queue, Map<ext_char, int>& frequencies) {
  * be present.
  */
 Node* buildEncodingTree(Map<ext_char, int>& frequencies) {
-	PriorityQueue<Node*> queue;
-	fillQueue(queue, frequencies);
-	while (queue.size() > 1) {
-		Node* node1 = queue.dequeue();
-		Node* node2 = queue.dequeue();
-		Node* parentNode = new Node();
-		parentNode->character = NOT_A_CHAR;
-		parentNode->zero = node1;
-		parentNode->one = node2;
-		parentNode->weight = node1->weight + node2->weight;
-		queue.enqueue(parentNode, parentNode->weight);
-	}
-	return queue.dequeue();
+	return buildTree(frequencies, nullptr);
+}
+
+/* Function: buildEncodingTree
+ * Usage: Node* tree = buildEncodingTree(frequency, arena);
+ * --------------------------------------------------------
+ * Builds the same tree as above, but takes its nodes from the
+ * given arena instead of the heap.  The tree lives until the
+ * arena is released; don't pass it to freeTree.
+ */
+Node* buildEncodingTree(Map<ext_char, int>& frequencies, NodeArena& arena) {
+	return buildTree(frequencies, &arena);
 }
 
 /*
-* Our helper function for freeTree. We
-* tree our tree recrusively
+* Orders leaves for the two-queue build: by weight,
+* then by character.
 */
-void freeTreeRec(Node* root) {
-	if (!root)return;
-	freeTreeRec(root->zero);
-	freeTreeRec(root->one);
-	delete root;
+static bool lighterLeaf(const Node* one, const Node* two) {
+	if (one->weight != two->weight) return one->weight < two->weight;
+	return one->character < two->character;
+}
+
+/*
+* Takes the lighter front node of the two queues, the leaf
+* if they weigh the same.
+*/
+static Node* takeLighter(Node* leaves[], int& nextLeaf, int numLeaves,
+                         Node* trees[], int& nextTree, int numTrees) {
+	if (nextTree == numTrees || (nextLeaf < numLeaves && leaves[nextLeaf]->weight <= trees[nextTree]->weight)) {
+		return leaves[nextLeaf++];
+	}
+	return trees[nextTree++];
+}
+
+/* Function: buildEncodingTreeFromCounts
+ * Usage: Node* tree = buildEncodingTreeFromCounts(counts, arena);
+ * --------------------------------------------------------
+ * Builds an optimal encoding tree for the given byte counts,
+ * plus one PSEUDO_EOF, with the two-queue method: the leaves
+ * are sorted by weight once, then merged from two queues with
+ * no heap at all.  Ties are broken so that every build of the
+ * same counts gives the same tree: leaves of equal weight are
+ * taken in character order, and a leaf is taken before a
+ * merged tree of equal weight.  The first node taken becomes
+ * the zero child.  The tree is not always the one
+ * buildEncodingTree builds, but it costs the same number of
+ * bits.  Nodes come from the given arena.
+ */
+Node* buildEncodingTreeFromCounts(const uint64_t counts[NUM_SYMBOLS], NodeArena& arena) {
+	Node* leaves[NUM_SYMBOLS];
+	int numLeaves = 0;
+	for (ext_char ch = 0; ch < NUM_SYMBOLS; ch++) {
+		uint64_t count = ch == PSEUDO_EOF ? 1 : counts[ch];
+		if (count == 0) continue;
+		if (count > uint64_t(INT_MAX)) error("Character count is too large for the frequency table.");
+		Node* leaf = arena.allocate();
+		leaf->character = ch;
+		leaf->weight = int(count);
+		leaves[numLeaves++] = leaf;
+	}
+	sort(leaves, leaves + numLeaves, lighterLeaf);
+
+	// merged trees come out in order of weight, so a plain array is a queue
+	Node* trees[NUM_SYMBOLS];
+	int nextLeaf = 0, nextTree = 0, numTrees = 0;
+	while ((numLeaves - nextLeaf) + (numTrees - nextTree) > 1) {
+		Node* zero = takeLighter(leaves, nextLeaf, numLeaves, trees, nextTree, numTrees);
+		Node* one = takeLighter(leaves, nextLeaf, numLeaves, trees, nextTree, numTrees);
+		if (zero->weight > INT_MAX - one->weight) error("Character counts are too large for the encoding tree.");
+		Node* parent = arena.allocate();
+		parent->zero = zero;
+		parent->one = one;
+		parent->weight = zero->weight + one->weight;
+		trees[numTrees++] = parent;
+	}
+	return numTrees > 0 ? trees[numTrees - 1] : leaves[0];
 }
 
 /* Function: freeTree
@@ -116,19 +223,16 @@ void freeTreeRec(Node* root) {
  * tree.
  */
 void freeTree(Node* root) {
-	freeTreeRec(root);
-}
-
-void fillMap(Map<ext_char, string>& encodeMap, Node* encodingTree, string path) {
-	if (!encodingTree) {
-		return;
-	}
-	if (!encodingTree->zero && !encodingTree->one) {
-		encodeMap[encodingTree->character] = path;
-		return;
+	// an explicit stack rather than recursion, so no tree is too deep to free
+	vector<Node*> pending;
+	if (root) pending.push_back(root);
+	while (!pending.empty()) {
+		Node* node = pending.back();
+		pending.pop_back();
+		if (node->zero) pending.push_back(node->zero);
+		if (node->one) pending.push_back(node->one);
+		delete node;
 	}
-	fillMap(encodeMap, encodingTree->zero, path + "0");
-	fillMap(encodeMap, encodingTree->one, path + "1");
 }
 
 /* Function: encodeFile
@@ -148,23 +252,19 @@ void fillMap(Map<ext_char, string>& encodeMap, Node* encodingTree, string path)
  *     to it, and the file cursor is at the end of the file.
  *     This means that you should just start writing the bits
  *     without seeking the file anywhere.
+ *
+ * Given stats, the time spent building the code table and
+ * encoding is added to them along with what was encoded.
  */
-void encodeFile(istream& infile, Node* encodingTree, obstream& outfile) {
-	Map<ext_char, string> encodeMap;
-	fillMap(encodeMap, encodingTree, "");
-	ext_char ch = EOF; // initialize it
-	while (true) {
-		ch = infile.get();
-		if (ch == EOF)break;
-		string code = encodeMap[ch];
-		for (char c : code) {
-			outfile.writeBit(c == '1');
-		}
-	}
-	string endCode = encodeMap[PSEUDO_EOF];
-	for (char c : endCode) {
-		outfile.writeBit(c == '1');
+void encodeFile(istream& infile, Node* encodingTree, obstream& outfile, CompressionStats* stats) {
+	EncodeTable table;
+	{
+		PhaseTimer timer(stats, &CompressionStats::treeSeconds);
+		buildEncodeTable(encodingTree, table);
 	}
+	if (stats != nullptr) stats->treeDepth = std::max(stats->treeDepth, longestEncodeCode(table));
+	PhaseTimer timer(stats, &CompressionStats::codingSeconds);
+	encodeFileWithTable(infile, table, outfile, stats);
 }
 
 /* Function: decodeFile
@@ -178,19 +278,37 @@ void encodeFile(istream& infile, Node* encodingTree, obstream& outfile) {
  *     this encoding table.
  *
  *   - The output file is open and ready for writing.
+ *
+ * Raises an error if the input runs out before PSEUDO_EOF, so a
+ * truncated or corrupt file fails as soon as its end is reached.
+ * Given stats, the time spent building the decode table and
+ * decoding is added to them along with what was decoded.
  */
-void decodeFile(ibstream& infile, Node* encodingTree, ostream& file) {
-	Node* curr = encodingTree;
-	while (true) {
-		if (!curr->zero && !curr->one) {
-			if (curr->character == PSEUDO_EOF) break;
-			file.put(curr->character);
-			curr = encodingTree;
-			continue;
-		}
-		bool bit = infile.readBit();
-		curr = bit ? curr->one : curr->zero;
+void decodeFile(ibstream& infile, Node* encodingTree, ostream& file, CompressionStats* stats) {
+	DecodeTable table;
+	{
+		PhaseTimer timer(stats, &CompressionStats::treeSeconds);
+		buildDecodeTable(encodingTree, table);
 	}
+	if (stats != nullptr) stats->treeDepth = std::max(stats->treeDepth, longestDecodeCode(table));
+	PhaseTimer timer(stats, &CompressionStats::codingSeconds);
+	decodeFileWithTable(infile, table, file, stats);
+}
+
+/* Function: decodeFileTreeWalk
+ * Usage: decodeFileTreeWalk(encodedFile, encodingTree, resultFile);
+ * --------------------------------------------------------
+ * Decodes a file exactly like decodeFile, but by walking the
+ * tree one bit at a time instead of using a decode table.  The
+ * tree is packed into a FlatTree first, so the walk stays within
+ * a kilobyte instead of chasing Node pointers about the heap.
+ * This is slower and is kept so that the table decoder can be
+ * checked against it.
+ */
+void decodeFileTreeWalk(ibstream& infile, Node* encodingTree, ostream& file) {
+	FlatTree tree;
+	buildFlatTree(encodingTree, tree);
+	decodeFileFlatTree(infile, tree, file);
 }
 
 /*
@@ -198,7 +316,7 @@ void decodeFile(ibstream& infile, Node* encodingTree, ostream& file) {
 * of our file, we use XOR encryption, so now map is encrypted
 * and can only be decrypted with password ( unless you hack it :) )
 */
-void writeEncryptedFileHeader(obstream& outfile, Map<ext_char, int>& frequencies, const string& password) {
+void writeEncryptedFileHeader(obstream& outfile, Map<ext_char, int>& frequencies, const PasswordKey& password) {
 	if (!frequencies.containsKey(PSEUDO_EOF)) {
 		error("No PSEUDO_EOF defined.");
 	}
@@ -207,65 +325,613 @@ void writeEncryptedFileHeader(obstream& outfile, Map<ext_char, int>& frequencies
 	int size = frequencies.size() - 1;
 
 	// we write size
-	for (int i = 31; i >= 0; i--) {
-		bool bit = (size >> i) & 1;
-		outfile.writeBit(stream.nextBit(bit));
-	}
+	outfile.writeBits(stream.nextBits(reverseBits(size, 32), 32), 32);
 
 	for (ext_char ch : frequencies) {
 		if (ch == PSEUDO_EOF) continue;
 
 		// we write character
-		for (int i = 7; i >= 0; i--) {
-			bool bit = (ch >> i) & 1;
-			outfile.writeBit(stream.nextBit(bit));
-		}
+		outfile.writeBits(stream.nextBits(reverseBits(ch, 8), 8), 8);
 
 		// then we write frequency
 		int freq = frequencies[ch];
-		for (int i = 31; i >= 0; i--) {
-			bool bit = (freq >> i) & 1;
-			outfile.writeBit(stream.nextBit(bit));
-		}
+		outfile.writeBits(stream.nextBits(reverseBits(freq, 32), 32), 32);
 	}
+	outfile.flushBits();
 }
 
 /*
 * This will be used to ready encrypted info, decyrpt it and
 * make map. You need correct password to get info correctly,
-* otherwise it won't work
+* otherwise it won't work.  These files have no password check,
+* but the writer goes through the map in order, so a header whose
+* count is out of range or whose characters are out of order can
+* only have come from the wrong password, and is turned away at
+* the first field that gives it away.
 */
-Map<ext_char, int> readEncryptedFileHeader(ibstream& infile, const string& password) {
+Map<ext_char, int> readEncryptedFileHeader(ibstream& infile, const PasswordKey& password) {
 	Map<ext_char, int> result;
 	PasswordStream stream(password);
 
-	int numValues = 0;
-	for (int i = 0; i < 32; i++) {
-		bool bit = infile.readBit();
-		bit = stream.nextBit(bit);
-		numValues = (numValues << 1) | bit;
-	}
+	int numValues = int(reverseBits(stream.nextBits(infile.readBits(32), 32), 32));
+	if (numValues < 0 || numValues > PSEUDO_EOF) error("Wrong password or corrupt file header.");
 
+	int previous = -1;
 	for (int i = 0; i < numValues; i++) {
-		ext_char ch = 0;
-		for (int j = 0; j < 8; j++) {
-			bool bit = infile.readBit();
-			bit = stream.nextBit(bit);
-			ch = (ch << 1) | bit;
+		ext_char ch = ext_char(reverseBits(stream.nextBits(infile.readBits(8), 8), 8));
+		int freq = int(reverseBits(stream.nextBits(infile.readBits(32), 32), 32));
+		if (ch <= previous || freq < 0) error("Wrong password or corrupt file header.");
+		previous = ch;
+		result[ch] = freq;
+	}
+
+	result[PSEUDO_EOF] = 1;
+	return result;
+}
+
+/* Characters in the canonical header need 9 bits, to fit PSEUDO_EOF. */
+static const int CHARACTER_BITS = 9;
+
+/* The width field of a compact header.  No other header has it,
+ * since no length needs more than six bits, but readers from
+ * before compact headers took it for a width of eight, so only
+ * versions with FORMAT_FLAG_COMPACT may use it.
+ */
+static const int COMPACT_WIDTH_FIELD = 7;
+
+/* The first length in a compact header is written in full. */
+static const int FIRST_LENGTH_BITS = 6;
+
+/* Type: HeaderForm
+ * The ways writeCanonicalFileHeader can lay out the lengths.
+ */
+enum HeaderForm {
+	HEADER_DENSE,
+	HEADER_SPARSE,
+	HEADER_COMPACT_GAPS,
+	HEADER_COMPACT_RUNS
+};
+
+/*
+* Number of bits needed to write value, which is at least 1.
+*/
+static int bitWidth(int value) {
+	int width = 1;
+	while ((value >> width) != 0) width++;
+	return width;
+}
+
+/*
+* Puts value, which is at least 1, in Elias gamma code: a 0 for
+* every bit of it after the first, a 1, and then those bits.
+*/
+template <typename Sink>
+static void putGamma(int value, Sink& put) {
+	int width = bitWidth(value);
+	put(uint64_t(1) << (width - 1), width);
+	if (width > 1) put(value & ((1 << (width - 1)) - 1), width - 1);
+}
+
+/*
+* Puts the body of a compact header, after its width field: which
+* bytes are used, as a list of the gaps between them or as runs of
+* unused and used bytes in turn, and then the lengths of those bytes
+* and of PSEUDO_EOF, each as the change from the one before. Sizes
+* come out small for the few bytes of a small file and for the runs
+* of letters in text, and code lengths change by little from one
+* byte to the next. put is given each field and its width, so the
+* same code counts the bits and writes them.
+*/
+template <typename Sink>
+static void putCompactHeader(const int lengths[NUM_SYMBOLS], bool runs, Sink& put) {
+	put(runs, 1);
+	if (runs) {
+		// runs alternate, starting with unused bytes, until all of them are covered
+		bool used = false;
+		for (int ch = 0; ch < PSEUDO_EOF; used = !used) {
+			int run = 0;
+			while (ch < PSEUDO_EOF && (lengths[ch] > 0) == used) {
+				ch++;
+				run++;
+			}
+			putGamma(run + 1, put);
+		}
+	} else {
+		int count = 0;
+		for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+			if (lengths[ch] > 0) count++;
+		}
+		putGamma(count + 1, put);
+		for (int ch = 0, previous = -1; ch < PSEUDO_EOF; ch++) {
+			if (lengths[ch] == 0) continue;
+			putGamma(ch - previous, put);
+			previous = ch;
 		}
+	}
 
-		int freq = 0;
-		for (int j = 0; j < 32; j++) {
-			bool bit = infile.readBit();
-			bit = stream.nextBit(bit);
-			freq = (freq << 1) | bit;
+	// 0 for no change, or 1, the sign, and then the size of the change in unary
+	int previous = 0;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (lengths[ch] == 0) continue;
+		if (previous == 0) {
+			put(lengths[ch], FIRST_LENGTH_BITS);
+		} else if (lengths[ch] == previous) {
+			put(0, 1);
+		} else {
+			put(1, 1);
+			put(lengths[ch] < previous, 1);
+			for (int step = abs(lengths[ch] - previous); step > 1; step--) {
+				put(1, 1);
+			}
+			put(0, 1);
 		}
+		previous = lengths[ch];
+	}
+}
 
-		result[ch] = freq;
+/*
+* The number of bits the compact header of the given form would take,
+* width field and all.
+*/
+static int compactHeaderBits(const int lengths[NUM_SYMBOLS], bool runs) {
+	int bits = 3;
+	auto count = [&](uint64_t, int width) {
+		bits += width;
+	};
+	putCompactHeader(lengths, runs, count);
+	return bits;
+}
+
+/*
+* Works out the shortest form of the canonical header for the given
+* lengths, setting the number of bits it takes, the width of each
+* length field, and how many characters are used. The compact forms
+* are only for versions with FORMAT_FLAG_COMPACT and codes with at
+* least one character besides PSEUDO_EOF, and are taken only when
+* they are shorter.
+*/
+static HeaderForm headerForm(const int lengths[NUM_SYMBOLS], int version, int& bits, int& width, int& used) {
+	int longest = 0;
+	used = 0;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (lengths[ch] > longest) longest = lengths[ch];
+		if (lengths[ch] > 0) used++;
+	}
+	width = bitWidth(longest);
+	HeaderForm form = HEADER_DENSE;
+	bits = 4 + NUM_SYMBOLS * width;
+	int sparseBits = 4 + CHARACTER_BITS + used * (CHARACTER_BITS + width);
+	if (sparseBits < bits) {
+		form = HEADER_SPARSE;
+		bits = sparseBits;
 	}
+	if (!(version & FORMAT_FLAG_COMPACT) || used < 2) return form;
 
-	result[PSEUDO_EOF] = 1;
-	return result;
+	int gapBits = compactHeaderBits(lengths, false), runBits = compactHeaderBits(lengths, true);
+	if (gapBits < bits && gapBits <= runBits) {
+		form = HEADER_COMPACT_GAPS;
+		bits = gapBits;
+	} else if (runBits < bits) {
+		form = HEADER_COMPACT_RUNS;
+		bits = runBits;
+	}
+	return form;
+}
+
+/*
+* The canonical header stores the width of each length field,
+* then either every length (dense) or just the characters that
+* are used together with their lengths (sparse), or, marked by
+* a width no length needs, the compact form putCompactHeader
+* writes, whichever is shortest. Like the original header it is
+* XOR encrypted, and fields go out bit 0 first.
+*/
+int writeCanonicalFileHeader(obstream& outfile, const int lengths[NUM_SYMBOLS], const PasswordKey& password, uint64_t block,
+                             int version) {
+	if (!isValidCodeLengths(lengths)) error("Invalid code lengths for a canonical code.");
+	KeyStream stream(password.keystreamKey(), block);
+
+	int bits, width, used;
+	HeaderForm form = headerForm(lengths, version, bits, width, used);
+	auto put = [&](uint64_t value, int count) {
+		outfile.writeBits(stream.nextBits(value, count), count);
+	};
+
+	if (form == HEADER_COMPACT_GAPS || form == HEADER_COMPACT_RUNS) {
+		put(COMPACT_WIDTH_FIELD, 3);
+		putCompactHeader(lengths, form == HEADER_COMPACT_RUNS, put);
+	} else if (form == HEADER_SPARSE) {
+		put(width - 1, 3);
+		put(1, 1);
+		put(used, CHARACTER_BITS);
+		for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+			if (lengths[ch] == 0) continue;
+			put(ch, CHARACTER_BITS);
+			put(lengths[ch], width);
+		}
+	} else {
+		put(width - 1, 3);
+		put(0, 1);
+		for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+			put(lengths[ch], width);
+		}
+	}
+	outfile.flushBits();
+	return bits;
+}
+
+/*
+* The size writeCanonicalFileHeader comes to, worked out the same
+* way but without writing anything.
+*/
+int canonicalHeaderBits(const int lengths[NUM_SYMBOLS], int version) {
+	int bits, width, used;
+	headerForm(lengths, version, bits, width, used);
+	return bits;
+}
+
+/*
+* Reads a value written by putGamma, the bits it took added to
+* bits. A value too large for any compact header gives the wrong
+* password away.
+*/
+template <typename Cipher>
+static int readGamma(ibstream& infile, Cipher& stream, int& bits) {
+	int width = 1;
+	while (stream.nextBits(infile.readBits(1), 1) == 0) {
+		if (++width > CHARACTER_BITS) error("Wrong password or corrupt file header.");
+	}
+	int value = 1 << (width - 1);
+	if (width > 1) value |= int(stream.nextBits(infile.readBits(width - 1), width - 1));
+	bits += 2 * width - 1;
+	return value;
+}
+
+/*
+* Reads back the body of a compact header, as putCompactHeader
+* writes it, adding the bits it took to bits.
+*/
+template <typename Cipher>
+static void readCompactLengths(ibstream& infile, int lengths[NUM_SYMBOLS], Cipher& stream, int& bits) {
+	bool used[NUM_SYMBOLS] = { false };
+	bool runs = stream.nextBits(infile.readBits(1), 1) != 0;
+	bits++;
+	if (runs) {
+		bool inUse = false;
+		for (int ch = 0; ch < PSEUDO_EOF; inUse = !inUse) {
+			int run = readGamma(infile, stream, bits) - 1;
+			// only the first run, of unused bytes before byte 0, can be empty
+			bool empty = run == 0 && (ch > 0 || inUse);
+			if (empty || run > PSEUDO_EOF - ch) error("Wrong password or corrupt file header.");
+			for (int i = 0; i < run; i++) {
+				used[ch++] = inUse;
+			}
+		}
+	} else {
+		int count = readGamma(infile, stream, bits) - 1;
+		for (int i = 0, ch = -1; i < count; i++) {
+			ch += readGamma(infile, stream, bits);
+			if (ch >= PSEUDO_EOF) error("Wrong password or corrupt file header.");
+			used[ch] = true;
+		}
+	}
+	used[PSEUDO_EOF] = true;
+
+	int previous = 0;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (!used[ch]) continue;
+		int length;
+		if (previous == 0) {
+			length = int(stream.nextBits(infile.readBits(FIRST_LENGTH_BITS), FIRST_LENGTH_BITS));
+			bits += FIRST_LENGTH_BITS;
+		} else if (stream.nextBits(infile.readBits(1), 1) == 0) {
+			length = previous;
+			bits++;
+		} else {
+			bool down = stream.nextBits(infile.readBits(1), 1) != 0;
+			int step = 1;
+			while (stream.nextBits(infile.readBits(1), 1) != 0) {
+				if (++step > MAX_CANONICAL_LENGTH) error("Wrong password or corrupt file header.");
+			}
+			length = down ? previous - step : previous + step;
+			bits += 2 + step;
+		}
+		if (length < 1 || length > MAX_CANONICAL_LENGTH) error("Wrong password or corrupt file header.");
+		lengths[ch] = length;
+		previous = length;
+	}
+}
+
+/*
+* Reads back the lengths written by writeCanonicalFileHeader,
+* with whichever cipher the file's version uses. A wrong
+* password almost always gives lengths that don't form a
+* complete code, which we report rather than decoding garbage.
+* The compact form is read only if compact is set; otherwise its
+* width field is the width of eight it always was.
+* Returns the number of bits read.
+*/
+template <typename Cipher>
+static int readCanonicalLengths(ibstream& infile, int lengths[NUM_SYMBOLS], Cipher& stream, bool compact) {
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		lengths[ch] = 0;
+	}
+
+	int widthField = int(stream.nextBits(infile.readBits(3), 3));
+	int bits = 3;
+	if (compact && widthField == COMPACT_WIDTH_FIELD) {
+		readCompactLengths(infile, lengths, stream, bits);
+		if (!isValidCodeLengths(lengths)) error("Wrong password or corrupt file header.");
+		return bits;
+	}
+
+	int width = widthField + 1;
+	bool sparse = stream.nextBits(infile.readBits(1), 1) != 0;
+	bits++;
+	if (sparse) {
+		int used = int(stream.nextBits(infile.readBits(CHARACTER_BITS), CHARACTER_BITS));
+		if (used > NUM_SYMBOLS) error("Wrong password or corrupt file header.");
+		for (int i = 0; i < used; i++) {
+			int ch = int(stream.nextBits(infile.readBits(CHARACTER_BITS), CHARACTER_BITS));
+			int length = int(stream.nextBits(infile.readBits(width), width));
+			if (ch >= NUM_SYMBOLS) error("Wrong password or corrupt file header.");
+			lengths[ch] = length;
+		}
+		bits += CHARACTER_BITS + used * (CHARACTER_BITS + width);
+	} else {
+		for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+			lengths[ch] = int(stream.nextBits(infile.readBits(width), width));
+		}
+		bits += NUM_SYMBOLS * width;
+	}
+	if (!isValidCodeLengths(lengths)) error("Wrong password or corrupt file header.");
+	return bits;
+}
+
+int readCanonicalFileHeader(ibstream& infile, int lengths[NUM_SYMBOLS], const PasswordKey& password, uint64_t block,
+                             int version) {
+	if (version == FORMAT_VERSION_CANONICAL || version == FORMAT_VERSION_BLOCKS) {
+		PasswordStream stream(password, block);
+		return readCanonicalLengths(infile, lengths, stream, false);
+	}
+	KeyStream stream(password.keystreamKey(), block);
+	return readCanonicalLengths(infile, lengths, stream, (version & FORMAT_FLAG_COMPACT) != 0);
+}
+
+/* Function: writeFormatMagic
+ * Usage: PasswordKey fileKey = writeFormatMagic(outfile, version, password);
+ * --------------------------------------------------------
+ * The salt and nonce go out a byte at a time, in order, and the
+ * nonce is little-endian.
+ */
+PasswordKey writeFormatMagic(obstream& outfile, int version, const PasswordKey& password) {
+	unsigned char salt[SALT_BYTES];
+	uint64_t nonce;
+	PasswordKey fileKey = password.forNewFile(salt, nonce);
+	outfile.writeBits(FORMAT_MAGIC | (uint64_t(version | FORMAT_FLAG_SALTED | FORMAT_FLAG_CHECKED) << 24), 32);
+	for (int i = 0; i < SALT_BYTES; i++) {
+		outfile.writeBits(salt[i], 8);
+	}
+	outfile.writeBits(nonce, 64);
+	outfile.writeBits(fileKey.check(), 32);
+	return fileKey;
+}
+
+/* Function: readFormatMagic
+ * Usage: int version = readFormatMagic(infile, password, fileKey);
+ * --------------------------------------------------------
+ * Reads the 32 bits of a magic number and returns its version
+ * without FORMAT_FLAG_SALTED or FORMAT_FLAG_CHECKED, or 0 if they
+ * are not a magic number.  fileKey is set to the password's key
+ * for the file, bound to its salt and nonce if it has them.  If
+ * the version has FORMAT_FLAG_CHECKED, the password check is read
+ * as well, and an error is raised unless it is the check of that
+ * key.  That takes the same few steps however large the file, and
+ * before anything is decoded.
+ */
+int readFormatMagic(ibstream& infile, const PasswordKey& password, PasswordKey& fileKey) {
+	fileKey = password;
+	uint64_t magic = infile.readBits(32);
+	if ((magic & 0xFFFFFF) != FORMAT_MAGIC) return 0;
+	int version = int(magic >> 24);
+	if (version & FORMAT_FLAG_SALTED) {
+		unsigned char salted[SALT_BYTES + 8];
+		readStoredBytes(infile, salted, sizeof salted);
+		uint64_t nonce = 0;
+		for (int b = 0; b < 8; b++) {
+			nonce |= uint64_t(salted[SALT_BYTES + b]) << (8 * b);
+		}
+		fileKey = password.forFile(salted, nonce);
+	}
+	if (version & FORMAT_FLAG_CHECKED) {
+		if (!infile.hasBits(32)) error("Compressed file is truncated.");
+		if (uint32_t(infile.readBits(32)) != fileKey.check()) error("Wrong password.");
+	}
+	return version & ~(FORMAT_FLAG_SALTED | FORMAT_FLAG_CHECKED);
+}
+
+/* Function: getCodeLengthsForCounts
+ * Usage: getCodeLengthsForCounts(counts, lengths, maxLength);
+ * --------------------------------------------------------
+ * Finds the code length of every character in the encoding tree
+ * buildEncodingTreeFromCounts would build for the given byte
+ * counts, plus one PSEUDO_EOF, with getHuffmanCodeLengths, which
+ * never builds the tree.  This is all the compressors need from
+ * it.  If any code would be longer than maxLength bits, the
+ * lengths instead come from getLimitedCodeLengths, which gives
+ * the best code with no code longer than that.  Any input up to
+ * 2^56 bytes can be compressed.
+ */
+void getCodeLengthsForCounts(const uint64_t counts[NUM_SYMBOLS], int lengths[NUM_SYMBOLS], int maxLength) {
+	uint64_t weights[NUM_SYMBOLS];
+	for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+		weights[ch] = counts[ch];
+	}
+	weights[PSEUDO_EOF] = 1;
+
+	getHuffmanCodeLengths(weights, lengths);
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (lengths[ch] > maxLength) {
+			// too deep, so start again from the weights alone
+			getLimitedCodeLengths(weights, maxLength, lengths);
+			return;
+		}
+	}
+}
+
+/* Function: readCompressedHeader
+ * Usage: int version = readCompressedHeader(infile, password, table);
+ * ---------------------------------------------------------------------------
+ * Reads the header at the start of a compressed file, in any of
+ * the formats, and fills in the table that decodes the rest of
+ * it.  Returns 0 for a file in the original format, or else the
+ * format version, without FORMAT_FLAG_COMPACT, since that makes no
+ * difference past the header.  Files in the block formats have a header per
+ * block instead, so for them nothing is read and the table is
+ * left alone; pass them to decompressStream.  The same goes for
+ * context modeled files, which have a code per context; pass
+ * them to decompressContexts.  Dictionaries and
+ * the records compressed against them raise an error.
+ */
+int readCompressedHeader(ibstream& infile, const PasswordKey& password, DecodeTable& table) {
+	uint64_t magic = infile.peekBits(32);
+	if ((magic & 0xFFFFFF) == FORMAT_MAGIC) {
+		int version = int(magic >> 24) & ~(FORMAT_FLAG_SALTED | FORMAT_FLAG_CHECKED);
+		int base = version & ~FORMAT_FLAG_COMPACT;
+		if (isBlockFormat(base) || base == FORMAT_VERSION_CONTEXT || version == FORMAT_VERSION_STORED) {
+			return base;
+		}
+		if (base == FORMAT_VERSION_DICTIONARY || version == FORMAT_VERSION_RECORD) {
+			error("This file belongs to a shared dictionary; use decompressRecord.");
+		}
+		if (version != FORMAT_VERSION_CANONICAL && base != FORMAT_VERSION_KEYSTREAM) {
+			error("Unsupported compressed file version.");
+		}
+		PasswordKey fileKey = password;
+		readFormatMagic(infile, password, fileKey);
+
+		// the lengths alone are enough to build the decode table
+		int lengths[NUM_SYMBOLS];
+		readCanonicalFileHeader(infile, lengths, fileKey, 0, version);
+		buildCanonicalDecodeTable(lengths, table);
+		return base;
+	}
+
+	// no magic number, so this is a file in the original format, whose
+	// code is exactly the tree buildEncodingTree builds
+	Map<ext_char, int> freqMap = readEncryptedFileHeader(infile, password);
+	NodeArena arena;
+	buildDecodeTable(buildEncodingTree(freqMap, arena), table);
+	return 0;
+}
+
+/* Bytes taken by the length of a stored file, and the size of the
+ * pieces its data is copied in, a whole number of keystream words.
+ */
+static const uint64_t STORED_LENGTH_BYTES = 8;
+static const size_t STORED_CHUNK_SIZE = 1 << 16;
+
+/* The nonce of the keystream a stored file is encrypted with, well
+ * clear of the block numbers and the other nonces.
+ */
+static const uint64_t STORED_NONCE = uint64_t(1) << 59;
+
+/* Function: writeStoredHeader
+ * Usage: KeyStream stream = writeStoredHeader(outfile, length, password);
+ * --------------------------------------------------------
+ * Starts a FORMAT_VERSION_STORED file of the given number of bytes,
+ * returning the keystream to encrypt the bytes with. The length
+ * can be told from the size of the file, so it isn't encrypted,
+ * and no keystream is spent on a value anyone could predict.
+ */
+KeyStream writeStoredHeader(obstream& outfile, uint64_t length, const PasswordKey& password) {
+	PasswordKey fileKey = writeFormatMagic(outfile, FORMAT_VERSION_STORED, password);
+	outfile.writeBits(length, 64);
+	outfile.flushBits();
+	return KeyStream(fileKey.keystreamKey(), STORED_NONCE);
+}
+
+/*
+* Our helper function for compress. Writes the next length bytes
+* of the input as a FORMAT_VERSION_STORED file, as they are but
+* for the encryption.
+*/
+static void writeStored(istream& infile, uint64_t length, obstream& outfile, const PasswordKey& password) {
+	KeyStream stream = writeStoredHeader(outfile, length, password);
+
+	std::vector<char> chunk(STORED_CHUNK_SIZE);
+	uint64_t written = 0;
+	while (written < length) {
+		infile.read(chunk.data(), std::streamsize(std::min<uint64_t>(chunk.size(), length - written)));
+		size_t got = size_t(infile.gcount());
+		if (got == 0) error("The input ended before all of it was stored.");
+		stream.apply((unsigned char*)chunk.data(), got);
+		outfile.write(chunk.data(), got);
+		written += got;
+	}
+}
+
+/* Function: readStoredHeader
+ * Usage: KeyStream stream = readStoredHeader(infile, password, length);
+ * --------------------------------------------------------
+ * Reads what writeStoredHeader writes, setting length, and returns
+ * the keystream to decrypt the bytes with.
+ */
+KeyStream readStoredHeader(ibstream& infile, const PasswordKey& password, uint64_t& length) {
+	PasswordKey fileKey = password;
+	if (!infile.hasBits(32) || readFormatMagic(infile, password, fileKey) != FORMAT_VERSION_STORED) {
+		error("This is not a stored file.");
+	}
+	KeyStream stream(fileKey.keystreamKey(), STORED_NONCE);
+	if (!infile.hasBits(32)) error("Compressed file is truncated.");
+	uint64_t low = infile.readBits(32);
+	if (!infile.hasBits(32)) error("Compressed file is truncated.");
+	length = low | (infile.readBits(32) << 32);
+	// files from before the salt encrypted the length with the first keystream word
+	if (fileKey.keystreamKey().legacy) length = stream.nextBits(length, 64);
+	return stream;
+}
+
+/* Function: readStoredBytes
+ * Usage: readStoredBytes(infile, buffer, count);
+ * --------------------------------------------------------
+ * The bytes come through the bit buffer, so a stream that can't
+ * seek works too.
+ */
+void readStoredBytes(ibstream& infile, unsigned char* buffer, size_t count) {
+	size_t i = 0;
+	for (; i + 4 <= count && infile.hasBits(32); i += 4) {
+		uint32_t word = uint32_t(infile.readBits(32));
+		for (int b = 0; b < 4; b++) buffer[i + b] = (unsigned char)(word >> (8 * b));
+	}
+	for (; i < count; i++) {
+		if (!infile.hasBits(8)) error("Compressed file is truncated.");
+		buffer[i] = (unsigned char)infile.readBits(8);
+	}
+}
+
+/* Function: decompressStored
+ * Usage: decompressStored(infile, outfile, password);
+ * --------------------------------------------------------
+ * Copies out the data of a FORMAT_VERSION_STORED file, starting
+ * from its magic number.  After the magic number and password
+ * check come 64 bits giving the number of bytes, then the bytes,
+ * all of it encrypted with a KeyStream of its own.  Raises an
+ * error if the file holds fewer bytes than it says.
+ */
+void decompressStored(ibstream& infile, ostream& outfile, const PasswordKey& password) {
+	uint64_t length;
+	KeyStream stream = readStoredHeader(infile, password, length);
+
+	std::vector<unsigned char> chunk(STORED_CHUNK_SIZE);
+	uint64_t copied = 0;
+	while (copied < length) {
+		size_t count = size_t(std::min<uint64_t>(chunk.size(), length - copied));
+		readStoredBytes(infile, chunk.data(), count);
+		stream.apply(chunk.data(), count);
+		outfile.write((const char*)chunk.data(), count);
+		copied += count;
+	}
 }
 
 /* Function: compress
@@ -280,13 +946,192 @@ Map<ext_char, int> readEncryptedFileHeader(ibstream& infile, const string& passw
  * primarily be glue code.
  */
 void compress(ibstream& infile, obstream& outfile) {
-	Map<ext_char, int> freqMap = getFrequencyTable(infile);
-	Node* root = buildEncodingTree(freqMap);
-	string password = getLine("Enter password: ");
-	writeEncryptedFileHeader(outfile, freqMap, password);
-	infile.rewind();
-	encodeFile(infile, root, outfile);
-	freeTree(root);
+	compress(infile, outfile, getLine("Enter password: "));
+}
+
+/* Function: compress
+ * Usage: compress(infile, outfile, password);
+ * --------------------------------------------------------
+ * Compresses with the given password instead of asking for
+ * one, so that it can run unattended.  The size of the output
+ * is worked out from the counts and code lengths before any of
+ * it is written, and if the codes would save nothing the input
+ * is stored as it is, as a FORMAT_VERSION_STORED file.  Given
+ * stats, it adds the time of every phase and what each of them
+ * did to them.
+ */
+void compress(ibstream& infile, obstream& outfile, const PasswordKey& password, CompressionStats* stats) {
+	uint64_t counts[NUM_SYMBOLS] = { 0 };
+	{
+		PhaseTimer timer(stats, &CompressionStats::countSeconds);
+		countStream(infile, counts);
+	}
+	int lengths[NUM_SYMBOLS];
+	{
+		PhaseTimer timer(stats, &CompressionStats::treeSeconds);
+		getCodeLengthsForCounts(counts, lengths);
+	}
+
+	// encode with the canonical code rather than the tree's own code
+	EncodeTable table;
+	buildCanonicalEncodeTable(lengths, table);
+	uint64_t total = 0;
+	for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+		total += counts[ch];
+	}
+	if (stats != nullptr) stats->bytesIn += total;
+
+	// the size is known before anything is written, so data the code can't shrink is stored
+	if (!isWorthEncoding(total + STORED_LENGTH_BYTES, uint64_t(canonicalHeaderBits(lengths)) + encodedBits(counts, table))) {
+		PhaseTimer timer(stats, &CompressionStats::codingSeconds);
+		infile.rewind();
+		writeStored(infile, total, outfile, password);
+		if (stats != nullptr) stats->bytesOut += FORMAT_PREFIX_BYTES + STORED_LENGTH_BYTES + total;
+		return;
+	}
+
+	int headerBits;
+	{
+		PhaseTimer timer(stats, &CompressionStats::headerSeconds);
+		PasswordKey fileKey = writeFormatMagic(outfile, FORMAT_VERSION_KEYSTREAM | FORMAT_FLAG_COMPACT, password);
+		headerBits = writeCanonicalFileHeader(outfile, lengths, fileKey);
+	}
+
+	uint64_t codeBitsBefore = stats != nullptr ? stats->codeBits : 0;
+	{
+		PhaseTimer timer(stats, &CompressionStats::codingSeconds);
+		infile.rewind();
+		encodeFileWithTable(infile, table, outfile, stats);
+	}
+
+	if (stats != nullptr) {
+		stats->bytesOut += (8 * FORMAT_PREFIX_BYTES + uint64_t(headerBits) + stats->codeBits - codeBitsBefore + 7) / 8;
+		stats->treeDepth = std::max(stats->treeDepth, longestEncodeCode(table));
+	}
+}
+
+/* Function: compressSampled
+ * Usage: compressSampled(infile, outfile, password);
+ * --------------------------------------------------------
+ * Compresses as compress does, but with a code built from one
+ * block in every interval.  An input no longer than one interval
+ * is counted whole, without the extra counts, so it gets exactly
+ * the file compress would write.
+ */
+void compressSampled(ibstream& infile, obstream& outfile, const PasswordKey& password, CompressionStats* stats,
+                     int interval) {
+	if (interval < 1) error("Sample interval is out of range.");
+	uint64_t total = uint64_t(infile.size());
+	std::vector<char> block(SAMPLE_BLOCK_SIZE);
+
+	uint64_t counts[NUM_SYMBOLS] = { 0 };
+	uint64_t sampled = 0;
+	{
+		PhaseTimer timer(stats, &CompressionStats::countSeconds);
+		uint64_t blocks = (total + SAMPLE_BLOCK_SIZE - 1) / SAMPLE_BLOCK_SIZE;
+		uint64_t step = blocks > uint64_t(interval) ? uint64_t(interval) : 1;
+		for (uint64_t next = 0; next < blocks; next += step) {
+			infile.clear();
+			infile.seekg(streamoff(next * SAMPLE_BLOCK_SIZE));
+			infile.read(block.data(), block.size());
+			size_t got = size_t(infile.gcount());
+			countBytes((const unsigned char*)block.data(), got, counts);
+			sampled += got;
+		}
+	}
+	counts[PSEUDO_EOF] = 1;
+
+	// what the sample missed may still be there, so every character gets a code
+	uint64_t smoothing = sampled < total ? 1 : 0;
+	for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+		counts[ch] += smoothing;
+	}
+	int lengths[NUM_SYMBOLS];
+	{
+		PhaseTimer timer(stats, &CompressionStats::treeSeconds);
+		getCodeLengthsForCounts(counts, lengths);
+	}
+	EncodeTable table;
+	buildCanonicalEncodeTable(lengths, table);
+	if (stats != nullptr) {
+		stats->bytesIn += total;
+		stats->sampledBytes += sampled;
+	}
+
+	// the sample's bits per byte stand in for the whole input's when deciding to store it
+	uint64_t sampleBits = 0;
+	for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+		sampleBits += (counts[ch] - smoothing) * uint64_t(lengths[ch]);
+	}
+	double scale = sampled > 0 ? double(total) / double(sampled) : 0;
+	uint64_t codeBits = uint64_t(double(sampleBits) * scale) + uint64_t(lengths[PSEUDO_EOF]);
+	if (!isWorthEncoding(total + STORED_LENGTH_BYTES, uint64_t(canonicalHeaderBits(lengths)) + codeBits)) {
+		PhaseTimer timer(stats, &CompressionStats::codingSeconds);
+		infile.rewind();
+		writeStored(infile, total, outfile, password);
+		if (stats != nullptr) stats->bytesOut += FORMAT_PREFIX_BYTES + STORED_LENGTH_BYTES + total;
+		return;
+	}
+
+	int headerBits;
+	{
+		PhaseTimer timer(stats, &CompressionStats::headerSeconds);
+		PasswordKey fileKey = writeFormatMagic(outfile, FORMAT_VERSION_KEYSTREAM | FORMAT_FLAG_COMPACT, password);
+		headerBits = writeCanonicalFileHeader(outfile, lengths, fileKey);
+	}
+
+	// with stats, the encoding pass also counts what the sample stood in for
+	uint64_t exact[NUM_SYMBOLS] = { 0 };
+	uint64_t reads = 0;
+	{
+		PhaseTimer timer(stats, &CompressionStats::codingSeconds);
+		infile.rewind();
+		while (true) {
+			infile.read(block.data(), block.size());
+			size_t got = size_t(infile.gcount());
+			if (got == 0) break;
+			encodeBytesWithTable((const unsigned char*)block.data(), got, table, outfile);
+			if (stats != nullptr) countBytes((const unsigned char*)block.data(), got, exact);
+			reads++;
+		}
+		outfile.writeBits(table.codes[PSEUDO_EOF].bits, table.codes[PSEUDO_EOF].length);
+		outfile.flushBits();
+	}
+	if (stats == nullptr) return;
+
+	exact[PSEUDO_EOF] = 1;
+	uint64_t actualBits = encodedBits(exact, table);
+	int exactLengths[NUM_SYMBOLS];
+	getCodeLengthsForCounts(exact, exactLengths);
+	EncodeTable exactTable;
+	buildCanonicalEncodeTable(exactLengths, exactTable);
+	uint64_t bestBits = uint64_t(canonicalHeaderBits(exactLengths)) + encodedBits(exact, exactTable);
+	stats->sampleLossBits += int64_t(uint64_t(headerBits) + actualBits) - int64_t(bestBits);
+	stats->codeBits += actualBits;
+	stats->symbols += total;
+	stats->refills += reads;
+	stats->bytesOut += (8 * FORMAT_PREFIX_BYTES + uint64_t(headerBits) + actualBits + 7) / 8;
+	stats->treeDepth = std::max(stats->treeDepth, longestEncodeCode(table));
+}
+
+/* Function: estimateCompressedSize
+ * Usage: uint64_t bytes = estimateCompressedSize(infile);
+ * --------------------------------------------------------
+ * Returns exactly how many bytes compress would write for the
+ * rest of the given stream, without encoding or writing it.
+ */
+uint64_t estimateCompressedSize(istream& infile) {
+	uint64_t counts[NUM_SYMBOLS] = { 0 };
+	uint64_t total = countStream(infile, counts);
+	int lengths[NUM_SYMBOLS];
+	getCodeLengthsForCounts(counts, lengths);
+	EncodeTable table;
+	buildCanonicalEncodeTable(lengths, table);
+
+	// the magic number, salt and password check come first either way
+	uint64_t bits = uint64_t(canonicalHeaderBits(lengths)) + encodedBits(counts, table);
+	if (!isWorthEncoding(total + STORED_LENGTH_BYTES, bits)) return FORMAT_PREFIX_BYTES + STORED_LENGTH_BYTES + total;
+	return FORMAT_PREFIX_BYTES + (bits + 7) / 8;
 }
 
 /* Function: decompress
@@ -302,9 +1147,50 @@ void compress(ibstream& infile, obstream& outfile) {
  * primarily be glue code.
  */
 void decompress(ibstream& infile, ostream& outfile) {
-	string password = getLine("password:");
-	Map<ext_char, int> freqMap = readEncryptedFileHeader(infile, password);
-	Node* root = buildEncodingTree(freqMap);
-	decodeFile(infile, root, outfile);
-	freeTree(root);
-}
\ No newline at end of file
+	decompress(infile, outfile, getLine("password:"));
+}
+
+/* Function: decompress
+ * Usage: decompress(infile, outfile, password);
+ * --------------------------------------------------------
+ * Decompresses with the given password instead of asking for
+ * one, so that it can run unattended.  Given stats, it adds
+ * the time of every phase and what each of them did to them.
+ */
+void decompress(ibstream& infile, ostream& outfile, const PasswordKey& password, CompressionStats* stats) {
+	uint64_t fetchedBefore = infile.bytesFetched(), readsBefore = infile.blockReads();
+	uint64_t symbolsBefore = stats != nullptr ? stats->symbols : 0;
+	streampos startPos = stats != nullptr ? outfile.tellp() : streampos(-1);
+
+	DecodeTable table;
+	int version;
+	{
+		PhaseTimer timer(stats, &CompressionStats::headerSeconds);
+		version = readCompressedHeader(infile, password, table);
+	}
+	{
+		PhaseTimer timer(stats, &CompressionStats::codingSeconds);
+		if (isBlockFormat(version)) {
+			decompressStream(infile, outfile, password);
+		} else if (version == FORMAT_VERSION_CONTEXT) {
+			decompressContexts(infile, outfile, password);
+		} else if (version == FORMAT_VERSION_STORED) {
+			decompressStored(infile, outfile, password);
+		} else {
+			decodeFileWithTable(infile, table, outfile, stats);
+		}
+	}
+
+	if (stats != nullptr) {
+		stats->bytesIn += infile.bytesFetched() - fetchedBefore;
+		stats->refills += infile.blockReads() - readsBefore;
+		if (isBlockFormat(version) || version == FORMAT_VERSION_CONTEXT || version == FORMAT_VERSION_STORED) {
+			// these decode as they go, so the bytes written are the only count
+			streampos endPos = outfile.tellp();
+			if (startPos != streampos(-1) && endPos != streampos(-1)) stats->bytesOut += uint64_t(endPos - startPos);
+		} else {
+			stats->bytesOut += stats->symbols - symbolsBefore;
+			stats->treeDepth = std::max(stats->treeDepth, longestDecodeCode(table));
+		}
+	}
+}
@@ -11,6 +11,106 @@
 #include "HuffmanTypes.h"
 #include "map.h"
 #include "bstream.h"
+#include "HuffmanTables.h"
+#include "NodeArena.h"
+#include "CanonicalHuffman.h"
+#include "KeyStream.h"
+
+/* Constants: FORMAT_MAGIC, FORMAT_VERSION_CANONICAL, FORMAT_VERSION_BLOCKS,
+ *            FORMAT_VERSION_KEYSTREAM, FORMAT_VERSION_KEYSTREAM_BLOCKS,
+ *            FORMAT_VERSION_DICTIONARY, FORMAT_VERSION_RECORD,
+ *            FORMAT_VERSION_CONTEXT, FORMAT_VERSION_INTERLEAVED_BLOCKS,
+ *            FORMAT_VERSION_STORED, FORMAT_FLAG_SEALED, FORMAT_FLAG_CHECKED,
+ *            FORMAT_FLAG_COMPACT, FORMAT_FLAG_SALTED
+ * Compressed files other than those in the original format start
+ * with 32 unencrypted bits: FORMAT_MAGIC in the low 24 and the
+ * format version in the high 8.  Version 1 is a single canonical
+ * stream; version 2 is a sequence of blocks (see BlockCompression.h).
+ * Versions 3 and 4 are laid out the same as 1 and 2, but their
+ * headers are encrypted with a KeyStream (see KeyStream.h) rather
+ * than the original cipher.  compress writes version 3 and
+ * compressStream writes version 4.  A block file whose version has
+ * FORMAT_FLAG_SEALED set has every block encrypted, not just its
+ * header.  Versions 5 and 6 are a shared dictionary and a record
+ * compressed against one (see Dictionary.h).  Version 7 is a
+ * single stream with a code per context (see ContextModel.h).
+ * Version 8 is laid out like version 4, but every block is
+ * encoded as interleaved streams (see encodeBufferInterleaved).
+ * Version 9 holds data that would not have come out any smaller
+ * encoded, stored as it is (see decompressStored).
+ * A file whose version has FORMAT_FLAG_CHECKED set has 32 more
+ * unencrypted bits after the magic number, the check of the
+ * password it was written with (see PasswordKey::check), so that
+ * a wrong password is turned away before any header is read.
+ * Files of versions 3, 4, 7, 8 and 9 are written with it.  A
+ * version with FORMAT_FLAG_COMPACT set may have compact canonical
+ * headers (see writeCanonicalFileHeader), which readers from before
+ * them would misread, so that they refuse it as a version they
+ * don't know instead.  Files of versions 3, 4, 5, 7 and 8 are
+ * written with it; a block file appended to keeps the version it
+ * had.  A version with FORMAT_FLAG_SALTED set has a random salt
+ * and nonce after the magic number, before any password check, and
+ * is encrypted with the ChaCha20 keys they give (see KeyStream.h);
+ * without it, with the old cipher.  All new files but records,
+ * which aren't encrypted, are written with it.
+ */
+const uint64_t FORMAT_MAGIC = 'H' | ('U' << 8) | ('F' << 16);
+const int FORMAT_VERSION_CANONICAL = 1;
+const int FORMAT_VERSION_BLOCKS = 2;
+const int FORMAT_VERSION_KEYSTREAM = 3;
+const int FORMAT_VERSION_KEYSTREAM_BLOCKS = 4;
+const int FORMAT_VERSION_DICTIONARY = 5;
+const int FORMAT_VERSION_RECORD = 6;
+const int FORMAT_VERSION_CONTEXT = 7;
+const int FORMAT_VERSION_INTERLEAVED_BLOCKS = 8;
+const int FORMAT_VERSION_STORED = 9;
+const int FORMAT_FLAG_SEALED = 0x80;
+const int FORMAT_FLAG_CHECKED = 0x40;
+const int FORMAT_FLAG_COMPACT = 0x20;
+const int FORMAT_FLAG_SALTED = 0x10;
+
+/* Constant: FORMAT_PREFIX_BYTES
+ * The number of bytes writeFormatMagic writes: the magic number,
+ * the salt and nonce, and the password check.
+ */
+const int FORMAT_PREFIX_BYTES = 4 + SALT_BYTES + 8 + 4;
+
+/* Function: isBlockFormat
+ * Usage: if (isBlockFormat(version)) { ... }
+ * --------------------------------------------------------
+ * Returns whether the given format version, flags and all, is one
+ * of the block formats.
+ */
+inline bool isBlockFormat(int version) {
+	int base = version & ~(FORMAT_FLAG_SEALED | FORMAT_FLAG_COMPACT);
+	return base == FORMAT_VERSION_BLOCKS || base == FORMAT_VERSION_KEYSTREAM_BLOCKS ||
+	       base == FORMAT_VERSION_INTERLEAVED_BLOCKS;
+}
+
+/* Function: writeFormatMagic
+ * Usage: PasswordKey fileKey = writeFormatMagic(outfile, version, password);
+ * --------------------------------------------------------
+ * Writes the magic number with the given version, marked with
+ * FORMAT_FLAG_SALTED and FORMAT_FLAG_CHECKED, followed by a new
+ * salt and nonce and the check of the key they give, and returns
+ * that key, which the rest of the file is encrypted with.
+ */
+PasswordKey writeFormatMagic(obstream& outfile, int version, const PasswordKey& password);
+
+/* Function: readFormatMagic
+ * Usage: int version = readFormatMagic(infile, password, fileKey);
+ * --------------------------------------------------------
+ * Reads the 32 bits of a magic number and returns its version
+ * without FORMAT_FLAG_SALTED and FORMAT_FLAG_CHECKED, or 0 if they
+ * are not a magic number.  fileKey is set to the key the rest of
+ * the file is encrypted with: the one its salt and nonce give, if
+ * its version has FORMAT_FLAG_SALTED, or else the password's own.
+ * If the version has FORMAT_FLAG_CHECKED, the password check is
+ * read as well, and an error is raised unless it is the check of
+ * that key.  That takes the same few steps however large the file,
+ * and before anything is decoded.
+ */
+int readFormatMagic(ibstream& infile, const PasswordKey& password, PasswordKey& fileKey);
 
 /* Function: getFrequencyTable
  * Usage: Map<ext_char, int> freq = getFrequencyTable(file);
@@ -40,6 +140,31 @@ Map<ext_char, int> getFrequencyTable(istream& file);
  */
 Node* buildEncodingTree(Map<ext_char, int>& frequencies);
 
+/* Function: buildEncodingTree
+ * Usage: Node* tree = buildEncodingTree(frequency, arena);
+ * --------------------------------------------------------
+ * Builds the same tree as above, but takes its nodes from the
+ * given arena instead of the heap.  The tree lives until the
+ * arena is released; don't pass it to freeTree.
+ */
+Node* buildEncodingTree(Map<ext_char, int>& frequencies, NodeArena& arena);
+
+/* Function: buildEncodingTreeFromCounts
+ * Usage: Node* tree = buildEncodingTreeFromCounts(counts, arena);
+ * --------------------------------------------------------
+ * Builds an optimal encoding tree for the given byte counts,
+ * plus one PSEUDO_EOF, with the two-queue method: the leaves
+ * are sorted by weight once, then merged from two queues with
+ * no heap at all.  Ties are broken so that every build of the
+ * same counts gives the same tree: leaves of equal weight are
+ * taken in character order, and a leaf is taken before a
+ * merged tree of equal weight.  The first node taken becomes
+ * the zero child.  The tree is not always the one
+ * buildEncodingTree builds, but it costs the same number of
+ * bits.  Nodes come from the given arena.
+ */
+Node* buildEncodingTreeFromCounts(const uint64_t counts[NUM_SYMBOLS], NodeArena& arena);
+
 /* Function: freeTree
  * Usage: freeTree(encodingTree);
  * --------------------------------------------------------
@@ -65,8 +190,11 @@ void freeTree(Node* root);
  *     to it, and the file cursor is at the end of the file.
  *     This means that you should just start writing the bits
  *     without seeking the file anywhere.
+ *
+ * Given stats, the time spent building the code table and
+ * encoding is added to them along with what was encoded.
  */
-void encodeFile(istream& infile, Node* encodingTree, obstream& outfile);
+void encodeFile(istream& infile, Node* encodingTree, obstream& outfile, CompressionStats* stats = nullptr);
 
 /* Function: decodeFile
  * Usage: decodeFile(encodedFile, encodingTree, resultFile);
@@ -79,8 +207,23 @@ void encodeFile(istream& infile, Node* encodingTree, obstream& outfile);
  *     this encoding table.
  *
  *   - The output file is open and ready for writing.
+ *
+ * Raises an error if the input runs out before PSEUDO_EOF, so a
+ * truncated or corrupt file fails as soon as its end is reached.
+ * Given stats, the time spent building the decode table and
+ * decoding is added to them along with what was decoded.
+ */
+void decodeFile(ibstream& infile, Node* encodingTree, ostream& file, CompressionStats* stats = nullptr);
+
+/* Function: decodeFileTreeWalk
+ * Usage: decodeFileTreeWalk(encodedFile, encodingTree, resultFile);
+ * --------------------------------------------------------
+ * Decodes a file exactly like decodeFile, but by walking the
+ * tree one bit at a time, packed into a FlatTree, instead of
+ * using a decode table.  This is slower and is kept so that the
+ * table decoder can be checked against it.
  */
-void decodeFile(ibstream& infile, Node* encodingTree, ostream& file);
+void decodeFileTreeWalk(ibstream& infile, Node* encodingTree, ostream& file);
 
 /* Function: writeEncryptedFileHeader
  * Usage: writeEncryptedFileHeader(output, frequencies, password);
@@ -96,7 +239,7 @@ void decodeFile(ibstream& infile, Node* encodingTree, ostream& file);
  * and reconstruct the frequency table during decompression.
  */
 
-void writeEncryptedFileHeader(obstream& outfile, Map<ext_char, int>& frequencies, const string& password);
+void writeEncryptedFileHeader(obstream& outfile, Map<ext_char, int>& frequencies, const PasswordKey& password);
 
 /* Function: readEncryptedFileHeader
  * Usage: Map<ext_char, int> freq = readEncryptedFileHeader(input, password);
@@ -113,7 +256,144 @@ void writeEncryptedFileHeader(obstream& outfile, Map<ext_char, int>& frequencies
  * Note: This function must match the format used by writeEncryptedFileHeader
  * to correctly interpret the file header.
  */
-Map<ext_char, int> readEncryptedFileHeader(ibstream& infile, const string& password);
+Map<ext_char, int> readEncryptedFileHeader(ibstream& infile, const PasswordKey& password);
+
+/* Function: writeCanonicalFileHeader
+ * Usage: writeCanonicalFileHeader(output, lengths, password);
+ * ----------------------------------------------------------------
+ * Writes an encrypted header holding only the code length of each
+ * character, for files encoded with the canonical code for those
+ * lengths (see CanonicalHuffman.h).  The lengths are packed into
+ * fields just wide enough for the longest code, and only the
+ * characters actually used are listed when that is shorter than
+ * listing all of them.  Shorter still, for most files, is the
+ * compact form: the used characters as gaps or runs, and each
+ * length as its change from the one before.  It is only written
+ * when the version of the file the header goes in, as it would
+ * be passed to readCanonicalFileHeader, has FORMAT_FLAG_COMPACT.
+ *
+ * The header is encrypted with a KeyStream for the password,
+ * as versions FORMAT_VERSION_KEYSTREAM and up expect.  Files
+ * holding several headers give each a different block number,
+ * so that no two are encrypted with the same bits; a whole-file
+ * header uses block 0.  Returns the number of bits written.  The
+ * header does not end on a byte boundary: whatever comes next
+ * carries on in its last byte.
+ */
+int writeCanonicalFileHeader(obstream& outfile, const int lengths[NUM_SYMBOLS], const PasswordKey& password, uint64_t block = 0,
+                             int version = FORMAT_VERSION_KEYSTREAM | FORMAT_FLAG_COMPACT);
+
+/* Function: canonicalHeaderBits
+ * Usage: int bits = canonicalHeaderBits(lengths);
+ * ----------------------------------------------------------------
+ * Returns the number of bits writeCanonicalFileHeader would write
+ * for the given lengths and version, without writing anything.
+ * The lengths must be valid.
+ */
+int canonicalHeaderBits(const int lengths[NUM_SYMBOLS], int version = FORMAT_VERSION_KEYSTREAM | FORMAT_FLAG_COMPACT);
+
+/* Function: isWorthEncoding
+ * Usage: if (isWorthEncoding(bytes, bits)) { ... }
+ * ----------------------------------------------------------------
+ * Returns whether the given number of bytes would come out smaller
+ * as the given number of header and code bits, so that encoding
+ * them saves something over storing them as they are.
+ */
+inline bool isWorthEncoding(uint64_t bytes, uint64_t encodedBits) {
+	return (encodedBits + 7) / 8 < bytes;
+}
+
+/* Function: readCanonicalFileHeader
+ * Usage: readCanonicalFileHeader(input, lengths, password);
+ * ---------------------------------------------------------------------------
+ * Reads and decrypts a header written by writeCanonicalFileHeader,
+ * filling in the code length of every character.  Raises an error
+ * if the decrypted lengths do not form a valid code, which is what
+ * almost always happens when the password is wrong.  The block
+ * number must match the one the header was written with, and the
+ * version must be that of the file it came from: headers in files
+ * of versions FORMAT_VERSION_CANONICAL and FORMAT_VERSION_BLOCKS
+ * use the original cipher, and only those with FORMAT_FLAG_COMPACT
+ * may be compact.  Returns the number of bits read, which is the
+ * number writeCanonicalFileHeader returned.
+ */
+int readCanonicalFileHeader(ibstream& infile, int lengths[NUM_SYMBOLS], const PasswordKey& password, uint64_t block = 0,
+                            int version = FORMAT_VERSION_KEYSTREAM | FORMAT_FLAG_COMPACT);
+
+/* Function: getCodeLengthsForCounts
+ * Usage: getCodeLengthsForCounts(counts, lengths, maxLength);
+ * --------------------------------------------------------
+ * Finds the code length of every character in the encoding tree
+ * buildEncodingTreeFromCounts would build for the given byte
+ * counts, plus one PSEUDO_EOF, with getHuffmanCodeLengths, which
+ * never builds the tree.  This is all the compressors need from
+ * it.  If any code would be longer than maxLength bits, the
+ * lengths instead come from getLimitedCodeLengths, which gives
+ * the best code with no code longer than that.  Any input up to
+ * 2^56 bytes can be compressed.
+ */
+void getCodeLengthsForCounts(const uint64_t counts[NUM_SYMBOLS], int lengths[NUM_SYMBOLS],
+                             int maxLength = MAX_CANONICAL_LENGTH);
+
+/* Function: readCompressedHeader
+ * Usage: int version = readCompressedHeader(infile, password, table);
+ * ---------------------------------------------------------------------------
+ * Reads the header at the start of a compressed file, in any of
+ * the formats, and fills in the table that decodes the rest of
+ * it.  Returns 0 for a file in the original format, or else the
+ * format version.  Files in the block formats have a header per
+ * block instead, so for them nothing is read and the table is
+ * left alone; pass them to decompressStream.  The same goes for
+ * context modeled files, which have a code per context; pass
+ * them to decompressContexts, and for stored files, which have
+ * no code at all; pass them to decompressStored.  Dictionaries and
+ * the records compressed against them raise an error.
+ */
+int readCompressedHeader(ibstream& infile, const PasswordKey& password, DecodeTable& table);
+
+/* Function: writeStoredHeader
+ * Usage: KeyStream stream = writeStoredHeader(outfile, length, password);
+ * --------------------------------------------------------
+ * Starts a FORMAT_VERSION_STORED file of the given number of bytes,
+ * writing its magic number, salt, nonce, password check and length,
+ * unencrypted, and flushing
+ * to a byte boundary.  Returns the keystream the bytes themselves
+ * are to be encrypted with, by apply, before they are written.
+ */
+KeyStream writeStoredHeader(obstream& outfile, uint64_t length, const PasswordKey& password);
+
+/* Function: readStoredHeader
+ * Usage: KeyStream stream = readStoredHeader(infile, password, length);
+ * --------------------------------------------------------
+ * Reads the start of a FORMAT_VERSION_STORED file, as written by
+ * writeStoredHeader, from its magic number, and sets length to the
+ * number of bytes stored, which begin on the next byte.  Returns
+ * the keystream to decrypt them with by apply.  Raises an error if
+ * the file isn't stored, the password is wrong or it is truncated.
+ */
+KeyStream readStoredHeader(ibstream& infile, const PasswordKey& password, uint64_t& length);
+
+/* Function: readStoredBytes
+ * Usage: readStoredBytes(infile, buffer, count);
+ * --------------------------------------------------------
+ * Reads the next count bytes into buffer through the bit buffer,
+ * a word at a time, so that a stream that can't seek works too.
+ * Raises an error if the input ends first.
+ */
+void readStoredBytes(ibstream& infile, unsigned char* buffer, size_t count);
+
+/* Function: decompressStored
+ * Usage: decompressStored(infile, outfile, password);
+ * --------------------------------------------------------
+ * Copies out the data of a FORMAT_VERSION_STORED file, starting
+ * from its magic number.  After the magic number, salt, nonce and
+ * password check come 64 bits giving the number of bytes, then the
+ * bytes, encrypted with a KeyStream of their own.  The number is
+ * left in the clear, since the size of the file gives it away
+ * anyway; files from before the salt have it encrypted too.
+ * Raises an error if the file holds fewer bytes than it says.
+ */
+void decompressStored(ibstream& infile, ostream& outfile, const PasswordKey& password);
 
 /* Function: compress
  * Usage: compress(infile, outfile);
@@ -125,9 +405,70 @@ Map<ext_char, int> readEncryptedFileHeader(ibstream& infile, const string& passw
  * previous functions together to implement this function,
  * which should not require much logic of its own and should
  * primarily be glue code.
+ *
+ * The output starts with a short unencrypted magic number and
+ * version, followed by a canonical code-length header and the
+ * data encoded with the canonical code.
  */
 void compress(ibstream& infile, obstream& outfile);
 
+/* Function: compress
+ * Usage: compress(infile, outfile, password);
+ * --------------------------------------------------------
+ * Compresses with the given password instead of asking for
+ * one, so that it can run unattended.  The size of the output
+ * is worked out from the counts and code lengths before any of
+ * it is written, and if the codes would save nothing the input
+ * is stored as it is, as a FORMAT_VERSION_STORED file.  Given
+ * stats, it adds the time of every phase and what each of them
+ * did to them.
+ */
+void compress(ibstream& infile, obstream& outfile, const PasswordKey& password, CompressionStats* stats = nullptr);
+
+/* Constant: SAMPLE_BLOCK_SIZE
+ * The number of bytes in each block compressSampled samples.
+ */
+const size_t SAMPLE_BLOCK_SIZE = 1 << 16;
+
+/* Constant: DEFAULT_SAMPLE_INTERVAL
+ * compressSampled counts one block in this many unless the caller
+ * asks for something else, reading about 5% of the input twice.
+ */
+const int DEFAULT_SAMPLE_INTERVAL = 20;
+
+/* Function: compressSampled
+ * Usage: compressSampled(infile, outfile, password);
+ * --------------------------------------------------------
+ * Compresses into the same file compress would write, that
+ * decompress reads, but builds its code from a sample of the
+ * input rather than from all of it: one SAMPLE_BLOCK_SIZE block
+ * in every interval, spread evenly over the stream, which must
+ * be able to seek.  Every character is given a count of at least
+ * one, so a character the sample missed still has a code.  An
+ * input of no more than interval blocks is counted whole instead,
+ * giving exactly the file compress would, since there would be
+ * nothing to gain.  The
+ * input is then read once more to encode it, so it is read about
+ * 1 + 1 / interval times rather than twice, at the cost of a
+ * slightly longer code.  The choice to store the input is made
+ * from the sample too.  Given stats, the encoding pass counts the
+ * input exactly as well, to record in sampleLossBits what the
+ * sample cost.
+ */
+void compressSampled(ibstream& infile, obstream& outfile, const PasswordKey& password,
+                     CompressionStats* stats = nullptr, int interval = DEFAULT_SAMPLE_INTERVAL);
+
+/* Function: estimateCompressedSize
+ * Usage: uint64_t bytes = estimateCompressedSize(infile);
+ * --------------------------------------------------------
+ * Returns exactly how many bytes compress would write for the
+ * rest of the given stream, whether encoded or stored, from its
+ * counts and code lengths alone: nothing is encoded and nothing
+ * written, and the stream is read once and left at its end.  The
+ * password makes no difference to the size, so none is needed.
+ */
+uint64_t estimateCompressedSize(istream& infile);
+
 /* Function: decompress
  * Usage: decompress(infile, outfile);
  * --------------------------------------------------------
@@ -139,7 +480,20 @@ void compress(ibstream& infile, obstream& outfile);
  * previous functions together to implement this function,
  * which should not require much logic of its own and should
  * primarily be glue code.
+ *
+ * Both the canonical format written by compress and the
+ * original frequency-table format are accepted; files without
+ * the magic number are read as the original format.
  */
 void decompress(ibstream& infile, ostream& outfile);
 
+/* Function: decompress
+ * Usage: decompress(infile, outfile, password);
+ * --------------------------------------------------------
+ * Decompresses with the given password instead of asking for
+ * one, so that it can run unattended.  Given stats, it adds
+ * the time of every phase and what each of them did to them.
+ */
+void decompress(ibstream& infile, ostream& outfile, const PasswordKey& password, CompressionStats* stats = nullptr);
+
 #endif
@@ -13,14 +13,71 @@
 #include <sstream>
 #include <iomanip>
 #include <limits>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <atomic>
+#include <new>
 #include "simpio.h"
 #include "strlib.h"
+#include "error.h"
 #include "bstream.h"
 #include "HuffmanEncoding.h"
 #include "ReferenceHuffmanEncoding.h"
 #include "MemoryDiagnostics.h"
+#include "CanonicalHuffman.h"
+#include "HuffmanTables.h"
+#include "BlockCompression.h"
+#include "MappedFile.h"
+#include "BufferCompression.h"
+#include "Histogram.h"
+#include "KeyStream.h"
+#include "Dictionary.h"
+#include "AdaptiveHuffman.h"
+#include "ContextModel.h"
+#include "CompressionStats.h"
+#include "StaticHuffmanCodec.h"
+#include "DecodeStream.h"
+#include "Checksum.h"
 using namespace std;
 
+/* Every call to the global operator new, counted so that tests can
+ * check that code which should allocate nothing doesn't.
+ */
+static std::atomic<uint64_t> heapAllocations(0);
+
+static void* countedAllocation(size_t bytesNeeded) {
+	heapAllocations++;
+	void* memory = malloc(bytesNeeded > 0 ? bytesNeeded : 1);
+	if (memory == NULL) throw std::bad_alloc();
+	return memory;
+}
+
+void* operator new(size_t bytesNeeded) {
+	return countedAllocation(bytesNeeded);
+}
+
+void* operator new[](size_t bytesNeeded) {
+	return countedAllocation(bytesNeeded);
+}
+
+void operator delete(void* memory) noexcept {
+	free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+	free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+	free(memory);
+}
+
 /* Type: MenuEntry
  * Identifying numbers for the menu.	See displayMenu() for descriptions.
  */
@@ -32,6 +89,14 @@ enum MenuEntry {
 	MANUAL_ENCODING_TESTS,
 	AUTOMATIC_ENCODING_TESTS,
 	AUTOMATIC_COMPLETE_TESTS,
+	AUTOMATIC_BITSTREAM_TESTS,
+	AUTOMATIC_CANONICAL_TESTS,
+	AUTOMATIC_BLOCK_TESTS,
+	AUTOMATIC_MAPPED_TESTS,
+	AUTOMATIC_FORMAT_TESTS,
+	AUTOMATIC_DICTIONARY_TESTS,
+	AUTOMATIC_ADAPTIVE_TESTS,
+	AUTOMATIC_CONTEXT_TESTS,
 	COMPRESS,
 	DECOMPRESS,
 	COMPARE,
@@ -248,6 +313,19 @@ void testGetFrequencyTable() {
 		ifbstream stream("test/input/random_10k.test");
 		validateFrequencyTable(stream, 10000);
 	}
+
+	/* The block counting kernel handles leftover bytes separately, so try lengths that
+	 * are not a multiple of its word size.
+	 */
+	{
+		logInfo("Testing on 4,099 bytes of skewed data.");
+		string skewed;
+		for (int i = 0; i < 4099; i++) {
+			skewed += char((i * i) % 7 == 0 ? 'x' : i % 251);
+		}
+		istringbstream stream(skewed);
+		validateFrequencyTable(stream, skewed.length());
+	}
 	
 	endTest("getFrequencyTable Tests");
 }
@@ -540,6 +618,129 @@ void testBuildEncodingTree() {
 		               "Number of allocations/deallocations matches for a huge tree.");
 	}
 
+	/* Trees built in an arena should match the heap trees, count their
+	 * nodes as allocations, and give them all back in one release.
+	 */
+	{
+		long disparity = numAllocations() - numDeallocations();
+
+		ifbstream stream("test/input/random_10k.test");
+		Map<ext_char, int> frequencies = referenceGetFrequencyTable(stream);
+		Node* expected = buildEncodingTree(frequencies);
+		NodeArena arena;
+		Node* tree = buildEncodingTree(frequencies, arena);
+		checkCondition(recCheckTreesEqual(expected, tree), "Arena tree matches the heap tree.");
+		checkCondition(arena.size() == 2 * frequencies.size() - 1, "Arena holds every node of the tree.");
+		freeTree(expected);
+		checkCondition(numAllocations() - numDeallocations() == disparity + arena.size(),
+		               "Arena nodes count as allocations.");
+
+		arena.release();
+		checkCondition(arena.size() == 0, "Released arena is empty.");
+		checkCondition(numAllocations() - numDeallocations() == disparity,
+		               "Number of allocations/deallocations matches after releasing the arena.");
+
+		Node* again = buildEncodingTree(frequencies, arena);
+		checkCondition(again == tree, "Released arena reuses its nodes.");
+	}
+
+	/* The two-queue build should make trees as cheap as the reference ones, the same
+	 * tree every time, and break ties the documented way.
+	 */
+	{
+		string files[] = { "allCharsOnce", "allRepeated", "fibonacci", "poem", "random", "singleChar", "tomSawyer" };
+		for (const string& file : files) {
+			ifbstream stream("test/encodeDecode/" + file);
+			uint64_t counts[NUM_SYMBOLS] = { 0 };
+			countStream(stream, counts);
+			Map<ext_char, int> frequencies = histogramToMap(counts);
+			Node* expected = referenceBuildEncodingTree(frequencies);
+			NodeArena first, second;
+			Node* tree = buildEncodingTreeFromCounts(counts, first);
+			checkCondition(treeCost(tree) == treeCost(expected), "Two-queue tree is optimal for " + file);
+			checkCondition(first.size() == 2 * frequencies.size() - 1, "Two-queue tree uses every node for " + file);
+			checkCondition(recCheckTreesEqual(tree, buildEncodingTreeFromCounts(counts, second)),
+			               "Two-queue tree is the same every time for " + file);
+
+			uint64_t weights[NUM_SYMBOLS];
+			for (int ch = 0; ch < NUM_SYMBOLS; ch++) weights[ch] = ch == PSEUDO_EOF ? 1 : counts[ch];
+			int treeLengths[NUM_SYMBOLS], arrayLengths[NUM_SYMBOLS];
+			getCodeLengths(tree, treeLengths);
+			getHuffmanCodeLengths(weights, arrayLengths);
+			checkCondition(equal(treeLengths, treeLengths + NUM_SYMBOLS, arrayLengths),
+			               "Lengths from the parent array match the two-queue tree for " + file);
+			freeTree(expected);
+		}
+	}
+	{
+		uint64_t counts[NUM_SYMBOLS] = { 0 };
+		counts['B'] = counts['A'] = 1;
+		NodeArena arena;
+		Node* tree = buildEncodingTreeFromCounts(counts, arena);
+		checkCondition(tree->zero->character == PSEUDO_EOF, "Lightest node becomes the zero child.");
+		checkCondition(tree->one->zero->character == 'A' && tree->one->one->character == 'B',
+		               "Equal leaves are merged in character order.");
+		checkCondition(tree->weight == 3, "Two-queue root weighs all the characters.");
+
+		counts['B'] = 2;
+		arena.release();
+		tree = buildEncodingTreeFromCounts(counts, arena);
+		checkCondition(tree->zero->character == 'B' && tree->one->character == NOT_A_CHAR,
+		               "Leaves are taken before equal merged trees.");
+
+		uint64_t none[NUM_SYMBOLS] = { 0 };
+		arena.release();
+		tree = buildEncodingTreeFromCounts(none, arena);
+		checkCondition(tree->character == PSEUDO_EOF && tree->zero == NULL, "Empty input gives a lone PSEUDO_EOF.");
+
+		uint64_t weights[NUM_SYMBOLS] = { 0 };
+		int lengths[NUM_SYMBOLS];
+		weights[PSEUDO_EOF] = 1;
+		getHuffmanCodeLengths(weights, lengths);
+		checkCondition(lengths[PSEUDO_EOF] == 0, "A lone PSEUDO_EOF gets length 0 from the parent array.");
+
+		// Fibonacci weights make a deep tree
+		uint64_t a = 1, b = 1, counts2[NUM_SYMBOLS] = { 0 };
+		for (int ch = 0; ch < 40; ch++) {
+			weights[ch] = counts2[ch] = a;
+			uint64_t next = a + b;
+			a = b;
+			b = next;
+		}
+		int treeLengths[NUM_SYMBOLS];
+		arena.release();
+		getCodeLengths(buildEncodingTreeFromCounts(counts2, arena), treeLengths);
+		getHuffmanCodeLengths(weights, lengths);
+		checkCondition(equal(lengths, lengths + NUM_SYMBOLS, treeLengths) && lengths[0] > 16,
+		               "Parent array lengths match a deep two-queue tree.");
+
+		// and weights too heavy for a tree of Nodes still give a complete code
+		for (int ch = 40; ch < 80; ch++) {
+			weights[ch] = a;
+			uint64_t next = a + b;
+			a = b;
+			b = next;
+		}
+		getHuffmanCodeLengths(weights, lengths);
+		checkCondition(isValidCodeLengths(lengths) && lengths[0] > lengths[79],
+		               "Parent array lengths work for weights past INT_MAX.");
+	}
+	{
+		/* A chain a million nodes deep is freed without running out of stack. */
+		Node* root = NULL;
+		for (int i = 0; i < 1000000; i++) {
+			Node* node = new Node;
+			node->character = NOT_A_CHAR;
+			node->zero = root;
+			node->one = NULL;
+			node->weight = 0;
+			root = node;
+		}
+		long before = numAllocations() - numDeallocations();
+		freeTree(root);
+		checkCondition(numAllocations() - numDeallocations() == before - 1000000, "Very deep trees are freed.");
+	}
+
 	/* This next step verifies that the encoding function creates the same tree each time.
 	 * The input given has a lot of possible trees that could be built.
 	 */
@@ -678,12 +879,46 @@ void testEncoding() {
 			decodeFile(toDecompress, encodingTree, decompressed);
 			checkCondition(fileContents.str() == decompressed.str(),
 			               "Encoding then decoding should get back the original file.");
+
+			/* The table decoder should agree with a plain walk of the tree. */
+			istringbstream toWalk(compressed.str());
+			ostringbstream walked;
+			decodeFileTreeWalk(toWalk, encodingTree, walked);
+			checkCondition(walked.str() == decompressed.str(),
+			               "Table decoding should match decoding by walking the tree.");
+
+			/* The flat tree numbers its internal nodes breadth first, one fewer than the leaves. */
+			FlatTree flat;
+			buildFlatTree(encodingTree, flat);
+			size_t leaves = 0;
+			for (uint16_t slot : flat.children) {
+				if ((slot & FLAT_LEAF) && slot != FLAT_MISSING) leaves++;
+			}
+			checkCondition(flat.children.empty() ? (flat.root & FLAT_LEAF) != 0 : leaves == flat.children.size() / 2 + 1,
+			               "A flat tree should have one more leaf than internal nodes.");
+			bool breadthFirst = true;
+			for (size_t i = 0; i < flat.children.size(); i++) {
+				if (!(flat.children[i] & FLAT_LEAF) && flat.children[i] <= i / 2) breadthFirst = false;
+			}
+			checkCondition(breadthFirst, "A flat tree's children should come after their parents.");
 		}
 	}
 	
 	endTest("encodeFile / decodeFile Tests");
 }
 
+/* Function: fileContentsOf
+ * --------------------------------------------------------
+ * Reads a whole file into a string, or returns the empty string
+ * if it can't be opened.
+ */
+string fileContentsOf(string filename) {
+	ifstream file(filename.c_str(), ios::binary);
+	ostringstream contents;
+	contents << file.rdbuf();
+	return contents.str();
+}
+
 /* Function: testCompleteStack
  * --------------------------------------------------------
  * This test will run your compress and decompress functions
@@ -725,183 +960,2475 @@ void testCompleteStack() {
 		/* Confirm that it matches. */
 		checkCondition(originalData.str() == decompressedData.str(),
 		               "Compressed/decompressed data matches.");
+
+		/* The estimate is the size of the file, found without writing it. */
+		istringstream estimateSource(originalData.str());
+		checkCondition(estimateCompressedSize(estimateSource) == result.str().size(),
+		               "The estimated size is the compressed size.");
 									 
 		checkCondition(numAllocations() - numDeallocations() == difference,
 		               "No tree nodes leaked.");
 	}
+
+	/* Stats change nothing about the output and add up to what was done. */
+	{
+		logInfo("Testing compress and decompress with stats on test/encodeDecode/tomSawyer");
+		ifbstream input("test/encodeDecode/tomSawyer");
+		assertCondition(input.is_open(), "Cannot open file test/encodeDecode/tomSawyer for reading!");
+		ostringstream originalData;
+		originalData << input.rdbuf();
+		string original = originalData.str();
+		// a fixed salt and nonce, so that the two files can be compared
+		PasswordKey password("stats test", string(SALT_BYTES, 's'), 1);
+
+		input.rewind();
+		ostringbstream plain;
+		compress(input, plain, password);
+		input.rewind();
+		ostringbstream counted;
+		CompressionStats stats;
+		compress(input, counted, password, &stats);
+		checkCondition(counted.str() == plain.str(), "Compressing with stats writes the same file.");
+		checkCondition(stats.bytesIn == original.size() && stats.symbols == original.size(),
+		               "Compress stats count every input byte.");
+		checkCondition(stats.bytesOut == counted.str().size(), "Compress stats count every output byte.");
+		checkCondition(stats.codeBits > 0 && stats.codeBits <= 8 * stats.bytesOut,
+		               "Compress stats count the code bits within the output.");
+		checkCondition(stats.treeDepth > 0 && stats.refills > 0, "Compress stats record the tree depth and refills.");
+		checkCondition(stats.countSeconds >= 0 && stats.treeSeconds >= 0 && stats.headerSeconds >= 0 &&
+		               stats.codingSeconds > 0, "Compress stats time every phase.");
+
+		istringbstream compressedData(counted.str());
+		ostringbstream decompressedData;
+		CompressionStats decoded;
+		decompress(compressedData, decompressedData, password, &decoded);
+		checkCondition(decompressedData.str() == original, "Decompressing with stats gets the file back.");
+		checkCondition(decoded.symbols == original.size() && decoded.bytesOut == original.size(),
+		               "Decompress stats count every output byte.");
+		checkCondition(decoded.bytesIn == counted.str().size(), "Decompress stats count every input byte.");
+		checkCondition(decoded.codeBits == stats.codeBits && decoded.treeDepth == stats.treeDepth,
+		               "Decompress stats agree with compress on the code.");
+
+		input.rewind();
+		ostringbstream blocks;
+		compressStream(input, blocks, password);
+		istringbstream blockData(blocks.str());
+		ostringbstream blockResult;
+		CompressionStats blockStats;
+		decompress(blockData, blockResult, password, &blockStats);
+		checkCondition(blockResult.str() == original && blockStats.bytesOut == original.size(),
+		               "Decompress stats count the output of block files.");
+	}
+
+	/* Sampling reads a twentieth of a large input to build its code, and costs it little. */
+	{
+		logInfo("Testing sampled compression on test/encodeDecode/tomSawyer");
+		string text = fileContentsOf("test/encodeDecode/tomSawyer");
+		PasswordKey password("sample password", string(SALT_BYTES, 's'), 1);
+		istringbstream small(text), smallExact(text);
+		ostringbstream sampledSmall, exactSmall;
+		compressSampled(small, sampledSmall, password);
+		compress(smallExact, exactSmall, password);
+		checkCondition(sampledSmall.str() == exactSmall.str(), "An input within one interval is counted exactly.");
+
+		// a character only in a block the sample skips must still have a code
+		string large;
+		while (large.size() < (4 << 20)) large += text;
+		large[SAMPLE_BLOCK_SIZE + 5] = '\x01';
+		istringbstream source(large), exactSource(large);
+		ostringbstream sampled, exact;
+		CompressionStats stats;
+		compressSampled(source, sampled, password, &stats);
+		compress(exactSource, exact, password);
+		istringbstream toDecode(sampled.str());
+		ostringbstream decoded;
+		decompress(toDecode, decoded, password);
+		checkCondition(decoded.str() == large, "A sampled file should decompress to the original.");
+		checkCondition(stats.bytesIn == large.size() && stats.bytesOut == sampled.str().size(),
+		               "Sampled stats count every byte in and out.");
+		checkCondition(stats.sampledBytes > 0 && stats.sampledBytes <= large.size() / DEFAULT_SAMPLE_INTERVAL + SAMPLE_BLOCK_SIZE,
+		               "Sampling should read about one block in twenty.");
+		int64_t extraBytes = int64_t(sampled.str().size()) - int64_t(exact.str().size());
+		checkCondition(stats.sampleLossBits >= 0 && extraBytes >= stats.sampleLossBits / 8 - 1 &&
+		               extraBytes <= stats.sampleLossBits / 8 + 1,
+		               "Sampled stats should record the bits the sample cost.");
+		checkCondition(sampled.str().size() < exact.str().size() + exact.str().size() / 100,
+		               "A sampled code should cost less than 1% over the exact one.");
+
+		string noise(1 << 21, '\0');
+		uint64_t state = 0x53414D50;
+		for (size_t i = 0; i < noise.size(); i++) {
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			noise[i] = char(state >> 56);
+		}
+		istringbstream noiseSource(noise);
+		ostringbstream storedNoise;
+		compressSampled(noiseSource, storedNoise, password);
+		checkCondition(storedNoise.str().size() == noise.size() + FORMAT_PREFIX_BYTES + 8, "Sampled random data should be stored.");
+		istringbstream noiseData(storedNoise.str());
+		ostringbstream noiseDecoded;
+		decompress(noiseData, noiseDecoded, password);
+		checkCondition(noiseDecoded.str() == noise, "Stored sampled data should decompress.");
+	}
+
+	/* Input cut short stops with an error at its end instead of decoding the padding after it. */
+	{
+		Vector<string> shortFiles;
+		shortFiles += "fibonacci", "poem", "tomSawyer";
+		foreach (string file in shortFiles) {
+			string original = fileContentsOf("test/encodeDecode/" + file);
+			istringbstream source(original), contextSource(original);
+			ostringbstream single, contexts;
+			compress(source, single, "truncation password");
+			compressWithContexts(contextSource, contexts, "truncation password");
+
+			bool allCaught = true;
+			string compressedFiles[] = { single.str(), contexts.str() };
+			for (const string& compressed : compressedFiles) {
+				size_t cuts[] = { compressed.size() - 1, compressed.size() - 2, compressed.size() / 2 };
+				for (size_t cut : cuts) {
+					try {
+						istringbstream toDecode(compressed.substr(0, cut));
+						ostringbstream garbage;
+						decompress(toDecode, garbage, "truncation password");
+						allCaught = false;
+					} catch (ErrorException&) {
+						// expected
+					}
+				}
+			}
+			checkCondition(allCaught, "Decompressing " + file + " cut short raises an error.");
+
+			istringstream frequencySource(original);
+			Map<ext_char, int> frequencies = getFrequencyTable(frequencySource);
+			NodeArena arena;
+			Node* tree = buildEncodingTree(frequencies, arena);
+			istringstream encodeSource(original);
+			ostringbstream encoded;
+			encodeFile(encodeSource, tree, encoded);
+			string cut = encoded.str().substr(0, encoded.str().size() - 1);
+			bool tableCaught = false, walkCaught = false;
+			try {
+				istringbstream toDecode(cut);
+				ostringbstream garbage;
+				decodeFile(toDecode, tree, garbage);
+			} catch (ErrorException&) {
+				tableCaught = true;
+			}
+			try {
+				istringbstream toDecode(cut);
+				ostringbstream garbage;
+				decodeFileTreeWalk(toDecode, tree, garbage);
+			} catch (ErrorException&) {
+				walkCaught = true;
+			}
+			checkCondition(tableCaught && walkCaught, "decodeFile and the tree walk stop at the end of " + file + " cut short.");
+		}
+	}
 	
 	endTest("Complete Stack Tests");
 }
 
-/* Function: printBits
+/* Function: codeCost
  * --------------------------------------------------------
- * Given a string, prints the bits of that string one at a
- * time.
+ * Returns the number of bits the given code lengths take to
+ * encode characters with the given weights.
  */
-void printBits(string str, int maxBits) {
-	/* Wrap your string in an istringbstream so we can do bit-by-bit
-	 * I/O.
-	 */
-	istringbstream stream(str);
-	for (int i = 0; i < maxBits; i++) {
-		int bit = stream.readBit();
-		if (bit == EOF) break;
-		cout << bit;
+uint64_t codeCost(const uint64_t weights[NUM_SYMBOLS], const int lengths[NUM_SYMBOLS]) {
+	uint64_t cost = 0;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		cost += weights[ch] * lengths[ch];
 	}
-	cout << endl;
+	return cost;
 }
 
-/* Function: manualEncodeDecode
+/* Function: maxCodeLength
  * --------------------------------------------------------
- * Function to let you manually test running encode and
- * decode on a given string.
+ * Returns the longest of the given code lengths.
  */
-void manualEncodeDecode() {
-	beginTest("Manual encodeFile / decodeFile Tests");
-	
-	cout << "Enter text for us to encode and then decode" << endl;
-	while (true) {
-		string text = getLine("Text (enter to stop test): ");
-		if (text == "") break;
-		
-		/* Build an istringstream holding the data. */
-		istringbstream source(text);
-
-		/* Construct the encoding tree for the text. */
-		Map<ext_char, int> frequencies = getFrequencyTable(source);
-		Node* tree = buildEncodingTree(frequencies);
-		ostringbstream compressed;
-		
-		/* Encode the text. */
-		source.rewind();
-		encodeFile(source, tree, compressed);
-		
-		/* Print out the compressed representation. */
-		cout << "Compressed representation: " << endl;
-		printBits(compressed.str(), treeCost(tree));
-		
-		/* No need to generate new map/tree because we know we'd read same map that we wrote,
-		 * meaning we'd also get the same tree (assuming tree function is deterministic.)
-		 */
-		istringbstream compressedIn(compressed.str());
-		ostringstream unpacked;
-		decodeFile(compressedIn, tree, unpacked);
-		checkCondition(unpacked.str() == text, "Result of compressing and decompressing should be the original input.");
-		
-		/* Clean up memory. */
-		freeTree(tree);
-	}
+int maxCodeLength(const int lengths[NUM_SYMBOLS]) {
+	return *max_element(lengths, lengths + NUM_SYMBOLS);
 }
 
-/* Function: openFile
+/* Function: putHeaderGamma
  * --------------------------------------------------------
- * Prompts the user for the name of a file to open, opening
- * the indicated stream object to that file.
+ * Writes value in the Elias gamma code compact headers use,
+ * encrypted with the given stream, so that tests can forge
+ * headers the writer would never produce.
  */
-template <typename FileStream>
-void openFile(FileStream& file, string prompt = "") {
-	while (true) {
-		string filename = getLine(prompt);
-		file.open(filename.c_str());
-		
-		if (file.is_open()) return;
-		
-		cout << "Sorry, I couldn't open that file." << endl;
-		file.clear();
-	}
+static void putHeaderGamma(obstream& outfile, KeyStream& stream, int value) {
+	int width = 0;
+	while ((value >> width) > 1) width++;
+	outfile.writeBits(stream.nextBits(uint64_t(1) << width, width + 1), width + 1);
+	if (width > 0) outfile.writeBits(stream.nextBits(value & ((1 << width) - 1), width), width);
 }
 
-/* Function: runCompress
+/* Function: compactRunsHeader
  * --------------------------------------------------------
- * Harness to run your compress function on actual files.
+ * A compact header, under block 0 of the password's keystream,
+ * that lists the used bytes as the given runs and gives 'a' and
+ * PSEUDO_EOF, which must be all the runs mark as used, a length
+ * of 1 each.
  */
-void runCompress() {
-	/* Open a file for reading. */
-	ifbstream infile;
-	openFile(infile, "File to compress: ");
-
-	/* Open a file for writing. */
-	ofbstream outfile;
-	openFile(outfile, "Filename for compressed output: ");
-		
-	/* Compress the file. */
-	cout << "Compressing... " << flush;
-	compress(infile, outfile);
-	cout << "done!" << endl << endl;
-		
-	/* Report statistics. */
-	cout << "Original file size: " << infile.size() << "B" << endl;
-	cout << "New file size:      " << outfile.size() << "B" << endl;
-	cout << "Compression ratio:  " << double(outfile.size()) / infile.size() << endl << endl;
-	getLine("Press ENTER to continue...");
+static string compactRunsHeader(const PasswordKey& password, const int* runs, int count) {
+	ostringbstream header;
+	KeyStream stream(password.keystreamKey(), 0);
+	header.writeBits(stream.nextBits(7, 3), 3); // the width field that marks a compact header
+	header.writeBits(stream.nextBits(1, 1), 1); // in runs
+	for (int i = 0; i < count; i++) putHeaderGamma(header, stream, runs[i] + 1);
+	header.writeBits(stream.nextBits(1, 6), 6);
+	header.writeBits(stream.nextBits(0, 1), 1);
+	header.flushBits();
+	return header.str();
 }
 
-/* Function: runDecompress
+/* Function: testCanonicalCodes
  * --------------------------------------------------------
- * Harness code to run your decompression routine. */
-void runDecompress() {
-	ifbstream infile;
-	openFile(infile, "File to decompress: ");
+ * Checks that canonical codes keep the lengths, and so the
+ * cost, of the encoding tree they come from, and that the
+ * table built straight from the lengths decodes what the
+ * canonical tree encodes.
+ */
+void testCanonicalCodes() {
+	beginTest("Canonical Code Tests");
 
-	/* Get the name of the output file. */
-	ofbstream outfile;
-	openFile(outfile, "Name of file to write result: ");
-		
-	/* Decompress the file. */
-	decompress(infile, outfile);
-	cout << "Decompressed file written!" << endl;
-	getLine("Press ENTER to continue...");
-}
+	Vector<string> files;
+	files += "singleChar", "nonRepeated", "alphaOnce", "allRepeated", "fibonacci", "poem", "allCharsOnce", "tomSawyer", "dikdik.jpg", "random";
 
-/* Function: compareFiles
- * --------------------------------------------------------
- * Compares two files byte-by-byte to determine whether or
- * not they are equivalent to one another.
- */
-void compareFiles() {
-	/* Get the two files to compare. */
-	ifstream one, two;
-	openFile(one, "First file to compare:  ");
-	openFile(two, "Second file to compare: ");
-	
-	/* Read the contents of the files into a stringstream for
-	 * comparison.
+	foreach (string file in files) {
+		logInfo("Testing canonical codes on file test/encodeDecode/" + file);
+		long difference = numAllocations() - numDeallocations();
+
+		ifbstream input("test/encodeDecode/" + file);
+		assertCondition(input.is_open(), ("Cannot open file test/encodeDecode/" + file + " for reading!"));
+		ostringstream fileContents;
+		fileContents << input.rdbuf();
+		input.rewind();
+
+		Map<ext_char, int> frequencies = getFrequencyTable(input);
+		input.rewind();
+		Node* tree = buildEncodingTree(frequencies);
+		int lengths[NUM_SYMBOLS];
+		getCodeLengths(tree, lengths);
+		checkCondition(isValidCodeLengths(lengths), "Tree depths should form a complete code.");
+
+		/* Same lengths, so the same number of bits as the original tree. */
+		Node* canonical = buildCanonicalTree(lengths);
+		int canonicalLengths[NUM_SYMBOLS];
+		getCodeLengths(canonical, canonicalLengths);
+		bool sameLengths = true;
+		for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+			if (lengths[ch] != canonicalLengths[ch]) sameLengths = false;
+		}
+		checkCondition(sameLengths, "Canonical tree should give every character the same length.");
+
+		ostringbstream compressed;
+		encodeFile(input, canonical, compressed);
+		checkCondition(compressed.size() == (treeCost(tree) + 7) / 8,
+		               "Canonical encoding should be exactly as long as the original encoding.");
+
+		/* Encoding straight from the lengths should give the same bytes. */
+		input.rewind();
+		EncodeTable encodeTable;
+		buildCanonicalEncodeTable(lengths, encodeTable);
+		ostringbstream fromTable;
+		encodeFileWithTable(input, encodeTable, fromTable);
+		checkCondition(fromTable.str() == compressed.str(),
+		               "Encoding with a table built from the lengths should match the canonical tree.");
+
+		istringbstream toDecode(compressed.str());
+		ostringbstream decoded;
+		DecodeTable table;
+		buildCanonicalDecodeTable(lengths, table);
+		decodeFileWithTable(toDecode, table, decoded);
+		checkCondition(decoded.str() == fileContents.str(),
+		               "Decoding with a table built from the lengths should get back the original file.");
+
+		/* The multi-symbol engine decodes the same, whichever one decodeFileWithTable picks. */
+		MultiDecodeTable multi;
+		buildMultiDecodeTable(table, multi);
+		istringbstream toMulti(compressed.str());
+		ostringbstream multiDecoded;
+		decodeFileMultiSymbol(toMulti, table, multi, multiDecoded);
+		checkCondition(multiDecoded.str() == fileContents.str(),
+		               "Multi-symbol decoding should get back the original file.");
+
+		/* Stats are counted by the engine that would run without them. */
+		istringbstream toCount(compressed.str());
+		ostringbstream countedDecoded;
+		CompressionStats decodeStats, encodeStats;
+		decodeFileWithTable(toCount, table, countedDecoded, &decodeStats);
+		input.rewind();
+		ostringbstream recoded;
+		encodeFileWithTable(input, encodeTable, recoded, &encodeStats);
+		checkCondition(countedDecoded.str() == fileContents.str() && decodeStats.symbols == fileContents.str().size() &&
+		               decodeStats.codeBits == encodeStats.codeBits,
+		               "Decoding with stats should count every code, whichever engine it picks.");
+		if (file == "tomSawyer" || file == "fibonacci") {
+			checkCondition(prefersMultiSymbolDecode(table), "Short codes should pick the multi-symbol engine.");
+		} else if (file == "random" || file == "dikdik.jpg") {
+			checkCondition(!prefersMultiSymbolDecode(table), "Eight bit codes should keep the single-symbol engine.");
+		}
+		bool rejected = false;
+		try {
+			istringbstream truncated(compressed.str().substr(0, compressed.str().size() / 2));
+			ostringstream ignored;
+			decodeFileMultiSymbol(truncated, table, multi, ignored);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected || compressed.str().size() < 2, "Multi-symbol decoding should reject a truncated file.");
+
+		freeTree(tree);
+		freeTree(canonical);
+		checkCondition(numAllocations() - numDeallocations() == difference, "No tree nodes leaked.");
+	}
+
+	/* Length-limited codes should stay valid and optimal, and only cost more when the
+	 * limit actually cuts into the tree.
 	 */
-	ostringstream oneContents, twoContents;
-	oneContents << one.rdbuf();
-	twoContents << two.rdbuf();
-	
-	const string oneString = oneContents.str(), twoString = twoContents.str();
-	
-	/* Check lengths are the same. */
-	if (oneString.length() != twoString.length()) {
-		cout << "Files differ!" << endl;
-		cout << "File one has length " << oneString.length() << "." << endl;
-		cout << "File two has length " << twoString.length() << "." << endl;
-	} else {
-		/* Compare the two sequences to find a mismatch. */
-		pair<string::const_iterator, string::const_iterator> diff =
-			mismatch(oneString.begin(), oneString.end(), twoString.begin());
-		if (diff.first != oneString.end()) {
-			cout << "Files differ!" << endl;
-			ptrdiff_t offset = diff.first - oneString.begin();
-			cout << "Bytes differ at offset " << offset << "." << endl;
-			cout << "File one has value " << representationOf(*diff.first) << endl;
-			cout << "File two has value " << representationOf(*diff.second) << endl;
-		} else {
-			/* Files match! */
-			cout << "Files match!" << endl;
+	foreach (string file in files) {
+		ifbstream input("test/encodeDecode/" + file);
+		uint64_t counts[NUM_SYMBOLS] = { 0 };
+		countStream(input, counts);
+		counts[PSEUDO_EOF] = 1;
+		int lengths[NUM_SYMBOLS], limited[NUM_SYMBOLS], capped[NUM_SYMBOLS];
+		getCodeLengthsForCounts(counts, lengths);
+		getLimitedCodeLengths(counts, MAX_CANONICAL_LENGTH, limited);
+		getLimitedCodeLengths(counts, 9, capped);
+		checkCondition(codeCost(counts, limited) == codeCost(counts, lengths),
+		               "Package-merge with room to spare is as cheap as the tree for " + file);
+		checkCondition(isValidCodeLengths(capped) && maxCodeLength(capped) <= 9,
+		               "Codes limited to 9 bits are complete for " + file);
+		checkCondition(codeCost(counts, capped) >= codeCost(counts, lengths),
+		               "Limited codes never beat the tree for " + file);
+		if (maxCodeLength(lengths) <= 9) {
+			checkCondition(codeCost(counts, capped) == codeCost(counts, lengths),
+			               "A limit the tree already meets costs nothing for " + file);
 		}
 	}
-	getLine("Press ENTER to continue...");
-}
+	{
+		/* Fibonacci weights make a tree as deep as it has characters. */
+		uint64_t counts[NUM_SYMBOLS] = { 0 };
+		uint64_t previous = 1, current = 1;
+		for (int ch = 0; ch < 40; ch++) {
+			counts[ch] = current;
+			uint64_t next = previous + current;
+			previous = current;
+			current = next;
+		}
+		int lengths[NUM_SYMBOLS];
+		getCodeLengthsForCounts(counts, lengths);
+		checkCondition(maxCodeLength(lengths) > 32, "Fibonacci counts give codes longer than 32 bits.");
+		getCodeLengthsForCounts(counts, lengths, 15);
+		checkCondition(isValidCodeLengths(lengths) && maxCodeLength(lengths) <= 15,
+		               "Fibonacci counts limited to 15 bits give a complete code.");
 
-/* Function: displayMenu
- * --------------------------------------------------------
- * Displays the main menu of options.
- */
-void displayMenu() {
-	cout << "CS106B Huffman Encoding Testing Harness" << endl;
+		/* The limited code should still round-trip. */
+		string text;
+		for (int ch = 0; ch < 40; ch++) {
+			text += string(ch % 7 + 1, char(ch));
+		}
+		EncodeTable encodeTable;
+		buildCanonicalEncodeTable(lengths, encodeTable);
+		istringstream source(text);
+		ostringbstream compressed;
+		encodeFileWithTable(source, encodeTable, compressed);
+		istringbstream toDecode(compressed.str());
+		ostringbstream decoded;
+		DecodeTable table;
+		buildCanonicalDecodeTable(lengths, table);
+		decodeFileWithTable(toDecode, table, decoded);
+		checkCondition(decoded.str() == text, "Text encoded with a 15-bit limited code decodes.");
+	}
+	{
+		/* Counts past what an int can hold, as in multi-gigabyte inputs. */
+		uint64_t counts[NUM_SYMBOLS] = { 0 };
+		counts['A'] = 3000000000ULL;
+		counts['B'] = 5000000000ULL;
+		counts['C'] = 1;
+		int lengths[NUM_SYMBOLS];
+		getCodeLengthsForCounts(counts, lengths);
+		checkCondition(lengths['B'] == 1 && lengths['A'] == 2 && lengths['C'] == 3 && lengths[PSEUDO_EOF] == 3,
+		               "Counts over 2^32 still give the optimal code.");
+
+		uint64_t previous = 1, current = 1;
+		for (int ch = 0; ch < 60; ch++) {
+			counts[ch] = current;
+			uint64_t next = previous + current;
+			previous = current;
+			current = next;
+		}
+		getCodeLengthsForCounts(counts, lengths);
+		checkCondition(isValidCodeLengths(lengths), "Fibonacci counts over 2^40 give a complete code.");
+		getCodeLengthsForCounts(counts, lengths, 24);
+		checkCondition(isValidCodeLengths(lengths) && maxCodeLength(lengths) <= 24,
+		               "Fibonacci counts over 2^40 limited to 24 bits give a complete code.");
+	}
+	{
+		/* With at most 3 bits, the best code for 1, 1, 2, 4, 8 is 3, 3, 3, 3, 1. */
+		uint64_t weights[NUM_SYMBOLS] = { 0 };
+		weights['A'] = weights['B'] = 1;
+		weights['C'] = 2;
+		weights['D'] = 4;
+		weights['E'] = 8;
+		int lengths[NUM_SYMBOLS];
+		getLimitedCodeLengths(weights, 3, lengths);
+		checkCondition(lengths['A'] == 3 && lengths['B'] == 3 && lengths['C'] == 3 && lengths['D'] == 3 && lengths['E'] == 1,
+		               "Package-merge finds the best 3-bit code.");
+		bool rejected = false;
+		try {
+			getLimitedCodeLengths(weights, 2, lengths);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "A limit too short for five characters is an error.");
+	}
+
+	/* A static alphabet's codes are canonical codes worked out by the compiler. */
+	static_assert(StaticHuffmanCodec<DnaAlphabet>::code('A').length == 2, "A takes two bits.");
+	static_assert(StaticHuffmanCodec<DnaAlphabet>::code('T').length == 3, "T takes three bits.");
+	static_assert(StaticHuffmanCodec<DnaAlphabet>::code('N').length == 0, "N is not a base.");
+	static_assert(StaticHuffmanCodec<HexAlphabet>::tables.rootBits == 5, "Hex codes are at most five bits.");
+	{
+		string samples[] = { "", "f", "0123456789abcdef", "deadbeef00c0ffee", string(5000, '7') + "abcdef" };
+		for (const string& sample : samples) {
+			ostringbstream encoded;
+			StaticHuffmanCodec<HexAlphabet>::encodeBuffer((const unsigned char*)sample.data(), sample.size(), encoded);
+			size_t bits = 4 * sample.size() + size_t(count(sample.begin(), sample.end(), 'f')) + 5;
+			checkCondition(encoded.size() == int64_t((bits + 7) / 8),
+			               "Hex digits take four bits, or five for f.");
+
+			/* The same bytes as the canonical table for the same lengths. */
+			int lengths[NUM_SYMBOLS];
+			StaticHuffmanCodec<HexAlphabet>::getCodeLengths(lengths);
+			checkCondition(isValidCodeLengths(lengths), "Static lengths should be a complete code.");
+			EncodeTable table;
+			buildCanonicalEncodeTable(lengths, table);
+			ostringbstream canonical;
+			encodeBufferWithTable((const unsigned char*)sample.data(), sample.size(), table, canonical);
+			checkCondition(canonical.str() == encoded.str(), "Static codes should be the canonical codes.");
+
+			/* The generic tree decoder reads the static stream, and the static decoder the tree's. */
+			Node* tree = StaticHuffmanCodec<HexAlphabet>::buildEncodingTree();
+			istringbstream source(encoded.str());
+			ostringstream decoded;
+			decodeFile(source, tree, decoded);
+			checkCondition(decoded.str() == sample, "decodeFile should read a static stream.");
+			istringstream plain(sample);
+			ostringbstream treeEncoded;
+			encodeFile(plain, tree, treeEncoded);
+			freeTree(tree);
+			istringbstream treeSource(treeEncoded.str());
+			ostringstream treeDecoded;
+			StaticHuffmanCodec<HexAlphabet>::decodeFile(treeSource, treeDecoded);
+			checkCondition(treeDecoded.str() == sample, "The static decoder should read encodeFile's stream.");
+		}
+
+		string bases = "GATTACA";
+		istringstream plain(bases);
+		ostringbstream encoded;
+		StaticHuffmanCodec<DnaAlphabet>::encodeFile(plain, encoded);
+		checkCondition(encoded.size() == 3, "Seven bases and PSEUDO_EOF should take 19 bits.");
+		istringbstream source(encoded.str());
+		ostringstream decoded;
+		StaticHuffmanCodec<DnaAlphabet>::decodeFile(source, decoded);
+		checkCondition(decoded.str() == bases, "DNA bases should round-trip.");
+
+		bool rejected = false;
+		try {
+			ostringbstream ignored;
+			StaticHuffmanCodec<DnaAlphabet>::encodeBuffer((const unsigned char*)"GATN", 4, ignored);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "A character outside the alphabet is an error.");
+
+		rejected = false;
+		try {
+			istringbstream truncated(encoded.str().substr(0, 1));
+			ostringstream ignored;
+			StaticHuffmanCodec<DnaAlphabet>::decodeFile(truncated, ignored);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "A truncated static stream is an error.");
+	}
+
+	/* Lengths that over- or under-fill the code space must be rejected. */
+	{
+		int lengths[NUM_SYMBOLS] = { 0 };
+		lengths['A'] = 1;
+		lengths[PSEUDO_EOF] = 2;
+		checkCondition(!isValidCodeLengths(lengths), "Incomplete code lengths should be rejected.");
+		lengths['B'] = 2;
+		checkCondition(isValidCodeLengths(lengths), "Complete code lengths should be accepted.");
+		lengths['C'] = 2;
+		checkCondition(!isValidCodeLengths(lengths), "Oversubscribed code lengths should be rejected.");
+	}
+
+	/* Headers read back exactly, in as many bits as canonicalHeaderBits says, and never
+	 * take more than listing the lengths, one way or the other, did before compact headers.
+	 */
+	{
+		Vector<string> samples;
+		foreach (string file in files) {
+			samples += fileContentsOf("test/encodeDecode/" + file);
+		}
+		samples += "ab", string(1000, 'x') + "y", "0123456789abcdef", "ACGTTGCAACGT";
+		string everyOther, deep;
+		for (int ch = 0; ch < PSEUDO_EOF; ch += 2) {
+			everyOther += string(ch % 5 + 1, char(ch));
+		}
+		uint64_t previous = 1, current = 1;
+		for (int ch = 0; ch < 20; ch++) {
+			deep += string(current, char('a' + ch * 11));
+			uint64_t next = previous + current;
+			previous = current;
+			current = next;
+		}
+		samples += everyOther, deep;
+
+		int compacted = 0;
+		foreach (string sample in samples) {
+			uint64_t counts[NUM_SYMBOLS] = { 0 };
+			countBytes((const unsigned char*)sample.data(), sample.size(), counts);
+			int lengths[NUM_SYMBOLS];
+			getCodeLengthsForCounts(counts, lengths);
+
+			ostringbstream header;
+			int bits = writeCanonicalFileHeader(header, lengths, "header password", 3);
+			checkCondition(bits == canonicalHeaderBits(lengths) && header.size() == (bits + 7) / 8,
+			               "A header takes the bits canonicalHeaderBits says.");
+			istringbstream reading(header.str());
+			int readLengths[NUM_SYMBOLS];
+			checkCondition(readCanonicalFileHeader(reading, readLengths, "header password", 3) == bits,
+			               "Reading a header takes the bits writing it did.");
+			bool same = true;
+			for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+				if (readLengths[ch] != lengths[ch]) same = false;
+			}
+			checkCondition(same, "A header reads back the lengths it was written with.");
+
+			int used = 0, longest = 0;
+			for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+				if (lengths[ch] > 0) used++;
+				longest = max(longest, lengths[ch]);
+			}
+			int width = 1;
+			while ((longest >> width) != 0) width++;
+			checkCondition(bits <= min(4 + NUM_SYMBOLS * width, 13 + used * (9 + width)),
+			               "A header is never longer than the dense and sparse lists.");
+
+			// a version without the flag gets the header older readers know, which reads the same either way
+			ostringbstream plain;
+			int plainBits = writeCanonicalFileHeader(plain, lengths, "header password", 3, FORMAT_VERSION_KEYSTREAM);
+			checkCondition(plainBits == canonicalHeaderBits(lengths, FORMAT_VERSION_KEYSTREAM) && plainBits >= bits &&
+			               plainBits == min(4 + NUM_SYMBOLS * width, 13 + used * (9 + width)),
+			               "A header for a version without FORMAT_FLAG_COMPACT is never compact.");
+			if (plainBits > bits) compacted++;
+			for (int compact = 0; compact < 2; compact++) {
+				istringbstream plainReading(plain.str());
+				int version = FORMAT_VERSION_KEYSTREAM | (compact ? FORMAT_FLAG_COMPACT : 0);
+				bool plainSame = readCanonicalFileHeader(plainReading, readLengths, "header password", 3, version) == plainBits;
+				for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+					if (readLengths[ch] != lengths[ch]) plainSame = false;
+				}
+				checkCondition(plainSame, "A header that isn't compact reads back with or without the flag.");
+			}
+		}
+		checkCondition(compacted > 0, "Compact headers are shorter for some of the samples.");
+
+		/* Small alphabets list their few characters in a handful of bits. */
+		uint64_t counts[NUM_SYMBOLS] = { 0 };
+		counts['a'] = 1;
+		int lengths[NUM_SYMBOLS];
+		getCodeLengthsForCounts(counts, lengths);
+		checkCondition(canonicalHeaderBits(lengths) < 4 + 9 + 2 * (9 + 1), "One character's header is compact.");
+
+		/* Only the first run may be empty; an empty run after it is a forged header. */
+		PasswordKey password("runs password");
+		int version = FORMAT_VERSION_KEYSTREAM | FORMAT_FLAG_COMPACT;
+		int plainRuns[] = { 'a', 1, PSEUDO_EOF - 'a' - 1 };
+		istringbstream plain(compactRunsHeader(password, plainRuns, 3));
+		readCanonicalFileHeader(plain, lengths, password, 0, version);
+		checkCondition(lengths['a'] == 1 && lengths[PSEUDO_EOF] == 1 && lengths['b'] == 0,
+		               "A hand-written compact header in runs reads back.");
+		int emptyRuns[] = { 'a', 0, 0, 1, PSEUDO_EOF - 'a' - 1 };
+		istringbstream forged(compactRunsHeader(password, emptyRuns, 5));
+		bool rejected = false;
+		try {
+			readCanonicalFileHeader(forged, lengths, password, 0, version);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "A compact header with an empty run after the first is rejected.");
+	}
+
+	endTest("Canonical Code Tests");
+}
+
+/* Function: testBitStreams
+ * --------------------------------------------------------
+ * Checks that the bulk bit operations on obstream produce
+ * exactly the same bytes as writing every bit with writeBit,
+ * including when the two are mixed on one stream.
+ */
+void testBitStreams() {
+	beginTest("Bulk Bit I/O Tests");
+
+	/* A fixed pseudo-random sequence of codes, so failures are repeatable. */
+	Vector<uint64_t> codes;
+	Vector<int> lengths;
+	uint64_t state = 12345;
+	for (int i = 0; i < 5000; i++) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		codes += state >> 7;
+		lengths += int(state >> 58) + 1;
+	}
+
+	logInfo("Writing 5000 codes of 1 to 64 bits with writeBits and with writeBit.");
+	{
+		ostringbstream bulk, single;
+		for (int i = 0; i < codes.size(); i++) {
+			bulk.writeBits(codes[i], lengths[i]);
+			for (int b = 0; b < lengths[i]; b++) {
+				single.writeBit(int((codes[i] >> b) & 1));
+			}
+		}
+		bulk.flushBits();
+		checkCondition(bulk.str() == single.str(), "writeBits should match writeBit bit for bit.");
+	}
+
+	logInfo("Mixing writeBits, writeBit and flushBits on one stream.");
+	{
+		ostringbstream mixed, single;
+		for (int i = 0; i < codes.size(); i++) {
+			if (i % 7 == 3) {
+				for (int b = 0; b < lengths[i]; b++) {
+					mixed.writeBit(int((codes[i] >> b) & 1));
+				}
+			} else {
+				mixed.writeBits(codes[i], lengths[i]);
+			}
+			if (i % 11 == 5) mixed.flushBits();
+			for (int b = 0; b < lengths[i]; b++) {
+				single.writeBit(int((codes[i] >> b) & 1));
+			}
+		}
+		mixed.flushBits();
+		checkCondition(mixed.str() == single.str(), "Interleaved bit writes should match writeBit bit for bit.");
+	}
+
+	logInfo("Reading the same codes back with readBits, peekBits and readBit.");
+	{
+		ostringbstream written;
+		for (int i = 0; i < codes.size(); i++) {
+			written.writeBits(codes[i], lengths[i]);
+		}
+		written.flushBits();
+
+		istringbstream reader(written.str());
+		bool allMatch = true;
+		for (int i = 0; i < codes.size(); i++) {
+			int length = lengths[i];
+			uint64_t expected = length == 64 ? codes[i] : codes[i] & ((uint64_t(1) << length) - 1);
+			uint64_t actual = 0;
+			if (length > 57) {
+				actual = reader.readBits(32);
+				actual |= reader.readBits(length - 32) << 32;
+			} else if (i % 5 == 0) {
+				for (int b = 0; b < length; b++) {
+					actual |= uint64_t(reader.readBit()) << b;
+				}
+			} else {
+				actual = reader.peekBits(length);
+				reader.consumeBits(length);
+			}
+			if (actual != expected) allMatch = false;
+		}
+		checkCondition(allMatch, "Bulk reads should return the bits that were written.");
+	}
+
+	logInfo("Handing read-ahead bytes back to the stream with syncBits.");
+	{
+		istringbstream reader("ABCDEFGHIJ");
+		reader.readBits(12);
+		reader.syncBits();
+		checkCondition(reader.readBit() == ((('B' >> 4) & 1)), "readBit should continue inside the partly read byte.");
+		checkCondition(reader.get() == 'C', "get should continue at the first untouched byte.");
+		checkCondition(reader.readBits(16) == ('D' | ('E' << 8)), "Bulk reads should resume after get.");
+	}
+
+	logInfo("Encoding bytes a code at a time and four codes at a time.");
+	{
+		/* Short codes get packed four at a time; a table with one long
+		 * code must take the one at a time path.  Both must lay the
+		 * bits out exactly as writing each code in turn does.
+		 */
+		int shortLengths[NUM_SYMBOLS], longLengths[NUM_SYMBOLS];
+		uint64_t counts[NUM_SYMBOLS] = { 0 };
+		for (int ch = 0; ch < PSEUDO_EOF; ch++) counts[ch] = 1 + (ch * 37) % 101;
+		getCodeLengthsForCounts(counts, shortLengths);
+		for (int ch = 0; ch < 40; ch++) counts[ch] = uint64_t(1) << ch;
+		getCodeLengthsForCounts(counts, longLengths);
+		const int* tables[] = { shortLengths, longLengths };
+
+		string data;
+		for (int i = 0; i < 4099; i++) {
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			data += char(state >> 56);
+		}
+		bool streamMatches = true, memoryMatches = true;
+		for (const int* lengths : tables) {
+			EncodeTable table;
+			buildCanonicalEncodeTable(lengths, table);
+			for (size_t start = 0; start < 4; start++) {
+				const unsigned char* bytes = (const unsigned char*)data.data() + start;
+				size_t length = data.size() - start;
+
+				ostringbstream single;
+				for (size_t i = 0; i < length; i++) {
+					single.writeBits(table.codes[bytes[i]].bits, table.codes[bytes[i]].length);
+				}
+				single.writeBits(table.codes[PSEUDO_EOF].bits, table.codes[PSEUDO_EOF].length);
+				single.flushBits();
+
+				ostringbstream packed;
+				encodeBufferWithTable(bytes, length, table, packed);
+				if (packed.str() != single.str()) streamMatches = false;
+
+				std::vector<unsigned char> memory(single.str().size() + 8, 0);
+				size_t used = encodeBufferToMemory(bytes, length, table, memory.data(), 0);
+				if (string((const char*)memory.data(), used) != single.str()) memoryMatches = false;
+			}
+		}
+		checkCondition(streamMatches, "Packed stream encoding matches encoding one code at a time.");
+		checkCondition(memoryMatches, "Packed memory encoding matches encoding one code at a time.");
+
+		/* Interleaved streams must decode back whatever the length, the
+		 * code, and however many bits come before them, and a frame
+		 * cut short or with a wrong size must be caught.
+		 */
+		logInfo("Encoding and decoding interleaved streams.");
+		bool roundTrips = true, truncationCaught = true, badSizeCaught = true;
+		for (const int* lengths : tables) {
+			EncodeTable encoder;
+			buildCanonicalEncodeTable(lengths, encoder);
+			DecodeTable decoder;
+			buildCanonicalDecodeTable(lengths, decoder);
+			for (size_t length = 0; length <= data.size(); length += length < 9 ? 1 : data.size() - 9) {
+				for (int startBits = 0; startBits < 8; startBits++) {
+					ostringbstream encoded;
+					encoded.writeBits(0x55, startBits);
+					encodeBufferInterleaved((const unsigned char*)data.data(), length, encoder, encoded);
+					string bytes = encoded.str();
+					std::vector<unsigned char> decoded(length + 1, 0);
+					decodeBufferInterleaved((const unsigned char*)bytes.data(), bytes.size(), startBits, decoder,
+					                        decoded.data(), length);
+					if (string((const char*)decoded.data(), length) != data.substr(0, length)) roundTrips = false;
+					if (length == 0) continue;
+
+					try {
+						decodeBufferInterleaved((const unsigned char*)bytes.data(), bytes.size() - 1, startBits, decoder,
+						                        decoded.data(), length);
+						truncationCaught = false;
+					} catch (ErrorException&) {
+					}
+					string resized = bytes;
+					resized[(startBits + 7) / 8]++;
+					try {
+						decodeBufferInterleaved((const unsigned char*)resized.data(), resized.size(), startBits, decoder,
+						                        decoded.data(), length);
+						badSizeCaught = false;
+					} catch (ErrorException&) {
+					}
+				}
+			}
+		}
+		checkCondition(roundTrips, "Interleaved streams decode back to the data.");
+		checkCondition(truncationCaught, "Cutting interleaved streams short is caught.");
+		checkCondition(badSizeCaught, "A wrong interleaved stream size is caught.");
+	}
+
+	endTest("Bulk Bit I/O Tests");
+}
+
+/* Function: testBlockCompression
+ * --------------------------------------------------------
+ * Runs the block format through compressStream and back,
+ * with blocks small enough that most files span several of
+ * them.  The input is a plain istream, which compressStream
+ * must read only once.  compressParallel must produce exactly
+ * the same bytes, and decompressParallel must read them back.
+ * decompressRange must match slices of the original.
+ */
+void testBlockCompression() {
+	beginTest("Block Compression Tests");
+
+	// a fixed salt and nonce, so that the ways of writing one file can be compared
+	PasswordKey password("block password", string(SALT_BYTES, 's'), 1);
+
+	Vector<string> files;
+	files += "singleChar", "nonRepeated", "alphaOnce", "allRepeated", "fibonacci", "poem", "allCharsOnce", "tomSawyer", "dikdik.jpg", "random";
+
+	Vector<size_t> blockSizes;
+	blockSizes += 100, 4096, DEFAULT_BLOCK_SIZE;
+
+	foreach (string file in files) {
+		ifbstream input("test/encodeDecode/" + file);
+		assertCondition(input.is_open(), ("Cannot open file test/encodeDecode/" + file + " for reading!"));
+		ostringstream fileContents;
+		fileContents << input.rdbuf();
+
+		foreach (size_t blockSize in blockSizes) {
+			logInfo("Testing blocks of " + integerToString(int(blockSize)) + " bytes on file test/encodeDecode/" + file);
+			long difference = numAllocations() - numDeallocations();
+
+			istringstream source(fileContents.str());
+			ostringbstream compressed;
+			compressStream(source, compressed, password, blockSize);
+
+			istringbstream toDecode(compressed.str());
+			ostringbstream decoded;
+			decompressStream(toDecode, decoded, password);
+			checkCondition(decoded.str() == fileContents.str(),
+			               "Block compressed data should decompress to the original.");
+
+			/* Encoding blocks on several threads must not change a byte. */
+			istringstream parallelSource(fileContents.str());
+			ostringbstream parallel;
+			compressParallel(parallelSource, parallel, password, 4, blockSize);
+			checkCondition(parallel.str() == compressed.str(),
+			               "Parallel compression should match single-threaded compression.");
+
+			/* So must reading, encoding and writing all at once. */
+			for (int workers = 1; workers <= 3; workers += 2) {
+				istringstream pipelinedSource(fileContents.str());
+				ostringbstream pipelined;
+				compressPipelined(pipelinedSource, pipelined, password, workers, blockSize);
+				checkCondition(pipelined.str() == compressed.str(),
+				               "Pipelined compression should match single-threaded compression.");
+			}
+
+			/* Estimates come out exactly the size of the file, without writing it. */
+			istringstream estimateSource(fileContents.str());
+			checkCondition(estimateStreamCompressedSize(estimateSource, blockSize) == compressed.str().size(),
+			               "The estimated size is the block compressed size.");
+
+			/* The block index lets several threads decode at once. */
+			istringbstream toDecodeParallel(compressed.str());
+			ostringbstream decodedParallel;
+			decompressParallel(toDecodeParallel, decodedParallel, password, 4);
+			checkCondition(decodedParallel.str() == fileContents.str(),
+			               "Parallel decompression should get back the original.");
+
+			/* Interleaved blocks read back through every reader, sealed or not. */
+			for (int sealed = 0; sealed < 2; sealed++) {
+				istringstream interleavedSource(fileContents.str()), interleavedParallelSource(fileContents.str());
+				ostringbstream interleaved, interleavedParallel;
+				compressStream(interleavedSource, interleaved, password, blockSize, sealed != 0, true);
+				compressParallel(interleavedParallelSource, interleavedParallel, password, 4, blockSize,
+				                 sealed != 0, true);
+				checkCondition(((unsigned char)interleaved.str()[3] & ~(FORMAT_FLAG_SALTED | FORMAT_FLAG_CHECKED)) ==
+				               (FORMAT_VERSION_INTERLEAVED_BLOCKS | FORMAT_FLAG_COMPACT | (sealed ? FORMAT_FLAG_SEALED : 0)),
+				               "Interleaved files have their own version.");
+				checkCondition(interleavedParallel.str() == interleaved.str(),
+				               "Parallel interleaved compression should match single-threaded compression.");
+				istringstream interleavedPipelinedSource(fileContents.str());
+				ostringbstream interleavedPipelined;
+				compressPipelined(interleavedPipelinedSource, interleavedPipelined, password, 2, blockSize,
+				                  sealed != 0, true);
+				checkCondition(interleavedPipelined.str() == interleaved.str(),
+				               "Pipelined interleaved compression should match single-threaded compression.");
+				istringstream estimateSource(fileContents.str());
+				checkCondition(estimateStreamCompressedSize(estimateSource, blockSize, true) == interleaved.str().size(),
+				               "The estimated size is the interleaved compressed size.");
+
+				istringbstream toDecodeInterleaved(interleaved.str());
+				ostringbstream decodedInterleaved;
+				decompress(toDecodeInterleaved, decodedInterleaved, password);
+				istringbstream toDecodeInterleavedParallel(interleaved.str());
+				ostringbstream decodedInterleavedParallel;
+				decompressParallel(toDecodeInterleavedParallel, decodedInterleavedParallel, password, 4);
+				checkCondition(decodedInterleaved.str() == fileContents.str() &&
+				               decodedInterleavedParallel.str() == fileContents.str(),
+				               "Interleaved blocks should decompress to the original.");
+			}
+
+			/* Slices that start and end inside blocks, span several, and run off the end. */
+			string original = fileContents.str();
+			Vector<size_t> starts;
+			starts += 0, original.size() / 3, original.size() - original.size() / 5, original.size();
+			foreach (size_t start in starts) {
+				size_t length = blockSize + 7;
+				istringbstream toSlice(compressed.str());
+				ostringbstream slice;
+				uint64_t written = decompressRange(toSlice, start, length, slice, password);
+				checkCondition(slice.str() == original.substr(start, length) && written == slice.str().size(),
+				               "Range decompression should match the same slice of the original.");
+			}
+			checkCondition(numAllocations() - numDeallocations() == difference,
+			               "No tree nodes leaked.");
+		}
+	}
+
+	/* Empty input is just the magic number, salt, nonce and password check, the end frame and an empty index. */
+	{
+		istringstream source("");
+		ostringbstream compressed;
+		compressStream(source, compressed, password);
+		checkCondition(compressed.str().size() == FORMAT_PREFIX_BYTES + 16, "Empty input should give a 48-byte file.");
+		istringstream estimateSource("");
+		checkCondition(estimateStreamCompressedSize(estimateSource) == FORMAT_PREFIX_BYTES + 16,
+		               "Empty input should be estimated at 48 bytes.");
+		istringbstream toDecode(compressed.str());
+		ostringbstream decoded;
+		decompressStream(toDecode, decoded, password);
+		checkCondition(decoded.str().empty(), "Empty input should decompress to nothing.");
+		istringbstream toDecodeParallel(compressed.str());
+		ostringbstream decodedParallel;
+		decompressParallel(toDecodeParallel, decodedParallel, password, 4);
+		checkCondition(decodedParallel.str().empty(), "Empty input should decompress to nothing in parallel.");
+	}
+
+	/* Appending to a block file gives the file compressStream would write for all of it. */
+	{
+		const string appendName = "test/append-test.huf";
+		ifbstream input("test/encodeDecode/tomSawyer");
+		ostringstream contents;
+		contents << input.rdbuf();
+		string text = contents.str();
+
+		{
+			istringstream head(text.substr(0, 3 * 4096));
+			ofbstream appendFile(appendName);
+			compressStream(head, appendFile, password, 4096);
+		}
+		istringstream tail(text.substr(3 * 4096));
+		appendStream(appendName, tail, password, 4096);
+		istringstream whole(text);
+		ostringbstream expected;
+		compressStream(whole, expected, password, 4096);
+		checkCondition(fileContentsOf(appendName) == expected.str(),
+		               "Appending whole blocks should match compressing everything at once.");
+
+		/* Appends of any size carry on in sealed and interleaved files, starting from nothing. */
+		for (int options = 0; options < 3; options++) {
+			{
+				istringstream empty("");
+				ofbstream appendFile(appendName);
+				compressStream(empty, appendFile, password, 4096, options == 1, options == 2);
+			}
+			size_t pieces[] = { 0, 5000, 5001, 20000, text.size() };
+			for (int i = 0; i + 1 < 5; i++) {
+				istringstream piece(text.substr(pieces[i], pieces[i + 1] - pieces[i]));
+				appendStream(appendName, piece, password, 4096);
+			}
+			istringbstream toDecode(fileContentsOf(appendName));
+			ostringbstream decoded;
+			decompressParallel(toDecode, decoded, password, 3);
+			checkCondition(decoded.str() == text, "Appended blocks should decompress to all the data.");
+			istringbstream toSlice(fileContentsOf(appendName));
+			ostringbstream slice;
+			decompressRange(toSlice, 4990, 20, slice, password);
+			checkCondition(slice.str() == text.substr(4990, 20), "A range across an append should decompress.");
+		}
+
+		/* A wrong password or a file that isn't in blocks is turned away untouched. */
+		string before = fileContentsOf(appendName);
+		bool rejected = false;
+		try {
+			istringstream more("more");
+			appendStream(appendName, more, "wrong password");
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected && fileContentsOf(appendName) == before, "Appending with the wrong password is an error.");
+		{
+			istringbstream source(text);
+			ofbstream appendFile(appendName);
+			compress(source, appendFile, password);
+		}
+		rejected = false;
+		try {
+			istringstream more("more");
+			appendStream(appendName, more, password);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "Appending to a file that is not in blocks is an error.");
+		remove(appendName.c_str());
+	}
+
+	/* Every block carries checksums, so damage anywhere is caught, with or without decoding. */
+	{
+		checkCondition(crc32c("123456789", 9) == 0xE3069283, "CRC32C gives the standard check value.");
+		checkCondition(crc32c("56789", 5, crc32c("1234", 4)) == 0xE3069283, "CRC32C carries on from an earlier CRC.");
+
+		ifbstream input("test/encodeDecode/tomSawyer");
+		ostringstream contents;
+		contents << input.rdbuf();
+		string text = contents.str();
+
+		for (int sealed = 0; sealed < 2; sealed++) {
+			istringstream source(text);
+			ostringbstream compressed;
+			compressStream(source, compressed, password, 4096, sealed != 0);
+			string file = compressed.str();
+			istringbstream toVerify(file);
+			checkCondition(verifyStream(toVerify) == (text.size() + 4095) / 4096, "Verifying checks every block.");
+
+			// a flipped bit in the middle of a frame, and one in the checksums at the end
+			size_t damageAt[] = { file.size() / 3, file.size() - 12 };
+			for (int d = 0; d < 2; d++) {
+				string damaged = file;
+				damaged[damageAt[d]] ^= 0x10;
+				bool caught = false;
+				try {
+					istringbstream toVerifyDamaged(damaged);
+					verifyStream(toVerifyDamaged);
+				} catch (ErrorException&) {
+					caught = true;
+				}
+				checkCondition(caught, "Verifying catches a damaged file.");
+
+				caught = false;
+				try {
+					istringbstream toDecode(damaged);
+					ostringbstream decoded;
+					decompressParallel(toDecode, decoded, password, 2);
+				} catch (ErrorException& e) {
+					caught = e.getMessage().find("damaged") != string::npos;
+				}
+				checkCondition(caught, "Parallel decompression reports a damaged block.");
+
+				caught = false;
+				try {
+					istringbstream toDecode(damaged);
+					ostringbstream decoded;
+					decompressStream(toDecode, decoded, password);
+				} catch (ErrorException&) {
+					caught = true;
+				}
+				checkCondition(caught, "Stream decompression catches a damaged block.");
+			}
+
+			// a damaged index size, or an index turned from checked to unchecked, can't skip the checksums
+			size_t blocks = (text.size() + 4095) / 4096;
+			size_t indexSize = file.size() - (blocks * 20 + 8) - 4;
+			size_t indexDamage[] = { indexSize, file.size() - 1 };
+			unsigned char indexFlips[] = { 0x04, 'C' ^ 'I' };
+			for (int d = 0; d < 2; d++) {
+				string damaged = file;
+				damaged[indexDamage[d]] ^= indexFlips[d];
+				bool caught = false;
+				try {
+					istringbstream toDecode(damaged);
+					ostringbstream decoded;
+					decompressStream(toDecode, decoded, password);
+				} catch (ErrorException& e) {
+					caught = e.getMessage() == "Corrupt block index.";
+				}
+				checkCondition(caught, "Stream decompression refuses an index of the wrong size or kind.");
+			}
+
+			// no code of a 4096 byte block comes to 33000 bytes, even at the longest code length, so
+			// the sizes alone are refused, before the frame is read
+			string oversized = file.substr(0, FORMAT_PREFIX_BYTES + 8);
+			for (int b = 0; b < 4; b++) oversized[FORMAT_PREFIX_BYTES + 4 + b] = char(33000 >> (8 * b));
+			bool refusedSize = false;
+			try {
+				istringbstream toDecode(oversized);
+				ostringbstream decoded;
+				decompressStream(toDecode, decoded, password);
+			} catch (ErrorException& e) {
+				refusedSize = e.getMessage() == "Corrupt block in compressed file.";
+			}
+			checkCondition(refusedSize, "Stream decompression refuses a frame longer than its block could code to.");
+		}
+
+		// files from before checksums still decode, but have nothing to verify
+		ifbstream old("test/formats/poem-v2");
+		bool refused = false;
+		try {
+			verifyStream(old);
+		} catch (ErrorException&) {
+			refused = true;
+		}
+		checkCondition(refused, "Verifying a file without checksums is an error.");
+	}
+
+	endTest("Block Compression Tests");
+}
+
+/* Function: testMappedFiles
+ * --------------------------------------------------------
+ * Runs compressMappedFile and decompressMappedFile over the
+ * test files.  The mapped compressor must write the same bytes
+ * as the stream-based one, and the mapped decompressor must
+ * read both single-stream and block compressed files.  The
+ * buffer functions, which skip the files as well as the streams,
+ * are held to the same, and kept compressors and decompressors
+ * must not allocate at all.
+ */
+void testMappedFiles() {
+	beginTest("Memory-Mapped File Tests");
+
+	// a fixed salt and nonce, so that the ways of writing one file can be compared
+	PasswordKey password("mapped password", string(SALT_BYTES, 's'), 1);
+
+	Vector<string> files;
+	files += "singleChar", "nonRepeated", "alphaOnce", "allRepeated", "fibonacci", "poem", "allCharsOnce", "tomSawyer", "dikdik.jpg", "random";
+
+	const string compressedName = "test/mapped-test.huf";
+	const string decompressedName = "test/mapped-test.out";
+	foreach (string file in files) {
+		logInfo("Testing mapped files on file test/encodeDecode/" + file);
+		string original = fileContentsOf("test/encodeDecode/" + file);
+
+		/* The same bytes compress writes, without its password prompt. */
+		istringbstream source(original);
+		ostringbstream expected;
+		compress(source, expected, password);
+
+		compressMappedFile("test/encodeDecode/" + file, compressedName, password);
+		checkCondition(fileContentsOf(compressedName) == expected.str(),
+		               "Mapped compression should write the same bytes as stream compression.");
+
+		/* Buffers in memory give the same bytes, with no stream at all. */
+		vector<uint8_t> buffer(compressBufferBound(original.size()));
+		size_t bufferBytes = compressBuffer((const uint8_t*)original.data(), original.size(), buffer.data(),
+		                                    buffer.size(), password);
+		checkCondition(string((const char*)buffer.data(), bufferBytes) == expected.str(),
+		               "Buffer compression should write the same bytes as stream compression.");
+		vector<uint8_t> unpacked(original.size());
+		size_t unpackedBytes = decompressBuffer(buffer.data(), bufferBytes, unpacked.data(), unpacked.size(),
+		                                        password);
+		checkCondition(string((const char*)unpacked.data(), unpackedBytes) == original,
+		               "Buffer decompression should get back the original.");
+
+		bool tooSmall = false;
+		try {
+			compressBuffer((const uint8_t*)original.data(), original.size(), buffer.data(), bufferBytes - 1,
+			               password);
+		} catch (ErrorException&) {
+			tooSmall = true;
+		}
+		checkCondition(tooSmall, "Buffer compression should reject an output buffer that is too small.");
+		if (!original.empty()) {
+			tooSmall = false;
+			try {
+				decompressBuffer(buffer.data(), bufferBytes, unpacked.data(), unpacked.size() - 1, password);
+			} catch (ErrorException&) {
+				tooSmall = true;
+			}
+			checkCondition(tooSmall, "Buffer decompression should reject an output buffer that is too small.");
+		}
+
+		decompressMappedFile(compressedName, decompressedName, password);
+		checkCondition(fileContentsOf(decompressedName) == original,
+		               "Mapped decompression should get back the original.");
+
+		/* Block compressed files go through the mapped reader too. */
+		{
+			istringstream blockSource(original);
+			ofbstream blockFile(compressedName);
+			compressStream(blockSource, blockFile, password, 4096);
+		}
+		decompressMappedFile(compressedName, decompressedName, password);
+		checkCondition(fileContentsOf(decompressedName) == original,
+		               "Mapped decompression of a block compressed file should get back the original.");
+		string blockData = fileContentsOf(compressedName);
+		unpackedBytes = decompressBuffer((const uint8_t*)blockData.data(), blockData.size(), unpacked.data(),
+		                                 unpacked.size(), password);
+		checkCondition(string((const char*)unpacked.data(), unpackedBytes) == original,
+		               "Buffer decompression of a block compressed file should get back the original.");
+	}
+
+	/* A file that won't decompress leaves the output there before alone. */
+	{
+		ofstream previous(decompressedName.c_str(), ios::binary);
+		previous << "kept";
+	}
+	bool rejected = false;
+	try {
+		decompressMappedFile(compressedName, decompressedName, "not the mapped password");
+	} catch (ErrorException&) {
+		rejected = true;
+	}
+	checkCondition(rejected, "Mapped decompression should reject the wrong password.");
+	checkCondition(fileContentsOf(decompressedName) == "kept",
+	               "A failed mapped decompression should leave the existing output unchanged.");
+	checkCondition(!ifstream((decompressedName + ".part").c_str()).is_open(),
+	               "A failed mapped decompression should leave no partial output behind.");
+	remove(compressedName.c_str());
+	remove(decompressedName.c_str());
+
+	/* Kept compressors and decompressors allocate nothing once they have warmed up. */
+	{
+		Vector<string> inputs;
+		inputs += "tomSawyer", "poem", "random", "dikdik.jpg", "singleChar";
+		HuffmanCompressor compressor("context password");
+		HuffmanDecompressor decompressor("context password");
+		foreach (string file in inputs) {
+			string original = fileContentsOf("test/encodeDecode/" + file);
+			vector<uint8_t> packed(compressBufferBound(original.size())), unpacked(original.size());
+			size_t packedBytes = compressor.compress((const uint8_t*)original.data(), original.size(), packed.data(),
+			                                         packed.size());
+			decompressor.decompress(packed.data(), packedBytes, unpacked.data(), unpacked.size());
+
+			uint64_t before = heapAllocations;
+			size_t unpackedBytes = 0;
+			for (int round = 0; round < 10; round++) {
+				packedBytes = compressor.compress((const uint8_t*)original.data(), original.size(), packed.data(),
+				                                  packed.size());
+				unpackedBytes = decompressor.decompress(packed.data(), packedBytes, unpacked.data(), unpacked.size());
+			}
+			uint64_t allocations = heapAllocations - before;
+			checkCondition(allocations == 0, "Kept compressors and decompressors should not allocate: " + file);
+
+			// with a fixed salt and nonce, it writes just what compressBuffer does
+			PasswordKey fixed("context password", string(SALT_BYTES, 's'), 1);
+			HuffmanCompressor fixedCompressor(fixed);
+			packedBytes = fixedCompressor.compress((const uint8_t*)original.data(), original.size(), packed.data(),
+			                                       packed.size());
+			vector<uint8_t> expected(compressBufferBound(original.size()));
+			size_t expectedBytes = compressBuffer((const uint8_t*)original.data(), original.size(), expected.data(),
+			                                      expected.size(), fixed);
+			checkCondition(packedBytes == expectedBytes && equal(expected.begin(), expected.begin() + expectedBytes,
+			               packed.begin()), "A kept compressor writes what compressBuffer does: " + file);
+			checkCondition(string((const char*)unpacked.data(), unpackedBytes) == original,
+			               "A kept decompressor gets back the original: " + file);
+		}
+
+		// a new password takes effect without making a new compressor
+		string original = fileContentsOf("test/encodeDecode/poem");
+		vector<uint8_t> packed(compressBufferBound(original.size())), unpacked(original.size());
+		compressor.reset("another password");
+		size_t packedBytes = compressor.compress((const uint8_t*)original.data(), original.size(), packed.data(),
+		                                         packed.size());
+		bool rejected = false;
+		try {
+			decompressor.decompress(packed.data(), packedBytes, unpacked.data(), unpacked.size());
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "A decompressor with the old password is turned away.");
+		decompressor.reset("another password");
+		size_t unpackedBytes = decompressor.decompress(packed.data(), packedBytes, unpacked.data(), unpacked.size());
+		checkCondition(string((const char*)unpacked.data(), unpackedBytes) == original,
+		               "A reset decompressor reads files of the new password.");
+	}
+
+	endTest("Memory-Mapped File Tests");
+}
+
+/* Function: pullDecoded
+ * --------------------------------------------------------
+ * Decodes the given compressed file with a HuffmanDecodeStream,
+ * asking for a different number of bytes each time, and returns
+ * all it hands out.  It must then hand out nothing more.
+ */
+string pullDecoded(const string& compressed, const PasswordKey& password, size_t windowBytes) {
+	istringbstream source(compressed);
+	HuffmanDecodeStream decoder(source, password, windowBytes);
+	const size_t sizes[] = { 1, 7, 4096, 3, 65536, 100 };
+	std::vector<char> buffer(65536);
+	string decoded;
+	for (size_t i = 0; ; i++) {
+		size_t want = sizes[i % (sizeof sizes / sizeof sizes[0])];
+		size_t got = decoder.read(buffer.data(), want);
+		decoded.append(buffer.data(), got);
+		if (got < want) break;
+	}
+	checkCondition(decoder.read(buffer.data(), 1) == 0, "A decode stream stays at its end.");
+	return decoded;
+}
+
+/* Function: hexOf
+ * --------------------------------------------------------
+ * The given bytes in lowercase hex, to compare with published
+ * test vectors.
+ */
+static string hexOf(const unsigned char* bytes, size_t count) {
+	static const char digits[] = "0123456789abcdef";
+	string hex;
+	for (size_t i = 0; i < count; i++) {
+		hex += digits[bytes[i] >> 4];
+		hex += digits[bytes[i] & 15];
+	}
+	return hex;
+}
+
+/* Function: littleEndianOf
+ * --------------------------------------------------------
+ * The count bytes of data starting at offset, read as a little-
+ * endian number, as the file formats store their fields.
+ */
+static uint64_t littleEndianOf(const string& data, size_t offset, int count) {
+	uint64_t value = 0;
+	for (int i = count - 1; i >= 0; i--) value = (value << 8) | (unsigned char)data[offset + i];
+	return value;
+}
+
+/* Function: testFileFormats
+ * --------------------------------------------------------
+ * Checks the KeyStream cipher, that files written before it
+ * still decompress, and that sealed block files round-trip
+ * and really are encrypted.  Every format must also decode
+ * a piece at a time through a HuffmanDecodeStream.
+ */
+void testFileFormats() {
+	beginTest("File Format Tests");
+
+	/* These values must never change, or old files won't open. */
+	checkCondition(passwordKey("pw") == 0x269D016AB9DDF096ULL, "Password keys are the same everywhere.");
+	checkCondition(KeyStream(passwordKey("pw"), 0).nextWord() == 0xC765DA73D59E400AULL,
+	               "Keystreams are the same everywhere.");
+	checkCondition(passwordKey("pw") != passwordKey("pW"), "Different passwords give different keys.");
+	checkCondition(KeyStream(1, 1).nextWord() != KeyStream(1, 2).nextWord(), "Different nonces give different keystreams.");
+
+	/* New files are encrypted with ChaCha20, under a key from PBKDF2-HMAC-SHA256, as published. */
+	{
+		unsigned char zero[32] = { 0 };
+		KeyStream chacha(KeystreamKey(zero), 0);
+		checkCondition(chacha.nextWord() == 0x903DF1A0ADE0B876ULL, "ChaCha20 matches its test vector.");
+		KeyStream other(KeystreamKey(zero), 1);
+		checkCondition(other.nextWord() != 0x903DF1A0ADE0B876ULL, "ChaCha20 nonces give different keystreams.");
+
+		const unsigned char* salt = (const unsigned char*)"salt";
+		unsigned char derived[32];
+		pbkdf2Sha256("password", salt, 4, 1, derived, sizeof derived);
+		checkCondition(hexOf(derived, 32) == "120fb6cffcf8b32c43e7225256c4f837a86548c92ccc35480805987cb70be17b",
+		               "PBKDF2 matches its test vector for one iteration.");
+		pbkdf2Sha256("password", salt, 4, 2, derived, sizeof derived);
+		checkCondition(hexOf(derived, 32) == "ae4d0c95af6b46d32d0adff928f06dd02a303f8ef3c251dfd6e2d85a95474c43",
+		               "PBKDF2 matches its test vector for two iterations.");
+		pbkdf2Sha256("password", salt, 4, 4096, derived, sizeof derived);
+		checkCondition(hexOf(derived, 32) == "c5e478d59288c841aa530db6845c4c8d962893a001ce4e11a4963873aa98134a",
+		               "PBKDF2 matches its test vector for 4096 iterations.");
+	}
+
+	/* Every file gets a nonce of its own, so no two share a keystream, even of the same input. */
+	{
+		string original = fileContentsOf("test/encodeDecode/poem");
+		PasswordKey key("nonce password");
+		istringbstream firstSource(original), secondSource(original);
+		ostringbstream first, second;
+		compress(firstSource, first, key);
+		compress(secondSource, second, key);
+		size_t nonceStart = 4 + SALT_BYTES;
+		checkCondition(first.str().substr(4, SALT_BYTES) == second.str().substr(4, SALT_BYTES) &&
+		               first.str().substr(nonceStart, 8) != second.str().substr(nonceStart, 8),
+		               "Files written in one run share a salt but not a nonce.");
+		checkCondition(first.str().substr(FORMAT_PREFIX_BYTES) != second.str().substr(FORMAT_PREFIX_BYTES),
+		               "The same header is encrypted differently in two files.");
+		istringbstream firstDecode(first.str()), secondDecode(second.str());
+		ostringbstream firstDecoded, secondDecoded;
+		decompress(firstDecode, firstDecoded, "nonce password");
+		decompress(secondDecode, secondDecoded, "nonce password");
+		checkCondition(firstDecoded.str() == original && secondDecoded.str() == original,
+		               "Files with their own nonces decompress.");
+
+		bool rejected = false;
+		try {
+			PasswordKey shortSalt("nonce password", "salt", 1);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "A fixed salt must be SALT_BYTES long.");
+
+		// the check comes from the salted key, not from the password alone or a keystream
+		string checkBytes = first.str().substr(FORMAT_PREFIX_BYTES - 4, 4);
+		checkCondition(checkBytes == second.str().substr(FORMAT_PREFIX_BYTES - 4, 4),
+		               "Files with one salt share a password check.");
+		unsigned char salt[SALT_BYTES], otherSalt[SALT_BYTES];
+		uint64_t nonce, otherNonce;
+		PasswordKey salted = PasswordKey("nonce password", string(SALT_BYTES, 's'), 1).forNewFile(salt, nonce);
+		PasswordKey otherSalted = PasswordKey("nonce password", string(SALT_BYTES, 't'), 1).forNewFile(otherSalt, otherNonce);
+		checkCondition(salted.check() != key.check() && salted.check() != otherSalted.check(),
+		               "Password checks depend on the salt.");
+		checkCondition(salted.check() != uint32_t(KeyStream(salted.keystreamKey(), uint64_t(1) << 60).nextWord() >> 32) &&
+		               salted.check() != uint32_t(KeyStream(salted.keystreamKey(), uint64_t(1) << 60).nextWord()),
+		               "Password checks aren't keystream.");
+	}
+
+	/* Bits from nextBits must line up with bytes from apply. */
+	{
+		unsigned char bytes[40] = { 0 };
+		KeyStream(7, 3).apply(bytes, sizeof bytes);
+		KeyStream bits(7, 3);
+		const int counts[] = { 3, 9, 13, 7, 32 }; // a word's worth
+		bool matches = true;
+		int position = 0;
+		for (int word = 0; word < 5; word++) {
+			for (int count : counts) {
+				uint64_t value = bits.nextBits(0, count);
+				for (int i = 0; i < count; i++, position++) {
+					if (((value >> i) & 1) != ((bytes[position / 8] >> (position % 8)) & 1u)) matches = false;
+				}
+			}
+		}
+		checkCondition(matches, "Keystream bits match keystream bytes.");
+
+		string text = "The quick brown fox jumps over the lazy dog.";
+		string sealed = text;
+		KeyStream(9, 9).apply((unsigned char*)&sealed[0], sealed.size());
+		checkCondition(sealed != text, "Applying a keystream changes the data.");
+		KeyStream(9, 9).apply((unsigned char*)&sealed[0], sealed.size());
+		checkCondition(sealed == text, "Applying a keystream twice restores the data.");
+	}
+
+	/* Files written with the original cipher, by earlier versions. */
+	Vector<string> files;
+	files += "poem", "random";
+	foreach (string file in files) {
+		string original = fileContentsOf("test/encodeDecode/" + file);
+		{
+			ifbstream input("test/formats/" + file + "-v1");
+			assertCondition(input.is_open(), "Cannot open file test/formats/" + file + "-v1 for reading!");
+			DecodeTable table;
+			checkCondition(readCompressedHeader(input, "pw", table) == FORMAT_VERSION_CANONICAL,
+			               "Version 1 files are recognized.");
+			ostringbstream decoded;
+			decodeFileWithTable(input, table, decoded);
+			checkCondition(decoded.str() == original, "Version 1 files still decompress: " + file);
+		}
+		{
+			ifbstream input("test/formats/" + file + "-v2");
+			assertCondition(input.is_open(), "Cannot open file test/formats/" + file + "-v2 for reading!");
+			ostringbstream decoded;
+			decompressStream(input, decoded, "pw");
+			checkCondition(decoded.str() == original, "Version 2 files still decompress: " + file);
+		}
+		{
+			ifbstream input("test/formats/" + file + "-v2");
+			ostringbstream decoded;
+			decompressParallel(input, decoded, "pw", 4);
+			checkCondition(decoded.str() == original, "Version 2 files still decompress in parallel: " + file);
+		}
+	}
+
+	/* Files written before compact headers, whose versions lack FORMAT_FLAG_COMPACT. */
+	{
+		string original = fileContentsOf("test/encodeDecode/poem");
+		string versions[] = { "3", "4", "7" };
+		for (const string& version : versions) {
+			ifbstream input("test/formats/poem-v" + version);
+			assertCondition(input.is_open(), "Cannot open file test/formats/poem-v" + version + " for reading!");
+			ostringbstream decoded;
+			decompress(input, decoded, "pw");
+			checkCondition(decoded.str() == original, "Version " + version + " files without compact headers decompress.");
+		}
+
+		// stored files from before the salt, whose length is encrypted
+		string random = fileContentsOf("test/encodeDecode/random");
+		string stored = fileContentsOf("test/formats/random-v9");
+		istringbstream storedSource(stored);
+		ostringbstream storedDecoded;
+		decompress(storedSource, storedDecoded, "pw");
+		checkCondition(storedDecoded.str() == random, "Version 9 files from before the salt decompress.");
+		checkCondition(pullDecoded(stored, "pw", 8) == random, "Version 9 files from before the salt decode on demand.");
+
+		// blocks appended to such a file keep its version, so older readers can still read it
+		const string appendName = "test/format-append-test.huf";
+		{
+			ofstream out(appendName.c_str(), ios::binary);
+			out << fileContentsOf("test/formats/poem-v4");
+		}
+		string more = fileContentsOf("test/encodeDecode/tomSawyer");
+		istringstream moreSource(more);
+		appendStream(appendName, moreSource, "pw", 4096);
+		string appended = fileContentsOf(appendName);
+		remove(appendName.c_str());
+		checkCondition((unsigned char)appended[3] == (FORMAT_VERSION_KEYSTREAM_BLOCKS | FORMAT_FLAG_CHECKED),
+		               "Appending to a file without compact headers keeps its version.");
+		istringbstream toDecode(appended);
+		ostringbstream decoded;
+		decompressStream(toDecode, decoded, "pw");
+		checkCondition(decoded.str() == original + more, "Blocks appended to a version 4 file decompress.");
+
+		// without its password check, which moves every frame 4 bytes closer to the start
+		string unchecked = fileContentsOf("test/formats/poem-v4");
+		unchecked[3] = char(FORMAT_VERSION_KEYSTREAM_BLOCKS);
+		unchecked.erase(4, 4);
+		size_t entries = size_t(littleEndianOf(unchecked, unchecked.size() - 8, 4));
+		for (size_t i = 0; i < entries; i++) {
+			size_t entry = unchecked.size() - 8 - (entries - i) * 20;
+			uint64_t offset = littleEndianOf(unchecked, entry, 8) - 4;
+			for (int b = 0; b < 8; b++) unchecked[entry + b] = char(offset >> (8 * b));
+		}
+		istringbstream uncheckedSource(unchecked);
+		ostringbstream uncheckedDecoded;
+		decompressStream(uncheckedSource, uncheckedDecoded, "pw");
+		checkCondition(uncheckedDecoded.str() == original, "Version 4 files without a password check decompress.");
+		{
+			ofstream out(appendName.c_str(), ios::binary);
+			out << unchecked;
+		}
+		bool refused = false;
+		try {
+			istringstream moreAgain(more);
+			appendStream(appendName, moreAgain, "not pw", 4096);
+		} catch (ErrorException&) {
+			refused = true;
+		}
+		checkCondition(refused && fileContentsOf(appendName) == unchecked,
+		               "Appending to a file with no password check is refused, leaving it as it was.");
+		checkCondition(!ifstream((appendName + ".part").c_str()).is_open(), "A refused append leaves no partial file.");
+		remove(appendName.c_str());
+	}
+
+	/* New files use the keystream versions. */
+	{
+		const string compressedName = "test/format-test.huf";
+		compressMappedFile("test/encodeDecode/poem", compressedName, "format password");
+		string compressed = fileContentsOf(compressedName);
+		remove(compressedName.c_str());
+		checkCondition(compressed.size() > 8 &&
+		               (unsigned char)compressed[3] ==
+		               (FORMAT_VERSION_KEYSTREAM | FORMAT_FLAG_COMPACT | FORMAT_FLAG_SALTED | FORMAT_FLAG_CHECKED),
+		               "Single-stream files are written as version 3, with compact headers, a salt and a password check.");
+		istringbstream toDecode(compressed);
+		DecodeTable table;
+		readCompressedHeader(toDecode, "format password", table);
+		ostringbstream decoded;
+		decodeFileWithTable(toDecode, table, decoded);
+		checkCondition(decoded.str() == fileContentsOf("test/encodeDecode/poem"), "Version 3 files decompress.");
+	}
+
+	/* The password check turns a wrong password away before anything is decoded. */
+	{
+		string original = fileContentsOf("test/encodeDecode/tomSawyer");
+		PasswordKey right("check password"), wrong("not the check password");
+		checkCondition(right.check() == PasswordKey("check password").check() && right.check() != wrong.check(),
+		               "Password checks depend only on the password.");
+
+		Vector<string> written;
+		istringbstream source(original);
+		ostringbstream single;
+		compress(source, single, right);
+		written += single.str();
+		istringstream blockSource(original), interleavedSource(original);
+		ostringbstream blocks, interleaved;
+		compressStream(blockSource, blocks, right, 4096);
+		compressStream(interleavedSource, interleaved, right, 4096, true, true);
+		written += blocks.str(), interleaved.str();
+		istringbstream contextSource(original);
+		ostringbstream contexts;
+		compressWithContexts(contextSource, contexts, right);
+		written += contexts.str();
+
+		foreach (string compressed in written) {
+			string message;
+			try {
+				istringbstream toDecode(compressed);
+				ostringbstream garbage;
+				decompress(toDecode, garbage, wrong);
+			} catch (ErrorException& e) {
+				message = e.getMessage();
+			}
+			checkCondition(message == "Wrong password.",
+			               "The password check rejects the wrong password for version " +
+			               integerToString((unsigned char)compressed[3] & ~(FORMAT_FLAG_SALTED | FORMAT_FLAG_CHECKED)));
+		}
+
+		string message;
+		try {
+			istringbstream toDecode(blocks.str());
+			ostringbstream garbage;
+			decompressParallel(toDecode, garbage, wrong, 4);
+		} catch (ErrorException& e) {
+			message = e.getMessage();
+		}
+		checkCondition(message == "Wrong password.", "The block index reader checks the password too.");
+
+		// files from before the check still open, with no check to make
+		istringbstream plainSource(original);
+		ostringbstream unchecked;
+		uint64_t counts[NUM_SYMBOLS] = { 0 };
+		countBytes((const unsigned char*)original.data(), original.size(), counts);
+		int lengths[NUM_SYMBOLS];
+		getCodeLengthsForCounts(counts, lengths);
+		unchecked.writeBits(FORMAT_MAGIC | (uint64_t(FORMAT_VERSION_KEYSTREAM) << 24), 32);
+		writeCanonicalFileHeader(unchecked, lengths, right, 0, FORMAT_VERSION_KEYSTREAM);
+		EncodeTable table;
+		buildCanonicalEncodeTable(lengths, table);
+		encodeFileWithTable(plainSource, table, unchecked);
+		istringbstream toDecode(unchecked.str());
+		ostringbstream decoded;
+		decompress(toDecode, decoded, right);
+		checkCondition(decoded.str() == original, "Version 3 files without a password check still decompress.");
+
+		// the original format has no check, but a wrong password can't get past its header
+		int rejected = 0;
+		string passwords[] = { "a", "b", "c", "d", "e", "f", "g", "h" };
+		for (const string& password : passwords) {
+			try {
+				ifbstream input("test/formats/poem-v1");
+				ostringbstream garbage;
+				decompress(input, garbage, password);
+			} catch (ErrorException&) {
+				rejected++;
+			}
+		}
+		checkCondition(rejected == 8, "Version 1 headers read with the wrong password are rejected.");
+	}
+
+	/* Sealed block files encrypt everything but the frame sizes and the index. */
+	// a fixed salt and nonce, so that plain and sealed files can be compared
+	PasswordKey sealKey("seal password", string(SALT_BYTES, 's'), 1);
+	files += "tomSawyer", "dikdik.jpg", "singleChar";
+	foreach (string file in files) {
+		string original = fileContentsOf("test/encodeDecode/" + file);
+		istringstream plainSource(original), sealedSource(original), parallelSource(original);
+		ostringbstream plain, sealed, parallel;
+		compressStream(plainSource, plain, sealKey, 4096);
+		compressStream(sealedSource, sealed, sealKey, 4096, true);
+		compressParallel(parallelSource, parallel, sealKey, 4, 4096, true);
+		checkCondition((unsigned char)sealed.str()[3] ==
+		               (FORMAT_VERSION_KEYSTREAM_BLOCKS | FORMAT_FLAG_SEALED | FORMAT_FLAG_COMPACT | FORMAT_FLAG_SALTED |
+		                FORMAT_FLAG_CHECKED),
+		               "Sealed files are flagged in their version.");
+		checkCondition(sealed.str().size() == plain.str().size(), "Sealing doesn't change the size of " + file);
+		checkCondition(parallel.str() == sealed.str(), "Parallel sealing matches for " + file);
+
+		// past the first header the plain and sealed frames should have nothing in common,
+		// but for stored frames, which are encrypted the same way in both
+		size_t same = 0, compared = 0;
+		const string& plainBytes = plain.str();
+		for (size_t frame = FORMAT_PREFIX_BYTES; ; ) {
+			const unsigned char* sizes = (const unsigned char*)plainBytes.data() + frame;
+			uint32_t blockBytes = sizes[0] | (sizes[1] << 8) | (sizes[2] << 16) | (uint32_t(sizes[3]) << 24);
+			uint32_t frameField = sizes[4] | (sizes[5] << 8) | (sizes[6] << 16) | (uint32_t(sizes[7]) << 24);
+			if (blockBytes == 0) break;
+			size_t frameBytes = frameField & 0x7FFFFFFF;
+			string plainFrame = plainBytes.substr(frame + 8, frameBytes), sealedFrame = sealed.str().substr(frame + 8, frameBytes);
+			if (frameField & 0x80000000) {
+				checkCondition(sealedFrame == plainFrame, "Stored frames are the same sealed or not for " + file);
+			} else {
+				for (size_t i = frame == FORMAT_PREFIX_BYTES ? 56 : 0; i < frameBytes; i++) {
+					if (plainFrame[i] == sealedFrame[i]) same++;
+					compared++;
+				}
+			}
+			frame += 8 + frameBytes;
+		}
+		checkCondition(same < compared / 32 + 8, "Sealed frames are encrypted for " + file);
+
+		istringbstream toDecode(sealed.str());
+		ostringbstream decoded;
+		decompressStream(toDecode, decoded, sealKey);
+		checkCondition(decoded.str() == original, "Sealed files decompress: " + file);
+
+		istringbstream toDecodeParallel(sealed.str());
+		ostringbstream decodedParallel;
+		decompressParallel(toDecodeParallel, decodedParallel, sealKey, 4);
+		checkCondition(decodedParallel.str() == original, "Sealed files decompress in parallel: " + file);
+
+		istringbstream toSlice(sealed.str());
+		ostringbstream slice;
+		decompressRange(toSlice, original.size() / 2, 5000, slice, sealKey);
+		checkCondition(slice.str() == original.substr(original.size() / 2, 5000), "Sealed files decompress by range: " + file);
+
+		bool rejected = false;
+		try {
+			istringbstream wrong(sealed.str());
+			ostringbstream garbage;
+			decompressStream(wrong, garbage, "wrong password");
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "Sealed files don't open with the wrong password: " + file);
+	}
+
+	/* Data the code can't shrink is stored, barely larger than it was, and still read back everywhere.
+	 * The JPEG shrinks by a few bytes as a whole, but many of its blocks don't.
+	 */
+	{
+		PasswordKey storedKey("stored password", string(SALT_BYTES, 's'), 1);
+		Vector<string> incompressible;
+		incompressible += "random", "allCharsOnce", "dikdik.jpg";
+		foreach (string file in incompressible) {
+			string original = fileContentsOf("test/encodeDecode/" + file);
+			bool wholeStored = file != "dikdik.jpg";
+			istringbstream source(original);
+			ostringbstream compressed;
+			compress(source, compressed, storedKey);
+			checkCondition(compressed.str().size() <= original.size() + FORMAT_PREFIX_BYTES + 8,
+			               "Files grow by no more than the magic number, salt, nonce, check and length: " + file);
+			if (wholeStored) {
+				checkCondition((unsigned char)compressed.str()[3] == (FORMAT_VERSION_STORED | FORMAT_FLAG_SALTED | FORMAT_FLAG_CHECKED),
+				               "Incompressible files are stored: " + file);
+				uint64_t length = 0;
+				for (int b = 7; b >= 0; b--) length = (length << 8) | (unsigned char)compressed.str()[FORMAT_PREFIX_BYTES + b];
+				checkCondition(length == original.size(), "A stored file's length is left unencrypted: " + file);
+			}
+			checkCondition(compressed.str().find(original.substr(0, 64)) == string::npos,
+			               "Stored files are still encrypted: " + file);
+
+			istringbstream toDecode(compressed.str());
+			ostringbstream decoded;
+			decompress(toDecode, decoded, storedKey);
+			checkCondition(decoded.str() == original, "Stored files decompress: " + file);
+
+			bool rejected = false;
+			try {
+				istringbstream wrongSource(compressed.str());
+				ostringbstream garbage;
+				decompress(wrongSource, garbage, "not the stored password");
+			} catch (ErrorException&) {
+				rejected = true;
+			}
+			checkCondition(rejected, "Stored files don't open with the wrong password: " + file);
+
+			bool truncated = false;
+			try {
+				istringbstream shortSource(compressed.str().substr(0, compressed.str().size() - 1));
+				ostringbstream partial;
+				decompress(shortSource, partial, storedKey);
+			} catch (ErrorException&) {
+				truncated = true;
+			}
+			checkCondition(truncated, "Stored files cut short are reported: " + file);
+
+			// their blocks are stored too, so block files grow by little more than their sizes and index
+			istringstream blockSource(original), parallelSource(original), sealedSource(original);
+			ostringbstream blocks, parallel, sealed;
+			compressStream(blockSource, blocks, storedKey, 4096, false, true);
+			compressParallel(parallelSource, parallel, storedKey, 4, 4096, false, true);
+			compressStream(sealedSource, sealed, storedKey, 4096, true, true);
+			size_t blockCount = (original.size() + 4095) / 4096;
+			checkCondition(blocks.str().size() <= original.size() + FORMAT_PREFIX_BYTES + 16 + blockCount * 28,
+			               "Incompressible blocks are stored: " + file);
+			checkCondition(parallel.str() == blocks.str(), "Parallel compression stores the same blocks: " + file);
+			if (wholeStored) {
+				checkCondition(sealed.str().substr(4) == blocks.str().substr(4), "Stored blocks are sealed already: " + file);
+
+				// every file has keystreams of its own, so the same stored block is encrypted differently in each
+				istringstream firstSource(original), secondSource(original);
+				ostringbstream first, second;
+				compressStream(firstSource, first, "stored password", 4096);
+				compressStream(secondSource, second, "stored password", 4096);
+				size_t frameStart = FORMAT_PREFIX_BYTES + 8;
+				checkCondition(first.str().substr(frameStart, 64) != second.str().substr(frameStart, 64),
+				               "Stored blocks of two files share no keystream: " + file);
+			}
+
+			istringbstream streamDecode(blocks.str()), parallelDecode(blocks.str()), rangeDecode(blocks.str());
+			ostringbstream streamDecoded, parallelDecoded, rangeDecoded;
+			decompressStream(streamDecode, streamDecoded, storedKey);
+			decompressParallel(parallelDecode, parallelDecoded, storedKey, 4);
+			decompressRange(rangeDecode, original.size() / 3, original.size() / 2, rangeDecoded, storedKey);
+			checkCondition(streamDecoded.str() == original, "Stored blocks decompress: " + file);
+			checkCondition(parallelDecoded.str() == original, "Stored blocks decompress in parallel: " + file);
+			checkCondition(rangeDecoded.str() == original.substr(original.size() / 3, original.size() / 2), "Stored blocks decompress in ranges: " + file);
+		}
+
+		// text is still encoded, as are the blocks of it
+		string text = fileContentsOf("test/encodeDecode/tomSawyer");
+		istringbstream source(text);
+		ostringbstream compressed;
+		compress(source, compressed, storedKey);
+		checkCondition((unsigned char)compressed.str()[3] ==
+		               (FORMAT_VERSION_KEYSTREAM | FORMAT_FLAG_COMPACT | FORMAT_FLAG_SALTED | FORMAT_FLAG_CHECKED),
+		               "Compressible files are still encoded.");
+	}
+
+	/* One key, derived once, serves a whole batch and every thread. */
+	{
+		PasswordKey key("batch password");
+		checkCondition(key.keystreamKey() == passwordKey("batch password"), "Password keys hold the keystream key.");
+		Vector<string> batch;
+		batch += "poem", "tomSawyer", "random";
+		foreach (string file in batch) {
+			string original = fileContentsOf("test/encodeDecode/" + file);
+			istringbstream source(original);
+			ostringbstream compressed;
+			compress(source, compressed, key);
+			istringbstream toDecode(compressed.str());
+			ostringbstream decoded;
+			decompress(toDecode, decoded, key);
+			checkCondition(decoded.str() == original, "Compressing with a shared key round-trips " + file);
+
+			istringbstream withPassword(compressed.str());
+			ostringbstream decodedWithPassword;
+			decompress(withPassword, decodedWithPassword, "batch password");
+			checkCondition(decodedWithPassword.str() == original, "A shared key matches its password for " + file);
+
+			istringstream blockSource(original);
+			ostringbstream blocks;
+			compressParallel(blockSource, blocks, key, 4, 4096, true);
+			istringbstream toDecodeBlocks(blocks.str());
+			ostringbstream decodedBlocks;
+			decompressParallel(toDecodeBlocks, decodedBlocks, key, 4);
+			checkCondition(decodedBlocks.str() == original, "Threads can share one key for " + file);
+		}
+	}
+
+	/* Every format decodes on demand, with as little as 8 bytes of window. */
+	{
+		Vector<string> streamed;
+		streamed += "singleChar", "poem", "allCharsOnce", "tomSawyer", "dikdik.jpg", "random";
+		foreach (string file in streamed) {
+			string original = fileContentsOf("test/encodeDecode/" + file);
+			istringbstream wholeSource(original), contextSource(original);
+			istringstream blockSource(original), sealedSource(original), interleavedSource(original);
+			ostringbstream whole, contexts, blocks, sealed, interleaved;
+			compress(wholeSource, whole, "pull password");
+			compressWithContexts(contextSource, contexts, "pull password");
+			compressStream(blockSource, blocks, "pull password", 4096);
+			compressStream(sealedSource, sealed, "pull password", 4096, true);
+			compressStream(interleavedSource, interleaved, "pull password", 4096, false, true);
+
+			checkCondition(pullDecoded(whole.str(), "pull password", 8) == original, "Whole files decode on demand: " + file);
+			checkCondition(pullDecoded(contexts.str(), "pull password", 8) == original,
+			               "Context modeled files decode on demand: " + file);
+			checkCondition(pullDecoded(blocks.str(), "pull password", 8) == original, "Block files decode on demand: " + file);
+			checkCondition(pullDecoded(sealed.str(), "pull password", 8) == original, "Sealed files decode on demand: " + file);
+			checkCondition(pullDecoded(interleaved.str(), "pull password", DEFAULT_DECODE_WINDOW) == original,
+			               "Interleaved files decode on demand: " + file);
+		}
+
+		// interleaved blocks of the default size fit the default window, and not a smaller one
+		string tom = fileContentsOf("test/encodeDecode/tomSawyer");
+		string big = tom + tom + tom + tom;
+		istringstream bigSource(big);
+		ostringbstream bigInterleaved;
+		compressStream(bigSource, bigInterleaved, "pull password", DEFAULT_BLOCK_SIZE, false, true);
+		checkCondition(pullDecoded(bigInterleaved.str(), "pull password", DEFAULT_DECODE_WINDOW) == big,
+		               "Interleaved files of the default block size decode with the default window.");
+		string message, needs = "Block 1 needs a decode window of at least ";
+		try {
+			pullDecoded(bigInterleaved.str(), "pull password", DEFAULT_BLOCK_SIZE);
+		} catch (ErrorException& e) {
+			message = e.getMessage();
+		}
+		checkCondition(message.find(needs) == 0 && std::stoull(message.substr(needs.size())) > DEFAULT_BLOCK_SIZE,
+		               "An interleaved block too big for the window says how big a window it needs.");
+
+		Vector<string> old;
+		old += "poem", "random";
+		foreach (string file in old) {
+			string original = fileContentsOf("test/encodeDecode/" + file);
+			checkCondition(pullDecoded(fileContentsOf("test/formats/" + file + "-v1"), "pw", 8) == original,
+			               "Version 1 files decode on demand: " + file);
+			checkCondition(pullDecoded(fileContentsOf("test/formats/" + file + "-v2"), "pw", 8) == original,
+			               "Version 2 files decode on demand: " + file);
+		}
+		string poem = fileContentsOf("test/encodeDecode/poem");
+		string versions[] = { "3", "4", "7" };
+		for (const string& version : versions) {
+			checkCondition(pullDecoded(fileContentsOf("test/formats/poem-v" + version), "pw", 8) == poem,
+			               "Version " + version + " files without compact headers decode on demand.");
+		}
+
+		// the window is all a block file needs, however many blocks it has
+		string text = fileContentsOf("test/encodeDecode/tomSawyer");
+		istringstream source(text);
+		ostringbstream blocks;
+		compressStream(source, blocks, "pull password", 4096, true);
+		{
+			istringbstream input(blocks.str());
+			HuffmanDecodeStream decoder(input, "pull password", 4096);
+			std::vector<char> buffer(1000);
+			long before = numAllocations();
+			size_t total = 0;
+			for (size_t got; (got = decoder.read(buffer.data(), buffer.size())) > 0; ) {
+				total += got;
+			}
+			checkCondition(total == text.size(), "A decode stream hands out every byte.");
+			checkCondition(numAllocations() - before <= 8, "Decoding blocks on demand allocates next to nothing.");
+		}
+
+		bool tooSmall = false, wrongPassword = false, damaged = false, truncated = false;
+		istringstream interleavedSource(text);
+		ostringbstream interleaved;
+		compressStream(interleavedSource, interleaved, "pull password", 4096, false, true);
+		try {
+			pullDecoded(interleaved.str(), "pull password", 4096);
+		} catch (ErrorException&) {
+			tooSmall = true;
+		}
+		checkCondition(tooSmall, "Interleaved blocks that don't fit the window are refused.");
+		try {
+			istringbstream input(blocks.str());
+			HuffmanDecodeStream decoder(input, "not the pull password");
+		} catch (ErrorException&) {
+			wrongPassword = true;
+		}
+		checkCondition(wrongPassword, "A decode stream turns the wrong password away at once.");
+
+		string broken = blocks.str();
+		broken[broken.size() / 2] ^= 0x10;
+		try {
+			pullDecoded(broken, "pull password", 8);
+		} catch (ErrorException&) {
+			damaged = true;
+		}
+		checkCondition(damaged, "A decode stream reports a damaged block.");
+
+		// the end frame's index size, four bytes before the index of 20 bytes a block and its trailer
+		string resized = blocks.str();
+		resized[resized.size() - ((text.size() + 4095) / 4096 * 20 + 8) - 4] ^= 0x04;
+		bool corruptIndex = false;
+		try {
+			pullDecoded(resized, "pull password", 8);
+		} catch (ErrorException& e) {
+			corruptIndex = e.getMessage() == "Corrupt block index.";
+		}
+		checkCondition(corruptIndex, "A decode stream refuses an index of the wrong size.");
+
+		istringbstream wholeSource(text);
+		ostringbstream whole;
+		compress(wholeSource, whole, "pull password");
+		try {
+			pullDecoded(whole.str().substr(0, whole.str().size() / 2), "pull password", 8);
+		} catch (ErrorException&) {
+			truncated = true;
+		}
+		checkCondition(truncated, "A decode stream reports a file cut short.");
+	}
+
+	endTest("File Format Tests");
+}
+
+/* Function: testDictionaries
+ * --------------------------------------------------------
+ * Trains a dictionary on one text, then checks that records
+ * round-trip through it, cost no more than their codes and the
+ * record header, and are rejected by any other dictionary.
+ */
+void testDictionaries() {
+	beginTest("Shared Dictionary Tests");
+
+	string sample = fileContentsOf("test/encodeDecode/tomSawyer");
+	uint64_t counts[NUM_SYMBOLS] = { 0 };
+	{
+		istringstream source(sample);
+		countStream(source, counts);
+	}
+	HuffmanDictionary dictionary(counts);
+
+	bool allCoded = true;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (dictionary.codeLength(ch) == 0) allCoded = false;
+	}
+	checkCondition(allCoded, "Every character has a code, even those the sample lacks.");
+
+	/* Small records cut from the sample, plus files unlike it. */
+	Vector<string> records;
+	for (size_t start = 0; start < sample.size() && records.size() < 20; start += 2048) {
+		records += sample.substr(start, 2048);
+	}
+	records += "", "a";
+	Vector<string> files;
+	files += "poem", "dikdik.jpg", "allCharsOnce", "singleChar";
+	foreach (string file in files) {
+		records += fileContentsOf("test/encodeDecode/" + file);
+	}
+
+	bool roundTrips = true, tight = true;
+	foreach (string record in records) {
+		istringstream source(record);
+		ostringbstream compressed;
+		compressRecord(source, compressed, dictionary);
+
+		uint64_t bits = dictionary.codeLength(PSEUDO_EOF);
+		for (size_t i = 0; i < record.size(); i++) {
+			bits += dictionary.codeLength((unsigned char)record[i]);
+		}
+		if (uint64_t(compressed.str().size()) != 8 + (bits + 7) / 8) tight = false;
+
+		istringbstream toDecode(compressed.str());
+		ostringbstream decoded;
+		decompressRecord(toDecode, decoded, dictionary);
+		if (decoded.str() != record) roundTrips = false;
+	}
+	checkCondition(roundTrips, "Records round-trip through the dictionary.");
+	checkCondition(tight, "A record is its codes plus eight bytes.");
+
+	/* The point of it all: small records beat standalone files. */
+	{
+		string record = sample.substr(4096, 2048);
+		istringstream recordSource(record);
+		ostringbstream recordCompressed;
+		compressRecord(recordSource, recordCompressed, dictionary);
+		istringbstream fileSource(record);
+		ostringbstream fileCompressed;
+		compress(fileSource, fileCompressed, "pw");
+		checkCondition(recordCompressed.str().size() < fileCompressed.str().size(),
+		               "A small record is smaller than the same data compressed alone.");
+	}
+
+	/* Dictionaries save and load, and only with their password. */
+	ostringbstream saved;
+	dictionary.write(saved, "dictionary password");
+	{
+		istringbstream input(saved.str());
+		HuffmanDictionary loaded(input, "dictionary password");
+		checkCondition(loaded.id() == dictionary.id(), "A loaded dictionary has the same id.");
+		bool sameCode = true;
+		for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+			if (loaded.codeLength(ch) != dictionary.codeLength(ch)) sameCode = false;
+		}
+		checkCondition(sameCode, "A loaded dictionary has the same code.");
+
+		istringstream source(records[3]);
+		ostringbstream compressed;
+		compressRecord(source, compressed, dictionary);
+		istringbstream toDecode(compressed.str());
+		ostringbstream decoded;
+		decompressRecord(toDecode, decoded, loaded);
+		checkCondition(decoded.str() == records[3], "A loaded dictionary decodes records from the original.");
+	}
+	{
+		bool rejected = false;
+		try {
+			istringbstream input(saved.str());
+			HuffmanDictionary loaded(input, "wrong password");
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "Dictionaries don't load with the wrong password.");
+	}
+
+	/* Records only decode with their own dictionary. */
+	{
+		uint64_t otherCounts[NUM_SYMBOLS] = { 0 };
+		string other = fileContentsOf("test/encodeDecode/dikdik.jpg");
+		countBytes((const unsigned char*)other.data(), other.size(), otherCounts);
+		HuffmanDictionary otherDictionary(otherCounts);
+		checkCondition(otherDictionary.id() != dictionary.id(), "Different dictionaries have different ids.");
+
+		istringstream source(records[0]);
+		ostringbstream compressed;
+		compressRecord(source, compressed, dictionary);
+		bool rejected = false;
+		try {
+			istringbstream toDecode(compressed.str());
+			ostringbstream decoded;
+			decompressRecord(toDecode, decoded, otherDictionary);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "Records don't decode with another dictionary.");
+
+		rejected = false;
+		try {
+			istringbstream toDecode(compressed.str());
+			ostringbstream decoded;
+			decompress(toDecode, decoded, "pw");
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "decompress refuses records.");
+	}
+
+	endTest("Shared Dictionary Tests");
+}
+
+/* Function: testAdaptiveHuffman
+ * --------------------------------------------------------
+ * Checks that adaptive coding round-trips every test file,
+ * with and without rescaling, compresses about as well as a
+ * static code, and decodes each character without waiting
+ * for the rest of the stream.
+ */
+void testAdaptiveHuffman() {
+	beginTest("Adaptive Huffman Tests");
+
+	Vector<string> files;
+	files += "allCharsOnce", "allRepeated", "alphaOnce", "dikdik.jpg", "fibonacci", "nonRepeated";
+	files += "poem", "random", "singleChar", "tomSawyer";
+	foreach (string file in files) {
+		string original = fileContentsOf("test/encodeDecode/" + file);
+		istringstream source(original);
+		ostringbstream encoded;
+		encodeFileAdaptive(source, encoded);
+		istringbstream toDecode(encoded.str());
+		ostringbstream decoded;
+		decodeFileAdaptive(toDecode, decoded);
+		checkCondition(decoded.str() == original, "Adaptive coding round-trips " + file);
+
+		/* The adaptive code pays to learn, but not by much. */
+		uint64_t counts[NUM_SYMBOLS] = { 0 };
+		countBytes((const unsigned char*)original.data(), original.size(), counts);
+		int lengths[NUM_SYMBOLS];
+		getCodeLengthsForCounts(counts, lengths);
+		counts[PSEUDO_EOF] = 1;
+		uint64_t staticBytes = (codeCost(counts, lengths) + 7) / 8;
+		checkCondition(encoded.str().size() <= staticBytes + staticBytes / 20 + 320,
+		               "Adaptive coding is close to a static code for " + file);
+	}
+
+	/* A low limit rescales often, and both sides must agree on it. */
+	{
+		string original = fileContentsOf("test/encodeDecode/tomSawyer");
+		AdaptiveHuffmanCoder encoder(4 * NUM_SYMBOLS), decoder(4 * NUM_SYMBOLS);
+		ostringbstream encoded;
+		for (size_t i = 0; i < original.size(); i++) {
+			encoder.encode((unsigned char)original[i], encoded);
+		}
+		encoder.encode(PSEUDO_EOF, encoded);
+		encoded.flushBits();
+
+		istringbstream toDecode(encoded.str());
+		string decoded;
+		ext_char ch;
+		while ((ch = decoder.decode(toDecode)) != PSEUDO_EOF) decoded += char(ch);
+		checkCondition(decoded == original, "Adaptive coding round-trips with frequent rescaling.");
+	}
+
+	/* Each code is written as soon as its character is, and code
+	 * lengths are what the encoder actually writes.
+	 */
+	{
+		string original = fileContentsOf("test/encodeDecode/poem");
+		AdaptiveHuffmanCoder encoder;
+		ostringbstream encoded;
+		uint64_t expectedBits = 0;
+		for (size_t i = 0; i < 100; i++) {
+			expectedBits += encoder.codeLength((unsigned char)original[i]);
+			encoder.encode((unsigned char)original[i], encoded);
+		}
+		encoded.flushBits();
+		checkCondition(uint64_t(encoded.str().size()) == (expectedBits + 7) / 8,
+		               "Code lengths match the bits written.");
+
+		AdaptiveHuffmanCoder decoder;
+		istringbstream toDecode(encoded.str());
+		string decoded;
+		for (size_t i = 0; i < 100; i++) decoded += char(decoder.decode(toDecode));
+		checkCondition(decoded == original.substr(0, 100), "A prefix decodes before the stream is finished.");
+	}
+
+	/* Bad limits and cut off streams are reported. */
+	{
+		bool rejected = false;
+		try {
+			AdaptiveHuffmanCoder coder(10);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "Weight limits that are too low are rejected.");
+
+		istringstream source(fileContentsOf("test/encodeDecode/poem"));
+		ostringbstream encoded;
+		encodeFileAdaptive(source, encoded);
+		string truncated = encoded.str().substr(0, encoded.str().size() / 2);
+		rejected = false;
+		try {
+			istringbstream toDecode(truncated);
+			ostringbstream decoded;
+			decodeFileAdaptive(toDecode, decoded);
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "Truncated adaptive streams are reported.");
+	}
+
+	endTest("Adaptive Huffman Tests");
+}
+
+/* Function: testContextModel
+ * --------------------------------------------------------
+ * Checks that contexts are grouped sensibly, that context
+ * modeled files round-trip through decompress, and that they
+ * beat a single code on text.
+ */
+void testContextModel() {
+	beginTest("Context Model Tests");
+
+	/* Contexts followed by the same characters share a code. */
+	{
+		std::unique_ptr<ContextCounts> counts(new ContextCounts());
+		for (int ch = 'a'; ch <= 'z'; ch++) {
+			counts->counts['x'][ch] = counts->counts['y'][ch] = 1000 + ch;
+			counts->counts['1'][ch] = 10;
+		}
+		counts->counts['1']['q'] = counts->counts['2']['q'] = 100000;
+		counts->counts['2']['u'] = 10;
+		int groups[NUM_CONTEXTS];
+		int codes = groupContexts(*counts, MAX_CONTEXT_CODES, groups);
+		checkCondition(groups['x'] == groups['y'], "Identical contexts share a code.");
+		checkCondition(groups['x'] != groups['2'], "Very different contexts get different codes.");
+		checkCondition(codes >= 2 && codes <= MAX_CONTEXT_CODES, "The number of codes is in range.");
+
+		codes = groupContexts(*counts, 1, groups);
+		bool allZero = true;
+		for (int context = 0; context < NUM_CONTEXTS; context++) {
+			if (groups[context] != 0) allZero = false;
+		}
+		checkCondition(codes == 1 && allZero, "A limit of one code puts every context in one group.");
+	}
+
+	Vector<string> files;
+	files += "allCharsOnce", "allRepeated", "alphaOnce", "dikdik.jpg", "fibonacci", "nonRepeated";
+	files += "poem", "random", "singleChar", "tomSawyer";
+	foreach (string file in files) {
+		string original = fileContentsOf("test/encodeDecode/" + file);
+		istringbstream source(original);
+		ostringbstream compressed;
+		compressWithContexts(source, compressed, "pw");
+		istringbstream toDecode(compressed.str());
+		ostringbstream decoded;
+		decompress(toDecode, decoded, "pw");
+		checkCondition(decoded.str() == original, "Context modeling round-trips " + file);
+	}
+
+	/* Text is where context pays: at least a tenth smaller. */
+	{
+		string original = fileContentsOf("test/encodeDecode/tomSawyer");
+		istringbstream contextSource(original);
+		ostringbstream withContexts;
+		compressWithContexts(contextSource, withContexts, "pw");
+		istringbstream plainSource(original);
+		ostringbstream plain;
+		compress(plainSource, plain, "pw");
+		checkCondition(withContexts.str().size() * 10 < plain.str().size() * 9,
+		               "Context modeling compresses text better than one code.");
+
+		bool rejected = false;
+		try {
+			istringbstream toDecode(withContexts.str());
+			ostringbstream decoded;
+			decompress(toDecode, decoded, "not pw");
+		} catch (ErrorException&) {
+			rejected = true;
+		}
+		checkCondition(rejected, "Context modeled files don't open with the wrong password.");
+
+		string compressedName = "test/contextMapped.huf", decompressedName = "test/contextMapped.out";
+		{
+			ofstream out(compressedName.c_str(), ios::binary);
+			out << withContexts.str();
+		}
+		decompressMappedFile(compressedName, decompressedName, "pw");
+		checkCondition(fileContentsOf(decompressedName) == original, "Mapped decompression reads context modeled files.");
+		remove(compressedName.c_str());
+		remove(decompressedName.c_str());
+	}
+
+	endTest("Context Model Tests");
+}
+
+/* Function: printBits
+ * --------------------------------------------------------
+ * Given a string, prints the bits of that string one at a
+ * time.
+ */
+void printBits(string str, int maxBits) {
+	/* Wrap your string in an istringbstream so we can do bit-by-bit
+	 * I/O.
+	 */
+	istringbstream stream(str);
+	for (int i = 0; i < maxBits; i++) {
+		int bit = stream.readBit();
+		if (bit == EOF) break;
+		cout << bit;
+	}
+	cout << endl;
+}
+
+/* Function: manualEncodeDecode
+ * --------------------------------------------------------
+ * Function to let you manually test running encode and
+ * decode on a given string.
+ */
+void manualEncodeDecode() {
+	beginTest("Manual encodeFile / decodeFile Tests");
+	
+	cout << "Enter text for us to encode and then decode" << endl;
+	while (true) {
+		string text = getLine("Text (enter to stop test): ");
+		if (text == "") break;
+		
+		/* Build an istringstream holding the data. */
+		istringbstream source(text);
+
+		/* Construct the encoding tree for the text. */
+		Map<ext_char, int> frequencies = getFrequencyTable(source);
+		Node* tree = buildEncodingTree(frequencies);
+		ostringbstream compressed;
+		
+		/* Encode the text. */
+		source.rewind();
+		encodeFile(source, tree, compressed);
+		
+		/* Print out the compressed representation. */
+		cout << "Compressed representation: " << endl;
+		printBits(compressed.str(), treeCost(tree));
+		
+		/* No need to generate new map/tree because we know we'd read same map that we wrote,
+		 * meaning we'd also get the same tree (assuming tree function is deterministic.)
+		 */
+		istringbstream compressedIn(compressed.str());
+		ostringstream unpacked;
+		decodeFile(compressedIn, tree, unpacked);
+		checkCondition(unpacked.str() == text, "Result of compressing and decompressing should be the original input.");
+		
+		/* Clean up memory. */
+		freeTree(tree);
+	}
+}
+
+/* Function: openFile
+ * --------------------------------------------------------
+ * Prompts the user for the name of a file to open, opening
+ * the indicated stream object to that file.
+ */
+template <typename FileStream>
+void openFile(FileStream& file, string prompt = "") {
+	while (true) {
+		string filename = getLine(prompt);
+		file.open(filename.c_str());
+		
+		if (file.is_open()) return;
+		
+		cout << "Sorry, I couldn't open that file." << endl;
+		file.clear();
+	}
+}
+
+/* Function: environmentValue
+ * --------------------------------------------------------
+ * Looks up an environment variable, returning whether it is
+ * set.
+ */
+bool environmentValue(const char* name, string& value) {
+#ifdef _MSC_VER
+	char* buffer = NULL;
+	size_t length = 0;
+	if (_dupenv_s(&buffer, &length, name) != 0 || buffer == NULL) return false;
+	value = buffer;
+	free(buffer);
+	return true;
+#else
+	const char* found = getenv(name);
+	if (found == NULL) return false;
+	value = found;
+	return true;
+#endif
+}
+
+/* Function: getPasswordKey
+ * --------------------------------------------------------
+ * Gets the password for compressing or decompressing a file
+ * without asking, if it can.  The key material is the whole of
+ * the file named by HUFFMAN_KEY_FILE, less one trailing line
+ * break, or else the value of HUFFMAN_PASSWORD.  If neither is
+ * set, the user is asked for a password.
+ */
+PasswordKey getPasswordKey(string prompt) {
+	string value;
+	if (environmentValue("HUFFMAN_KEY_FILE", value)) {
+		ifstream keyFile(value.c_str(), ios::binary);
+		if (!keyFile.is_open()) error("Cannot open key file " + value + ".");
+		ostringstream contents;
+		contents << keyFile.rdbuf();
+		string material = contents.str();
+		if (!material.empty() && material[material.size() - 1] == '\n') material.erase(material.size() - 1);
+		if (!material.empty() && material[material.size() - 1] == '\r') material.erase(material.size() - 1);
+		return PasswordKey(material);
+	}
+	if (environmentValue("HUFFMAN_PASSWORD", value)) return PasswordKey(value);
+	return PasswordKey(getLine(prompt));
+}
+
+/* Function: runCompress
+ * --------------------------------------------------------
+ * Harness to run your compress function on actual files.
+ */
+void runCompress() {
+	/* Open a file for reading. */
+	ifbstream infile;
+	openFile(infile, "File to compress: ");
+
+	/* Open a file for writing. */
+	ofbstream outfile;
+	openFile(outfile, "Filename for compressed output: ");
+		
+	/* Compress the file. */
+	PasswordKey key = getPasswordKey("Enter password: ");
+	cout << "Compressing... " << flush;
+	compress(infile, outfile, key);
+	cout << "done!" << endl << endl;
+		
+	/* Report statistics. */
+	cout << "Original file size: " << infile.size() << "B" << endl;
+	cout << "New file size:      " << outfile.size() << "B" << endl;
+	cout << "Compression ratio:  " << double(outfile.size()) / infile.size() << endl << endl;
+	getLine("Press ENTER to continue...");
+}
+
+/* Function: runDecompress
+ * --------------------------------------------------------
+ * Harness code to run your decompression routine. */
+void runDecompress() {
+	ifbstream infile;
+	openFile(infile, "File to decompress: ");
+
+	/* Get the name of the output file. */
+	ofbstream outfile;
+	openFile(outfile, "Name of file to write result: ");
+		
+	/* Decompress the file. */
+	decompress(infile, outfile, getPasswordKey("password:"));
+	cout << "Decompressed file written!" << endl;
+	getLine("Press ENTER to continue...");
+}
+
+/* Function: compareFiles
+ * --------------------------------------------------------
+ * Compares two files byte-by-byte to determine whether or
+ * not they are equivalent to one another.
+ */
+void compareFiles() {
+	/* Get the two files to compare. */
+	ifstream one, two;
+	openFile(one, "First file to compare:  ");
+	openFile(two, "Second file to compare: ");
+	
+	/* Read the contents of the files into a stringstream for
+	 * comparison.
+	 */
+	ostringstream oneContents, twoContents;
+	oneContents << one.rdbuf();
+	twoContents << two.rdbuf();
+	
+	const string oneString = oneContents.str(), twoString = twoContents.str();
+	
+	/* Check lengths are the same. */
+	if (oneString.length() != twoString.length()) {
+		cout << "Files differ!" << endl;
+		cout << "File one has length " << oneString.length() << "." << endl;
+		cout << "File two has length " << twoString.length() << "." << endl;
+	} else {
+		/* Compare the two sequences to find a mismatch. */
+		pair<string::const_iterator, string::const_iterator> diff =
+			mismatch(oneString.begin(), oneString.end(), twoString.begin());
+		if (diff.first != oneString.end()) {
+			cout << "Files differ!" << endl;
+			ptrdiff_t offset = diff.first - oneString.begin();
+			cout << "Bytes differ at offset " << offset << "." << endl;
+			cout << "File one has value " << representationOf(*diff.first) << endl;
+			cout << "File two has value " << representationOf(*diff.second) << endl;
+		} else {
+			/* Files match! */
+			cout << "Files match!" << endl;
+		}
+	}
+	getLine("Press ENTER to continue...");
+}
+
+/* Function: displayMenu
+ * --------------------------------------------------------
+ * Displays the main menu of options.
+ */
+void displayMenu() {
+	cout << "CS106B Huffman Encoding Testing Harness" << endl;
 	cout << "=====================================" << endl; 
 	cout << setw(2) << MANUAL_FREQUENCY_TESTS << ": Manually test getFrequencyTable" << endl;
 	cout << setw(2) << AUTOMATIC_FREQUENCY_TESTS << ": Automatically test getFrequencyTable" << endl;
@@ -910,6 +3437,14 @@ void displayMenu() {
 	cout << setw(2) << MANUAL_ENCODING_TESTS << ": Manually test encodeFile/decodeFile" << endl;
 	cout << setw(2) << AUTOMATIC_ENCODING_TESTS << ": Automatically test encodeFile/decodeFile" << endl;
 	cout << setw(2) << AUTOMATIC_COMPLETE_TESTS << ": Automatically test compress/decompress" << endl;
+	cout << setw(2) << AUTOMATIC_BITSTREAM_TESTS << ": Automatically test bulk bit I/O" << endl;
+	cout << setw(2) << AUTOMATIC_CANONICAL_TESTS << ": Automatically test canonical codes" << endl;
+	cout << setw(2) << AUTOMATIC_BLOCK_TESTS << ": Automatically test block compression" << endl;
+	cout << setw(2) << AUTOMATIC_MAPPED_TESTS << ": Automatically test memory-mapped files" << endl;
+	cout << setw(2) << AUTOMATIC_FORMAT_TESTS << ": Automatically test file formats and encryption" << endl;
+	cout << setw(2) << AUTOMATIC_DICTIONARY_TESTS << ": Automatically test shared dictionaries" << endl;
+	cout << setw(2) << AUTOMATIC_ADAPTIVE_TESTS << ": Automatically test adaptive Huffman coding" << endl;
+	cout << setw(2) << AUTOMATIC_CONTEXT_TESTS << ": Automatically test context modeling" << endl;
 	cout << setw(2) << COMPRESS << ": Compress a file" << endl;
 	cout << setw(2) << DECOMPRESS << ": Decompress a compressed file" << endl;
 	cout << setw(2) << COMPARE << ": Compare two files for equality" << endl;
@@ -972,6 +3507,30 @@ int main() {
 			case AUTOMATIC_COMPLETE_TESTS:
 				testCompleteStack();
 				break;
+			case AUTOMATIC_BITSTREAM_TESTS:
+				testBitStreams();
+				break;
+			case AUTOMATIC_CANONICAL_TESTS:
+				testCanonicalCodes();
+				break;
+			case AUTOMATIC_BLOCK_TESTS:
+				testBlockCompression();
+				break;
+			case AUTOMATIC_MAPPED_TESTS:
+				testMappedFiles();
+				break;
+			case AUTOMATIC_FORMAT_TESTS:
+				testFileFormats();
+				break;
+			case AUTOMATIC_DICTIONARY_TESTS:
+				testDictionaries();
+				break;
+			case AUTOMATIC_ADAPTIVE_TESTS:
+				testAdaptiveHuffman();
+				break;
+			case AUTOMATIC_CONTEXT_TESTS:
+				testContextModel();
+				break;
 			case COMPARE:
 				compareFiles();
 				break;
@@ -0,0 +1,711 @@
+/**********************************************************
+ * File: HuffmanFuzz.cpp
+ *
+ * A fuzz and differential test driver, built as its own
+ * executable so that it runs with nobody at the keyboard.
+ * Every fast path is checked against the plainest way of
+ * doing the same job: the reference frequency table and
+ * tree, a writeBit at a time encoder and a Node at a time
+ * decoder.  For each input it checks that
+ *
+ *   histogram    countBytes agrees with the reference table
+ *   tree         every code builder costs what the reference
+ *                tree costs
+ *   encode       the word writer writes what writeBit writes
+ *   decode       the table, multi-symbol and flat tree decoders
+ *                read back what the reference decoder reads
+ *   canonical    canonical codes cost the same and round-trip
+ *   interleaved  interleaved streams round-trip
+ *   formats      compress, the block compressors, the buffer
+ *                API and their decompressors round-trip, the
+ *                parallel ones matching the serial ones byte
+ *                for byte, HuffmanDecodeStream reads back the
+ *                same a random piece at a time through a random
+ *                window, and damaged files fail cleanly,
+ *                damaged block files always failing their
+ *                checksums
+ *
+ * The inputs are generated from a seed, a mix of random, skewed,
+ * small-alphabet, repetitive and text data of every size up to a
+ * few blocks, so a failure can be run again from its seed.
+ *
+ * Then each fast path is timed against its reference on a large
+ * input, and the run fails if any speedup falls below the one
+ * recorded in the baseline file, test/fuzz-baseline.txt, by more
+ * than timing noise would explain.  Since
+ * the speedups are ratios of two runs on the same machine, the
+ * baseline holds from one machine to the next.  The one that would
+ * not, the parallel blocks, is timed with a fixed number of threads
+ * and skipped on machines with fewer cores than that.  Run it as
+ *
+ *   HuffmanFuzz [cases [seed]]
+ *   HuffmanFuzz --record      writes the measured speedups as
+ *                             the new baseline
+ *   HuffmanFuzz --no-timing [cases [seed]]
+ *                             checks the inputs but times
+ *                             nothing, for unoptimized and
+ *                             sanitizer builds
+ *
+ * It exits with 0 if everything passed and 1 if anything failed.
+ * Built with HUFFMAN_LIBFUZZER defined, it has no main of its own
+ * and instead gives libFuzzer the checks to run on every input.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include "error.h"
+#include "bstream.h"
+#include "HuffmanEncoding.h"
+#include "ReferenceHuffmanEncoding.h"
+#include "CanonicalHuffman.h"
+#include "HuffmanTables.h"
+#include "Histogram.h"
+#include "BlockCompression.h"
+#include "BufferCompression.h"
+#include "DecodeStream.h"
+#include "KeyStream.h"
+using namespace std;
+
+/* The number of inputs checked unless the command line says otherwise. */
+static const int DEFAULT_CASES = 300;
+
+/* Where the recorded speedups are kept. */
+static const char* const BASELINE_FILE = "test/fuzz-baseline.txt";
+
+/* The size of the input the fast paths are timed on. */
+static const size_t TIMING_BYTES = 4 << 20;
+
+/* Every timing runs at least this many times, and keeps running
+ * until it has taken at least this long in all.
+ */
+static const int MIN_TIMING_RUNS = 3;
+static const double MIN_TIMING_SECONDS = 0.2;
+
+/* How far below its recorded speedup a fast path may fall before
+ * the run fails, as a fraction of it, to allow for timing noise.
+ */
+static const double BASELINE_TOLERANCE = 0.7;
+
+/* The parallel blocks are timed with this many threads, and only
+ * on a machine with at least as many cores, so that the speedup
+ * does not depend on how many cores there are.
+ */
+static const int TIMING_THREADS = 4;
+
+/* The password every format is checked with, with a fixed salt
+ * and nonce, so that the ways of writing one file can be compared.
+ */
+static const PasswordKey FUZZ_PASSWORD("fuzz password", string(SALT_BYTES, 'f'), 1);
+
+/* Type: Speedup
+ * How many times faster one fast path ran than its reference.
+ */
+struct Speedup {
+	string name;
+	double ratio;
+};
+
+/* The number of checks that failed so far. */
+static int failures = 0;
+
+/*
+* Records a failed check, saying which input it failed on.
+*/
+static void check(bool condition, const string& what, const string& input) {
+	if (condition) return;
+	cerr << "FAIL: " << what << " (" << input << ")" << endl;
+	failures++;
+}
+
+/*
+* The same pseudo-random sequence the benchmark uses.
+*/
+static unsigned char nextRandomByte(uint64_t& state) {
+	state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (unsigned char)(state >> 56);
+}
+
+/*
+* A random number below limit, which must be positive.
+*/
+static size_t nextBelow(uint64_t& state, size_t limit) {
+	uint64_t value = 0;
+	for (int i = 0; i < 4; i++) value = (value << 8) | nextRandomByte(state);
+	return size_t(value % limit);
+}
+
+/*
+* The number of bits the tree's codes take for the given frequencies,
+* which is the same for every optimal tree.
+*/
+static uint64_t referenceTreeCost(Node* root, Map<ext_char, int>& frequencies, int depth = 0) {
+	if (root == nullptr) return 0;
+	if (!root->zero && !root->one) return uint64_t(frequencies[root->character]) * uint64_t(depth);
+	return referenceTreeCost(root->zero, frequencies, depth + 1) + referenceTreeCost(root->one, frequencies, depth + 1);
+}
+
+/*
+* Records the code of every leaf of the tree as a string of '0's and
+* '1's, the way the assignment first builds its encoding map.
+*/
+static void referenceCodes(Node* root, const string& prefix, vector<string>& codes) {
+	if (root == nullptr) return;
+	if (!root->zero && !root->one) {
+		codes[root->character] = prefix;
+		return;
+	}
+	referenceCodes(root->zero, prefix + "0", codes);
+	referenceCodes(root->one, prefix + "1", codes);
+}
+
+/*
+* Encodes the data one writeBit at a time from the code strings, then
+* PSEUDO_EOF, which is what encodeFile must write too.
+*/
+static string referenceEncode(const string& data, Node* tree) {
+	vector<string> codes(NUM_SYMBOLS);
+	referenceCodes(tree, "", codes);
+	ostringbstream encoded;
+	for (size_t i = 0; i <= data.size(); i++) {
+		const string& code = i < data.size() ? codes[(unsigned char)data[i]] : codes[PSEUDO_EOF];
+		for (char bit : code) encoded.writeBit(bit - '0');
+	}
+	return encoded.str();
+}
+
+/*
+* Decodes one readBit and one Node at a time, as the assignment's own
+* decodeFile first did.
+*/
+static string referenceDecode(const string& encoded, Node* tree) {
+	istringbstream source(encoded);
+	string decoded;
+	Node* curr = tree;
+	while (true) {
+		if (!curr->zero && !curr->one) {
+			if (curr->character == PSEUDO_EOF) break;
+			decoded += char(curr->character);
+			curr = tree;
+			continue;
+		}
+		int bit = source.readBit();
+		if (bit == EOF) error("Encoded data ends before its PSEUDO_EOF.");
+		curr = bit ? curr->one : curr->zero;
+	}
+	return decoded;
+}
+
+/*
+* The counts of the data as an array, with no reference code at all.
+*/
+static void plainCounts(const string& data, uint64_t counts[NUM_SYMBOLS]) {
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) counts[ch] = 0;
+	for (unsigned char ch : data) counts[ch]++;
+}
+
+/*
+* Decompresses damaged copies of a compressed file, each with one
+* byte changed or cut short. Every one must either decompress or
+* raise an ErrorException; crashes and other exceptions are what
+* this is looking for, especially under a sanitizer.
+*/
+static void checkDamaged(const string& compressed, uint64_t& state, const string& input) {
+	if (compressed.empty()) return;
+	for (int attempt = 0; attempt < 4; attempt++) {
+		string damaged = compressed;
+		if (attempt == 0) {
+			damaged.resize(nextBelow(state, damaged.size()));
+		} else {
+			damaged[nextBelow(state, damaged.size())] ^= char(1 + nextBelow(state, 255));
+		}
+		try {
+			istringbstream source(damaged);
+			ostringbstream ignored;
+			decompress(source, ignored, FUZZ_PASSWORD);
+		} catch (ErrorException&) {
+			// refusing damaged input is fine
+		} catch (...) {
+			check(false, "Damaged input raised something other than an ErrorException", input);
+		}
+	}
+}
+
+/*
+* Damages copies of a block compressed file past its magic number,
+* salt, nonce and password check, where every byte is covered by a checksum or
+* by the structure of the index, so both verifyStream and parallel
+* decompression must notice.
+*/
+static void checkDamagedBlocks(const string& compressed, uint64_t& state, const string& input) {
+	const size_t headerBytes = FORMAT_PREFIX_BYTES;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		string damaged = compressed;
+		damaged[headerBytes + nextBelow(state, damaged.size() - headerBytes)] ^= char(1 + nextBelow(state, 255));
+		for (int reader = 0; reader < 2; reader++) {
+			bool caught = false;
+			try {
+				istringbstream source(damaged);
+				ostringbstream ignored;
+				if (reader == 0) {
+					verifyStream(source);
+				} else {
+					decompressParallel(source, ignored, FUZZ_PASSWORD, 2);
+				}
+			} catch (ErrorException&) {
+				caught = true;
+			} catch (...) {
+				check(false, "Damaged blocks raised something other than an ErrorException", input);
+			}
+			check(caught, reader == 0 ? "verifyStream should catch damaged blocks" :
+			                            "decompressParallel should catch damaged blocks", input);
+		}
+	}
+}
+
+/*
+* Decodes the given compressed file with a HuffmanDecodeStream
+* whose window holds windowBytes, asking for a random number of
+* bytes each time, and returns everything it hands out.
+*/
+static string pullDecoded(const string& compressed, size_t windowBytes, uint64_t& state) {
+	istringbstream source(compressed);
+	HuffmanDecodeStream decoder(source, FUZZ_PASSWORD, windowBytes);
+	vector<char> buffer(4096);
+	string decoded;
+	while (true) {
+		size_t want = 1 + nextBelow(state, buffer.size());
+		size_t got = decoder.read(buffer.data(), want);
+		decoded.append(buffer.data(), got);
+		if (got < want) break;
+	}
+	return decoded;
+}
+
+/*
+* Runs every check on one input. The state picks the damage done
+* to the compressed files.
+*/
+static void checkInput(const string& data, uint64_t& state, const string& input) {
+	const unsigned char* bytes = (const unsigned char*)data.data();
+
+	// histogram: the reference table, getFrequencyTable and countBytes all agree
+	istringstream referenceSource(data), frequencySource(data);
+	Map<ext_char, int> reference = referenceGetFrequencyTable(referenceSource);
+	Map<ext_char, int> frequencies = getFrequencyTable(frequencySource);
+	uint64_t counts[NUM_SYMBOLS], expected[NUM_SYMBOLS];
+	plainCounts(data, expected);
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) counts[ch] = 0;
+	countBytes(bytes, data.size(), counts);
+	bool countsMatch = reference.size() == frequencies.size();
+	for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+		int count = reference.containsKey(ch) ? reference[ch] : 0;
+		if (uint64_t(count) != counts[ch] || counts[ch] != expected[ch]) countsMatch = false;
+		if (frequencies.containsKey(ch) != reference.containsKey(ch)) countsMatch = false;
+	}
+	check(countsMatch, "Histograms should match the reference frequency table", input);
+
+	// tree: every builder is as cheap as the reference tree
+	Node* referenceTree = referenceBuildEncodingTree(reference);
+	uint64_t bestCost = referenceTreeCost(referenceTree, reference);
+	Node* tree = buildEncodingTree(frequencies);
+	check(referenceTreeCost(tree, reference) == bestCost, "buildEncodingTree should cost what the reference does", input);
+	int lengths[NUM_SYMBOLS];
+	getCodeLengthsForCounts(counts, lengths);
+	uint64_t lengthCost = lengths[PSEUDO_EOF];
+	for (int ch = 0; ch < PSEUDO_EOF; ch++) lengthCost += counts[ch] * uint64_t(lengths[ch]);
+	check(lengthCost == bestCost, "getCodeLengthsForCounts should cost what the reference tree does", input);
+	check(isValidCodeLengths(lengths), "Code lengths should be a complete code", input);
+
+	// encode: encodeFile's word writer writes what writeBit writes
+	string encodedReference = referenceEncode(data, referenceTree);
+	istringstream encodeSource(data);
+	ostringbstream encoded;
+	encodeFile(encodeSource, referenceTree, encoded);
+	check(encoded.str() == encodedReference, "encodeFile should write what writeBit does", input);
+
+	// decode: every decoder reads it back, as the reference does
+	check(referenceDecode(encodedReference, referenceTree) == data, "The reference decoder should round-trip", input);
+	DecodeTable table;
+	buildDecodeTable(referenceTree, table);
+	istringbstream tableSource(encodedReference);
+	ostringbstream tableDecoded;
+	decodeFileWithTable(tableSource, table, tableDecoded);
+	check(tableDecoded.str() == data, "The table decoder should round-trip", input);
+	MultiDecodeTable multi;
+	buildMultiDecodeTable(table, multi);
+	istringbstream multiSource(encodedReference);
+	ostringbstream multiDecoded;
+	decodeFileMultiSymbol(multiSource, table, multi, multiDecoded);
+	check(multiDecoded.str() == data, "The multi-symbol decoder should round-trip", input);
+	istringbstream walkSource(encodedReference);
+	ostringbstream walked;
+	decodeFileTreeWalk(walkSource, referenceTree, walked);
+	check(walked.str() == data, "The flat tree decoder should round-trip", input);
+
+	// canonical: the same lengths, table and tree encoders agree, and decode back
+	EncodeTable encodeTable;
+	buildCanonicalEncodeTable(lengths, encodeTable);
+	ostringbstream canonicalStream;
+	encodeBufferWithTable(bytes, data.size(), encodeTable, canonicalStream);
+	string canonical = canonicalStream.str();
+	check(uint64_t(canonical.size()) == (lengthCost + 7) / 8, "Canonical codes should cost their lengths", input);
+	vector<unsigned char> memory(size_t((encodedBits(counts, encodeTable) + 7) / 8) + 1);
+	size_t memoryBytes = encodeBufferToMemory(bytes, data.size(), encodeTable, memory.data());
+	check(string((const char*)memory.data(), memoryBytes) == canonical,
+	      "The memory encoder should write what the stream encoder does", input);
+	Node* canonicalTree = buildCanonicalTree(lengths);
+	check(referenceDecode(canonical, canonicalTree) == data, "Canonical codes should round-trip", input);
+	DecodeTable canonicalTable;
+	buildCanonicalDecodeTable(lengths, canonicalTable);
+	vector<unsigned char> decoded(data.size() + 1);
+	istringbstream bufferSource(canonical);
+	decodeBufferWithTable(bufferSource, canonicalTable, decoded.data(), data.size());
+	check(string((const char*)decoded.data(), data.size()) == data, "The buffer decoder should round-trip", input);
+
+	// interleaved streams
+	ostringbstream interleaved;
+	encodeBufferInterleaved(bytes, data.size(), encodeTable, interleaved);
+	string interleavedBytes = interleaved.str();
+	decodeBufferInterleaved((const unsigned char*)interleavedBytes.data(), interleavedBytes.size(), 0, canonicalTable,
+	                        decoded.data(), data.size());
+	check(string((const char*)decoded.data(), data.size()) == data, "Interleaved streams should round-trip", input);
+
+	freeTree(referenceTree);
+	freeTree(tree);
+	freeTree(canonicalTree);
+
+	// formats: every compressor round-trips, and the parallel ones match the serial ones
+	istringbstream compressSource(data);
+	ostringbstream compressed;
+	compress(compressSource, compressed, FUZZ_PASSWORD);
+	istringbstream decompressSource(compressed.str());
+	ostringbstream decompressed;
+	decompress(decompressSource, decompressed, FUZZ_PASSWORD);
+	check(decompressed.str() == data, "compress should round-trip", input);
+	istringstream estimateSource(data);
+	check(estimateCompressedSize(estimateSource) == uint64_t(compressed.str().size()),
+	      "estimateCompressedSize should be exact", input);
+	checkDamaged(compressed.str(), state, input);
+	check(pullDecoded(compressed.str(), 8 + nextBelow(state, 4096), state) == data,
+	      "HuffmanDecodeStream should round-trip", input);
+
+	size_t blockSize = 1 + nextBelow(state, 8192);
+	bool sealed = nextBelow(state, 2) == 0, interleave = nextBelow(state, 2) == 0;
+	istringstream streamSource(data), parallelSource(data), pipelinedSource(data);
+	ostringbstream blocks, parallel, pipelined;
+	compressStream(streamSource, blocks, FUZZ_PASSWORD, blockSize, sealed, interleave);
+	compressParallel(parallelSource, parallel, FUZZ_PASSWORD, 3, blockSize, sealed, interleave);
+	compressPipelined(pipelinedSource, pipelined, FUZZ_PASSWORD, 2, blockSize, sealed, interleave);
+	check(parallel.str() == blocks.str(), "compressParallel should match compressStream", input);
+	check(pipelined.str() == blocks.str(), "compressPipelined should match compressStream", input);
+	istringbstream blockSource(blocks.str()), parallelBlockSource(blocks.str());
+	ostringbstream blockDecoded, parallelDecoded;
+	decompress(blockSource, blockDecoded, FUZZ_PASSWORD);
+	decompressParallel(parallelBlockSource, parallelDecoded, FUZZ_PASSWORD, 3);
+	check(blockDecoded.str() == data && parallelDecoded.str() == data, "Block files should round-trip", input);
+	istringbstream verifySource(blocks.str());
+	check(verifyStream(verifySource) == (data.size() + blockSize - 1) / blockSize,
+	      "verifyStream should check every block", input);
+	// an interleaved block needs its frame, at most nine times the block, and the block in the window
+	size_t window = interleave ? 9 * blockSize + 1024 : 8 + nextBelow(state, 4096);
+	check(pullDecoded(blocks.str(), window, state) == data, "HuffmanDecodeStream should round-trip blocks", input);
+	checkDamaged(blocks.str(), state, input);
+	checkDamagedBlocks(blocks.str(), state, input);
+
+	vector<uint8_t> buffer(compressBufferBound(data.size()));
+	size_t bufferBytes = compressBuffer(bytes, data.size(), buffer.data(), buffer.size(), FUZZ_PASSWORD);
+	check(string((const char*)buffer.data(), bufferBytes) == compressed.str(), "compressBuffer should match compress", input);
+	size_t unpacked = decompressBuffer(buffer.data(), bufferBytes, decoded.data(), decoded.size(), FUZZ_PASSWORD);
+	check(string((const char*)decoded.data(), unpacked) == data, "The buffer API should round-trip", input);
+}
+
+#ifdef HUFFMAN_LIBFUZZER
+
+/* Entry point for libFuzzer, which supplies the inputs itself. */
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	uint64_t state = size;
+	try {
+		checkInput(string((const char*)data, size), state, "libFuzzer input");
+	} catch (ErrorException& e) {
+		check(false, "Valid input raised an error: " + e.getMessage(), "libFuzzer input");
+	}
+	if (failures > 0) abort();
+	return 0;
+}
+
+#else
+
+/*
+* Makes one input from the given state: its size is anything up to a
+* few small blocks, with a bias towards the edge cases near zero, and
+* its bytes come from one of several kinds of source.
+*/
+static string generateInput(uint64_t& state, const string& text, string& kind) {
+	static const size_t sizes[] = { 0, 1, 2, 3, 7, 64, 255, 4096, 70000 };
+	size_t length = nextBelow(state, 4) == 0 ? sizes[nextBelow(state, 9)] : nextBelow(state, 20000);
+	string data(length, '\0');
+	switch (nextBelow(state, 6)) {
+	case 0:
+		kind = "random";
+		for (size_t i = 0; i < length; i++) data[i] = char(nextRandomByte(state));
+		break;
+	case 1: {
+		// the number of leading one bits of a random byte, mostly 0 or 1
+		kind = "skewed";
+		for (size_t i = 0; i < length; i++) {
+			unsigned char byte = nextRandomByte(state);
+			int ones = 0;
+			while (ones < 8 && (byte & (0x80 >> ones))) ones++;
+			data[i] = char('a' + ones);
+		}
+		break;
+	}
+	case 2: {
+		kind = "small alphabet";
+		size_t letters = 1 + nextBelow(state, 5);
+		for (size_t i = 0; i < length; i++) data[i] = char(nextBelow(state, letters) * 37);
+		break;
+	}
+	case 3: {
+		kind = "runs";
+		char current = char(nextRandomByte(state));
+		for (size_t i = 0; i < length; i++) {
+			if (nextBelow(state, 50) == 0) current = char(nextRandomByte(state));
+			data[i] = current;
+		}
+		break;
+	}
+	case 4:
+		// powers of two make the deepest trees there can be
+		kind = "fibonacci-like";
+		for (size_t i = 0; i < length; i++) {
+			int depth = 0;
+			while (depth < 40 && (nextRandomByte(state) & 1)) depth++;
+			data[i] = char(depth);
+		}
+		break;
+	default:
+		kind = "text";
+		if (!text.empty()) {
+			size_t start = nextBelow(state, text.size());
+			for (size_t i = 0; i < length; i++) data[i] = text[(start + i) % text.size()];
+		}
+		break;
+	}
+	return data;
+}
+
+/*
+* Runs a job until it has run MIN_TIMING_RUNS times and for
+* MIN_TIMING_SECONDS in all, and returns its fastest run in seconds.
+*/
+static double timeRuns(const function<void()>& job) {
+	double fastest = 0, total = 0;
+	for (int runs = 0; runs < MIN_TIMING_RUNS || total < MIN_TIMING_SECONDS; runs++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		job();
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if (runs == 0 || seconds < fastest) fastest = seconds;
+		total += seconds;
+	}
+	return fastest;
+}
+
+/*
+* Times every fast path against its reference on text of
+* TIMING_BYTES, or on generated inputs if there is no text.
+*/
+static vector<Speedup> measureSpeedups(const string& text) {
+	string data;
+	uint64_t state = 0x46555A5A;
+	while (data.size() < TIMING_BYTES) {
+		string kind;
+		data += text.empty() ? generateInput(state, text, kind) : text;
+	}
+	data.resize(TIMING_BYTES);
+	const unsigned char* bytes = (const unsigned char*)data.data();
+	vector<Speedup> speedups;
+
+	uint64_t counts[NUM_SYMBOLS];
+	double fast = timeRuns([&]() {
+		for (int ch = 0; ch < NUM_SYMBOLS; ch++) counts[ch] = 0;
+		countBytes(bytes, data.size(), counts);
+	});
+	double slow = timeRuns([&]() {
+		istringstream source(data);
+		referenceGetFrequencyTable(source);
+	});
+	Speedup histogram = { "histogram", slow / fast };
+	speedups.push_back(histogram);
+
+	istringstream frequencySource(data);
+	Map<ext_char, int> frequencies = referenceGetFrequencyTable(frequencySource);
+	int lengths[NUM_SYMBOLS];
+	fast = timeRuns([&]() { getCodeLengthsForCounts(counts, lengths); });
+	slow = timeRuns([&]() { freeTree(referenceBuildEncodingTree(frequencies)); });
+	Speedup tree = { "tree", slow / fast };
+	speedups.push_back(tree);
+
+	Node* referenceTree = referenceBuildEncodingTree(frequencies);
+	string encoded;
+	fast = timeRuns([&]() {
+		istringstream source(data);
+		ostringbstream output;
+		encodeFile(source, referenceTree, output);
+		encoded = output.str();
+	});
+	slow = timeRuns([&]() { referenceEncode(data, referenceTree); });
+	Speedup encode = { "encode", slow / fast };
+	speedups.push_back(encode);
+
+	fast = timeRuns([&]() {
+		istringbstream source(encoded);
+		ostringbstream output;
+		decodeFile(source, referenceTree, output);
+	});
+	slow = timeRuns([&]() { referenceDecode(encoded, referenceTree); });
+	Speedup decode = { "decode", slow / fast };
+	speedups.push_back(decode);
+	freeTree(referenceTree);
+
+	// the reference for the parallel blocks is the same blocks one at a time
+	unsigned cores = thread::hardware_concurrency();
+	if (cores < unsigned(TIMING_THREADS)) {
+		cerr << "  parallelBlocks: skipped, it needs " << TIMING_THREADS << " cores and there are " << cores << endl;
+		return speedups;
+	}
+	fast = timeRuns([&]() {
+		istringstream source(data);
+		ostringbstream output;
+		compressParallel(source, output, FUZZ_PASSWORD, TIMING_THREADS, size_t(1) << 18);
+	});
+	slow = timeRuns([&]() {
+		istringstream source(data);
+		ostringbstream output;
+		compressStream(source, output, FUZZ_PASSWORD, size_t(1) << 18);
+	});
+	Speedup blocks = { "parallelBlocks", slow / fast };
+	speedups.push_back(blocks);
+	return speedups;
+}
+
+/*
+* Reads the recorded speedups, one "name ratio" pair per line. Lines
+* starting with # are comments.
+*/
+static vector<Speedup> readBaseline() {
+	vector<Speedup> baseline;
+	ifstream file(BASELINE_FILE);
+	string line;
+	while (getline(file, line)) {
+		if (line.empty() || line[0] == '#') continue;
+		istringstream fields(line);
+		Speedup speedup;
+		if (fields >> speedup.name >> speedup.ratio) baseline.push_back(speedup);
+	}
+	return baseline;
+}
+
+/*
+* Writes the measured speedups as the new baseline.
+*/
+static bool writeBaseline(const vector<Speedup>& speedups) {
+	ofstream file(BASELINE_FILE);
+	if (!file.is_open()) return false;
+	file << "# Minimum speedup of each fast path over its reference, written by HuffmanFuzz --record." << endl;
+	for (const Speedup& speedup : speedups) {
+		file << speedup.name << " " << fixed << setprecision(2) << speedup.ratio << endl;
+	}
+	return true;
+}
+
+/*
+* Checks the measured speedups against the baseline, failing any fast
+* path that has fallen below BASELINE_TOLERANCE of its recorded
+* speedup.
+*/
+static void checkSpeedups(const vector<Speedup>& speedups, const vector<Speedup>& baseline) {
+	for (const Speedup& speedup : speedups) {
+		cerr << "  " << speedup.name << ": " << fixed << setprecision(2) << speedup.ratio << "x";
+		const Speedup* recorded = nullptr;
+		for (const Speedup& entry : baseline) {
+			if (entry.name == speedup.name) recorded = &entry;
+		}
+		if (recorded == nullptr) {
+			cerr << " (no baseline)" << endl;
+			continue;
+		}
+		cerr << " (baseline " << recorded->ratio << "x)" << endl;
+		check(speedup.ratio >= recorded->ratio * BASELINE_TOLERANCE, speedup.name + " is slower than its baseline",
+		      "timing");
+	}
+}
+
+/*
+* The text to generate inputs from, or nothing if it can't be read.
+*/
+static string readText() {
+	ifstream source("test/encodeDecode/tomSawyer", ios::binary);
+	ostringstream contents;
+	contents << source.rdbuf();
+	return contents.str();
+}
+
+
+/* Main program: argc and argv come from the library's main. */
+int main() {
+	bool record = argc > 1 && string(argv[1]) == "--record";
+	bool timing = !(argc > 1 && string(argv[1]) == "--no-timing");
+	int first = record || !timing ? 2 : 1;
+	int cases = argc > first ? atoi(argv[first]) : DEFAULT_CASES;
+	uint64_t seed = argc > first + 1 ? strtoull(argv[first + 1], nullptr, 0) : 0x48554646;
+	string text = readText();
+
+	cerr << "Checking " << cases << " inputs from seed " << seed << "..." << endl;
+	uint64_t state = seed;
+	for (int i = 0; i < cases; i++) {
+		string kind;
+		uint64_t caseSeed = state;
+		string data = generateInput(state, text, kind);
+		ostringstream name;
+		name << kind << ", " << data.size() << " bytes, case " << i << ", case seed " << caseSeed;
+		try {
+			checkInput(data, state, name.str());
+		} catch (ErrorException& e) {
+			check(false, "Valid input raised an error: " + e.getMessage(), name.str());
+		}
+	}
+
+	if (timing) {
+		cerr << "Timing the fast paths against their references..." << endl;
+		vector<Speedup> speedups;
+		try {
+			speedups = measureSpeedups(text);
+		} catch (ErrorException& e) {
+			check(false, "Timing raised an error: " + e.getMessage(), "timing");
+		}
+		if (record) {
+			if (!writeBaseline(speedups)) check(false, "Cannot write the baseline", BASELINE_FILE);
+		} else {
+			checkSpeedups(speedups, readBaseline());
+		}
+	}
+
+	if (failures > 0) {
+		cerr << failures << " checks failed." << endl;
+		return 1;
+	}
+	cerr << "All checks passed." << endl;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,1015 @@
+/**********************************************************
+ * File: HuffmanTables.cpp
+ *
+ * Implementation of the functions from HuffmanTables.h.
+ */
+
+#include "HuffmanTables.h"
+#include "CanonicalHuffman.h"
+#include "error.h"
+#include <algorithm>
+#include <string.h>
+
+/* Size of the blocks of input read by encodeFileWithTable. */
+static const size_t ENCODE_BLOCK_SIZE = 1 << 16;
+
+/* Size of the buffer decodeFileMultiSymbol gathers its output in. */
+static const size_t MULTI_DECODE_BUFFER_SIZE = 1 << 12;
+
+/* Type: CodeWord
+ * A character together with its code.  Bits of the code are
+ * stored in the order they appear in the stream: the first bit
+ * of the code is bit 0.
+ */
+struct CodeWord {
+	ext_char character;
+	uint64_t bits;
+	int length;
+};
+
+/*
+* Our helper function for buildDecodeTable and buildEncodeTable.
+* Walks the tree and records the code of every leaf, zero side
+* first, keeping the nodes still to visit on a stack of its own so
+* that no tree is too deep for it.  Bits past the 64th are dropped;
+* the callers reject such codes.
+*/
+static void collectCodes(Node* root, std::vector<CodeWord>& codes) {
+	std::vector<std::pair<Node*, CodeWord> > pending;
+	if (root) {
+		CodeWord top = { NOT_A_CHAR, 0, 0 };
+		pending.push_back(std::make_pair(root, top));
+	}
+	while (!pending.empty()) {
+		Node* node = pending.back().first;
+		CodeWord word = pending.back().second;
+		pending.pop_back();
+		if (!node->zero && !node->one) {
+			word.character = node->character;
+			codes.push_back(word);
+			continue;
+		}
+		CodeWord next = { NOT_A_CHAR, word.bits, word.length + 1 };
+		if (node->one) {
+			CodeWord one = next;
+			if (word.length < 64) one.bits |= uint64_t(1) << word.length;
+			pending.push_back(std::make_pair(node->one, one));
+		}
+		if (node->zero) pending.push_back(std::make_pair(node->zero, next));
+	}
+}
+
+/*
+* Orders codes by the bits a table of the given width, after the
+* given number of bits already consumed, indexes them with, so
+* that the codes sharing a sub-table sit next to each other.
+*/
+struct TableSlotOrder {
+	int consumed;
+	int width;
+
+	bool operator()(const CodeWord& one, const CodeWord& two) const {
+		uint64_t mask = (uint64_t(1) << width) - 1;
+		return ((one.bits >> consumed) & mask) < ((two.bits >> consumed) & mask);
+	}
+};
+
+/*
+* Fills the table of the given width starting at slot base. Every
+* code in the list shares the same first `consumed` bits, which
+* have already been resolved by the tables above this one. The
+* list is sorted in place, so that the codes too long for this
+* table come in runs, one per sub-table, and nothing needs to be
+* allocated but the sub-tables themselves.
+*/
+static void fillTable(DecodeTable& table, size_t base, int width, CodeWord* codes, size_t count, int consumed) {
+	TableSlotOrder order = { consumed, width };
+	std::sort(codes, codes + count, order);
+	uint64_t mask = (uint64_t(1) << width) - 1;
+	for (size_t next = 0; next < count; ) {
+		const CodeWord& word = codes[next];
+		int remaining = word.length - consumed;
+		uint64_t bits = word.bits >> consumed;
+		if (remaining <= width) {
+			// every index whose low bits match the code decodes to it
+			DecodeEntry entry = { uint16_t(word.character), uint8_t(remaining), DECODE_LEAF };
+			for (uint64_t i = bits; i < (uint64_t(1) << width); i += uint64_t(1) << remaining) {
+				table.entries[base + i] = entry;
+			}
+			next++;
+			continue;
+		}
+
+		// codes longer than this table continue in a sub-table per prefix, and
+		// a prefix that starts a longer code can't also be a whole code
+		size_t end = next;
+		int longest = 0;
+		while (end < count && ((codes[end].bits >> consumed) & mask) == (bits & mask)) {
+			if (codes[end].length > longest) longest = codes[end].length;
+			end++;
+		}
+		int subWidth = longest - consumed - width;
+		if (subWidth > DECODE_SUBTABLE_BITS) subWidth = DECODE_SUBTABLE_BITS;
+
+		size_t subBase = table.entries.size();
+		if (subBase + (size_t(1) << subWidth) > 0xFFFF) error("Decode table is too large.");
+		DecodeEntry invalid = { uint16_t(NOT_A_CHAR), 0, DECODE_INVALID };
+		table.entries.resize(subBase + (size_t(1) << subWidth), invalid);
+
+		DecodeEntry link = { uint16_t(subBase), uint8_t(subWidth), DECODE_LINK };
+		table.entries[base + (bits & mask)] = link;
+		fillTable(table, subBase, subWidth, codes + next, end - next, consumed + width);
+		next = end;
+	}
+}
+
+/*
+* Shared by both table builders: sizes the primary table for
+* the longest code and fills in every table from the code list,
+* which it reorders.
+*/
+static void buildTableFromCodes(CodeWord* codes, size_t count, DecodeTable& table) {
+	int longest = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (codes[i].length > longest) longest = codes[i].length;
+	}
+	table.rootBits = longest < DECODE_TABLE_BITS ? longest : DECODE_TABLE_BITS;
+
+	DecodeEntry invalid = { uint16_t(NOT_A_CHAR), 0, DECODE_INVALID };
+	table.entries.assign(size_t(1) << table.rootBits, invalid);
+	fillTable(table, 0, table.rootBits, codes, count, 0);
+}
+
+/*
+* Our helper function for longestDecodeCode. Returns the longest
+* code among the slots of the table starting at base, counting
+* the bits of the tables before it.
+*/
+static int longestCodeFrom(const DecodeTable& table, size_t base, int width, int consumed) {
+	int longest = 0;
+	for (size_t i = 0; i < (size_t(1) << width); i++) {
+		const DecodeEntry& entry = table.entries[base + i];
+		int length = 0;
+		if (entry.kind == DECODE_LEAF) {
+			length = consumed + entry.bits;
+		} else if (entry.kind == DECODE_LINK) {
+			length = longestCodeFrom(table, entry.value, entry.bits, consumed + width);
+		}
+		if (length > longest) longest = length;
+	}
+	return longest;
+}
+
+/* Function: longestDecodeCode
+ * Usage: int depth = longestDecodeCode(table);
+ * --------------------------------------------------------
+ * Returns the length of the longest code in the table, which
+ * is the depth of the encoding tree it was built from.
+ */
+int longestDecodeCode(const DecodeTable& table) {
+	return longestCodeFrom(table, 0, table.rootBits, 0);
+}
+
+/* Function: longestEncodeCode
+ * Usage: int depth = longestEncodeCode(table);
+ * --------------------------------------------------------
+ * Returns the length of the longest code in the table.
+ */
+int longestEncodeCode(const EncodeTable& table) {
+	int longest = 0;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (table.codes[ch].length > longest) longest = table.codes[ch].length;
+	}
+	return longest;
+}
+
+/* Function: encodedBits
+ * Usage: uint64_t bits = encodedBits(counts, table);
+ * --------------------------------------------------------
+ * Returns how many bits encoding characters with the given
+ * counts would take, including the PSEUDO_EOF at the end,
+ * without encoding anything.
+ */
+uint64_t encodedBits(const uint64_t counts[NUM_SYMBOLS], const EncodeTable& table) {
+	uint64_t bits = table.codes[PSEUDO_EOF].length;
+	for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+		bits += counts[ch] * uint64_t(table.codes[ch].length);
+	}
+	return bits;
+}
+
+/* Codes no longer than this are packed four at a time: four of
+ * them always fit in the 64 bits writeBits and the memory encoder
+ * take in one go.
+ */
+static const int PACKED_CODE_LENGTH = 16;
+
+/*
+* Returns whether every code in the table is short enough to pack.
+*/
+static bool canPackCodes(const EncodeTable& table) {
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (table.codes[ch].length > PACKED_CODE_LENGTH) return false;
+	}
+	return true;
+}
+
+/*
+* Our helper function for the encoders. Joins the codes of the four
+* bytes at data into one run of bits, first code lowest, exactly as
+* writing them one after another would lay them out, and returns
+* how many bits there are.
+*/
+static inline int packFourCodes(const unsigned char* data, const EncodeEntry* codes, uint64_t& bits) {
+	const EncodeEntry& first = codes[data[0]];
+	const EncodeEntry& second = codes[data[1]];
+	const EncodeEntry& third = codes[data[2]];
+	const EncodeEntry& fourth = codes[data[3]];
+	if (first.length == 0 || second.length == 0 || third.length == 0 || fourth.length == 0) {
+		error("Input contains a character that is not in the encoding tree.");
+	}
+	int secondAt = first.length, thirdAt = secondAt + second.length, fourthAt = thirdAt + third.length;
+	bits = first.bits | (second.bits << secondAt) | (third.bits << thirdAt) | (fourth.bits << fourthAt);
+	return fourthAt + fourth.length;
+}
+
+/*
+* Our helper function for encodeBufferToMemory. Stores the low
+* count bytes of word, lowest byte first, which is the order the
+* bit streams use whatever the machine's own byte order.
+*/
+static inline void storeBytes(unsigned char* output, uint64_t word, int count) {
+	for (int i = 0; i < count; i++) {
+		output[i] = (unsigned char)(word >> (8 * i));
+	}
+}
+
+/*
+* Our helper function for encodeBufferToMemory. Adds count bits to
+* the word being filled, which already holds used bits.  A whole
+* word goes out as soon as it fills, carrying the rest of the bits
+* over into the next.
+*/
+static inline void appendBits(uint64_t bits, int count, uint64_t& word, int& used, unsigned char*& next) {
+	word |= bits << used;
+	if (used + count >= 64) {
+		storeBytes(next, word, 8);
+		next += 8;
+		word = used == 0 ? 0 : bits >> (64 - used);
+		used = used + count - 64;
+	} else {
+		used += count;
+	}
+}
+
+/* Function: encodeBufferToMemory
+ * Usage: size_t bytes = encodeBufferToMemory(data, length, table, output);
+ * --------------------------------------------------------
+ * Writes exactly the bits encodeBufferWithTable would write to
+ * a stream, but straight into memory with no stream in between,
+ * and returns how many bytes they take.  The first startBits
+ * bits of output[0] (at most 7) are kept and the code follows
+ * them, the way a stream carries on in a partly written byte.
+ * The output must have room for startBits plus the encodedBits
+ * of the data, rounded up to whole bytes.
+ */
+size_t encodeBufferToMemory(const unsigned char* data, size_t length, const EncodeTable& table,
+                            unsigned char* output, int startBits) {
+	const EncodeEntry* codes = table.codes;
+	unsigned char* next = output;
+	uint64_t word = startBits > 0 ? output[0] & ((1 << startBits) - 1) : 0;
+	int used = startBits;
+	size_t i = 0;
+	if (length >= 4 && canPackCodes(table)) {
+		for (; i + 4 <= length; i += 4) {
+			uint64_t bits;
+			int count = packFourCodes(data + i, codes, bits);
+			appendBits(bits, count, word, used, next);
+		}
+	}
+	for (; i <= length; i++) {
+		const EncodeEntry& entry = codes[i < length ? data[i] : PSEUDO_EOF];
+		if (i < length && entry.length == 0) error("Input contains a character that is not in the encoding tree.");
+		appendBits(entry.bits, entry.length, word, used, next);
+	}
+	storeBytes(next, word, (used + 7) / 8);
+	next += (used + 7) / 8;
+	return size_t(next - output);
+}
+
+/* Function: buildDecodeTable
+ * Usage: buildDecodeTable(encodingTree, table);
+ * --------------------------------------------------------
+ * Fills in the decode table for the given encoding tree.
+ * The primary table is no wider than DECODE_TABLE_BITS, and
+ * only as wide as the longest code requires.
+ */
+void buildDecodeTable(Node* encodingTree, DecodeTable& table) {
+	std::vector<CodeWord> codes;
+	collectCodes(encodingTree, codes);
+	buildTableFromCodes(codes.data(), codes.size(), table);
+}
+
+/* Function: buildCanonicalDecodeTable
+ * Usage: buildCanonicalDecodeTable(lengths, table);
+ * --------------------------------------------------------
+ * Fills in the decode table for the canonical code with the
+ * given code lengths, without building an encoding tree.  The
+ * lengths must be valid.
+ */
+void buildCanonicalDecodeTable(const int lengths[NUM_SYMBOLS], DecodeTable& table) {
+	uint64_t canonical[NUM_SYMBOLS];
+	getCanonicalCodes(lengths, canonical);
+
+	CodeWord codes[NUM_SYMBOLS];
+	size_t count = 0;
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		if (lengths[ch] == 0) continue;
+		CodeWord word = { ch, canonical[ch], lengths[ch] };
+		codes[count++] = word;
+	}
+	if (count == 0) {
+		// only PSEUDO_EOF, whose code is empty
+		CodeWord word = { PSEUDO_EOF, 0, 0 };
+		codes[count++] = word;
+	}
+	buildTableFromCodes(codes, count, table);
+}
+
+/*
+* The slot a FlatTree gives a node: a leaf slot for a leaf, and
+* otherwise the next internal number, the node being queued up to
+* have its own children filled in when its turn comes.
+*/
+static uint16_t flatSlot(Node* node, std::vector<Node*>& queue) {
+	if (node == nullptr) return FLAT_MISSING;
+	if (!node->zero && !node->one) return uint16_t(FLAT_LEAF | node->character);
+	if (queue.size() >= FLAT_LEAF) error("Encoding tree is too large to flatten.");
+	queue.push_back(node);
+	return uint16_t(queue.size() - 1);
+}
+
+/* Function: buildFlatTree
+ * Usage: buildFlatTree(encodingTree, tree);
+ * --------------------------------------------------------
+ * Packs the given encoding tree into a FlatTree, numbering the
+ * internal nodes in the order a breadth-first walk meets them.
+ */
+void buildFlatTree(Node* encodingTree, FlatTree& tree) {
+	std::vector<Node*> queue;
+	tree.children.clear();
+	tree.root = flatSlot(encodingTree, queue);
+	for (size_t i = 0; i < queue.size(); i++) {
+		uint16_t zero = flatSlot(queue[i]->zero, queue);
+		uint16_t one = flatSlot(queue[i]->one, queue);
+		tree.children.push_back(zero);
+		tree.children.push_back(one);
+	}
+}
+
+/* Function: decodeFileFlatTree
+ * Usage: decodeFileFlatTree(encodedFile, tree, resultFile);
+ * --------------------------------------------------------
+ * Decodes by following the flat tree one bit at a time.
+ */
+void decodeFileFlatTree(ibstream& infile, const FlatTree& tree, ostream& file) {
+	const uint16_t* children = tree.children.data();
+	uint16_t node = tree.root;
+	while (true) {
+		if (node & FLAT_LEAF) {
+			if (node == FLAT_MISSING) error("Encoded data does not match the encoding tree.");
+			ext_char ch = node & ~FLAT_LEAF;
+			if (ch == PSEUDO_EOF) break;
+			file.put(char(ch));
+			node = tree.root;
+			continue;
+		}
+		uint64_t bit = infile.readBits(1);
+		if (infile.readPastEnd()) error("Encoded data ends before its PSEUDO_EOF.");
+		node = children[2 * size_t(node) + size_t(bit)];
+	}
+}
+
+/*
+* Our helper function for the encoders. Writes the code of each
+* byte, without the PSEUDO_EOF that ends the stream.  When the codes
+* are short enough it hands them to the stream four at a time, which
+* cuts the calls to writeBits, and the loop the compiler can see
+* through, by four.
+*/
+static void encodeBytes(const unsigned char* data, size_t length, const EncodeTable& table, obstream& outfile) {
+	const EncodeEntry* codes = table.codes;
+	size_t i = 0;
+	if (length >= 4 && canPackCodes(table)) {
+		for (; i + 4 <= length; i += 4) {
+			uint64_t bits;
+			int count = packFourCodes(data + i, codes, bits);
+			outfile.writeBits(bits, count);
+		}
+	}
+	for (; i < length; i++) {
+		const EncodeEntry& entry = codes[data[i]];
+		if (entry.length == 0) error("Input contains a character that is not in the encoding tree.");
+		outfile.writeBits(entry.bits, entry.length);
+	}
+}
+
+/* Function: buildEncodeTable
+ * Usage: buildEncodeTable(encodingTree, table);
+ * --------------------------------------------------------
+ * Fills in the code of every character in the given encoding
+ * tree.  Building the table once and passing it to
+ * encodeFileWithTable avoids walking the tree again for every
+ * file encoded with the same tree.  Raises an error if a code
+ * is longer than 64 bits.
+ */
+void buildEncodeTable(Node* encodingTree, EncodeTable& table) {
+	std::vector<CodeWord> codes;
+	collectCodes(encodingTree, codes);
+
+	EncodeEntry none = { 0, 0 };
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		table.codes[ch] = none;
+	}
+	for (const CodeWord& word : codes) {
+		if (word.length > 64) error("Encoding tree has a code longer than 64 bits.");
+		EncodeEntry entry = { word.bits, word.length };
+		table.codes[word.character] = entry;
+	}
+}
+
+/* Function: buildCanonicalEncodeTable
+ * Usage: buildCanonicalEncodeTable(lengths, table);
+ * --------------------------------------------------------
+ * Fills in the canonical code for the given code lengths.  The
+ * lengths must be valid.
+ */
+void buildCanonicalEncodeTable(const int lengths[NUM_SYMBOLS], EncodeTable& table) {
+	uint64_t canonical[NUM_SYMBOLS];
+	getCanonicalCodes(lengths, canonical);
+	for (int ch = 0; ch < NUM_SYMBOLS; ch++) {
+		EncodeEntry entry = { canonical[ch], lengths[ch] };
+		table.codes[ch] = entry;
+	}
+}
+
+/*
+* Our helper function for encodeFileWithTable. Adds a block that
+* has just been encoded to the stats, in a pass of its own so that
+* the encoding loop is the same with stats or without.
+*/
+static void countBlock(const unsigned char* data, size_t length, const EncodeTable& table, CompressionStats& stats) {
+	uint64_t bits = 0;
+	for (size_t i = 0; i < length; i++) {
+		bits += uint64_t(table.codes[data[i]].length);
+	}
+	stats.codeBits += bits;
+	stats.symbols += length;
+	stats.refills++;
+}
+
+/* Function: encodeFileWithTable
+ * Usage: encodeFileWithTable(source, table, output);
+ * --------------------------------------------------------
+ * Encodes the given file exactly as encodeFile would with the
+ * tree the table was built from, followed by the code for
+ * PSEUDO_EOF.  The input is read in large blocks.  Raises an
+ * error if the input holds a character with no code.  Given
+ * stats, adds the symbols, code bits and blocks read to them.
+ */
+void encodeFileWithTable(istream& infile, const EncodeTable& table, obstream& outfile, CompressionStats* stats) {
+	std::vector<char> block(ENCODE_BLOCK_SIZE);
+	while (true) {
+		infile.read(block.data(), block.size());
+		size_t got = size_t(infile.gcount());
+		if (got == 0) break;
+		encodeBytes((const unsigned char*)block.data(), got, table, outfile);
+		if (stats != nullptr) countBlock((const unsigned char*)block.data(), got, table, *stats);
+	}
+	if (stats != nullptr) stats->codeBits += uint64_t(table.codes[PSEUDO_EOF].length);
+	outfile.writeBits(table.codes[PSEUDO_EOF].bits, table.codes[PSEUDO_EOF].length);
+	outfile.flushBits();
+}
+
+/* Function: encodeBufferWithTable
+ * Usage: encodeBufferWithTable(data, length, table, output);
+ * --------------------------------------------------------
+ * Like encodeFileWithTable, but encodes a block of memory
+ * rather than the rest of a stream.
+ */
+void encodeBufferWithTable(const unsigned char* data, size_t length, const EncodeTable& table, obstream& outfile) {
+	encodeBytes(data, length, table, outfile);
+	outfile.writeBits(table.codes[PSEUDO_EOF].bits, table.codes[PSEUDO_EOF].length);
+	outfile.flushBits();
+}
+
+/* Function: encodeBytesWithTable
+ * Usage: encodeBytesWithTable(data, length, table, output);
+ * --------------------------------------------------------
+ * Writes the codes of the buffer with no PSEUDO_EOF after them.
+ */
+void encodeBytesWithTable(const unsigned char* data, size_t length, const EncodeTable& table, obstream& outfile) {
+	encodeBytes(data, length, table, outfile);
+}
+
+/* Types: NoDecodeCounts, DecodeCounts
+ * The counting policies of the decode loops below, which call add
+ * with the bits and characters of every code or slot they read.
+ * NoDecodeCounts does nothing, so the loops it is given compile to
+ * just the decoding; DecodeCounts adds them up for the stats, in
+ * the same loops.
+ */
+struct NoDecodeCounts {
+	void add(int, int) {}
+};
+
+struct DecodeCounts {
+	uint64_t bits, symbols;
+
+	DecodeCounts() : bits(0), symbols(0) {}
+
+	void add(int bits, int symbols) {
+		this->bits += uint64_t(bits);
+		this->symbols += uint64_t(symbols);
+	}
+};
+
+/*
+* Decodes one symbol as decodeSymbol does, handing the bits of every
+* level it reads to counts.  The characters are left to the caller,
+* which knows whether the symbol was PSEUDO_EOF.
+*/
+template <typename Counts>
+static ext_char decodeCountedSymbol(ibstream& infile, const DecodeEntry* entries, int rootBits, Counts& counts) {
+	int width = rootBits;
+	DecodeEntry entry = entries[infile.peekBits(width)];
+	while (entry.kind == DECODE_LINK) {
+		infile.consumeBits(width);
+		counts.add(width, 0);
+		width = entry.bits;
+		entry = entries[entry.value + infile.peekBits(width)];
+	}
+	if (entry.kind == DECODE_INVALID) error("Encoded data does not match the decode table.");
+	infile.consumeBits(entry.bits);
+	counts.add(entry.bits, 0);
+	return entry.value;
+}
+
+/*
+* The single-symbol loop of decodeFileWithTable.
+*/
+template <typename Counts>
+static void decodeFileSingle(ibstream& infile, const DecodeTable& table, ostream& file, Counts& counts) {
+	const DecodeEntry* entries = table.entries.data();
+	while (true) {
+		ext_char ch = decodeCountedSymbol(infile, entries, table.rootBits, counts);
+		if (infile.readPastEnd()) error("Encoded data ends before its PSEUDO_EOF.");
+		if (ch == PSEUDO_EOF) break;
+		file.put(char(ch));
+		counts.add(0, 1);
+	}
+}
+
+/*
+* The loop of decodeFileMultiSymbol.  Output is gathered in a buffer
+* so that each lookup costs one copy rather than a put per character;
+* what was decoded before an error is written out before raising it.
+*/
+template <typename Counts>
+static void decodeFileMulti(ibstream& infile, const DecodeTable& table, const MultiDecodeTable& multi, ostream& file,
+                            Counts& counts) {
+	const DecodeEntry* entries = table.entries.data();
+	const MultiDecodeEntry* slots = multi.entries.data();
+	char buffer[MULTI_DECODE_BUFFER_SIZE + MULTI_DECODE_SYMBOLS];
+	size_t used = 0;
+	while (true) {
+		const MultiDecodeEntry& slot = slots[infile.peekBits(MULTI_DECODE_BITS)];
+		if (slot.count > 0) {
+			infile.consumeBits(slot.bits);
+			if (infile.readPastEnd()) break;
+			// all four bytes are copied, whatever the count, to keep the copy a single move
+			memcpy(buffer + used, slot.bytes, MULTI_DECODE_SYMBOLS);
+			used += slot.count;
+			counts.add(slot.bits, slot.count);
+		} else {
+			ext_char ch = decodeCountedSymbol(infile, entries, table.rootBits, counts);
+			if (infile.readPastEnd() || ch == PSEUDO_EOF) break;
+			buffer[used++] = char(ch);
+			counts.add(0, 1);
+		}
+		if (used >= MULTI_DECODE_BUFFER_SIZE) {
+			file.write(buffer, used);
+			used = 0;
+		}
+	}
+	file.write(buffer, used);
+	if (infile.readPastEnd()) error("Encoded data ends before its PSEUDO_EOF.");
+}
+
+/*
+* Decodes with whichever engine suits the code, counting as the
+* policy given does.
+*/
+template <typename Counts>
+static void decodeFileCounted(ibstream& infile, const DecodeTable& table, ostream& file, Counts& counts) {
+	if (prefersMultiSymbolDecode(table)) {
+		MultiDecodeTable multi;
+		buildMultiDecodeTable(table, multi);
+		decodeFileMulti(infile, table, multi, file, counts);
+	} else {
+		decodeFileSingle(infile, table, file, counts);
+	}
+}
+
+/* Function: decodeFileWithTable
+ * Usage: decodeFileWithTable(encodedFile, table, resultFile);
+ * --------------------------------------------------------
+ * Decodes a file previously written by encodeFile, one whole
+ * symbol per table lookup, stopping at PSEUDO_EOF.  The table
+ * must have been built from the tree used to encode the file.
+ * Raises an error if the input runs out before PSEUDO_EOF, so
+ * a truncated file stops at its end.  Given stats, adds the
+ * symbols and code bits read to them, counted by the same
+ * engine that decodes without them.
+ */
+void decodeFileWithTable(ibstream& infile, const DecodeTable& table, ostream& file, CompressionStats* stats) {
+	if (stats == nullptr) {
+		NoDecodeCounts counts;
+		decodeFileCounted(infile, table, file, counts);
+		return;
+	}
+	DecodeCounts counts;
+	decodeFileCounted(infile, table, file, counts);
+	stats->codeBits += counts.bits;
+	stats->symbols += counts.symbols;
+}
+
+/* Function: buildMultiDecodeTable
+ * Usage: buildMultiDecodeTable(table, multi);
+ * --------------------------------------------------------
+ * Fills in the multi-symbol table for the same code as the given
+ * single-symbol table.
+ */
+void buildMultiDecodeTable(const DecodeTable& table, MultiDecodeTable& multi) {
+	const DecodeEntry* entries = table.entries.data();
+	uint64_t rootMask = (uint64_t(1) << table.rootBits) - 1;
+	multi.entries.resize(size_t(1) << MULTI_DECODE_BITS);
+	for (uint64_t index = 0; index < (uint64_t(1) << MULTI_DECODE_BITS); index++) {
+		MultiDecodeEntry slot = { { 0 }, 0, 0 };
+
+		// a leaf no longer than the bits left depends only on those bits, not the ones past the slot
+		int used = 0;
+		while (slot.count < MULTI_DECODE_SYMBOLS) {
+			const DecodeEntry& entry = entries[(index >> used) & rootMask];
+			if (entry.kind != DECODE_LEAF || entry.value == PSEUDO_EOF) break;
+			if (used + entry.bits > MULTI_DECODE_BITS) break;
+			slot.bytes[slot.count++] = (unsigned char)entry.value;
+			used += entry.bits;
+		}
+		slot.bits = uint8_t(used);
+		multi.entries[size_t(index)] = slot;
+	}
+}
+
+/* Function: prefersMultiSymbolDecode
+ * Usage: if (prefersMultiSymbolDecode(table)) { ... }
+ * --------------------------------------------------------
+ * Returns whether the expected code length, as the code lengths
+ * imply it, is at most half of MULTI_DECODE_BITS.  Codes past the
+ * primary table count the bits of their first sub-table too.
+ */
+bool prefersMultiSymbolDecode(const DecodeTable& table) {
+	uint64_t bits = 0;
+	for (size_t i = 0; i < (size_t(1) << table.rootBits); i++) {
+		const DecodeEntry& entry = table.entries[i];
+		if (entry.kind == DECODE_LEAF) {
+			bits += entry.bits;
+		} else if (entry.kind == DECODE_LINK) {
+			bits += uint64_t(table.rootBits) + entry.bits;
+		} else {
+			bits += uint64_t(table.rootBits);
+		}
+	}
+	return 2 * bits <= uint64_t(MULTI_DECODE_BITS) << table.rootBits;
+}
+
+/* Function: decodeFileMultiSymbol
+ * Usage: decodeFileMultiSymbol(encodedFile, table, multi, resultFile);
+ * --------------------------------------------------------
+ * Decodes like decodeFileWithTable, several characters per lookup
+ * where the slot holds them, with nothing counted.
+ */
+void decodeFileMultiSymbol(ibstream& infile, const DecodeTable& table, const MultiDecodeTable& multi, ostream& file) {
+	NoDecodeCounts counts;
+	decodeFileMulti(infile, table, multi, file, counts);
+}
+
+/* Function: decodeSpanMultiSymbol
+ * Usage: size_t got = decodeSpanMultiSymbol(encodedFile, table, multi, buffer, capacity, finished);
+ * --------------------------------------------------------
+ * A slot is copied whole only while all of its bytes fit, so the
+ * copy stays a single move.
+ */
+size_t decodeSpanMultiSymbol(ibstream& infile, const DecodeTable& table, const MultiDecodeTable& multi,
+                             unsigned char* buffer, size_t capacity, bool& finished) {
+	const DecodeEntry* entries = table.entries.data();
+	const MultiDecodeEntry* slots = multi.entries.data();
+	finished = false;
+	size_t used = 0;
+	while (used + MULTI_DECODE_SYMBOLS <= capacity) {
+		const MultiDecodeEntry& slot = slots[infile.peekBits(MULTI_DECODE_BITS)];
+		if (slot.count > 0) {
+			infile.consumeBits(slot.bits);
+			memcpy(buffer + used, slot.bytes, MULTI_DECODE_SYMBOLS);
+			used += slot.count;
+		} else {
+			ext_char ch = decodeSymbol(infile, entries, table.rootBits);
+			if (ch == PSEUDO_EOF) {
+				finished = true;
+				break;
+			}
+			buffer[used++] = (unsigned char)ch;
+		}
+	}
+	if (!finished) used += decodeSpanWithTable(infile, table, buffer + used, capacity - used, finished);
+	if (infile.readPastEnd()) error("Encoded data ends before its PSEUDO_EOF.");
+	return used;
+}
+
+/* Function: decodeBufferWithTable
+ * Usage: decodeBufferWithTable(encodedFile, table, buffer, length);
+ * --------------------------------------------------------
+ * Decodes exactly length characters into the given buffer and
+ * then the PSEUDO_EOF that must follow them.  Raises an error
+ * if the stream ends early or does not end there, so corrupt
+ * input can never write past the end of the buffer.
+ */
+void decodeBufferWithTable(ibstream& infile, const DecodeTable& table, unsigned char* buffer, size_t length) {
+	const DecodeEntry* entries = table.entries.data();
+	for (size_t i = 0; i < length; i++) {
+		ext_char ch = decodeSymbol(infile, entries, table.rootBits);
+		if (ch == PSEUDO_EOF) error("Encoded data ends before its recorded length.");
+		buffer[i] = (unsigned char)ch;
+	}
+	if (decodeSymbol(infile, entries, table.rootBits) != PSEUDO_EOF) {
+		error("Encoded data runs past its recorded length.");
+	}
+	if (infile.readPastEnd()) error("Encoded data ends before its PSEUDO_EOF.");
+}
+
+/* Function: decodeSpanWithTable
+ * Usage: size_t got = decodeSpanWithTable(encodedFile, table, buffer, capacity, finished);
+ * --------------------------------------------------------
+ * Decodes characters into the given buffer until it reads the
+ * PSEUDO_EOF, when it sets finished to true, or until it has
+ * written capacity characters.  Returns how many it wrote.
+ * Calling it again with more room carries on where it left
+ * off, so the output can be decoded into memory of any size.
+ * Raises an error, by the end of the span, if the input runs
+ * out before PSEUDO_EOF.
+ */
+size_t decodeSpanWithTable(ibstream& infile, const DecodeTable& table, unsigned char* buffer, size_t capacity,
+                           bool& finished) {
+	const DecodeEntry* entries = table.entries.data();
+	finished = false;
+	for (size_t i = 0; i < capacity; i++) {
+		ext_char ch = decodeSymbol(infile, entries, table.rootBits);
+		if (ch == PSEUDO_EOF) {
+			if (infile.readPastEnd()) error("Encoded data ends before its PSEUDO_EOF.");
+			finished = true;
+			return i;
+		}
+		buffer[i] = (unsigned char)ch;
+	}
+
+	// checked once per span, so input that ends early costs at most a span of padding
+	if (infile.readPastEnd()) error("Encoded data ends before its PSEUDO_EOF.");
+	return capacity;
+}
+
+/* Type: StreamWriter
+ * One of the streams encodeBufferInterleaved fills in memory, with
+ * the word being filled as appendBits keeps it.
+ */
+struct StreamWriter {
+	std::vector<unsigned char> bytes;
+	unsigned char* next;
+	uint64_t word;
+	int used;
+};
+
+/*
+* Our helper function for encodeBufferInterleaved. Adds the code
+* of one character to the given stream.
+*/
+static inline void appendCode(const EncodeEntry& entry, StreamWriter& stream) {
+	if (entry.length == 0) error("Input contains a character that is not in the encoding tree.");
+	appendBits(entry.bits, entry.length, stream.word, stream.used, stream.next);
+}
+
+/* Function: encodeBufferInterleaved
+ * Usage: encodeBufferInterleaved(data, length, table, output);
+ * --------------------------------------------------------
+ * Encodes a block of memory as INTERLEAVED_STREAMS separate bit
+ * streams, dealing out the characters in turn: character i goes
+ * to stream i % INTERLEAVED_STREAMS.  The byte sizes of all but
+ * the last stream are written first, 32 bits each, carrying on
+ * in the current byte; then come the streams, each starting on a
+ * byte boundary.  No PSEUDO_EOF is written, so the reader must
+ * know the length.  Raises an error if the data holds a character
+ * with no code.
+ */
+void encodeBufferInterleaved(const unsigned char* data, size_t length, const EncodeTable& table, obstream& outfile) {
+	const EncodeEntry* codes = table.codes;
+	int longest = 0;
+	for (int ch = 0; ch < PSEUDO_EOF; ch++) {
+		if (codes[ch].length > longest) longest = codes[ch].length;
+	}
+
+	// no stream can take more than its share of characters at the longest code
+	StreamWriter streams[INTERLEAVED_STREAMS];
+	for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+		size_t count = (length + INTERLEAVED_STREAMS - 1 - s) / INTERLEAVED_STREAMS;
+		streams[s].bytes.resize((count * longest + 7) / 8 + 8);
+		streams[s].next = streams[s].bytes.data();
+		streams[s].word = 0;
+		streams[s].used = 0;
+	}
+
+	size_t i = 0;
+	for (; i + INTERLEAVED_STREAMS <= length; i += INTERLEAVED_STREAMS) {
+		for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+			appendCode(codes[data[i + s]], streams[s]);
+		}
+	}
+	for (int s = 0; i < length; i++, s++) {
+		appendCode(codes[data[i]], streams[s]);
+	}
+
+	size_t sizes[INTERLEAVED_STREAMS];
+	for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+		StreamWriter& stream = streams[s];
+		storeBytes(stream.next, stream.word, (stream.used + 7) / 8);
+		sizes[s] = size_t(stream.next - stream.bytes.data()) + (stream.used + 7) / 8;
+		if (uint64_t(sizes[s]) > 0xFFFFFFFF) error("Interleaved stream is too large.");
+	}
+	for (int s = 0; s + 1 < INTERLEAVED_STREAMS; s++) {
+		outfile.writeBits(sizes[s], 32);
+	}
+	outfile.flushBits();
+	for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+		outfile.write((const char*)streams[s].bytes.data(), sizes[s]);
+	}
+}
+
+/* Type: StreamReader
+ * One of the streams decodeBufferInterleaved reads from memory: the
+ * bytes it spans, the next one not yet loaded, the count bits that
+ * are loaded, and how many zero bytes have been made up past the end.
+ * Bits above the count may already hold part of the next byte, which
+ * loading it again leaves as it is.
+ */
+struct StreamReader {
+	const unsigned char* start;
+	const unsigned char* next;
+	const unsigned char* end;
+	uint64_t bits;
+	int count;
+	size_t padding;
+};
+
+/*
+* Loads eight bytes, lowest byte first, whatever the machine's own
+* byte order.
+*/
+static inline uint64_t loadWord(const unsigned char* bytes) {
+	uint64_t word = 0;
+	for (int i = 7; i >= 0; i--) {
+		word = (word << 8) | bytes[i];
+	}
+	return word;
+}
+
+/*
+* Tops up the stream's bit buffer to at least 57 bits.  Away from
+* the end of the stream that is one load of eight bytes, moving on
+* by however many whole bytes fit; near the end it goes a byte at a
+* time, with zeros past the end.
+*/
+static inline void refillReader(StreamReader& reader) {
+	if (reader.end - reader.next >= 8) {
+		reader.bits |= loadWord(reader.next) << reader.count;
+		reader.next += (63 - reader.count) >> 3;
+		reader.count |= 56;
+	} else {
+		while (reader.count <= 56) {
+			uint64_t byte = 0;
+			if (reader.next < reader.end) {
+				byte = *reader.next++;
+			} else {
+				reader.padding++;
+			}
+			reader.bits |= byte << reader.count;
+			reader.count += 8;
+		}
+	}
+}
+
+/*
+* Decodes one symbol from the stream, as decodeSymbol does from an
+* ibstream.  The stream must hold at least rootBits bits; sub-tables
+* top it up as they need.
+*/
+static inline ext_char readSymbol(StreamReader& reader, const DecodeEntry* entries, int rootBits) {
+	int width = rootBits;
+	DecodeEntry entry = entries[reader.bits & ((uint64_t(1) << width) - 1)];
+	while (entry.kind == DECODE_LINK) {
+		reader.bits >>= width;
+		reader.count -= width;
+		if (reader.count < DECODE_SUBTABLE_BITS) refillReader(reader);
+		width = entry.bits;
+		entry = entries[entry.value + (reader.bits & ((uint64_t(1) << width) - 1))];
+	}
+	if (entry.kind == DECODE_INVALID) error("Encoded data does not match the decode table.");
+	reader.bits >>= entry.bits;
+	reader.count -= entry.bits;
+	return entry.value;
+}
+
+/*
+* Reads count bits starting the given number of bits into data.
+*/
+static uint64_t bitsAt(const unsigned char* data, size_t bit, int count) {
+	uint64_t result = 0;
+	for (int i = 0; i < count; i++, bit++) {
+		result |= uint64_t((data[bit / 8] >> (bit % 8)) & 1) << i;
+	}
+	return result;
+}
+
+/* Function: decodeBufferInterleaved
+ * Usage: decodeBufferInterleaved(encoded, bytes, startBits, table, buffer, length);
+ * --------------------------------------------------------
+ * Decodes exactly length characters written by
+ * encodeBufferInterleaved from the given bytes of memory, whose
+ * first startBits bits (at most 7) come before the stream sizes.
+ * The last stream runs to the end of the bytes.  Each step takes
+ * one character from every stream, so the four decode as separate
+ * chains that the processor can overlap.  Raises an error if the
+ * sizes don't fit in the bytes or a stream does not end in its
+ * own last byte.
+ */
+void decodeBufferInterleaved(const unsigned char* encoded, size_t bytes, int startBits, const DecodeTable& table,
+                             unsigned char* buffer, size_t length) {
+	size_t sizeBits = size_t(startBits) + 32 * (INTERLEAVED_STREAMS - 1);
+	size_t offset = (sizeBits + 7) / 8;
+	if (offset > bytes) error("Interleaved data is truncated.");
+
+	StreamReader streams[INTERLEAVED_STREAMS];
+	const unsigned char* next = encoded + offset;
+	const unsigned char* end = encoded + bytes;
+	for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+		size_t size = size_t(end - next);
+		if (s + 1 < INTERLEAVED_STREAMS) {
+			uint64_t recorded = bitsAt(encoded, size_t(startBits) + 32 * s, 32);
+			if (recorded > size) error("Interleaved data is truncated.");
+			size = size_t(recorded);
+		}
+		StreamReader reader = { next, next, next + size, 0, 0, 0 };
+		streams[s] = reader;
+		next += size;
+	}
+
+	const DecodeEntry* entries = table.entries.data();
+	int rootBits = table.rootBits;
+	size_t i = 0;
+	for (; i + INTERLEAVED_STREAMS <= length; i += INTERLEAVED_STREAMS) {
+		ext_char got[INTERLEAVED_STREAMS], seen = 0;
+		for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+			// a refill lasts several symbols, so most steps skip it
+			if (streams[s].count < rootBits) refillReader(streams[s]);
+			got[s] = readSymbol(streams[s], entries, rootBits);
+			seen |= got[s];
+		}
+		// PSEUDO_EOF is the only symbol that doesn't fit in a byte
+		if (seen > 0xFF) error("Interleaved data holds a PSEUDO_EOF.");
+		for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+			buffer[i + s] = (unsigned char)got[s];
+		}
+	}
+	for (int s = 0; i < length; i++, s++) {
+		if (streams[s].count < rootBits) refillReader(streams[s]);
+		ext_char ch = readSymbol(streams[s], entries, rootBits);
+		if (ch > 0xFF) error("Interleaved data holds a PSEUDO_EOF.");
+		buffer[i] = (unsigned char)ch;
+	}
+
+	// every stream must end within its last byte, or the sizes are wrong
+	for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+		const StreamReader& reader = streams[s];
+		uint64_t consumed = uint64_t(reader.next - reader.start + reader.padding) * 8 - uint64_t(reader.count);
+		if ((consumed + 7) / 8 != uint64_t(reader.end - reader.start)) {
+			error("Interleaved stream does not end where its size says.");
+		}
+	}
+}
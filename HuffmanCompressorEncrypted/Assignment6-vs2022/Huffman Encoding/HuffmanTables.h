@@ -0,0 +1,409 @@
+/**********************************************************
+ * File: HuffmanTables.h
+ *
+ * Lookup tables derived from a Huffman encoding tree.  The
+ * decode table lets the decoder resolve a whole symbol with
+ * one or two array lookups instead of following one Node
+ * pointer per bit.
+ */
+
+#ifndef HuffmanTables_Included
+#define HuffmanTables_Included
+
+#include "HuffmanTypes.h"
+#include "bstream.h"
+#include "error.h"
+#include "CompressionStats.h"
+#include <stdint.h>
+#include <vector>
+
+/* Constant: DECODE_TABLE_BITS
+ * The maximum number of bits resolved by the primary decode
+ * table.  Codes no longer than this are decoded with a single
+ * lookup.
+ */
+const int DECODE_TABLE_BITS = 11;
+
+/* Constant: DECODE_SUBTABLE_BITS
+ * The maximum number of bits resolved by each overflow
+ * sub-table.  Longer codes chain through further sub-tables.
+ */
+const int DECODE_SUBTABLE_BITS = 7;
+
+/* Type: DecodeEntry
+ * One slot of a decode table.  A leaf slot names the decoded
+ * character and how many bits its code occupies within the
+ * current table.  A link slot names the sub-table that resolves
+ * the remaining bits and how wide that sub-table is.
+ */
+struct DecodeEntry {
+	/* The decoded character for a leaf, or the index of the first
+	 * slot of the sub-table for a link.
+	 */
+	uint16_t value;
+
+	/* Bits consumed by a leaf, or the index width of the sub-table
+	 * for a link.
+	 */
+	uint8_t bits;
+
+	/* One of the DECODE_* kinds below. */
+	uint8_t kind;
+};
+
+/* Constants: DECODE_LEAF, DECODE_LINK, DECODE_INVALID
+ * The kinds of decode table slots.  Invalid slots correspond to
+ * bit patterns that are not a prefix of any code.
+ */
+const uint8_t DECODE_INVALID = 0;
+const uint8_t DECODE_LEAF = 1;
+const uint8_t DECODE_LINK = 2;
+
+/* Type: DecodeTable
+ * A multi-level decode table.  The primary table occupies the
+ * first (1 << rootBits) slots of entries; sub-tables follow it.
+ * Each table is indexed by the next bits of the stream, first
+ * bit in the lowest position, which is the order in which
+ * ibstream delivers them.
+ */
+struct DecodeTable {
+	std::vector<DecodeEntry> entries;
+	int rootBits;
+};
+
+/* Type: EncodeEntry
+ * The code for one character: its bits in stream order, with
+ * the first bit of the code in bit 0, and how many there are.
+ * Characters that have no code have a length of 0.
+ */
+struct EncodeEntry {
+	uint64_t bits;
+	int length;
+};
+
+/* Type: EncodeTable
+ * The code of every extended character, indexed by ext_char.
+ */
+struct EncodeTable {
+	EncodeEntry codes[NUM_SYMBOLS];
+};
+
+/* Function: buildEncodeTable
+ * Usage: buildEncodeTable(encodingTree, table);
+ * --------------------------------------------------------
+ * Fills in the code of every character in the given encoding
+ * tree.  Building the table once and passing it to
+ * encodeFileWithTable avoids walking the tree again for every
+ * file encoded with the same tree.  Raises an error if a code
+ * is longer than 64 bits.
+ */
+void buildEncodeTable(Node* encodingTree, EncodeTable& table);
+
+/* Function: buildCanonicalEncodeTable
+ * Usage: buildCanonicalEncodeTable(lengths, table);
+ * --------------------------------------------------------
+ * Fills in the canonical code for the given code lengths.  The
+ * lengths must be valid.
+ */
+void buildCanonicalEncodeTable(const int lengths[NUM_SYMBOLS], EncodeTable& table);
+
+/* Function: encodeFileWithTable
+ * Usage: encodeFileWithTable(source, table, output);
+ * --------------------------------------------------------
+ * Encodes the given file exactly as encodeFile would with the
+ * tree the table was built from, followed by the code for
+ * PSEUDO_EOF.  The input is read in large blocks.  Raises an
+ * error if the input holds a character with no code.  Given
+ * stats, adds the symbols, code bits and blocks read to them.
+ */
+void encodeFileWithTable(istream& infile, const EncodeTable& table, obstream& outfile,
+                         CompressionStats* stats = nullptr);
+
+/* Function: encodeBufferWithTable
+ * Usage: encodeBufferWithTable(data, length, table, output);
+ * --------------------------------------------------------
+ * Like encodeFileWithTable, but encodes a block of memory
+ * rather than the rest of a stream.
+ */
+void encodeBufferWithTable(const unsigned char* data, size_t length, const EncodeTable& table, obstream& outfile);
+
+/* Function: encodeBytesWithTable
+ * Usage: encodeBytesWithTable(data, length, table, output);
+ * --------------------------------------------------------
+ * Writes the code of every byte of the buffer and nothing else:
+ * no PSEUDO_EOF, and the last bits are left unflushed, so that a
+ * stream can be encoded a block at a time and ended by the
+ * caller.  Raises an error if the data holds a character with
+ * no code.
+ */
+void encodeBytesWithTable(const unsigned char* data, size_t length, const EncodeTable& table, obstream& outfile);
+
+/* Function: longestEncodeCode
+ * Usage: int depth = longestEncodeCode(table);
+ * --------------------------------------------------------
+ * Returns the length of the longest code in the table.
+ */
+int longestEncodeCode(const EncodeTable& table);
+
+/* Function: longestDecodeCode
+ * Usage: int depth = longestDecodeCode(table);
+ * --------------------------------------------------------
+ * Returns the length of the longest code in the table, which
+ * is the depth of the encoding tree it was built from.
+ */
+int longestDecodeCode(const DecodeTable& table);
+
+/* Function: encodedBits
+ * Usage: uint64_t bits = encodedBits(counts, table);
+ * --------------------------------------------------------
+ * Returns how many bits encoding characters with the given
+ * counts would take, including the PSEUDO_EOF at the end,
+ * without encoding anything.
+ */
+uint64_t encodedBits(const uint64_t counts[NUM_SYMBOLS], const EncodeTable& table);
+
+/* Function: encodeBufferToMemory
+ * Usage: size_t bytes = encodeBufferToMemory(data, length, table, output);
+ * --------------------------------------------------------
+ * Writes exactly the bits encodeBufferWithTable would write to
+ * a stream, but straight into memory with no stream in between,
+ * and returns how many bytes they take.  The first startBits
+ * bits of output[0] (at most 7) are kept and the code follows
+ * them, the way a stream carries on in a partly written byte.
+ * The output must have room for startBits plus the encodedBits
+ * of the data, rounded up to whole bytes.
+ */
+size_t encodeBufferToMemory(const unsigned char* data, size_t length, const EncodeTable& table,
+                            unsigned char* output, int startBits = 0);
+
+/* Constant: INTERLEAVED_STREAMS
+ * The number of streams an interleaved encoding deals its
+ * characters out to.
+ */
+const int INTERLEAVED_STREAMS = 4;
+
+/* Function: encodeBufferInterleaved
+ * Usage: encodeBufferInterleaved(data, length, table, output);
+ * --------------------------------------------------------
+ * Encodes a block of memory as INTERLEAVED_STREAMS separate bit
+ * streams, dealing out the characters in turn: character i goes
+ * to stream i % INTERLEAVED_STREAMS.  The byte sizes of all but
+ * the last stream are written first, 32 bits each, carrying on
+ * in the current byte; then come the streams, each starting on a
+ * byte boundary.  No PSEUDO_EOF is written, so the reader must
+ * know the length.  Raises an error if the data holds a character
+ * with no code.
+ */
+void encodeBufferInterleaved(const unsigned char* data, size_t length, const EncodeTable& table, obstream& outfile);
+
+/* Function: buildDecodeTable
+ * Usage: buildDecodeTable(encodingTree, table);
+ * --------------------------------------------------------
+ * Fills in the decode table for the given encoding tree.
+ * The primary table is no wider than DECODE_TABLE_BITS, and
+ * only as wide as the longest code requires.
+ */
+void buildDecodeTable(Node* encodingTree, DecodeTable& table);
+
+/* Constants: FLAT_LEAF, FLAT_MISSING
+ * A FlatTree slot with FLAT_LEAF set is a leaf, whose character
+ * is the rest of the slot; any other slot is the index of an
+ * internal node.  FLAT_MISSING stands for a child the tree does
+ * not have, which no code leads to.
+ */
+const uint16_t FLAT_LEAF = 0x8000;
+const uint16_t FLAT_MISSING = 0xFFFF;
+
+/* Type: FlatTree
+ * An encoding tree packed into an array for walking a bit at a
+ * time.  The internal nodes are numbered in breadth-first order
+ * from the root, 0, and the children of node i are children[2i]
+ * for a 0 bit and children[2i + 1] for a 1 bit.  A tree of every
+ * character has 256 internal nodes, so the whole of it takes 1 KB,
+ * where its Nodes would take over 12 KB scattered over the heap.
+ * root is a leaf slot when the tree is a single leaf.
+ */
+struct FlatTree {
+	std::vector<uint16_t> children;
+	uint16_t root;
+};
+
+/* Function: buildFlatTree
+ * Usage: buildFlatTree(encodingTree, tree);
+ * --------------------------------------------------------
+ * Packs the given encoding tree into a FlatTree.  Raises an error
+ * if it has too many nodes to number.
+ */
+void buildFlatTree(Node* encodingTree, FlatTree& tree);
+
+/* Function: decodeFileFlatTree
+ * Usage: decodeFileFlatTree(encodedFile, tree, resultFile);
+ * --------------------------------------------------------
+ * Decodes like decodeFileWithTable, but by following the flat
+ * tree one bit at a time.  Raises an error if the bits lead to
+ * a missing child or the input runs out before PSEUDO_EOF.
+ */
+void decodeFileFlatTree(ibstream& infile, const FlatTree& tree, ostream& file);
+
+/* Function: buildCanonicalDecodeTable
+ * Usage: buildCanonicalDecodeTable(lengths, table);
+ * --------------------------------------------------------
+ * Fills in the decode table for the canonical code with the
+ * given code lengths, without building an encoding tree.  The
+ * lengths must be valid.
+ */
+void buildCanonicalDecodeTable(const int lengths[NUM_SYMBOLS], DecodeTable& table);
+
+/* Function: decodeSymbol
+ * Usage: ext_char ch = decodeSymbol(encodedFile, table.entries.data(), table.rootBits);
+ * --------------------------------------------------------
+ * Decodes and consumes one symbol with one lookup per table
+ * level.  Decoders that switch between several tables call
+ * this directly; it is inline so that costs them nothing over
+ * the loops below.  Raises an error if the bits are not a
+ * code in the table.
+ */
+inline ext_char decodeSymbol(ibstream& infile, const DecodeEntry* entries, int rootBits) {
+	int width = rootBits;
+	DecodeEntry entry = entries[infile.peekBits(width)];
+	while (entry.kind == DECODE_LINK) {
+		infile.consumeBits(width);
+		width = entry.bits;
+		entry = entries[entry.value + infile.peekBits(width)];
+	}
+	if (entry.kind == DECODE_INVALID) error("Encoded data does not match the decode table.");
+	infile.consumeBits(entry.bits);
+	return entry.value;
+}
+
+/* Function: decodeFileWithTable
+ * Usage: decodeFileWithTable(encodedFile, table, resultFile);
+ * --------------------------------------------------------
+ * Decodes a file previously written by encodeFile, one whole
+ * symbol per table lookup, stopping at PSEUDO_EOF.  The table
+ * must have been built from the tree used to encode the file.
+ * Raises an error if the input runs out before PSEUDO_EOF, so
+ * a truncated file stops at its end.  Given stats, adds the
+ * symbols and code bits read to them.  Either way, codes that
+ * prefersMultiSymbolDecode finds short enough are decoded as
+ * decodeFileMultiSymbol does, and the counting is compiled into
+ * that engine only when there are stats to count for.
+ */
+void decodeFileWithTable(ibstream& infile, const DecodeTable& table, ostream& file,
+                         CompressionStats* stats = nullptr);
+
+/* Function: decodeBufferWithTable
+ * Usage: decodeBufferWithTable(encodedFile, table, buffer, length);
+ * --------------------------------------------------------
+ * Decodes exactly length characters into the given buffer and
+ * then the PSEUDO_EOF that must follow them.  Raises an error
+ * if the stream ends early or does not end there, so corrupt
+ * input can never write past the end of the buffer.
+ */
+void decodeBufferWithTable(ibstream& infile, const DecodeTable& table, unsigned char* buffer, size_t length);
+
+/* Function: decodeSpanWithTable
+ * Usage: size_t got = decodeSpanWithTable(encodedFile, table, buffer, capacity, finished);
+ * --------------------------------------------------------
+ * Decodes characters into the given buffer until it reads the
+ * PSEUDO_EOF, when it sets finished to true, or until it has
+ * written capacity characters.  Returns how many it wrote.
+ * Calling it again with more room carries on where it left
+ * off, so the output can be decoded into memory of any size.
+ * Raises an error, by the end of the span, if the input runs
+ * out before PSEUDO_EOF.
+ */
+size_t decodeSpanWithTable(ibstream& infile, const DecodeTable& table, unsigned char* buffer, size_t capacity,
+                           bool& finished);
+
+/* Function: decodeBufferInterleaved
+ * Usage: decodeBufferInterleaved(encoded, bytes, startBits, table, buffer, length);
+ * --------------------------------------------------------
+ * Decodes exactly length characters written by
+ * encodeBufferInterleaved from the given bytes of memory, whose
+ * first startBits bits (at most 7) come before the stream sizes.
+ * The last stream runs to the end of the bytes.  Each step takes
+ * one character from every stream, so the four decode as separate
+ * chains that the processor can overlap.  This is plain scalar
+ * code, with no SIMD, and still decodes two to three times as fast
+ * as decodeBufferWithTable on the benchmark's larger inputs (see
+ * decodeInterleaved in HuffmanBenchmark).  Raises an error if the
+ * sizes don't fit in the bytes or a stream does not end in its
+ * own last byte.
+ */
+void decodeBufferInterleaved(const unsigned char* encoded, size_t bytes, int startBits, const DecodeTable& table,
+                             unsigned char* buffer, size_t length);
+
+
+/* Constant: MULTI_DECODE_BITS
+ * The number of bits a multi-symbol decode table is indexed by.
+ */
+const int MULTI_DECODE_BITS = 12;
+
+/* Constant: MULTI_DECODE_SYMBOLS
+ * The most characters one multi-symbol lookup can yield.
+ */
+const int MULTI_DECODE_SYMBOLS = 4;
+
+/* Type: MultiDecodeEntry
+ * One slot of a multi-symbol decode table: the whole characters
+ * whose codes fit one after another in the slot's bits, and how
+ * many bits those codes take in all.  A slot whose first code is
+ * too long for it, or is PSEUDO_EOF, has a count of 0, and the
+ * decoder falls back on the single-symbol table for that code.
+ */
+struct MultiDecodeEntry {
+	unsigned char bytes[MULTI_DECODE_SYMBOLS];
+	uint8_t count;
+	uint8_t bits;
+};
+
+/* Type: MultiDecodeTable
+ * A table of (1 << MULTI_DECODE_BITS) multi-symbol slots, indexed
+ * by the next bits of the stream as a DecodeTable is.
+ */
+struct MultiDecodeTable {
+	std::vector<MultiDecodeEntry> entries;
+};
+
+/* Function: buildMultiDecodeTable
+ * Usage: buildMultiDecodeTable(table, multi);
+ * --------------------------------------------------------
+ * Fills in the multi-symbol table for the same code as the given
+ * single-symbol table, which it is built from.
+ */
+void buildMultiDecodeTable(const DecodeTable& table, MultiDecodeTable& multi);
+
+/* Function: prefersMultiSymbolDecode
+ * Usage: if (prefersMultiSymbolDecode(table)) { ... }
+ * --------------------------------------------------------
+ * Returns whether the code is short enough for the multi-symbol
+ * table to pay for building it.  Only the code lengths are known
+ * to a decoder, so they stand in for the frequencies: a complete
+ * code of length n fits a character seen 1 in 2^n times, which
+ * makes the expected code length the average of the bits over the
+ * primary table's slots.  If that is at most half of
+ * MULTI_DECODE_BITS, most lookups yield two or more characters.
+ */
+bool prefersMultiSymbolDecode(const DecodeTable& table);
+
+/* Function: decodeFileMultiSymbol
+ * Usage: decodeFileMultiSymbol(encodedFile, table, multi, resultFile);
+ * --------------------------------------------------------
+ * Decodes exactly as decodeFileWithTable does, but writes every
+ * character of a multi-symbol slot with one lookup, using the
+ * single-symbol table only for long codes and PSEUDO_EOF.  The
+ * multi-symbol table must have been built from the given table.
+ */
+void decodeFileMultiSymbol(ibstream& infile, const DecodeTable& table, const MultiDecodeTable& multi, ostream& file);
+
+/* Function: decodeSpanMultiSymbol
+ * Usage: size_t got = decodeSpanMultiSymbol(encodedFile, table, multi, buffer, capacity, finished);
+ * --------------------------------------------------------
+ * Decodes exactly as decodeSpanWithTable does, a slot at a time
+ * as decodeFileMultiSymbol does, but never writes past capacity:
+ * the last few characters of a span are decoded one at a time.
+ */
+size_t decodeSpanMultiSymbol(ibstream& infile, const DecodeTable& table, const MultiDecodeTable& multi,
+                             unsigned char* buffer, size_t capacity, bool& finished);
+#endif
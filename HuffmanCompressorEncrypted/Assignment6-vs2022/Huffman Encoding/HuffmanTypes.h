@@ -29,6 +29,13 @@ const ext_char PSEUDO_EOF = 256;
  */
 const ext_char NOT_A_CHAR = 257;
 
+/* Constant: NUM_SYMBOLS
+ * The number of distinct extended characters that can appear in
+ * an encoding: every byte value, plus PSEUDO_EOF.  Tables indexed
+ * by ext_char have this many entries.
+ */
+const int NUM_SYMBOLS = PSEUDO_EOF + 1;
+
 /* Type: Node
  * A node inside a Huffman encoding tree.	 Each node stores four
  * values - the character stored here (or NOT_A_CHAR if the value
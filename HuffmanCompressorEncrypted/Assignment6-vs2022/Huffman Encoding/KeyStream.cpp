@@ -0,0 +1,562 @@
+/**********************************************************
+ * File: KeyStream.cpp
+ *
+ * Implementation of the functions from KeyStream.h.
+ */
+
+#include "KeyStream.h"
+#include "error.h"
+#include "strlib.h"
+#include <array>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+
+/*
+* The SplitMix64 step, used to spread a key and nonce over the
+* generator state.
+*/
+static uint64_t splitMix(uint64_t& x) {
+	uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/*
+* Rotates x left by count bits, for 0 < count < 64.
+*/
+static inline uint64_t rotateLeft(uint64_t x, int count) {
+	return (x << count) | (x >> (64 - count));
+}
+
+/*
+* Rotates x right by count bits, for 0 < count < 32.
+*/
+static inline uint32_t rotateRight32(uint32_t x, int count) {
+	return (x >> count) | (x << (32 - count));
+}
+
+/*
+* Reads four bytes as a little-endian word.
+*/
+static inline uint32_t littleWord(const unsigned char* bytes) {
+	return uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+/* The SHA-256 round constants. */
+static const uint32_t SHA256_ROUNDS[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+/*
+* SHA-256, fed any number of bytes at a time.
+*/
+class Sha256 {
+public:
+	Sha256() : length(0), buffered(0) {
+		static const uint32_t initial[8] = {
+			0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+		};
+		memcpy(state, initial, sizeof state);
+	}
+
+	void add(const unsigned char* data, size_t bytes) {
+		length += bytes;
+		while (bytes > 0) {
+			size_t take = bytes < 64 - buffered ? bytes : 64 - buffered;
+			memcpy(buffer + buffered, data, take);
+			buffered += take;
+			data += take;
+			bytes -= take;
+			if (buffered == 64) {
+				compress(buffer);
+				buffered = 0;
+			}
+		}
+	}
+
+	void finish(unsigned char digest[32]) {
+		uint64_t bits = length * 8;
+		unsigned char pad[72] = { 0x80 };
+		size_t padBytes = (buffered < 56 ? 56 : 120) - buffered;
+		for (int i = 0; i < 8; i++) {
+			pad[padBytes + i] = (unsigned char)(bits >> (56 - 8 * i));
+		}
+		add(pad, padBytes + 8);
+		for (int i = 0; i < 8; i++) {
+			for (int b = 0; b < 4; b++) {
+				digest[4 * i + b] = (unsigned char)(state[i] >> (24 - 8 * b));
+			}
+		}
+	}
+
+private:
+	void compress(const unsigned char chunk[64]) {
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++) {
+			w[i] = (uint32_t(chunk[4 * i]) << 24) | (uint32_t(chunk[4 * i + 1]) << 16) |
+			       (uint32_t(chunk[4 * i + 2]) << 8) | uint32_t(chunk[4 * i + 3]);
+		}
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = rotateRight32(w[i - 15], 7) ^ rotateRight32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotateRight32(w[i - 2], 17) ^ rotateRight32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; i++) {
+			uint32_t s1 = rotateRight32(e, 6) ^ rotateRight32(e, 11) ^ rotateRight32(e, 25);
+			uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + SHA256_ROUNDS[i] + w[i];
+			uint32_t s0 = rotateRight32(a, 2) ^ rotateRight32(a, 13) ^ rotateRight32(a, 22);
+			uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char buffer[64];
+	size_t buffered;
+};
+
+/*
+* HMAC-SHA256 with one key, which is hashed into its inner and
+* outer states once however many messages it signs.
+*/
+class HmacSha256 {
+public:
+	HmacSha256(const unsigned char* key, size_t keyBytes) {
+		unsigned char block[64] = { 0 };
+		if (keyBytes > 64) {
+			Sha256 hash;
+			hash.add(key, keyBytes);
+			hash.finish(block);
+		} else if (keyBytes > 0) {
+			memcpy(block, key, keyBytes);
+		}
+		unsigned char pad[64];
+		for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x36;
+		inner.add(pad, 64);
+		for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x5C;
+		outer.add(pad, 64);
+	}
+
+	void sign(const unsigned char* message, size_t bytes, unsigned char mac[32]) const {
+		Sha256 hash = inner;
+		hash.add(message, bytes);
+		hash.finish(mac);
+		Sha256 wrap = outer;
+		wrap.add(mac, 32);
+		wrap.finish(mac);
+	}
+
+private:
+	Sha256 inner, outer;
+};
+
+/* Function: pbkdf2Sha256
+ * Usage: pbkdf2Sha256(password, salt, saltBytes, iterations, key, keyBytes);
+ * --------------------------------------------------------
+ * Each 32 bytes of key is the XOR of iterations chained HMACs,
+ * the first of the salt and the block's number.
+ */
+void pbkdf2Sha256(const string& password, const unsigned char* salt, size_t saltBytes, uint32_t iterations,
+                  unsigned char* key, size_t keyBytes) {
+	HmacSha256 mac((const unsigned char*)password.data(), password.size());
+	string first((const char*)salt, saltBytes);
+	first.append(4, '\0');
+	for (uint32_t number = 1; keyBytes > 0; number++) {
+		for (int b = 0; b < 4; b++) {
+			first[saltBytes + b] = char(number >> (24 - 8 * b));
+		}
+		unsigned char chained[32], sum[32];
+		mac.sign((const unsigned char*)first.data(), first.size(), chained);
+		memcpy(sum, chained, 32);
+		for (uint32_t i = 1; i < iterations; i++) {
+			mac.sign(chained, 32, chained);
+			for (int b = 0; b < 32; b++) sum[b] ^= chained[b];
+		}
+		size_t take = keyBytes < 32 ? keyBytes : 32;
+		memcpy(key, sum, take);
+		key += take;
+		keyBytes -= take;
+	}
+}
+
+/* Function: passwordKey
+ * Usage: uint64_t key = passwordKey(password);
+ * --------------------------------------------------------
+ * FNV-1a over the bytes of the password, then one SplitMix64
+ * step so that similar passwords give unrelated keys.
+ */
+uint64_t passwordKey(const string& password) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < password.size(); i++) {
+		hash ^= (unsigned char)password[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return splitMix(hash);
+}
+
+KeystreamKey::KeystreamKey(uint64_t legacyKey) : legacy(true), legacyKey(legacyKey) {
+	for (int i = 0; i < 8; i++) words[i] = 0;
+}
+
+KeystreamKey::KeystreamKey(const unsigned char key[32]) : legacy(false), legacyKey(0) {
+	for (int i = 0; i < 8; i++) words[i] = littleWord(key + 4 * i);
+}
+
+bool KeystreamKey::operator==(const KeystreamKey& other) const {
+	if (legacy != other.legacy || legacyKey != other.legacyKey) return false;
+	for (int i = 0; i < 8; i++) {
+		if (words[i] != other.words[i]) return false;
+	}
+	return true;
+}
+
+/* The nonce of the keystream the password check of a file from
+ * before the salt is taken from, well clear of the nonces used to
+ * encrypt anything.  That check is only ever read, never written.
+ */
+static const uint64_t CHECK_NONCE = uint64_t(1) << 60;
+
+/* What the master key signs for the password check of a salted
+ * file.  It is longer than a nonce, so it never signs the same
+ * message as a file key.
+ */
+static const char CHECK_MESSAGE[] = "password check";
+
+typedef std::array<unsigned char, 32> Secret;
+typedef std::array<unsigned char, 32 + SALT_BYTES> SecretAndSalt;
+typedef std::array<unsigned char, SALT_BYTES> Salt;
+typedef std::array<unsigned char, 32> MasterKey;
+
+/*
+* What has been derived for the passwords of this run: the salt
+* of the files each one writes, and the key each one gives with
+* each salt, both looked up by the password's secret, and the
+* keystream nonces are drawn from. Threads share them, under the
+* lock, and once something is there, looking it up again takes
+* nothing from the heap.
+*/
+struct DerivedKeys {
+	DerivedKeys() : nonces(nullptr) {}
+	~DerivedKeys() {
+		delete nonces;
+	}
+
+	std::mutex lock;
+	std::map<Secret, Salt> salts;
+	std::map<SecretAndSalt, MasterKey> keys;
+	KeyStream* nonces;
+};
+
+static DerivedKeys& derivedKeys() {
+	static DerivedKeys derived;
+	return derived;
+}
+
+/*
+* Fills the given bytes from the system's source of random numbers.
+*/
+static void randomBytes(unsigned char* bytes, size_t count) {
+	std::random_device source;
+	for (size_t i = 0; i < count; i += 4) {
+		uint32_t word = source();
+		for (size_t b = 0; b < 4 && i + b < count; b++) {
+			bytes[i + b] = (unsigned char)(word >> (8 * b));
+		}
+	}
+}
+
+/*
+* Returns a new random nonce, from a keystream under a random key
+* drawn once a run, so that the system is only asked the once.
+*/
+static uint64_t randomNonce() {
+	DerivedKeys& derived = derivedKeys();
+	std::lock_guard<std::mutex> hold(derived.lock);
+	if (derived.nonces == nullptr) {
+		unsigned char key[32];
+		randomBytes(key, sizeof key);
+		derived.nonces = new KeyStream(KeystreamKey(key), 0);
+	}
+	return derived.nonces->nextWord();
+}
+
+/*
+* Fills master with the key a password's secret gives with the
+* given salt, deriving it with PBKDF2 the first time it is asked
+* for, outside the lock so that other threads aren't held up.
+*/
+static void masterKey(const unsigned char secret[32], const unsigned char salt[SALT_BYTES], unsigned char master[32]) {
+	SecretAndSalt lookup;
+	memcpy(lookup.data(), secret, 32);
+	memcpy(lookup.data() + 32, salt, SALT_BYTES);
+	DerivedKeys& derived = derivedKeys();
+	{
+		std::lock_guard<std::mutex> hold(derived.lock);
+		std::map<SecretAndSalt, MasterKey>::const_iterator found = derived.keys.find(lookup);
+		if (found != derived.keys.end()) {
+			memcpy(master, found->second.data(), 32);
+			return;
+		}
+	}
+	pbkdf2Sha256(string((const char*)secret, 32), salt, SALT_BYTES, KDF_ITERATIONS, master, 32);
+	std::lock_guard<std::mutex> hold(derived.lock);
+	memcpy(derived.keys[lookup].data(), master, 32);
+}
+
+/*
+* Fills salt with the one the files of this run with the given
+* secret are written with, picking it the first time.
+*/
+static void runSalt(const unsigned char secret[32], unsigned char salt[SALT_BYTES]) {
+	Secret lookup;
+	memcpy(lookup.data(), secret, 32);
+	DerivedKeys& derived = derivedKeys();
+	std::lock_guard<std::mutex> hold(derived.lock);
+	std::map<Secret, Salt>::iterator found = derived.salts.find(lookup);
+	if (found == derived.salts.end()) {
+		found = derived.salts.insert(std::make_pair(lookup, Salt())).first;
+		randomBytes(found->second.data(), SALT_BYTES);
+	}
+	memcpy(salt, found->second.data(), SALT_BYTES);
+}
+
+/*
+* The secret new files' keys are derived from. Hashing the
+* password first means the password itself needn't be kept.
+*/
+static void passwordSecret(const string& password, unsigned char secret[32]) {
+	Sha256 hash;
+	hash.add((const unsigned char*)password.data(), password.size());
+	hash.finish(secret);
+}
+
+/* Constructor PasswordKey::PasswordKey
+ * -------------------------------------------
+ * The original cipher seeded its engine with std::hash of the
+ * password, so that is what its files need.  Nothing slow is
+ * done until a new file's key is asked for.
+ */
+PasswordKey::PasswordKey(const string& password)
+	: key(passwordKey(password)), seed(hash<string>{}(password)), fixed(false), nonce(0) {
+	checkValue = uint32_t(KeyStream(key, CHECK_NONCE).nextWord() >> 32);
+	passwordSecret(password, secret);
+	memset(salt, 0, SALT_BYTES);
+}
+
+PasswordKey::PasswordKey(const char* password)
+	: key(passwordKey(password)), seed(hash<string>{}(password)), fixed(false), nonce(0) {
+	checkValue = uint32_t(KeyStream(key, CHECK_NONCE).nextWord() >> 32);
+	passwordSecret(password, secret);
+	memset(salt, 0, SALT_BYTES);
+}
+
+PasswordKey::PasswordKey(const string& password, const string& salt, uint64_t nonce)
+	: key(passwordKey(password)), seed(hash<string>{}(password)), fixed(true), nonce(nonce) {
+	if (salt.size() != size_t(SALT_BYTES)) error("A salt must be " + integerToString(SALT_BYTES) + " bytes.");
+	checkValue = uint32_t(KeyStream(key, CHECK_NONCE).nextWord() >> 32);
+	passwordSecret(password, secret);
+	memcpy(this->salt, salt.data(), SALT_BYTES);
+}
+
+/* Member function PasswordKey::forFile
+ * -------------------------------------------
+ * The file's key is an HMAC of its nonce, under the key the
+ * password gives with its salt, and its check an HMAC of
+ * CHECK_MESSAGE under that same key, which no nonce can match.
+ * Nothing about the keystream follows from the check, and testing
+ * a guess at the password against it costs the whole PBKDF2.
+ */
+PasswordKey PasswordKey::forFile(const unsigned char salt[SALT_BYTES], uint64_t nonce) const {
+	unsigned char master[32];
+	masterKey(secret, salt, master);
+	HmacSha256 mac(master, 32);
+	unsigned char message[8];
+	for (int b = 0; b < 8; b++) {
+		message[b] = (unsigned char)(nonce >> (8 * b));
+	}
+	unsigned char fileKey[32];
+	mac.sign(message, 8, fileKey);
+	unsigned char check[32];
+	mac.sign((const unsigned char*)CHECK_MESSAGE, sizeof CHECK_MESSAGE - 1, check);
+
+	PasswordKey bound = *this;
+	bound.key = KeystreamKey(fileKey);
+	bound.checkValue = littleWord(check);
+	return bound;
+}
+
+PasswordKey PasswordKey::forNewFile(unsigned char salt[SALT_BYTES], uint64_t& nonce) const {
+	if (fixed) {
+		memcpy(salt, this->salt, SALT_BYTES);
+		nonce = this->nonce;
+	} else {
+		runSalt(secret, salt);
+		nonce = randomNonce();
+	}
+	return forFile(salt, nonce);
+}
+
+KeystreamKey PasswordKey::keystreamKey() const {
+	return key;
+}
+
+size_t PasswordKey::legacySeed() const {
+	return seed;
+}
+
+uint32_t PasswordKey::check() const {
+	return checkValue;
+}
+
+/* Constructor KeyStream::KeyStream
+ * -------------------------------------------
+ * The ChaCha20 input is the constant, the key, a block counter and
+ * the nonce, as in the original 64-bit nonce form of the cipher.
+ */
+KeyStream::KeyStream(const KeystreamKey& key, uint64_t nonce)
+	: chacha(!key.legacy), used(8), buffered(0), available(0) {
+	if (!chacha) {
+		uint64_t x = key.legacyKey ^ splitMix(nonce);
+		for (int i = 0; i < 4; i++) {
+			state[i] = splitMix(x);
+		}
+		return;
+	}
+	input[0] = 0x61707865;
+	input[1] = 0x3320646E;
+	input[2] = 0x79622D32;
+	input[3] = 0x6B206574;
+	for (int i = 0; i < 8; i++) {
+		input[4 + i] = key.words[i];
+	}
+	input[12] = 0;
+	input[13] = 0;
+	input[14] = uint32_t(nonce);
+	input[15] = uint32_t(nonce >> 32);
+}
+
+/*
+* The ChaCha quarter round on four words of the state.
+*/
+static inline void quarterRound(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) {
+	a += b; d ^= a; d = (d << 16) | (d >> 16);
+	c += d; b ^= c; b = (b << 12) | (b >> 20);
+	a += b; d ^= a; d = (d << 8) | (d >> 24);
+	c += d; b ^= c; b = (b << 7) | (b >> 25);
+}
+
+/* Member function KeyStream::nextBlock
+ * -------------------------------------------
+ * Twenty rounds of ChaCha over the input, whose counter then
+ * moves on to the next block.
+ */
+void KeyStream::nextBlock() {
+	uint32_t x[16];
+	memcpy(x, input, sizeof x);
+	for (int round = 0; round < 10; round++) {
+		quarterRound(x[0], x[4], x[8], x[12]);
+		quarterRound(x[1], x[5], x[9], x[13]);
+		quarterRound(x[2], x[6], x[10], x[14]);
+		quarterRound(x[3], x[7], x[11], x[15]);
+		quarterRound(x[0], x[5], x[10], x[15]);
+		quarterRound(x[1], x[6], x[11], x[12]);
+		quarterRound(x[2], x[7], x[8], x[13]);
+		quarterRound(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < 8; i++) {
+		block[i] = uint64_t(x[2 * i] + input[2 * i]) | (uint64_t(x[2 * i + 1] + input[2 * i + 1]) << 32);
+	}
+	if (++input[12] == 0) input[13]++;
+	used = 0;
+}
+
+/* Member function KeyStream::nextWord
+ * -------------------------------------------
+ * The next word of the ChaCha20 block, or one step of xoshiro256**
+ * for the old cipher.
+ */
+uint64_t KeyStream::nextWord() {
+	available = 0;
+	if (chacha) {
+		if (used == 8) nextBlock();
+		return block[used++];
+	}
+	uint64_t result = rotateLeft(state[1] * 5, 7) * 9;
+	uint64_t t = state[1] << 17;
+	state[2] ^= state[0];
+	state[3] ^= state[1];
+	state[1] ^= state[2];
+	state[0] ^= state[3];
+	state[2] ^= t;
+	state[3] = rotateLeft(state[3], 45);
+	return result;
+}
+
+uint64_t KeyStream::nextBits(uint64_t bits, int count) {
+	uint64_t mask = 0;
+	int filled = 0;
+	while (filled < count) {
+		if (available == 0) {
+			buffered = nextWord();
+			available = 64;
+		}
+		int take = count - filled < available ? count - filled : available;
+		uint64_t piece = take == 64 ? buffered : buffered & ((uint64_t(1) << take) - 1);
+		mask |= piece << filled;
+		buffered = take == 64 ? 0 : buffered >> take;
+		available -= take;
+		filled += take;
+	}
+	if (count < 64) mask &= (uint64_t(1) << count) - 1;
+	return bits ^ mask;
+}
+
+/* Member function KeyStream::apply
+ * -------------------------------------------
+ * Works a word at a time, spelling out the byte order so that
+ * the result is the same on any machine.
+ */
+void KeyStream::apply(unsigned char* data, size_t length) {
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word = nextWord();
+		for (int b = 0; b < 8; b++) {
+			data[i + b] ^= (unsigned char)(word >> (8 * b));
+		}
+	}
+	if (i < length) {
+		uint64_t word = nextWord();
+		for (int b = 0; i < length; b++, i++) {
+			data[i] ^= (unsigned char)(word >> (8 * b));
+		}
+	}
+}
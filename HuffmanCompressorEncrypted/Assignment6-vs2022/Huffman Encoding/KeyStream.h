@@ -0,0 +1,232 @@
+/**********************************************************
+ * File: KeyStream.h
+ *
+ * The XOR cipher used by the newer file formats.  The original
+ * header cipher drew one bit from default_random_engine for
+ * every bit it encrypted; a KeyStream instead makes 64 bits of
+ * keystream at a time, so a header costs a handful of steps and
+ * whole buffers can be XORed a word at a time.
+ *
+ * New files are encrypted with ChaCha20.  Each one starts with a
+ * random salt and nonce (see writeFormatMagic), and its key comes
+ * from the password and the salt through PBKDF2-HMAC-SHA256 and
+ * then from the nonce through HMAC-SHA256, so no two files share
+ * a keystream and nothing in one gives away the key of another.
+ * Files written before that used xoshiro256** keyed straight from
+ * the password, whose output gives its key back; they can still
+ * be read, but nothing writes them anymore.
+ */
+
+#ifndef KeyStream_Included
+#define KeyStream_Included
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+using namespace std;
+
+/* Constants: SALT_BYTES, KDF_ITERATIONS
+ * The size of the salt a new file's key is derived with, and the
+ * number of PBKDF2 iterations that derivation takes.
+ */
+const int SALT_BYTES = 16;
+const uint32_t KDF_ITERATIONS = 1 << 16;
+
+/* Function: passwordKey
+ * Usage: uint64_t key = passwordKey(password);
+ * --------------------------------------------------------
+ * Turns a password into the 64-bit key the KeyStreams of files
+ * written before ChaCha20 started from.  Unlike std::hash, this
+ * gives the same key on every platform, so files can move
+ * between them.
+ */
+uint64_t passwordKey(const string& password);
+
+/* Function: pbkdf2Sha256
+ * Usage: pbkdf2Sha256(password, salt, saltBytes, iterations, key, keyBytes);
+ * --------------------------------------------------------
+ * Fills the key with keyBytes bytes of PBKDF2-HMAC-SHA256 over the
+ * given password and salt, as RFC 8018 defines it.
+ */
+void pbkdf2Sha256(const string& password, const unsigned char* salt, size_t saltBytes, uint32_t iterations,
+                  unsigned char* key, size_t keyBytes);
+
+/*
+ * Struct: KeystreamKey
+ * ---------------
+ * The key a KeyStream starts from: the 256-bit ChaCha20 key of one
+ * file, or the 64-bit key passwordKey gives, for files written
+ * before ChaCha20.
+ */
+struct KeystreamKey {
+	/* Constructor: KeystreamKey(uint64_t legacyKey);
+	 * Usage: KeyStream stream(passwordKey(password), block);
+	 * --------------------------
+	 * The key of the cipher from before ChaCha20.
+	 */
+	KeystreamKey(uint64_t legacyKey = 0);
+
+	/* Constructor: KeystreamKey(const unsigned char key[32]);
+	 * Usage: KeystreamKey key(bytes);
+	 * --------------------------
+	 * A ChaCha20 key, its words read in little-endian order.
+	 */
+	explicit KeystreamKey(const unsigned char key[32]);
+
+	bool operator==(const KeystreamKey& other) const;
+
+	bool legacy;
+	uint64_t legacyKey;
+	uint32_t words[8];
+};
+
+/*
+ * Class: PasswordKey
+ * ---------------
+ * Everything the ciphers need from one password, worked out once.
+ * Anything that takes a PasswordKey also takes a plain password,
+ * which is converted on the spot; a batch over many files should
+ * make one PasswordKey and pass it to every call instead.  A
+ * PasswordKey never changes, so threads can share one.
+ *
+ * A PasswordKey holds the keys of the old ciphers, and what it
+ * takes to derive the key of any new file.  forFile gives the
+ * PasswordKey of one file, which encrypts with that file's key.
+ * Deriving that is slow on purpose, so that guessing passwords is
+ * slow too; what is derived for a password and salt is kept for
+ * the rest of the run, and every file written with one password
+ * in one run shares a salt, each with a nonce of its own.
+ */
+class PasswordKey {
+public:
+	/* Constructor: PasswordKey(string password);
+	 * Usage: PasswordKey key(password);
+	 * --------------------------
+	 * Derives the keys for the given password or key material, which
+	 * may hold any bytes at all.
+	 */
+	PasswordKey(const string& password);
+	PasswordKey(const char* password);
+
+	/* Constructor: PasswordKey(string password, string salt, uint64_t nonce);
+	 * Usage: PasswordKey key(password, salt, nonce);
+	 * --------------------------
+	 * A key that writes every file with the given salt, of SALT_BYTES
+	 * bytes, and nonce, so that the same input always gives the same
+	 * file.  Two different files written with it share a keystream,
+	 * so it is only for checking that two ways of writing one file
+	 * agree.
+	 */
+	PasswordKey(const string& password, const string& salt, uint64_t nonce);
+
+	/* Member function: forFile(salt, nonce);
+	 * Usage: PasswordKey fileKey = key.forFile(salt, nonce);
+	 * --------------------------
+	 * The key of the file with the given salt and nonce, which
+	 * encrypts with the file's own keystreams.
+	 */
+	PasswordKey forFile(const unsigned char salt[SALT_BYTES], uint64_t nonce) const;
+
+	/* Member function: forNewFile(salt, nonce);
+	 * Usage: PasswordKey fileKey = key.forNewFile(salt, nonce);
+	 * --------------------------
+	 * Picks the salt and nonce of a new file, and returns its key.
+	 */
+	PasswordKey forNewFile(unsigned char salt[SALT_BYTES], uint64_t& nonce) const;
+
+	/* Member function: keystreamKey();
+	 * Usage: KeyStream stream(key.keystreamKey(), block);
+	 * --------------------------
+	 * The key for KeyStream: the file's, for a key from forFile, or
+	 * else the one passwordKey gives.
+	 */
+	KeystreamKey keystreamKey() const;
+
+	/* Member function: legacySeed();
+	 * Usage: engine.seed(key.legacySeed());
+	 * --------------------------
+	 * The seed the original cipher starts from, for files written
+	 * before the KeyStream cipher.
+	 */
+	size_t legacySeed() const;
+
+	/* Member function: check();
+	 * Usage: outfile.writeBits(key.check(), 32);
+	 * --------------------------
+	 * 32 bits that depend on the password, and for a key from forFile
+	 * on the file's salt, stored near the start of a file so that the
+	 * wrong password can be turned away before anything is decoded.  A
+	 * wrong password has one chance in 2^32 of giving the same check.
+	 * A file key's check comes from the salted PBKDF2 key, apart from
+	 * the file's keystream key, so trying a password against it is as
+	 * slow as deriving that key; the check of a plain PasswordKey is
+	 * only for reading files from before the salt.
+	 */
+	uint32_t check() const;
+
+private:
+	KeystreamKey key;
+	size_t seed;
+	uint32_t checkValue;
+	unsigned char secret[32]; // SHA-256 of the password, which new files' keys are derived from
+	bool fixed;               // whether new files get the salt and nonce below
+	unsigned char salt[SALT_BYTES];
+	uint64_t nonce;
+};
+
+/*
+ * Class: KeyStream
+ * ---------------
+ * The keystream for one key and nonce.  Bit i of the keystream is
+ * bit i % 64 of word i / 64, so XORing bytes with consecutive words
+ * in little-endian order matches XORing bits with nextBits.
+ */
+class KeyStream {
+public:
+	/* Constructor: KeyStream(KeystreamKey key, uint64_t nonce);
+	 * Usage: KeyStream stream(key, block);
+	 * --------------------------
+	 * Starts the keystream for the given key.  Every nonce gives an
+	 * unrelated keystream, so each thing encrypted with one key
+	 * should have a nonce of its own.  A ChaCha20 stream takes the
+	 * nonce as its 64-bit nonce and counts its blocks from 0.
+	 */
+	KeyStream(const KeystreamKey& key, uint64_t nonce);
+
+	/* Member function: nextWord();
+	 * Usage: uint64_t word = stream.nextWord();
+	 * --------------------------
+	 * Returns the next 64 bits of keystream.  Any bits left over from
+	 * nextBits are skipped.
+	 */
+	uint64_t nextWord();
+
+	/* Member function: nextBits(uint64_t bits, int count);
+	 * Usage: outfile.writeBits(stream.nextBits(value, 9), 9);
+	 * --------------------------
+	 * XORs the low count bits of the given value, bit 0 first, with
+	 * the next count bits of keystream, for count up to 64.
+	 */
+	uint64_t nextBits(uint64_t bits, int count);
+
+	/* Member function: apply(unsigned char* data, size_t length);
+	 * Usage: stream.apply(data, length);
+	 * --------------------------
+	 * XORs the given bytes with the keystream, starting from the next
+	 * whole word.  Applying the same keystream again restores them.
+	 */
+	void apply(unsigned char* data, size_t length);
+
+private:
+	void nextBlock();
+
+	bool chacha;
+	uint64_t state[4];  // the xoshiro256** state, for the old cipher
+	uint32_t input[16]; // the ChaCha20 input block, its counter in words 12 and 13
+	uint64_t block[8];  // the ChaCha20 block being used, as words
+	int used;           // words of it used
+	uint64_t buffered;  // keystream bits not yet used by nextBits
+	int available;
+};
+
+#endif
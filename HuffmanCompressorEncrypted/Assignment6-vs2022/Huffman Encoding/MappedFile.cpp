@@ -0,0 +1,364 @@
+/**********************************************************
+ * File: MappedFile.cpp
+ *
+ * Implementation of the classes and functions from
+ * MappedFile.h, with one mapping layer for Windows and one
+ * for POSIX systems.
+ */
+
+#include "MappedFile.h"
+#include "BufferCompression.h"
+#include "HuffmanEncoding.h"
+#include "HuffmanTables.h"
+#include "CanonicalHuffman.h"
+#include "BlockCompression.h"
+#include "ContextModel.h"
+#include "Histogram.h"
+#include "bstream.h"
+#include "error.h"
+#include <string.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* The smallest amount MappedOutput grows by, so that small writes
+ * don't each resize the file.
+ */
+static const size_t MIN_OUTPUT_GROWTH = 1 << 20;
+
+/* How much room to ask for at a time when the decoded size isn't
+ * known in advance.
+ */
+static const size_t DECODE_SPAN_SIZE = 1 << 20;
+
+/* The extension of an output file while it is being written. */
+static const char* const PARTIAL_EXTENSION = ".part";
+
+#ifdef _WIN32
+
+/*
+* Maps the first length bytes of an open file. The view keeps the
+* file alive, so the mapping handle can be closed straight away.
+*/
+static void* mapFile(HANDLE file, size_t length, bool writable) {
+	ULARGE_INTEGER size;
+	size.QuadPart = length;
+	HANDLE mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+	                                    size.HighPart, size.LowPart, NULL);
+	if (mapping == NULL) return NULL;
+	void* view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, length);
+	CloseHandle(mapping);
+	return view;
+}
+
+/*
+* Sets the length of an open file, which must not be mapped.
+*/
+static bool resizeFile(HANDLE file, size_t length) {
+	LARGE_INTEGER size;
+	size.QuadPart = LONGLONG(length);
+	return SetFilePointerEx(file, size, NULL, FILE_BEGIN) && SetEndOfFile(file);
+}
+
+MappedInput::MappedInput(const string& filename) : bytes(NULL), length(0) {
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+	                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) error("Cannot open file " + filename + " for reading.");
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		CloseHandle(file);
+		error("Cannot get the size of file " + filename + ".");
+	}
+	length = size_t(size.QuadPart);
+	if (length > 0) {
+		bytes = (const unsigned char*)mapFile(file, length, false);
+		if (bytes == NULL) {
+			CloseHandle(file);
+			error("Cannot map file " + filename + ".");
+		}
+	}
+	CloseHandle(file);
+}
+
+MappedInput::~MappedInput() {
+	if (bytes) UnmapViewOfFile(bytes);
+}
+
+MappedOutput::MappedOutput(const string& filename)
+	: bytes(NULL), length(0), capacity(0), target(filename), partial(filename + PARTIAL_EXTENSION) {
+	HANDLE handle = CreateFileA(partial.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+	                            FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) error("Cannot open file " + partial + " for writing.");
+	file = intptr_t(handle);
+}
+
+void MappedOutput::remap(size_t newCapacity) {
+	HANDLE handle = HANDLE(file);
+	if (bytes) UnmapViewOfFile(bytes);
+	bytes = NULL;
+	capacity = 0;
+	if (!resizeFile(handle, newCapacity)) error("Cannot grow the output file.");
+	if (newCapacity > 0) {
+		bytes = (unsigned char*)mapFile(handle, newCapacity, true);
+		if (bytes == NULL) error("Cannot map the output file.");
+	}
+	capacity = newCapacity;
+}
+
+bool MappedOutput::release(bool resize) {
+	if (file == intptr_t(INVALID_HANDLE_VALUE)) return false;
+	HANDLE handle = HANDLE(file);
+	file = intptr_t(INVALID_HANDLE_VALUE);
+	if (bytes) UnmapViewOfFile(bytes);
+	bytes = NULL;
+	bool resized = !resize || resizeFile(handle, length);
+	CloseHandle(handle);
+	if (!resized) {
+		remove(partial.c_str());
+		error("Cannot set the length of the output file.");
+	}
+	return true;
+}
+
+/*
+* Gives the written file the output's name, replacing any file there.
+*/
+static bool replaceFile(const string& from, const string& to) {
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+#else
+
+/*
+* Maps the first length bytes of an open file.
+*/
+static void* mapFile(int file, size_t length, bool writable) {
+	void* view = mmap(NULL, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+	return view == MAP_FAILED ? NULL : view;
+}
+
+/*
+* Sets the length of an open file.
+*/
+static bool resizeFile(int file, size_t length) {
+	return ftruncate(file, off_t(length)) == 0;
+}
+
+MappedInput::MappedInput(const string& filename) : bytes(NULL), length(0) {
+	int file = open(filename.c_str(), O_RDONLY);
+	if (file < 0) error("Cannot open file " + filename + " for reading.");
+	struct stat info;
+	if (fstat(file, &info) != 0) {
+		::close(file);
+		error("Cannot get the size of file " + filename + ".");
+	}
+	length = size_t(info.st_size);
+	if (length > 0) {
+		bytes = (const unsigned char*)mapFile(file, length, false);
+		if (bytes == NULL) {
+			::close(file);
+			error("Cannot map file " + filename + ".");
+		}
+		madvise((void*)bytes, length, MADV_SEQUENTIAL);
+	}
+	::close(file); // the mapping keeps the file alive
+}
+
+MappedInput::~MappedInput() {
+	if (bytes) munmap((void*)bytes, length);
+}
+
+MappedOutput::MappedOutput(const string& filename)
+	: bytes(NULL), length(0), capacity(0), target(filename), partial(filename + PARTIAL_EXTENSION) {
+	int handle = open(partial.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (handle < 0) error("Cannot open file " + partial + " for writing.");
+	file = handle;
+}
+
+void MappedOutput::remap(size_t newCapacity) {
+	if (bytes) munmap(bytes, capacity);
+	bytes = NULL;
+	capacity = 0;
+	if (!resizeFile(int(file), newCapacity)) error("Cannot grow the output file.");
+	if (newCapacity > 0) {
+		bytes = (unsigned char*)mapFile(int(file), newCapacity, true);
+		if (bytes == NULL) error("Cannot map the output file.");
+	}
+	capacity = newCapacity;
+}
+
+bool MappedOutput::release(bool resize) {
+	if (file < 0) return false;
+	int handle = int(file);
+	file = -1;
+	if (bytes) munmap(bytes, capacity);
+	bytes = NULL;
+	bool resized = !resize || resizeFile(handle, length);
+	::close(handle);
+	if (!resized) {
+		remove(partial.c_str());
+		error("Cannot set the length of the output file.");
+	}
+	return true;
+}
+
+/*
+* Gives the written file the output's name, replacing any file there.
+*/
+static bool replaceFile(const string& from, const string& to) {
+	return rename(from.c_str(), to.c_str()) == 0;
+}
+
+#endif
+
+const unsigned char* MappedInput::data() const {
+	return bytes;
+}
+
+size_t MappedInput::size() const {
+	return length;
+}
+
+/* Member function MappedOutput::close
+ * -------------------------------------------
+ * Cuts the file to the bytes written, then renames it over the
+ * output, so that until then any file of that name is untouched.
+ */
+void MappedOutput::close() {
+	if (!release(true)) return;
+	if (!replaceFile(partial, target)) {
+		remove(partial.c_str());
+		error("Cannot rename " + partial + " to " + target + ".");
+	}
+}
+
+/* Destructor MappedOutput::~MappedOutput
+ * -------------------------------------------
+ * An output that was never closed was not finished, so its file
+ * is thrown away.
+ */
+MappedOutput::~MappedOutput() {
+	if (release(false)) remove(partial.c_str());
+}
+
+/* Member function MappedOutput::reserve
+ * -------------------------------------------
+ * Grows the file at least geometrically, so that a long run of
+ * small reserves costs a handful of remaps rather than one each.
+ */
+unsigned char* MappedOutput::reserve(size_t bytesNeeded) {
+	if (capacity - length < bytesNeeded) {
+		size_t newCapacity = capacity + capacity / 2;
+		if (newCapacity < length + bytesNeeded) newCapacity = length + bytesNeeded;
+		if (newCapacity < MIN_OUTPUT_GROWTH) newCapacity = MIN_OUTPUT_GROWTH;
+		remap(newCapacity);
+	}
+	return bytes + length;
+}
+
+void MappedOutput::advance(size_t bytesUsed) {
+	if (bytesUsed > capacity - length) error("Advanced past the reserved output.");
+	length += bytesUsed;
+}
+
+void MappedOutput::write(const void* data, size_t count) {
+	if (count == 0) return;
+	memcpy(reserve(count), data, count);
+	length += count;
+}
+
+size_t MappedOutput::size() const {
+	return length;
+}
+
+/*
+* Lets stream-based code such as decompressStream write into a
+* MappedOutput. Nothing is buffered here; every write goes
+* straight into the mapping.
+*/
+class MappedOutputBuffer: public streambuf {
+public:
+	MappedOutputBuffer(MappedOutput& output) : output(output) {}
+
+protected:
+	virtual int_type overflow(int_type ch) {
+		if (ch != traits_type::eof()) {
+			char byte = char(ch);
+			output.write(&byte, 1);
+		}
+		return traits_type::not_eof(ch);
+	}
+
+	virtual streamsize xsputn(const char* data, streamsize count) {
+		output.write(data, size_t(count));
+		return count;
+	}
+
+private:
+	MappedOutput& output;
+};
+
+/* Function: compressMappedFile
+ * Usage: compressMappedFile(inputName, outputName, password);
+ * --------------------------------------------------------
+ * Compresses one file into another, writing exactly the bytes
+ * compress would.  The input is counted and encoded straight
+ * from its mapping, and since the size of the result is known
+ * once the codes are, it is encoded straight into the output
+ * mapping too, or copied there if it is to be stored, by
+ * compressBuffer.
+ */
+void compressMappedFile(const string& inputName, const string& outputName, const PasswordKey& password) {
+	MappedInput input(inputName);
+	MappedOutput output(outputName);
+	size_t bound = compressBufferBound(input.size());
+	output.advance(compressBuffer(input.data(), input.size(), output.reserve(bound), bound, password));
+	output.close();
+}
+
+/* Function: decompressMappedFile
+ * Usage: decompressMappedFile(inputName, outputName, password);
+ * --------------------------------------------------------
+ * Decompresses a file in any of the formats decompress reads
+ * into another file, reading the input from its mapping and
+ * decoding into the output mapping, growing it as needed.  A wrong
+ * password or a damaged file leaves any existing output as it was.
+ */
+void decompressMappedFile(const string& inputName, const string& outputName, const PasswordKey& password) {
+	MappedInput input(inputName);
+	imembstream source(input.data(), input.size());
+	MappedOutput output(outputName);
+
+	DecodeTable table;
+	int version = readCompressedHeader(source, password, table);
+	if (isBlockFormat(version)) {
+		// blocks are written whole, so the stream adds little here
+		MappedOutputBuffer buffer(output);
+		ostream sink(&buffer);
+		decompressStream(source, sink, password);
+	} else if (version == FORMAT_VERSION_CONTEXT) {
+		MappedOutputBuffer buffer(output);
+		ostream sink(&buffer);
+		decompressContexts(source, sink, password);
+	} else if (version == FORMAT_VERSION_STORED) {
+		MappedOutputBuffer buffer(output);
+		ostream sink(&buffer);
+		decompressStored(source, sink, password);
+	} else {
+		bool finished = false;
+		while (!finished) {
+			unsigned char* room = output.reserve(DECODE_SPAN_SIZE);
+			output.advance(decodeSpanWithTable(source, table, room, DECODE_SPAN_SIZE, finished));
+		}
+	}
+	output.close();
+}
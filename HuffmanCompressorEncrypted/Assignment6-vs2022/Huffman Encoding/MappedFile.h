@@ -0,0 +1,150 @@
+/**********************************************************
+ * File: MappedFile.h
+ *
+ * Memory-mapped files, so that whole files can be counted,
+ * encoded and decoded as plain spans of bytes rather than one
+ * stream call at a time.  MappedInput maps an existing file
+ * for reading; MappedOutput maps a new file for writing and
+ * grows it as needed.  compressMappedFile and
+ * decompressMappedFile use them to run the whole compressor
+ * with no stream between the files and the Huffman code.
+ */
+
+#ifndef MappedFile_Included
+#define MappedFile_Included
+
+#include "KeyStream.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+using namespace std;
+
+/*
+ * Class: MappedInput
+ * ---------------
+ * A read-only view of a whole file.  The file is unmapped when the
+ * MappedInput is destroyed.
+ */
+class MappedInput {
+public:
+	/* Constructor: MappedInput(string filename);
+	 * Usage: MappedInput input("file");
+	 * --------------------------
+	 * Maps the given file.  Raises an error if it can't be opened or
+	 * mapped.  An empty file gives an empty span.
+	 */
+	MappedInput(const string& filename);
+	~MappedInput();
+
+	/* Member functions: data(), size()
+	 * Usage: countBytes(input.data(), input.size(), counts);
+	 * --------------------------
+	 * The bytes of the file.
+	 */
+	const unsigned char* data() const;
+	size_t size() const;
+
+private:
+	const unsigned char* bytes;
+	size_t length;
+
+	MappedInput(const MappedInput&);
+	MappedInput& operator=(const MappedInput&);
+};
+
+/*
+ * Class: MappedOutput
+ * ---------------
+ * A new file written through a memory mapping.  Callers ask for room
+ * with reserve, fill it in, then say how much they used with advance.
+ * The file ends up exactly as long as the bytes advanced over.  It is
+ * written as the output's name followed by .part and only takes the
+ * output's name when it is closed, so an output abandoned part way,
+ * by an error say, leaves what was there before as it was.
+ */
+class MappedOutput {
+public:
+	/* Constructor: MappedOutput(string filename);
+	 * Usage: MappedOutput output("file");
+	 * --------------------------
+	 * Creates the temporary file for the given one, leaving any file
+	 * already there alone for now.  Raises an error if that fails.
+	 */
+	MappedOutput(const string& filename);
+	~MappedOutput();
+
+	/* Member function: reserve(size_t bytes);
+	 * Usage: unsigned char* room = output.reserve(bytes);
+	 * --------------------------
+	 * Makes sure at least the given number of bytes can be written past
+	 * the end of the output and returns where they start.  Growing the
+	 * file may move the mapping, so earlier pointers are no longer valid.
+	 */
+	unsigned char* reserve(size_t bytes);
+
+	/* Member function: advance(size_t bytes);
+	 * Usage: output.advance(bytes);
+	 * --------------------------
+	 * Adds the given number of reserved bytes to the output.
+	 */
+	void advance(size_t bytes);
+
+	/* Member function: write(const void* data, size_t bytes);
+	 * Usage: output.write(data, bytes);
+	 * --------------------------
+	 * Copies the given bytes onto the end of the output.
+	 */
+	void write(const void* data, size_t bytes);
+
+	/* Member function: size();
+	 * Usage: size_t written = output.size();
+	 * --------------------------
+	 * The number of bytes in the output so far.
+	 */
+	size_t size() const;
+
+	/* Member function: close();
+	 * Usage: output.close();
+	 * --------------------------
+	 * Unmaps the file, cuts it to the bytes written and renames it
+	 * over the given file, replacing what was there.  Raises an error
+	 * if any of that fails.  The destructor of an output that wasn't
+	 * closed removes the temporary file instead.
+	 */
+	void close();
+
+private:
+	unsigned char* bytes;
+	size_t length, capacity;
+	intptr_t file; // a HANDLE on Windows, a file descriptor elsewhere
+	string target, partial;
+
+	void remap(size_t newCapacity);
+	bool release(bool resize);
+
+	MappedOutput(const MappedOutput&);
+	MappedOutput& operator=(const MappedOutput&);
+};
+
+/* Function: compressMappedFile
+ * Usage: compressMappedFile(inputName, outputName, password);
+ * --------------------------------------------------------
+ * Compresses one file into another, writing exactly the bytes
+ * compress would.  The input is counted and encoded straight
+ * from its mapping, and since the size of the result is known
+ * once the codes are, it is encoded straight into the output
+ * mapping too, or copied there if it is to be stored.
+ */
+void compressMappedFile(const string& inputName, const string& outputName, const PasswordKey& password);
+
+/* Function: decompressMappedFile
+ * Usage: decompressMappedFile(inputName, outputName, password);
+ * --------------------------------------------------------
+ * Decompresses a file in any of the formats decompress reads
+ * into another file, reading the input from its mapping and
+ * decoding into the output mapping, growing it as needed.  A wrong
+ * password or a damaged file leaves any existing output as it was.
+ */
+void decompressMappedFile(const string& inputName, const string& outputName, const PasswordKey& password);
+
+#endif
@@ -6,10 +6,13 @@
 
 #include "MemoryDiagnostics.h"
 #include "HuffmanTypes.h"
+#include <atomic>
 
-/* Global variables (ewww!) tracking total allocations. */
-static long gTotalAllocs = 0;
-static long gTotalFrees = 0;
+/* Global variables (ewww!) tracking total allocations.  They are
+ * atomic because blocks are compressed on several threads at once.
+ */
+static std::atomic<long> gTotalAllocs(0);
+static std::atomic<long> gTotalFrees(0);
 
 /* Operators new and delete
  * Usage: Implicit
@@ -48,3 +51,18 @@ long numDeallocations() {
 	return gTotalFrees;
 }
 
+
+/* Functions: recordNodeAllocations, recordNodeDeallocations
+ * Usage: recordNodeAllocations(1);
+ * --------------------------------------------------------
+ * Adds to the totals above for Nodes that don't go through
+ * Node::operator new and delete, such as those handed out by
+ * a NodeArena.
+ */
+void recordNodeAllocations(long count) {
+	gTotalAllocs += count;
+}
+
+void recordNodeDeallocations(long count) {
+	gTotalFrees += count;
+}
@@ -24,4 +24,14 @@ long numAllocations();
  */
 long numDeallocations();
 
+/* Functions: recordNodeAllocations, recordNodeDeallocations
+ * Usage: recordNodeAllocations(1);
+ * --------------------------------------------------------
+ * Adds to the totals above for Nodes that don't go through
+ * Node::operator new and delete, such as those handed out by
+ * a NodeArena.
+ */
+void recordNodeAllocations(long count);
+void recordNodeDeallocations(long count);
+
 #endif
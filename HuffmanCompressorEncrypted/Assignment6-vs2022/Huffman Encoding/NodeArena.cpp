@@ -0,0 +1,42 @@
+/**********************************************************
+ * File: NodeArena.cpp
+ *
+ * Implementation of the NodeArena class from NodeArena.h.
+ */
+
+#include "NodeArena.h"
+#include "MemoryDiagnostics.h"
+#include "error.h"
+
+NodeArena::NodeArena() : used(0) {}
+
+NodeArena::~NodeArena() {
+	release();
+}
+
+/* Member function NodeArena::allocate
+ * -------------------------------------------
+ * Counts as one Node allocation, just as new Node() would.
+ */
+Node* NodeArena::allocate() {
+	if (used == MAX_TREE_NODES) error("Node arena is full.");
+	Node* node = &nodes[used++];
+	node->character = NOT_A_CHAR;
+	node->zero = node->one = nullptr;
+	node->weight = 0;
+	recordNodeAllocations(1);
+	return node;
+}
+
+/* Member function NodeArena::release
+ * -------------------------------------------
+ * Counts as one deallocation per node handed out.
+ */
+void NodeArena::release() {
+	recordNodeDeallocations(used);
+	used = 0;
+}
+
+int NodeArena::size() const {
+	return used;
+}
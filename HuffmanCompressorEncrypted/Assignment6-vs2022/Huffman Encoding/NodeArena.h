@@ -0,0 +1,76 @@
+/**********************************************************
+ * File: NodeArena.h
+ *
+ * A fixed block of Nodes for building one encoding tree at a
+ * time.  An encoding tree never has more than MAX_TREE_NODES
+ * nodes, so an arena can hold any of them without ever going
+ * to the heap, and freeing the whole tree is a single release
+ * rather than one delete per node.
+ */
+
+#ifndef NodeArena_Included
+#define NodeArena_Included
+
+#include "HuffmanTypes.h"
+
+/* Constant: MAX_TREE_NODES
+ * The most nodes an encoding tree can have: a leaf for every
+ * extended character, plus one fewer internal nodes.
+ */
+const int MAX_TREE_NODES = 2 * NUM_SYMBOLS - 1;
+
+/*
+ * Class: NodeArena
+ * ---------------
+ * Hands out Nodes from one contiguous array.  Nodes handed out by an
+ * arena belong to it: never pass them to delete or freeTree.  They are
+ * counted by numAllocations and numDeallocations like any other Node,
+ * so leak checks still work.
+ */
+class NodeArena {
+public:
+	/* Constructor: NodeArena();
+	 * Usage: NodeArena arena;
+	 * --------------------------
+	 * Creates an empty arena.
+	 */
+	NodeArena();
+
+	/* Destructor: ~NodeArena();
+	 * --------------------------
+	 * Releases any nodes still handed out.
+	 */
+	~NodeArena();
+
+	/* Member function: allocate();
+	 * Usage: Node* node = arena.allocate();
+	 * --------------------------
+	 * Returns the next unused node, with no children.  Raises an error
+	 * if all MAX_TREE_NODES are in use.
+	 */
+	Node* allocate();
+
+	/* Member function: release();
+	 * Usage: arena.release();
+	 * --------------------------
+	 * Frees every node handed out so far at once, which discards any
+	 * tree built from them, and makes them available again.
+	 */
+	void release();
+
+	/* Member function: size();
+	 * Usage: int used = arena.size();
+	 * --------------------------
+	 * The number of nodes handed out since the last release.
+	 */
+	int size() const;
+
+private:
+	Node nodes[MAX_TREE_NODES];
+	int used;
+
+	NodeArena(const NodeArena&);
+	NodeArena& operator=(const NodeArena&);
+};
+
+#endif
@@ -0,0 +1,251 @@
+/**********************************************************
+ * File: StaticHuffmanCodec.h
+ *
+ * Huffman codes fixed when the program is compiled.  Some
+ * data always comes from the same small alphabet, such as
+ * hexadecimal digits or DNA bases, and for it there is no
+ * need to count the input, build a tree or write a header:
+ * the code can be agreed on in advance.  StaticHuffmanCodec
+ * takes the code lengths of such an alphabet as a type and
+ * works out the canonical codes and the decode table for them
+ * with constexpr functions, so that at run time nothing is
+ * left to do but encode and decode.
+ *
+ * An alphabet is a type with one member,
+ *
+ *   static constexpr int codeLength(ext_char ch);
+ *
+ * giving the length of each character's code, or 0 for the
+ * characters that are not in the alphabet.  PSEUDO_EOF must
+ * have a code, since it ends every stream, and the lengths
+ * must be a complete code of at most STATIC_CODE_MAX_LENGTH
+ * bits; an alphabet that isn't fails to compile.
+ *
+ * The codes are the same canonical codes buildCanonicalTree,
+ * buildCanonicalEncodeTable and buildCanonicalDecodeTable give
+ * for the same lengths, so a stream encoded here can be read
+ * back with decodeFile and the tree from buildEncodingTree, and
+ * the other way around.  Streams are the bare codes followed by
+ * the code for PSEUDO_EOF, as encodeFile writes them, with no
+ * header, magic number or encryption.
+ */
+
+#ifndef StaticHuffmanCodec_Included
+#define StaticHuffmanCodec_Included
+
+#include "HuffmanTypes.h"
+#include "HuffmanTables.h"
+#include "CanonicalHuffman.h"
+#include "bstream.h"
+#include "error.h"
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+
+/* Constant: STATIC_CODE_MAX_LENGTH
+ * The longest code a static alphabet may use.  Every code is
+ * decoded with a single lookup in a table of 1 << longest code
+ * slots, which this keeps to at most 4096.
+ */
+const int STATIC_CODE_MAX_LENGTH = 12;
+
+/* Type: StaticCodeTables
+ * The code of every character and the one level decode table
+ * for a static alphabet, worked out at compile time.  The decode
+ * table is indexed by the next rootBits bits of the stream, first
+ * bit in the lowest position, as a DecodeTable's root is.
+ */
+struct StaticCodeTables {
+	EncodeEntry codes[NUM_SYMBOLS];
+	DecodeEntry entries[1 << STATIC_CODE_MAX_LENGTH];
+	int rootBits;
+	bool valid;
+};
+
+/*
+* Our helper function for StaticHuffmanCodec.  Builds the tables for
+* the alphabet's lengths as getCanonicalCodes and the decode table
+* builders would, setting valid only if the lengths are a complete
+* code no longer than STATIC_CODE_MAX_LENGTH with a PSEUDO_EOF.
+*/
+template <typename Alphabet>
+constexpr StaticCodeTables buildStaticCodeTables() {
+	StaticCodeTables tables = {};
+	int count[STATIC_CODE_MAX_LENGTH + 1] = {};
+	uint64_t sum = 0;
+	for (ext_char ch = 0; ch < NUM_SYMBOLS; ch++) {
+		int length = Alphabet::codeLength(ch);
+		if (length < 0 || length > STATIC_CODE_MAX_LENGTH) return tables;
+		if (length == 0) continue;
+		count[length]++;
+		sum += uint64_t(1) << (STATIC_CODE_MAX_LENGTH - length);
+		if (length > tables.rootBits) tables.rootBits = length;
+	}
+	if (Alphabet::codeLength(PSEUDO_EOF) == 0) return tables;
+	if (sum != uint64_t(1) << STATIC_CODE_MAX_LENGTH) return tables;
+
+	// the first code of each length follows the last code of the length before
+	uint64_t next[STATIC_CODE_MAX_LENGTH + 1] = {};
+	uint64_t code = 0;
+	for (int length = 1; length <= STATIC_CODE_MAX_LENGTH; length++) {
+		code = (code + count[length - 1]) << 1;
+		next[length] = code;
+	}
+
+	for (ext_char ch = 0; ch < NUM_SYMBOLS; ch++) {
+		int length = Alphabet::codeLength(ch);
+		if (length == 0) continue;
+
+		// the code is numbered most significant bit first; flip it to stream order
+		uint64_t value = next[length]++;
+		uint64_t bits = 0;
+		for (int i = 0; i < length; i++) {
+			bits |= ((value >> (length - 1 - i)) & 1) << i;
+		}
+		tables.codes[ch].bits = bits;
+		tables.codes[ch].length = length;
+
+		// every slot whose low bits are the code decodes to this character
+		for (uint64_t slot = bits; slot < (uint64_t(1) << tables.rootBits); slot += uint64_t(1) << length) {
+			tables.entries[slot].value = uint16_t(ch);
+			tables.entries[slot].bits = uint8_t(length);
+			tables.entries[slot].kind = DECODE_LEAF;
+		}
+	}
+	tables.valid = true;
+	return tables;
+}
+
+/*
+ * Class: StaticHuffmanCodec
+ * ---------------
+ * Encodes and decodes with the canonical code for the code lengths
+ * of the Alphabet type, all of it worked out at compile time.  All
+ * of its members are static; there is nothing to construct.
+ */
+template <typename Alphabet>
+class StaticHuffmanCodec {
+public:
+	/* Constant: tables
+	 * The codes and decode table for the alphabet.
+	 */
+	static constexpr StaticCodeTables tables = buildStaticCodeTables<Alphabet>();
+
+	static_assert(tables.valid, "A static alphabet must be a complete code of at most STATIC_CODE_MAX_LENGTH "
+	                            "bits that includes PSEUDO_EOF.");
+
+	/* Function: code
+	 * Usage: EncodeEntry entry = StaticHuffmanCodec<Alphabet>::code(ch);
+	 * --------------------------------------------------------
+	 * Returns the code of an extended character, with a length of
+	 * 0 if it is not in the alphabet.  This is a constant
+	 * expression.
+	 */
+	static constexpr EncodeEntry code(ext_char ch) {
+		return tables.codes[ch];
+	}
+
+	/* Function: getCodeLengths
+	 * Usage: StaticHuffmanCodec<Alphabet>::getCodeLengths(lengths);
+	 * --------------------------------------------------------
+	 * Fills in the code length of every extended character, for
+	 * handing to the canonical table and tree builders.
+	 */
+	static void getCodeLengths(int lengths[NUM_SYMBOLS]) {
+		for (ext_char ch = 0; ch < NUM_SYMBOLS; ch++) {
+			lengths[ch] = tables.codes[ch].length;
+		}
+	}
+
+	/* Function: buildEncodingTree
+	 * Usage: Node* tree = StaticHuffmanCodec<Alphabet>::buildEncodingTree();
+	 * --------------------------------------------------------
+	 * Builds the encoding tree for the alphabet's code, so that the
+	 * tree-based encodeFile and decodeFile can write and read the
+	 * same streams as this class.  Free it with freeTree.
+	 */
+	static Node* buildEncodingTree() {
+		int lengths[NUM_SYMBOLS];
+		getCodeLengths(lengths);
+		return buildCanonicalTree(lengths);
+	}
+
+	/* Function: encodeBuffer
+	 * Usage: StaticHuffmanCodec<Alphabet>::encodeBuffer(data, length, outfile);
+	 * --------------------------------------------------------
+	 * Writes the code of every byte of the buffer and then that of
+	 * PSEUDO_EOF, and flushes the last bits.  Raises an error if
+	 * the data holds a character that is not in the alphabet.
+	 */
+	static void encodeBuffer(const unsigned char* data, size_t length, obstream& outfile) {
+		for (size_t i = 0; i < length; i++) {
+			const EncodeEntry& entry = tables.codes[data[i]];
+			if (entry.length == 0) error("Input contains a character that is not in the static alphabet.");
+			outfile.writeBits(entry.bits, entry.length);
+		}
+		outfile.writeBits(tables.codes[PSEUDO_EOF].bits, tables.codes[PSEUDO_EOF].length);
+		outfile.flushBits();
+	}
+
+	/* Function: encodeFile
+	 * Usage: StaticHuffmanCodec<Alphabet>::encodeFile(infile, outfile);
+	 * --------------------------------------------------------
+	 * Like encodeBuffer, but encodes the rest of a stream.
+	 */
+	static void encodeFile(istream& infile, obstream& outfile) {
+		const EncodeEntry* codes = tables.codes;
+		int ch;
+		while ((ch = infile.get()) != EOF) {
+			if (codes[ch].length == 0) error("Input contains a character that is not in the static alphabet.");
+			outfile.writeBits(codes[ch].bits, codes[ch].length);
+		}
+		outfile.writeBits(codes[PSEUDO_EOF].bits, codes[PSEUDO_EOF].length);
+		outfile.flushBits();
+	}
+
+	/* Function: decodeFile
+	 * Usage: StaticHuffmanCodec<Alphabet>::decodeFile(infile, outfile);
+	 * --------------------------------------------------------
+	 * Decodes a stream written with this alphabet's code, one table
+	 * lookup per character, up to its PSEUDO_EOF.  Raises an error
+	 * if the stream ends before PSEUDO_EOF.
+	 */
+	static void decodeFile(ibstream& infile, ostream& outfile) {
+		const DecodeEntry* entries = tables.entries;
+		while (true) {
+			DecodeEntry entry = entries[infile.peekBits(tables.rootBits)];
+			infile.consumeBits(entry.bits);
+			if (infile.readPastEnd()) error("Encoded data ends before its PSEUDO_EOF.");
+			if (entry.value == PSEUDO_EOF) break;
+			outfile.put(char(entry.value));
+		}
+	}
+
+private:
+	StaticHuffmanCodec();
+};
+
+template <typename Alphabet>
+constexpr StaticCodeTables StaticHuffmanCodec<Alphabet>::tables;
+
+/* Type: HexAlphabet
+ * The lowercase hexadecimal digits, four bits each, except that
+ * 'f' shares its code's last slot with PSEUDO_EOF.
+ */
+struct HexAlphabet {
+	static constexpr int codeLength(ext_char ch) {
+		return ch == 'f' || ch == PSEUDO_EOF ? 5 : (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'e') ? 4 : 0;
+	}
+};
+
+/* Type: DnaAlphabet
+ * The four DNA bases in capitals.  A, C and G take two bits, and
+ * T shares the last two bit code with PSEUDO_EOF.
+ */
+struct DnaAlphabet {
+	static constexpr int codeLength(ext_char ch) {
+		return ch == 'A' || ch == 'C' || ch == 'G' ? 2 : ch == 'T' || ch == PSEUDO_EOF ? 3 : 0;
+	}
+};
+
+#endif
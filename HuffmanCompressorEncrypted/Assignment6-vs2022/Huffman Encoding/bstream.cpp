@@ -8,6 +8,7 @@
 #include "error.h"
 #include "strlib.h"
 #include <iostream>
+#include <climits>
 
 static const int NUM_BITS_IN_BYTE = 8;
 
@@ -25,7 +26,9 @@ inline void SetNthBit(int n, int & inByte) { inByte |= (1 << n); }
  * We set initial state for lastTell and curByte to 0, then pos is
  * set at 8 so that next readBit will trigger a fresh read.
  */
-ibstream::ibstream() : istream(NULL), lastTell(0), curByte(0), pos(NUM_BITS_IN_BYTE) {}
+ibstream::ibstream() : istream(NULL), lastTell(0), curByte(0), pos(NUM_BITS_IN_BYTE),
+	bitBuffer(0), bitCount(0), readingBits(false), blockPos(0), blockEnd(0), overran(false), readCount(0),
+	fetchedCount(0) {}
 
 /* Member function ibstream::readBit
  * ---------------------------------
@@ -36,6 +39,16 @@ ibstream::ibstream() : istream(NULL), lastTell(0), curByte(0), pos(NUM_BITS_IN_B
  */
 int ibstream::readBit() {
 	if (!is_open()) error("Cannot read a bit from a stream that is not open.");
+
+	// in the middle of peekBits/consumeBits, keep reading from the bit buffer
+	if (readingBits) {
+		if (bitCount == 0) refillBits();
+		if (bitCount == 0) return EOF;
+		int bit = int(bitBuffer & 1);
+		bitBuffer >>= 1;
+		bitCount--;
+		return bit;
+	}
 	
 	// if just finished bits from curByte or if data read from stream after last readBit()
 	if (lastTell != tellg() || pos == NUM_BITS_IN_BYTE) { 
@@ -49,6 +62,86 @@ int ibstream::readBit() {
 	return result;
 }
 
+/* Member function ibstream::refillBits
+ * -------------------------------------
+ * Tops the bit buffer up to at least 57 bits, one byte at a time, from
+ * the block buffer, reading the next block from the stream buffer when
+ * the current one runs out.  On the first call we also pick up the rest
+ * of any byte that readBit had started on.  At the end of the stream the
+ * buffer is simply left short, and the missing bits read as zeros.
+ */
+void ibstream::refillBits() {
+	if (!readingBits) {
+		if (!is_open()) error("Cannot read bits from a stream that is not open.");
+		resetBits();
+		if (pos != NUM_BITS_IN_BYTE && lastTell == tellg()) {
+			bitBuffer = uint64_t(curByte) >> pos;
+			bitCount = NUM_BITS_IN_BYTE - pos;
+		}
+		pos = NUM_BITS_IN_BYTE;
+		readingBits = true;
+	}
+	while (bitCount <= 56) {
+		if (blockPos == blockEnd) {
+			blockPos = 0;
+			blockEnd = int(rdbuf()->sgetn(blockBuffer, BLOCK_BUFFER_SIZE));
+			if (blockEnd <= 0) {
+				blockEnd = 0;
+				setstate(ios::eofbit);
+				return;
+			}
+			readCount++;
+			fetchedCount += uint64_t(blockEnd);
+		}
+		bitBuffer |= uint64_t((unsigned char)blockBuffer[blockPos++]) << bitCount;
+		bitCount += NUM_BITS_IN_BYTE;
+	}
+}
+
+/* Member function ibstream::resetBits
+ * -----------------------------------
+ * Forgets everything held in the bit buffer and block buffer.
+ */
+void ibstream::resetBits() {
+	bitBuffer = 0;
+	bitCount = 0;
+	blockPos = blockEnd = 0;
+	overran = false;
+	readingBits = false;
+}
+
+uint64_t ibstream::blockReads() const {
+	return readCount;
+}
+
+uint64_t ibstream::bytesFetched() const {
+	return fetchedCount;
+}
+
+/* Member function ibstream::syncBits
+ * ----------------------------------
+ * Seeks the stream back over the whole bytes that were read ahead, then
+ * turns a partly consumed byte back into readBit's curByte/pos state.
+ */
+void ibstream::syncBits() {
+	if (!readingBits) return;
+	int partial = bitCount % NUM_BITS_IN_BYTE;
+	int unread = (blockEnd - blockPos) + bitCount / NUM_BITS_IN_BYTE;
+	uint64_t partialBits = bitBuffer & ((1 << partial) - 1);
+	resetBits();
+	clear(); // reaching the end of the block reads may have set eofbit
+
+	if (unread > 0) {
+		if (rdbuf()->pubseekoff(-unread, ios::cur, ios::in) == streampos(-1))
+			error("Cannot hand read-ahead bytes back to a stream that cannot seek.");
+	}
+	if (partial > 0) {
+		curByte = int(partialBits << (NUM_BITS_IN_BYTE - partial));
+		pos = NUM_BITS_IN_BYTE - partial;
+		lastTell = tellg();
+	}
+}
+
 /* Member function ibstream::rewind
  * ---------------------------------
  * Simply seeks back to beginning of file, so reading begins again
@@ -56,6 +149,8 @@ int ibstream::readBit() {
  */
 void ibstream::rewind() {
 	if (!is_open()) error("Cannot rewind stream which is not open.");
+	resetBits();
+	pos = NUM_BITS_IN_BYTE;
 	clear();
 	seekg(0, ios::beg);
 }
@@ -66,14 +161,14 @@ void ibstream::rewind() {
  * In order to not disrupt reading, we also record cur streampos and
  * re-seek to there before returning.
  */
-long ibstream::size() {
+int64_t ibstream::size() {
 	if (!is_open()) error("Cannot get size of stream which is not open.");
 	clear();					// clear any error state
 	streampos cur = tellg();	// save current streampos
 	seekg(0, ios::end);			// seek to end
 	streampos end = tellg();	// get offset
 	seekg(cur);					// seek back to original pos
-	return long(end);
+	return int64_t(streamoff(end));
 }
 
 /* Member function ibstream::is_open
@@ -95,7 +190,8 @@ bool ibstream::is_open() {
  * We set initial state for lastTell and curByte to 0, then pos is
  * set at 8 so that next writeBit will start a new byte.
  */
-obstream::obstream() : ostream(NULL), lastTell(0), curByte(0), pos(NUM_BITS_IN_BYTE) {}
+obstream::obstream() : ostream(NULL), lastTell(0), curByte(0), pos(NUM_BITS_IN_BYTE),
+	bitBuffer(0), bitCount(0), writingBits(false), wordBytes(0) {}
 
 /* Member function obstream::writeBit
  * ----------------------------------
@@ -110,6 +206,7 @@ obstream::obstream() : ostream(NULL), lastTell(0), curByte(0), pos(NUM_BITS_IN_B
 void obstream::writeBit(int bit) {
 	if (bit != 0 && bit != 1) error("writeBit expects argument which can be only 0 or 1.");
 	if (!is_open()) error("Cannot writeBit to stream which is not open.");
+	if (writingBits) flushBits(); // hand over any bits buffered by writeBits
 	
 		// if just filled curByte or if data written to stream after last writeBit()
 	if (lastTell != tellp() || pos == NUM_BITS_IN_BYTE) { 
@@ -129,6 +226,103 @@ void obstream::writeBit(int bit) {
 	lastTell = tellp();
 }
 
+/* Member function obstream::beginBits
+ * -----------------------------------
+ * Starts a run of writeBits calls.  If writeBit (or an earlier flushBits)
+ * left a partly filled byte at the end of the stream and nothing else has
+ * been written since, we back up over that byte and load its bits into the
+ * accumulator so the new bits carry on right after them.
+ */
+void obstream::beginBits() {
+	if (!is_open()) error("Cannot writeBits to stream which is not open.");
+	bitBuffer = 0;
+	bitCount = 0;
+	wordBytes = 0;
+	if (pos != NUM_BITS_IN_BYTE && lastTell == tellp()) {
+		seekp(-1, ios::cur);
+		bitBuffer = uint64_t(curByte);
+		bitCount = pos;
+	}
+	pos = NUM_BITS_IN_BYTE;
+	writingBits = true;
+}
+
+/* Member function obstream::writeBits
+ * -----------------------------------
+ * Adds the bits above the bits already in the accumulator.  Whenever a full
+ * 32-bit word has built up it is moved, little-endian so that bit 0 lands in
+ * the first byte, into the word buffer, which is only handed to the stream
+ * when it fills up or flushBits is called.
+ */
+void obstream::writeBits(uint64_t code, int length) {
+	if (length < 0 || length > 64) error("writeBits expects a length between 0 and 64.");
+	if (!writingBits) beginBits();
+
+	if (length > 32) {
+		writeBits(code, 32);
+		code >>= 32;
+		length -= 32;
+	}
+	code &= (uint64_t(1) << length) - 1;
+
+	bitBuffer |= code << bitCount;
+	bitCount += length;
+	if (bitCount >= 32) {
+		if (wordBytes > WORD_BUFFER_SIZE - 4) {
+			write(wordBuffer, wordBytes);
+			wordBytes = 0;
+		}
+		for (int i = 0; i < 4; i++) {
+			wordBuffer[wordBytes++] = char(bitBuffer >> (8 * i));
+		}
+		bitBuffer >>= 32;
+		bitCount -= 32;
+	}
+}
+
+/* Member function obstream::flushBits
+ * -----------------------------------
+ * Writes the word buffer and the whole bytes left in the accumulator, then
+ * the final partial byte (if any) padded with zeros.  That partial byte is
+ * remembered in curByte/pos just as writeBit would have left it, so that
+ * either writeBit or writeBits can keep filling it later.
+ */
+void obstream::flushBits() {
+	if (!writingBits) return;
+	write(wordBuffer, wordBytes);
+	wordBytes = 0;
+
+	char tail[NUM_BITS_IN_BYTE];
+	int tailBytes = 0;
+	while (bitCount > 0) {
+		tail[tailBytes++] = char(bitBuffer);
+		if (bitCount < NUM_BITS_IN_BYTE) break;
+		bitBuffer >>= NUM_BITS_IN_BYTE;
+		bitCount -= NUM_BITS_IN_BYTE;
+	}
+	write(tail, tailBytes);
+
+	curByte = int(bitBuffer & 0xFF);
+	pos = (bitCount > 0 && bitCount < NUM_BITS_IN_BYTE) ? bitCount : NUM_BITS_IN_BYTE;
+	bitBuffer = 0;
+	bitCount = 0;
+	writingBits = false;
+	lastTell = tellp();
+}
+
+/* Member function obstream::discardBits
+ * -----------------------------------
+ * Puts the bit writer back as the constructor leaves it.
+ */
+void obstream::discardBits() {
+	lastTell = 0;
+	curByte = 0;
+	pos = NUM_BITS_IN_BYTE;
+	bitBuffer = 0;
+	bitCount = 0;
+	writingBits = false;
+	wordBytes = 0;
+}
 
 /* Member function obstream::size
  * ------------------------------
@@ -136,14 +330,15 @@ void obstream::writeBit(int bit) {
  * In order to not disrupt writing, we also record cur streampos and
  * re-seek to there before returning.
  */
-long obstream::size() {
+int64_t obstream::size() {
 	if (!is_open()) error("Cannot get size of stream which is not open.");
+	flushBits();				// make sure buffered bits are counted
 	clear();					// clear any error state
 	streampos cur = tellp();	// save current streampos
 	seekp(0, ios::end);			// seek to end
 	streampos end = tellp();	// get offset
 	seekp(cur);					// seek back to original pos
-	return long(end);
+	return int64_t(streamoff(end));
 }
 
 /* Member function obstream::is_open
@@ -237,6 +432,27 @@ ofbstream::ofbstream(string filename) {
  * to do so.
  */
 void ofbstream::open(const char* filename) {
+	openWithMode(filename, ios::out | ios::binary);
+}
+void ofbstream::open(string filename) {
+	open(filename.c_str());
+}
+
+/* Member function ofbstream::openForUpdate
+ * -------------------------------------------
+ * Attempts to open the specified file, which must exist, for
+ * writing in place, failing if unable to do so.
+ */
+void ofbstream::openForUpdate(string filename) {
+	openWithMode(filename.c_str(), ios::in | ios::out | ios::binary);
+}
+
+/* Member function ofbstream::openWithMode
+ * -------------------------------------------
+ * Opens the file with the given mode, unless its name is that
+ * of a source file.
+ */
+void ofbstream::openWithMode(const char* filename, ios::openmode mode) {
 	/* Confirm we aren't about to do something that could potentially be a
 	 * Very Bad Idea.
 	 */
@@ -249,13 +465,10 @@ void ofbstream::open(const char* filename) {
 		setstate(ios::failbit);
 		
 	} else {
-		if (!fb.open(filename, ios::out | ios::binary))
+		if (!fb.open(filename, mode))
 			setstate(ios::failbit);
 	}
 }
-void ofbstream::open(string filename) {
-	open(filename.c_str());
-}
 
 /* Member function ofbstream::is_open
  * -------------------------------------------
@@ -293,6 +506,118 @@ void istringbstream::str(string s) {
 	sb.str(s);
 }
 
+/* Constructor imembstream::imembstream
+ * -------------------------------------------
+ * Sets the stream to use the span buffer over the given bytes.
+ */
+imembstream::imembstream(const void* data, size_t length) {
+	init(&sb);
+	sb.reset((const char*)data, length);
+}
+
+/* Member function imembstream::span
+ * -------------------------------------------
+ * Points the span buffer at new bytes and clears any error state
+ * and buffered bits left from the old ones.
+ */
+void imembstream::span(const void* data, size_t length) {
+	sb.reset((const char*)data, length);
+	rewind();
+}
+
+/* Member function imembstream::SpanBuffer::reset
+ * -------------------------------------------
+ * The get area is the whole span.  streambuf wants writable pointers,
+ * but nothing ever writes through them.
+ */
+void imembstream::SpanBuffer::reset(const char* data, size_t length) {
+	char* start = const_cast<char*>(data);
+	setg(start, start, start + length);
+}
+
+/* Member functions imembstream::SpanBuffer::seekoff, seekpos
+ * -------------------------------------------
+ * Moves within the span, refusing positions outside it.
+ */
+streambuf::pos_type imembstream::SpanBuffer::seekoff(off_type offset, ios_base::seekdir dir,
+                                                      ios_base::openmode which) {
+	if (!(which & ios_base::in)) return pos_type(off_type(-1));
+	off_type base = dir == ios_base::beg ? 0 : dir == ios_base::cur ? gptr() - eback() : egptr() - eback();
+	off_type target = base + offset;
+	if (target < 0 || target > egptr() - eback()) return pos_type(off_type(-1));
+	setg(eback(), eback() + target, egptr());
+	return pos_type(target);
+}
+
+streambuf::pos_type imembstream::SpanBuffer::seekpos(pos_type position, ios_base::openmode which) {
+	return seekoff(off_type(position), ios_base::beg, which);
+}
+
+/* Constructor omembstream::omembstream
+ * -------------------------------------------
+ * Sets the stream to use the span buffer over the given bytes.
+ */
+omembstream::omembstream(void* data, size_t capacity) {
+	init(&sb);
+	sb.reset((char*)data, capacity);
+}
+
+/* Member function omembstream::span
+ * -------------------------------------------
+ * Points the span buffer at new bytes and starts the bit writer
+ * afresh, as a new stream would.
+ */
+void omembstream::span(void* data, size_t capacity) {
+	sb.reset((char*)data, capacity);
+	clear();
+	discardBits();
+}
+
+/* Member function omembstream::written
+ * -------------------------------------------
+ * The position of the put pointer in the span.
+ */
+size_t omembstream::written() const {
+	return sb.position();
+}
+
+/* Member functions omembstream::SpanBuffer::reset, position
+ * -------------------------------------------
+ * The put area is the whole span, and once it is full overflow,
+ * left as streambuf has it, turns every further write away.
+ */
+void omembstream::SpanBuffer::reset(char* data, size_t capacity) {
+	setp(data, data + capacity);
+}
+
+size_t omembstream::SpanBuffer::position() const {
+	return size_t(pptr() - pbase());
+}
+
+/* Member functions omembstream::SpanBuffer::seekoff, seekpos
+ * -------------------------------------------
+ * Moves within the span, refusing positions outside it.  pbump only
+ * takes an int, so long moves are made in several steps.
+ */
+streambuf::pos_type omembstream::SpanBuffer::seekoff(off_type offset, ios_base::seekdir dir,
+                                                      ios_base::openmode which) {
+	if (!(which & ios_base::out)) return pos_type(off_type(-1));
+	off_type base = dir == ios_base::beg ? 0 : dir == ios_base::cur ? pptr() - pbase() : epptr() - pbase();
+	off_type target = base + offset;
+	if (target < 0 || target > epptr() - pbase()) return pos_type(off_type(-1));
+	setp(pbase(), epptr());
+	for (off_type left = target; left > 0; ) {
+		int step = left > INT_MAX ? INT_MAX : int(left);
+		pbump(step);
+		left -= step;
+	}
+	return pos_type(target);
+}
+
+streambuf::pos_type omembstream::SpanBuffer::seekpos(pos_type position, ios_base::openmode which) {
+	return seekoff(off_type(position), ios_base::beg, which);
+}
+
 /* Member function ostringbstream::ostringbstream
  * -------------------------------------------
  * Sets the stream to use the string buffer.
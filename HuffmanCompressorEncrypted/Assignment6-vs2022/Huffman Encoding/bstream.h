@@ -26,6 +26,7 @@
 #include <ostream>
 #include <fstream>
 #include <sstream>
+#include <stdint.h>
 using namespace std;
 
 /*
@@ -55,6 +56,90 @@ public:
 	 * Raises an error if this ibstream has not been properly opened.
 	 */
 	int readBit();
+
+	/*
+	 * Member function: peekBits
+	 * Usage: bits = in.peekBits(count);
+	 * ---------------------------------
+	 * Returns the next count bits of the ibstream (at most 57), the next
+	 * bit in bit 0, without consuming them.  Bits are read from the stream
+	 * in large blocks into a 64-bit bit buffer, so most calls touch no
+	 * stream at all.  Bits past the end of the stream read as zeros.
+	 * Raises an error if this ibstream has not been properly opened.
+	 */
+	uint64_t peekBits(int count);
+
+	/*
+	 * Member function: consumeBits
+	 * Usage: in.consumeBits(count);
+	 * -----------------------------
+	 * Discards the next count bits (at most 57), normally after they have
+	 * been examined with peekBits.
+	 */
+	void consumeBits(int count);
+
+	/*
+	 * Member function: readBits
+	 * Usage: bits = in.readBits(count);
+	 * ---------------------------------
+	 * Reads and consumes the next count bits (at most 57), the first bit
+	 * read in bit 0.  Equivalent to peekBits followed by consumeBits.
+	 */
+	uint64_t readBits(int count);
+
+	/*
+	 * Member function: hasBits
+	 * Usage: if (in.hasBits(count)) { ... }
+	 * -------------------------------------
+	 * Returns whether at least count more bits (at most 57) remain in the
+	 * ibstream, as opposed to the zero padding peekBits returns past the
+	 * end.  Lets a reader tell a truncated stream from real zero bits.
+	 */
+	bool hasBits(int count);
+
+	/*
+	 * Member function: readPastEnd
+	 * Usage: if (in.readPastEnd()) { ... }
+	 * ------------------------------------
+	 * Returns whether consumeBits has gone past the end of the stream into
+	 * the zero padding since the bulk bit operations last started.  A
+	 * decoder that checks this can stop on input that ends too soon,
+	 * rather than decoding the padding for as long as it likes.
+	 */
+	bool readPastEnd() const;
+
+	/*
+	 * Member function: syncBits
+	 * Usage: in.syncBits();
+	 * ---------------------
+	 * Hands back to the stream every whole byte read ahead by peekBits, so
+	 * that ordinary reads such as get() continue from the first byte not
+	 * yet touched.  A partly consumed byte is kept for readBit, just as
+	 * readBit itself would leave it.  Call this before switching from the
+	 * bulk bit operations to any other input operation.  Raises an error
+	 * if bytes were read ahead from a stream that cannot seek.
+	 */
+	void syncBits();
+
+	/*
+	 * Member function: blockReads
+	 * Usage: uint64_t reads = in.blockReads();
+	 * ----------------------------------------
+	 * Returns how many times the bulk bit operations have gone back to
+	 * the stream for another block of bytes, over the life of the
+	 * ibstream.  Counted only when a block is fetched, so the bit reads
+	 * themselves cost nothing extra.
+	 */
+	uint64_t blockReads() const;
+
+	/*
+	 * Member function: bytesFetched
+	 * Usage: uint64_t bytes = in.bytesFetched();
+	 * ------------------------------------------
+	 * Returns how many bytes those block reads have fetched in all,
+	 * including any read ahead and not yet used.
+	 */
+	uint64_t bytesFetched() const;
 	
 	/*
 	 * Member function: rewind
@@ -73,7 +158,7 @@ public:
 	 * Returns the size in bytes of the data attached to this stream.
 	 * Raises an error if this ibstream has not been properly opened.
 	 */
-	long size();
+	int64_t size();
 	
 	/*
 	 * Member function: is_open()
@@ -88,6 +173,21 @@ public:
 private:
 	int pos, curByte;
 	streampos lastTell;
+
+	/* State for peekBits/consumeBits: the bit buffer, and the block of
+	 * bytes most recently read from the stream to refill it.
+	 */
+	static const int BLOCK_BUFFER_SIZE = 4096;
+	uint64_t bitBuffer;
+	int bitCount;
+	bool readingBits;
+	int blockPos, blockEnd;
+	bool overran;
+	char blockBuffer[BLOCK_BUFFER_SIZE];
+	uint64_t readCount, fetchedCount;
+
+	void refillBits();
+	void resetBits();
 };
 
 
@@ -118,6 +218,31 @@ public:
 	 * Raises an error if this ibstream has not been properly opened.
 	 */
 	void writeBit(int bit);
+
+	/*
+	 * Member function: writeBits
+	 * Usage: out.writeBits(code, length);
+	 * -----------------------------------
+	 * Writes the low length bits of code to the obstream, bit 0 first,
+	 * exactly as if each had been passed to writeBit in turn.  The bits
+	 * are packed into a 64-bit accumulator and handed to the stream a
+	 * word at a time, so they do not appear in the stream until
+	 * flushBits is called.
+	 * Raises an error if this obstream has not been properly opened.
+	 */
+	void writeBits(uint64_t code, int length);
+
+	/*
+	 * Member function: flushBits
+	 * Usage: out.flushBits();
+	 * -----------------------
+	 * Writes every bit buffered by writeBits to the stream, padding the
+	 * final partial byte with zeros.  A later writeBit or writeBits call
+	 * carries on filling that partial byte, as long as nothing else has
+	 * been written in between.  Call this before using any other output
+	 * operation on the stream.
+	 */
+	void flushBits();
 	
 	/*
 	 * Member function: size
@@ -126,7 +251,7 @@ public:
 	 * Returns the size in bytes of the file attached to this stream.
 	 * Raises an error if this obstream has not been properly opened.
 	 */
-	long size();
+	int64_t size();
 	
 	/*
 	 * Member function: is_open()
@@ -137,10 +262,32 @@ public:
 	 * returns true.
 	 */
 	virtual bool is_open();
+
+protected:
+	/*
+	 * Member function: discardBits
+	 * Usage: discardBits();
+	 * -----------------------
+	 * Forgets every bit buffered by writeBits and any partial byte, as if
+	 * the stream were new, for streams that move on to new storage.
+	 */
+	void discardBits();
 	
 private:
 	int pos, curByte;
 	streampos lastTell;
+
+	/* State for writeBits: the bit accumulator, and whole words that are
+	 * waiting to be handed to the stream in one write.
+	 */
+	static const int WORD_BUFFER_SIZE = 4096;
+	uint64_t bitBuffer;
+	int bitCount;
+	bool writingBits;
+	int wordBytes;
+	char wordBuffer[WORD_BUFFER_SIZE];
+
+	void beginBits();
 };
 
 /*
@@ -255,6 +402,16 @@ public:
 	 */
 	void open(const char* filename);
 	void open(string filename);
+
+	/*
+	 * Member function: openForUpdate(string filename);
+	 * Usage: ofb.openForUpdate("my-file.huf");
+	 * -------------------------
+	 * Opens an existing file for writing without emptying it, so that
+	 * after seekp the stream writes over the file in place.  Fails as
+	 * open does, and also if the file does not exist.
+	 */
+	void openForUpdate(string filename);
 	
 	/*
 	 * Member function: is_open();
@@ -277,6 +434,8 @@ public:
 private:
 	/* The actual file buffer which does reading and writing. */
 	filebuf fb;
+
+	void openWithMode(const char* filename, ios::openmode mode);
 };
 
 /*
@@ -308,6 +467,47 @@ private:
 	stringbuf sb;
 };
 
+/*
+ * Class: imembstream
+ * ---------------
+ * An ibstream that reads straight from a block of memory owned by the
+ * caller, such as a memory-mapped file (see MappedFile.h), without
+ * copying it the way istringbstream copies its string.  The memory must
+ * stay valid and unchanged for as long as the stream reads from it.
+ */
+class imembstream: public ibstream {
+public:
+	/* Constructor: imembstream(const void* data = NULL, size_t length = 0);
+	 * Usage: imembstream stream(data, length);
+	 * --------------------------
+	 * Constructs an imembstream reading the given bytes.
+	 */
+	imembstream(const void* data = NULL, size_t length = 0);
+
+	/* Member function: span(const void* data, size_t length);
+	 * Usage: imb.span(data, length);
+	 * ---------------------------
+	 * Switches the stream to reading the given bytes, from the start.
+	 */
+	void span(const void* data, size_t length);
+
+private:
+	/* A read-only stream buffer over the caller's memory, which can seek
+	 * so that rewind and syncBits work as they do on other streams.
+	 */
+	class SpanBuffer: public streambuf {
+	public:
+		void reset(const char* data, size_t length);
+
+	protected:
+		virtual pos_type seekoff(off_type offset, ios_base::seekdir dir, ios_base::openmode which);
+		virtual pos_type seekpos(pos_type position, ios_base::openmode which);
+	};
+
+	/* The span buffer that hands out the bytes. */
+	SpanBuffer sb;
+};
+
 /*
  * Class: ostringbstream
  * ---------------
@@ -339,4 +539,93 @@ private:
 	stringbuf sb;
 };
 
+/*
+ * Class: omembstream
+ * ---------------
+ * An obstream that writes straight into a block of memory owned by the
+ * caller, the writing counterpart of imembstream.  Nothing past the end
+ * of the block is ever written: a write that doesn't fit fails the
+ * stream, as a full disk would, and fail() is then true.
+ */
+class omembstream: public obstream {
+public:
+	/* Constructor: omembstream(void* data = NULL, size_t capacity = 0);
+	 * Usage: omembstream stream(buffer, capacity);
+	 * --------------------------
+	 * Constructs an omembstream writing into the given bytes.
+	 */
+	omembstream(void* data = NULL, size_t capacity = 0);
+
+	/* Member function: span(void* data, size_t capacity);
+	 * Usage: omb.span(buffer, capacity);
+	 * ---------------------------
+	 * Switches the stream to writing the given bytes, from the start,
+	 * forgetting any bits and error state left from the old ones.
+	 */
+	void span(void* data, size_t capacity);
+
+	/* Member function: written();
+	 * Usage: size_t bytes = omb.written();
+	 * ---------------------------
+	 * Returns how many bytes the stream has written, up to where it
+	 * would write next.  Bits not yet flushed are not counted.
+	 */
+	size_t written() const;
+
+private:
+	/* A stream buffer whose put area is the caller's memory, which can
+	 * seek so that the bit writer can back up over a partial byte.
+	 */
+	class SpanBuffer: public streambuf {
+	public:
+		void reset(char* data, size_t capacity);
+		size_t position() const;
+
+	protected:
+		virtual pos_type seekoff(off_type offset, ios_base::seekdir dir, ios_base::openmode which);
+		virtual pos_type seekpos(pos_type position, ios_base::openmode which);
+	};
+
+	/* The span buffer that takes the bytes. */
+	SpanBuffer sb;
+};
+
+/*
+ * Inline fast paths for the bulk bit reader.  The bit buffer only needs
+ * to go back to the stream once every few dozen bits, so the common case
+ * is a compare, a mask and a shift.
+ */
+inline uint64_t ibstream::peekBits(int count) {
+	if (bitCount < count) refillBits();
+	return bitBuffer & ((uint64_t(1) << count) - 1);
+}
+
+inline void ibstream::consumeBits(int count) {
+	if (bitCount < count) refillBits();
+	if (count >= bitCount) {
+		// consuming the padding past the end of the stream
+		if (count > bitCount) overran = true;
+		bitBuffer = 0;
+		bitCount = 0;
+	} else {
+		bitBuffer >>= count;
+		bitCount -= count;
+	}
+}
+
+inline uint64_t ibstream::readBits(int count) {
+	uint64_t result = peekBits(count);
+	consumeBits(count);
+	return result;
+}
+
+inline bool ibstream::hasBits(int count) {
+	if (bitCount < count) refillBits();
+	return bitCount >= count;
+}
+
+inline bool ibstream::readPastEnd() const {
+	return overran;
+}
+
 #endif
@@ -0,0 +1,160 @@
+/*
+ * File: portable.cpp
+ * ------------------
+ * The few non-template parts of the Stanford library that the
+ * compressor and its drivers use, written against nothing but
+ * the standard library, so that they build where the prebuilt
+ * StanfordCPPLib-vs2022.lib can't be linked.  The headers are
+ * still the ones in StanfordCPPLib-vs2022/include; only their
+ * out-of-line functions are here.  Console input comes straight
+ * from cin, and main runs with no console or graphics window.
+ *
+ * The CMake build links this in place of the Windows library.
+ * The Visual Studio projects don't use it.
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "error.h"
+#include "simpio.h"
+#include "strlib.h"
+#include "map.h"
+#include "pqueue.h"
+#include "HuffmanTypes.h"
+using namespace std;
+
+/* Implementation of error.h */
+
+ErrorException::ErrorException(string msg) {
+   this->msg = msg;
+}
+
+ErrorException::~ErrorException() throw () {
+   /* Empty */
+}
+
+string ErrorException::getMessage() const {
+   return msg;
+}
+
+const char *ErrorException::what() const throw () {
+   return msg.c_str();
+}
+
+void error(string msg) {
+   throw ErrorException(msg);
+}
+
+/* Implementation of simpio.h */
+
+string getLine(string prompt) {
+   cout << prompt;
+   string line;
+   if (!getline(cin, line)) error("getLine: End of input");
+   return line;
+}
+
+int getInteger(string prompt) {
+   while (true) {
+      istringstream stream(getLine(prompt));
+      int value;
+      char extra;
+      if (stream >> value && !(stream >> extra)) return value;
+      cout << "Illegal integer format. Try again." << endl;
+      if (prompt == "") prompt = "Enter an integer: ";
+   }
+}
+
+double getReal(string prompt) {
+   while (true) {
+      istringstream stream(getLine(prompt));
+      double value;
+      char extra;
+      if (stream >> value && !(stream >> extra)) return value;
+      cout << "Illegal numeric format. Try again." << endl;
+      if (prompt == "") prompt = "Enter a number: ";
+   }
+}
+
+/* Implementation of strlib.h */
+
+string integerToString(int n) {
+   ostringstream stream;
+   stream << n;
+   return stream.str();
+}
+
+string realToString(double d) {
+   ostringstream stream;
+   stream << uppercase << d;
+   return stream.str();
+}
+
+bool startsWith(string str, string prefix) {
+   return str.size() >= prefix.size() && str.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool startsWith(string str, char prefix) {
+   return !str.empty() && str[0] == prefix;
+}
+
+bool endsWith(string str, string suffix) {
+   return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool endsWith(string str, char suffix) {
+   return !str.empty() && str[str.size() - 1] == suffix;
+}
+
+/*
+ * The reference solutions the test drivers compare against, as
+ * ReferenceHuffmanEncoding.h declares them: a plain count of every
+ * character plus one PSEUDO_EOF, and the textbook tree built by
+ * repeatedly joining the two lightest trees in a priority queue.
+ */
+
+Map<ext_char, int> referenceGetFrequencyTable(istream & file) {
+   Map<ext_char, int> frequencies;
+   int ch;
+   while ((ch = file.get()) != EOF) {
+      frequencies[ch]++;
+   }
+   frequencies[PSEUDO_EOF] = 1;
+   return frequencies;
+}
+
+Node *referenceBuildEncodingTree(Map<ext_char, int> frequencies) {
+   PriorityQueue<Node *> queue;
+   for (ext_char ch : frequencies) {
+      Node *leaf = new Node;
+      leaf->character = ch;
+      leaf->zero = leaf->one = NULL;
+      leaf->weight = frequencies[ch];
+      queue.enqueue(leaf, leaf->weight);
+   }
+   while (queue.size() > 1) {
+      Node *parent = new Node;
+      parent->character = NOT_A_CHAR;
+      parent->zero = queue.dequeue();
+      parent->one = queue.dequeue();
+      parent->weight = parent->zero->weight + parent->one->weight;
+      queue.enqueue(parent, parent->weight);
+   }
+   return queue.isEmpty() ? NULL : queue.dequeue();
+}
+
+/* Implementation of private/main.h, for programs with no window */
+
+int _mainFlags;
+
+int Main(int argc, char **argv);
+
+int mainWrapper(int argc, char **argv) {
+   return Main(argc, argv);
+}
+
+int startupMain(int argc, char **argv) {
+   return Main(argc, argv);
+}